@@ -0,0 +1,48 @@
+#ifndef SNOWROBOT_REMOTECONTROL_BENCHMARKS_ALLOCATIONCOUNTER_H
+#define SNOWROBOT_REMOTECONTROL_BENCHMARKS_ALLOCATIONCOUNTER_H
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+
+// Counts the heap allocations, so that the benchmarks can check that a path doesn't allocate. This replaces the global
+// operator new and delete, so it must only be included by one translation unit in each executable, which is the
+// benchmark's own .cpp file.
+
+
+namespace snowrobot {
+
+
+// How many allocations have been counted so far.
+inline std::atomic<size_t> allocation_count{0};
+
+// By default every thread's allocations are counted. A benchmark that only cares about one thread, like the motor
+// loop's, sets count_all_threads to false and count_this_thread to true on that thread.
+inline std::atomic<bool> count_all_threads{true};
+inline thread_local bool count_this_thread = false;
+
+}
+
+
+void* operator new(size_t size) {
+  if (snowrobot::count_this_thread || snowrobot::count_all_threads.load(std::memory_order_relaxed)) {
+    snowrobot::allocation_count.fetch_add(1, std::memory_order_relaxed);
+  }
+  void* ptr = std::malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+// These aren't inlined, since gcc's -Wmismatched-new-delete would then see a pointer from operator new go to free().
+[[gnu::noinline]] void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void* ptr, size_t) noexcept {
+  std::free(ptr);
+}
+
+#endif
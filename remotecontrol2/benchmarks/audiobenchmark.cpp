@@ -0,0 +1,419 @@
+#include "../server/microphoneinfo.h"
+#include "../common/gst_wrappers.h"
+#include "latencyhistogram.h"
+
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <gst/gst.h>
+#include <gst/rtp/rtp.h>
+
+#include <boost/json/object.hpp>
+#include <boost/log/trivial.hpp>
+#include <boost/program_options.hpp>
+
+
+// This benchmark measures the latency and bitrate of the server's audio pipeline. It runs the MicrophoneInfo pipeline
+// from the server with an audiotestsrc instead of a real microphone, and a receiver pipeline that is similar to the
+// AudioPlayer in the client. The two pipelines talk to each other via rtp/rtcp over the loopback interface.
+//
+// Like in the latencybenchmark, pad-probes record when each opus frame passes each stage, and the latencies are
+// reported as p50/p99/max values. The stages are:
+//   captured:   the samples left the audio source
+//   encoded:    the opus frame left the encoder
+//   packetized: the rtp packet left the payloader
+//   received:   the rtp packet was received by the receiver's udpsrc
+//   playout:    the rtp packet left the receiver's jitterbuffer
+//   decoded:    the decoded samples left the decoder
+//
+// Each opus frame is sent in its own rtp packet, so the frames are identified by their pts on the server side and by
+// their rtp timestamp on the receiver side, and the payloader probe joins the two.
+//
+// The benchmark also reports the bitrate of the rtp stream, and what it costs on the wire with the ip/udp headers,
+// compared to the 64 kbit/s PCMA the old gstreamer scripts used. With --expect-max-bitrate the benchmark fails if the
+// rtp bitrate is higher than the given value.
+
+
+namespace snowrobot {
+
+
+// Timestamps from g_get_monotonic_time() (in microseconds). Zero means that the frame never reached the stage.
+struct AudioFrameTimes {
+  gint64 captured = 0;
+  gint64 encoded = 0;
+  gint64 packetized = 0;
+};
+
+struct ReceivedAudioFrameTimes {
+  gint64 received = 0;
+  gint64 playout = 0;
+  gint64 decoded = 0;
+};
+
+
+// The size of the ipv4 and udp headers that each rtp packet gets on the wire.
+constexpr int ip_udp_header_size = 20 + 8;
+
+
+class AudioLatencyProbes {
+  public:
+    void attach_to_server(const MicrophoneInfo& microphone_info) {
+      add_probe(microphone_info.getAudioSource(), "src", &AudioLatencyProbes::on_captured);
+      add_probe(microphone_info.getEncoder(), "src", &AudioLatencyProbes::on_encoded);
+      add_probe(microphone_info.getPayloader(), "src", &AudioLatencyProbes::on_packetized);
+    }
+
+    void attach_to_receiver(GstElement* rtp_source, GstElement* depay, GstElement* decoder) {
+      add_probe(rtp_source, "src", &AudioLatencyProbes::on_received);
+      add_probe(depay, "sink", &AudioLatencyProbes::on_playout);
+      add_probe(depay, "src", &AudioLatencyProbes::on_depayloaded);
+      add_probe(decoder, "src", &AudioLatencyProbes::on_decoded);
+    }
+
+    // Only the frames that were captured after warmup_end_time are included in the report.
+    void report(gint64 warmup_end_time) {
+      std::lock_guard guard(lock_);
+      LatencyHistogram capture_to_encode("capture->encode");
+      LatencyHistogram encode_to_packetize("encode->packetize");
+      LatencyHistogram packetize_to_receive("packetize->receive");
+      LatencyHistogram receive_to_playout("receive->playout");
+      LatencyHistogram playout_to_decode("playout->decode");
+      LatencyHistogram capture_to_decode("capture->decode (total)");
+
+      for (const auto& [rtp_timestamp, pts] : rtp_timestamp_to_pts_) {
+        auto frame_find = frames_.find(pts);
+        auto received_find = received_frames_.find(rtp_timestamp);
+        if (frame_find == frames_.end() || received_find == received_frames_.end()) {
+          continue;
+        }
+        const AudioFrameTimes& frame = frame_find->second;
+        const ReceivedAudioFrameTimes& received = received_find->second;
+        if (frame.captured < warmup_end_time || frame.encoded == 0 || frame.packetized == 0 ||
+            received.received == 0 || received.playout == 0 || received.decoded == 0) {
+          continue;
+        }
+        capture_to_encode.add(frame.encoded - frame.captured);
+        encode_to_packetize.add(frame.packetized - frame.encoded);
+        packetize_to_receive.add(received.received - frame.packetized);
+        receive_to_playout.add(received.playout - received.received);
+        playout_to_decode.add(received.decoded - received.playout);
+        capture_to_decode.add(received.decoded - frame.captured);
+      }
+      std::cout << "Opus frames decoded: " << capture_to_decode.count() << std::endl;
+      capture_to_encode.report();
+      encode_to_packetize.report();
+      packetize_to_receive.report();
+      receive_to_playout.report();
+      playout_to_decode.report();
+      capture_to_decode.report();
+    }
+
+    // Returns the bitrate of the received rtp packets (with the rtp headers) in kbit/s, and the number of packets per
+    // second. Only the packets received after the warmup are counted.
+    void getReceivedRate(gint64 warmup_end_time, gint64 end_time, double& rtp_kbps, double& packets_per_second) {
+      std::lock_guard guard(lock_);
+      double seconds = (end_time - warmup_end_time) / (double)G_USEC_PER_SEC;
+      rtp_kbps = seconds > 0 ? received_bytes_ * 8 / 1000.0 / seconds : 0;
+      packets_per_second = seconds > 0 ? received_packets_ / seconds : 0;
+    }
+
+    void startCounting() {
+      std::lock_guard guard(lock_);
+      received_bytes_ = 0;
+      received_packets_ = 0;
+    }
+
+  private:
+    using ProbeFunc = void (AudioLatencyProbes::*)(GstBuffer* buffer, gint64 now);
+
+    struct ProbeData {
+      AudioLatencyProbes* self;
+      ProbeFunc func;
+    };
+
+    void add_probe(GstElement* element, const char* pad_name, ProbeFunc func) {
+      GstPad* pad = gst_element_get_static_pad(element, pad_name);
+      ASSERT_NOT_NULL(pad);
+      ProbeData* probe_data = new ProbeData{this, func};
+      gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER,
+        [](GstPad* pad, GstPadProbeInfo* info, gpointer user_data) -> GstPadProbeReturn {
+          ProbeData* probe_data = (ProbeData*)user_data;
+          gint64 now = g_get_monotonic_time();
+          std::lock_guard guard(probe_data->self->lock_);
+          (probe_data->self->*(probe_data->func))(GST_PAD_PROBE_INFO_BUFFER(info), now);
+          return GST_PAD_PROBE_OK;
+        },
+        probe_data,
+        [](gpointer user_data) { delete (ProbeData*)user_data; });
+      gst_object_unref(pad);
+    }
+
+    static bool read_rtp_timestamp(GstBuffer* buffer, guint32& rtp_timestamp) {
+      GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+      if (!gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp)) {
+        return false;
+      }
+      rtp_timestamp = gst_rtp_buffer_get_timestamp(&rtp);
+      gst_rtp_buffer_unmap(&rtp);
+      return true;
+    }
+
+    void on_captured(GstBuffer* buffer, gint64 now) {
+      frames_[GST_BUFFER_PTS(buffer)].captured = now;
+    }
+
+    void on_encoded(GstBuffer* buffer, gint64 now) {
+      auto find = frames_.find(GST_BUFFER_PTS(buffer));
+      if (find != frames_.end() && find->second.encoded == 0) {
+        find->second.encoded = now;
+      }
+    }
+
+    void on_packetized(GstBuffer* buffer, gint64 now) {
+      guint32 rtp_timestamp;
+      if (!read_rtp_timestamp(buffer, rtp_timestamp)) {
+        return;
+      }
+      GstClockTime pts = GST_BUFFER_PTS(buffer);
+      rtp_timestamp_to_pts_[rtp_timestamp] = pts;
+      auto find = frames_.find(pts);
+      if (find != frames_.end()) {
+        find->second.packetized = now;
+      }
+    }
+
+    void on_received(GstBuffer* buffer, gint64 now) {
+      guint32 rtp_timestamp;
+      if (read_rtp_timestamp(buffer, rtp_timestamp)) {
+        received_frames_[rtp_timestamp].received = now;
+        received_bytes_ += gst_buffer_get_size(buffer);
+        received_packets_++;
+      }
+    }
+
+    void on_playout(GstBuffer* buffer, gint64 now) {
+      guint32 rtp_timestamp;
+      if (read_rtp_timestamp(buffer, rtp_timestamp)) {
+        received_frames_[rtp_timestamp].playout = now;
+        last_playout_rtp_timestamp_ = rtp_timestamp;
+      }
+    }
+
+    // The depayloader pushes one opus frame per rtp packet, so the frame that leaves it belongs to the rtp timestamp
+    // we just saw in on_playout().
+    void on_depayloaded(GstBuffer* buffer, gint64 now) {
+      receiver_pts_to_rtp_timestamp_[GST_BUFFER_PTS(buffer)] = last_playout_rtp_timestamp_;
+    }
+
+    void on_decoded(GstBuffer* buffer, gint64 now) {
+      auto find = receiver_pts_to_rtp_timestamp_.find(GST_BUFFER_PTS(buffer));
+      if (find != receiver_pts_to_rtp_timestamp_.end()) {
+        ReceivedAudioFrameTimes& received = received_frames_[find->second];
+        if (received.decoded == 0) {
+          received.decoded = now;
+        }
+      }
+    }
+
+    std::mutex lock_;
+    std::map<GstClockTime, AudioFrameTimes> frames_;
+    std::map<guint32, GstClockTime> rtp_timestamp_to_pts_;
+    std::map<guint32, ReceivedAudioFrameTimes> received_frames_;
+    std::map<GstClockTime, guint32> receiver_pts_to_rtp_timestamp_;
+    guint32 last_playout_rtp_timestamp_ = 0;
+    uint64_t received_bytes_ = 0;
+    uint64_t received_packets_ = 0;
+};
+
+
+static void
+receiver_pad_added_handler(GstElement* rtpbin, GstPad* pad, gpointer data)
+{
+  std::string pad_name = string_from_gchar(gst_pad_get_name(pad));
+  if (pad_name.find("recv_rtp_src_0_") == 0) {
+    GstElement* depay = (GstElement*)data;
+    GstPad* sink_pad = gst_element_get_static_pad(depay, "sink");
+    ASSERT_NOT_NULL(sink_pad);
+    if (gst_pad_link(pad, sink_pad) != GST_PAD_LINK_OK) {
+      BOOST_LOG_TRIVIAL(error) << "receiver_pad_added_handler(): failed to link the pad '" << pad_name << "'";
+    }
+    gst_object_unref(sink_pad);
+  }
+}
+
+
+static void
+cb_error(GstBus* bus, GstMessage* message, gpointer data)
+{
+  GError* error = NULL;
+  gst_message_parse_error(message, &error, NULL);
+  BOOST_LOG_TRIVIAL(error) << "cb_error:" << GST_OBJECT_NAME(message->src) << ": " << error->message;
+  g_error_free(error);
+  g_main_loop_quit((GMainLoop*)data);
+}
+
+
+int main(int argc, char** argv)
+{
+  gst_init(&argc, &argv);
+
+  int duration_s;
+  int warmup_s;
+  int latency_ms;
+  int expect_max_bitrate_kbps;
+  AudioSettings audio_settings;
+  boost::program_options::options_description desc("Allowed options");
+  desc.add_options()
+      ("duration", boost::program_options::value<int>(&duration_s)->default_value(10), "how many seconds to run the benchmark")
+      ("warmup", boost::program_options::value<int>(&warmup_s)->default_value(2), "how many seconds at the start to exclude from the report")
+      ("latency", boost::program_options::value<int>(&latency_ms)->default_value(200), "the receiver's jitterbuffer latency in ms")
+      ("bitrate", boost::program_options::value<int>(&audio_settings.bitrate_kbps)->default_value(audio_settings.bitrate_kbps), "the opus bitrate in kbit/s")
+      ("frame-ms", boost::program_options::value<int>(&audio_settings.frame_ms)->default_value(audio_settings.frame_ms), "the length of each opus frame in ms (5, 10, 20, 40 or 60)")
+      ("expect-max-bitrate", boost::program_options::value<int>(&expect_max_bitrate_kbps)->default_value(0), "fail if the rtp bitrate (kbit/s) is higher than this")
+  ;
+  boost::program_options::variables_map vm;
+  boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+  boost::program_options::notify(vm);
+
+  GMainLoop* loop = g_main_loop_new(NULL, FALSE);
+  ASSERT_NOT_NULL(loop);
+
+  AudioLatencyProbes probes;
+
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  // The receiver pipeline
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  GstElement* receiver_pipeline = gst_pipeline_new("receiver");
+  ASSERT_NOT_NULL(receiver_pipeline);
+  GstElement* receiver_rtpbin = gst_element_factory_make("rtpbin", NULL);
+  ASSERT_NOT_NULL(receiver_rtpbin);
+  g_object_set(receiver_rtpbin, "latency", latency_ms, NULL);
+
+  GstElement* audio_rtp_udpsrc = gst_element_factory_make("udpsrc", NULL);
+  ASSERT_NOT_NULL(audio_rtp_udpsrc);
+  g_object_set(audio_rtp_udpsrc, "port", 0, NULL);
+  auto audio_rtp_udpsrc_caps = make_GstCaps_ptr(gst_caps_from_string(
+    "application/x-rtp,media=(string)audio,clock-rate=(int)48000,encoding-name=(string)OPUS"));
+  g_object_set(audio_rtp_udpsrc, "caps", audio_rtp_udpsrc_caps.get(), NULL);
+  gst_element_set_state(audio_rtp_udpsrc, GST_STATE_PAUSED);
+  gint audio_rtp_udpsrc_port;
+  g_object_get(audio_rtp_udpsrc, "port", &audio_rtp_udpsrc_port, NULL);
+
+  GstElement* audio_rtcp_udpsrc = gst_element_factory_make("udpsrc", NULL);
+  ASSERT_NOT_NULL(audio_rtcp_udpsrc);
+  g_object_set(audio_rtcp_udpsrc, "port", 0, NULL);
+  gst_element_set_state(audio_rtcp_udpsrc, GST_STATE_PAUSED);
+  gint audio_rtcp_udpsrc_port;
+  g_object_get(audio_rtcp_udpsrc, "port", &audio_rtcp_udpsrc_port, NULL);
+
+  GstElement* audio_rtcp_udpsink = gst_element_factory_make("udpsink", NULL);
+  ASSERT_NOT_NULL(audio_rtcp_udpsink);
+
+  GstElement* depay = gst_element_factory_make("rtpopusdepay", NULL);
+  ASSERT_NOT_NULL(depay);
+  GstElement* decoder = gst_element_factory_make("opusdec", NULL);
+  ASSERT_NOT_NULL(decoder);
+  GstElement* audiosink = gst_element_factory_make("fakesink", NULL);
+  ASSERT_NOT_NULL(audiosink);
+  // We measure when the samples leave the decoder, and a syncing sink would block the decoder until they are due.
+  g_object_set(audiosink, "sync", FALSE, NULL);
+
+  gst_bin_add_many(GST_BIN_CAST(receiver_pipeline), receiver_rtpbin, audio_rtp_udpsrc, audio_rtcp_udpsrc,
+                   audio_rtcp_udpsink, depay, decoder, audiosink, NULL);
+  ASSERT_TRUE(gst_element_link_pads(audio_rtp_udpsrc, "src", receiver_rtpbin, "recv_rtp_sink_0"));
+  ASSERT_TRUE(gst_element_link_pads(audio_rtcp_udpsrc, "src", receiver_rtpbin, "recv_rtcp_sink_0"));
+  ASSERT_TRUE(gst_element_link_pads(receiver_rtpbin, "send_rtcp_src_0", audio_rtcp_udpsink, "sink"));
+  ASSERT_TRUE(gst_element_link_many(depay, decoder, audiosink, NULL));
+  g_signal_connect(receiver_rtpbin, "pad-added", G_CALLBACK(receiver_pad_added_handler), depay);
+  probes.attach_to_receiver(audio_rtp_udpsrc, depay, decoder);
+
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  // The server pipeline
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  GstElement* server_pipeline = gst_pipeline_new("server");
+  ASSERT_NOT_NULL(server_pipeline);
+  GstElement* server_rtpbin = gst_element_factory_make("rtpbin", NULL);
+  ASSERT_NOT_NULL(server_rtpbin);
+  ASSERT_TRUE(gst_bin_add(GST_BIN_CAST(server_pipeline), server_rtpbin));
+
+  MicrophoneInfo microphone_info;
+  boost::json::object microphone = microphone_info.initialize(GST_BIN_CAST(server_pipeline), server_rtpbin, nullptr, 0, audio_settings);
+
+  g_object_set(audio_rtcp_udpsink, "host", "127.0.0.1", NULL);
+  g_object_set(audio_rtcp_udpsink, "port", (gint)microphone.at("audio_rtcp_udpsrc_port").as_int64(), NULL);
+  g_object_set(audio_rtcp_udpsink, "sync", FALSE, NULL);
+  g_object_set(audio_rtcp_udpsink, "async", FALSE, NULL);
+
+  boost::json::object client_info;
+  client_info["audio_rtp_udpsrc_port"] = audio_rtp_udpsrc_port;
+  client_info["audio_rtcp_udpsrc_port"] = audio_rtcp_udpsrc_port;
+  microphone_info.addClient("benchmark", "127.0.0.1", client_info);
+  probes.attach_to_server(microphone_info);
+
+  for (GstElement* pipeline : {receiver_pipeline, server_pipeline}) {
+    GstBus* bus = gst_element_get_bus(pipeline);
+    g_signal_connect(bus, "message::error", G_CALLBACK(cb_error), loop);
+    gst_bus_add_signal_watch(bus);
+    gst_object_unref(bus);
+  }
+
+  ASSERT_TRUE(gst_element_set_state(receiver_pipeline, GST_STATE_PLAYING) != GST_STATE_CHANGE_FAILURE);
+  ASSERT_TRUE(gst_element_set_state(server_pipeline, GST_STATE_PLAYING) != GST_STATE_CHANGE_FAILURE);
+  gint64 warmup_end_time = g_get_monotonic_time() + (gint64)warmup_s * G_USEC_PER_SEC;
+
+  BOOST_LOG_TRIVIAL(info) << "Running the audio benchmark for " << duration_s << " seconds...";
+  g_timeout_add_seconds(warmup_s, function_pointer<gboolean(gpointer)>([&](gpointer) -> gboolean {
+    probes.startCounting();
+    return G_SOURCE_REMOVE;
+  }), nullptr);
+  g_timeout_add_seconds(duration_s, [](gpointer data) -> gboolean {
+    g_main_loop_quit((GMainLoop*)data);
+    return G_SOURCE_REMOVE;
+  }, loop);
+  g_main_loop_run(loop);
+  gint64 end_time = g_get_monotonic_time();
+
+  gst_element_set_state(server_pipeline, GST_STATE_NULL);
+  gst_element_set_state(receiver_pipeline, GST_STATE_NULL);
+
+  std::cout << "Opus " << audio_settings.bitrate_kbps << " kbit/s, " << audio_settings.frame_ms << " ms frames" << std::endl;
+  probes.report(warmup_end_time);
+
+  double rtp_kbps = 0;
+  double packets_per_second = 0;
+  probes.getReceivedRate(warmup_end_time, end_time, rtp_kbps, packets_per_second);
+  double wire_kbps = rtp_kbps + packets_per_second * ip_udp_header_size * 8 / 1000.0;
+  // PCMA is 8000 one-byte samples per second, usually sent as 20 ms packets.
+  double pcma_wire_kbps = 64 + 50 * (12 + ip_udp_header_size) * 8 / 1000.0;
+  std::cout << std::fixed << std::setprecision(1)
+            << "Audio bitrate: rtp " << rtp_kbps << " kbit/s, on the wire " << wire_kbps << " kbit/s ("
+            << packets_per_second << " packets/s). PCMA with 20 ms packets: rtp 68.8 kbit/s, on the wire "
+            << pcma_wire_kbps << " kbit/s" << std::endl;
+
+  int exit_code = 0;
+  if (packets_per_second == 0) {
+    std::cout << "FAILED: the receiver didn't get any audio" << std::endl;
+    exit_code = 1;
+  }
+  if (expect_max_bitrate_kbps > 0 && rtp_kbps > expect_max_bitrate_kbps) {
+    std::cout << "FAILED: the rtp bitrate " << rtp_kbps << " kbit/s is higher than the expected "
+              << expect_max_bitrate_kbps << " kbit/s" << std::endl;
+    exit_code = 1;
+  }
+
+  gst_object_unref(server_pipeline);
+  gst_object_unref(receiver_pipeline);
+  g_main_loop_unref(loop);
+  return exit_code;
+}
+
+
+}
+
+
+int main(int argc, char** argv) {
+    return snowrobot::main(argc, argv);
+}
@@ -0,0 +1,121 @@
+#include "../common/decoderbackend.h"
+#include "../server/encoderbackend.h"
+
+#include <iostream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+
+// This checks the encoder and decoder backend selection with made-up capabilities, so every combination can be tried on
+// any machine. The encoderfallback and decoderfallback tests only try the one the machine happens to have. Each case
+// prints a line, and the exit code is 1 if any of them picked the wrong backend.
+
+
+namespace snowrobot {
+
+
+struct EncoderCase {
+  const char* description;
+  EncoderBackend requested;
+  EncoderCapabilities capabilities;
+  std::optional<EncoderBackend> expected;  // std::nullopt if there is no usable backend, so it must throw
+};
+
+
+struct DecoderCase {
+  const char* description;
+  DecoderBackend requested;
+  DecoderCapabilities capabilities;
+  std::optional<DecoderBackend> expected;
+};
+
+
+// Returns false if the backend that was picked isn't the expected one. The names are printed with to_string(), and
+// "none" means that the selection threw.
+template<typename Backend, typename Capabilities, typename ChooseFunc>
+static bool checkCase(const char* description, Backend requested, const Capabilities& capabilities,
+                      std::optional<Backend> expected, ChooseFunc choose) {
+  std::optional<Backend> chosen;
+  try {
+    chosen = choose(requested, capabilities);
+  }
+  catch(const std::runtime_error&) {
+  }
+  bool passed = chosen == expected;
+  std::cout << (passed ? "ok      " : "FAILED  ") << description << ": asked for '" << to_string(requested)
+            << "', got '" << (chosen ? to_string(*chosen) : "none") << "'";
+  if (!passed) {
+    std::cout << ", expected '" << (expected ? to_string(*expected) : "none") << "'";
+  }
+  std::cout << std::endl;
+  return passed;
+}
+
+
+int main()
+{
+  const EncoderCase encoder_cases[] = {
+    {"no encoder at all", EncoderBackend::Auto, {}, std::nullopt},
+    {"only x264enc", EncoderBackend::Auto, {.has_x264enc = true}, EncoderBackend::X264},
+    {"the hardware encoder is preferred", EncoderBackend::Auto,
+     {.has_x264enc = true, .has_v4l2h264enc = true, .camera_has_h264 = true}, EncoderBackend::V4l2M2m},
+    {"the camera's h264 is preferred over x264enc", EncoderBackend::Auto,
+     {.has_x264enc = true, .camera_has_h264 = true}, EncoderBackend::CameraH264},
+    {"an available backend is used as asked", EncoderBackend::X264,
+     {.has_x264enc = true, .has_v4l2h264enc = true, .camera_has_h264 = true}, EncoderBackend::X264},
+    {"the camera without h264 falls back to x264enc", EncoderBackend::CameraH264,
+     {.has_x264enc = true}, EncoderBackend::X264},
+    {"no hardware encoder falls back to the camera", EncoderBackend::V4l2M2m,
+     {.has_x264enc = true, .camera_has_h264 = true}, EncoderBackend::CameraH264},
+    {"only the hardware encoder", EncoderBackend::X264, {.has_v4l2h264enc = true}, EncoderBackend::V4l2M2m},
+    {"no encoder at all, with a backend asked for", EncoderBackend::X264, {}, std::nullopt},
+  };
+
+  const DecoderCase decoder_cases[] = {
+    {"no decoder at all", DecoderBackend::Auto, {}, std::nullopt},
+    {"only avdec_h264", DecoderBackend::Auto, {.has_avdec_h264 = true}, DecoderBackend::Software},
+    {"d3d11 is preferred", DecoderBackend::Auto,
+     {.has_avdec_h264 = true, .has_d3d11h264dec = true, .has_nvh264dec = true}, DecoderBackend::D3D11},
+    {"va-api is preferred over nvdec", DecoderBackend::Auto,
+     {.has_avdec_h264 = true, .has_vah264dec = true, .has_nvh264dec = true}, DecoderBackend::VaApi},
+    {"the old vaapih264dec counts as va-api", DecoderBackend::Auto,
+     {.has_avdec_h264 = true, .has_vaapih264dec = true}, DecoderBackend::VaApi},
+    {"the stateless v4l2 decoder", DecoderBackend::Auto,
+     {.has_avdec_h264 = true, .has_v4l2slh264dec = true}, DecoderBackend::V4l2M2m},
+    {"the stateful v4l2 decoder", DecoderBackend::Auto,
+     {.has_avdec_h264 = true, .has_v4l2h264dec = true}, DecoderBackend::V4l2M2m},
+    {"an available backend is used as asked", DecoderBackend::Software,
+     {.has_avdec_h264 = true, .has_d3d11h264dec = true}, DecoderBackend::Software},
+    {"no va-api falls back to avdec_h264", DecoderBackend::VaApi, {.has_avdec_h264 = true}, DecoderBackend::Software},
+    {"no nvdec falls back to the best one", DecoderBackend::NvDec,
+     {.has_avdec_h264 = true, .has_v4l2h264dec = true}, DecoderBackend::V4l2M2m},
+    {"no decoder at all, with a backend asked for", DecoderBackend::Software, {}, std::nullopt},
+  };
+
+  int failed_count = 0;
+  for (const EncoderCase& c : encoder_cases) {
+    if (!checkCase(c.description, c.requested, c.capabilities, c.expected, chooseEncoderBackend)) {
+      failed_count++;
+    }
+  }
+  for (const DecoderCase& c : decoder_cases) {
+    if (!checkCase(c.description, c.requested, c.capabilities, c.expected, chooseDecoderBackend)) {
+      failed_count++;
+    }
+  }
+
+  if (failed_count > 0) {
+    std::cout << "FAILED: " << failed_count << " of the cases picked the wrong backend" << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+
+}
+
+
+int main() {
+    return snowrobot::main();
+}
@@ -0,0 +1,192 @@
+#include "../common/linebasedserver.h"
+#include "latencyhistogram.h"
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio/connect.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/program_options.hpp>
+
+
+// This stress test runs a LineBasedServer on a multi-threaded io_context, and connects a few hundred telnet-style
+// clients to it. Most of the clients send "ping" in a loop and measure the round trip time. They also send a "count"
+// request now and then, which runs on the application strand. One client keeps sending "slow" requests, which block
+// the application strand for a while, like a slow gstreamer state change would.
+//
+// The test fails if two callbacks ever run at the same time (the application strand must serialize them), or if the
+// p99 ping round trip time is higher than --expect-max-ping (the pings must not wait for the slow requests).
+
+
+namespace snowrobot {
+
+
+// Reads one line from the socket, without the '\n'.
+static boost::asio::awaitable<std::string> read_line(boost::asio::ip::tcp::socket& sock, boost::asio::streambuf& streambuf) {
+  co_await boost::asio::async_read_until(sock, streambuf, "\n", boost::asio::use_awaitable);
+  std::string line;
+  std::istream is(&streambuf);
+  std::getline(is, line, '\n');
+  co_return line;
+}
+
+
+int main(int argc, char** argv)
+{
+  int client_count;
+  int duration_s;
+  int server_thread_count;
+  int slow_request_ms;
+  int expect_max_ping_ms;
+  boost::program_options::options_description desc("Allowed options");
+  desc.add_options()
+      ("clients", boost::program_options::value<int>(&client_count)->default_value(300), "how many clients to connect")
+      ("duration", boost::program_options::value<int>(&duration_s)->default_value(10), "how many seconds to run the test")
+      ("server-threads", boost::program_options::value<int>(&server_thread_count)->default_value(4), "how many threads that run the server's io_context")
+      ("slow-request", boost::program_options::value<int>(&slow_request_ms)->default_value(300), "how many ms each slow request blocks the application strand")
+      ("expect-max-ping", boost::program_options::value<int>(&expect_max_ping_ms)->default_value(0), "fail if the p99 ping round trip time is higher than this many ms")
+  ;
+  boost::program_options::variables_map vm;
+  boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+  boost::program_options::notify(vm);
+
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  // The server
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  boost::asio::io_context server_ctx;
+  std::atomic<int> callbacks_running{0};
+  std::atomic<int> overlap_count{0};
+  int app_request_count = 0;  // only touched by the callbacks, so it doesn't need to be atomic
+  int slow_request_count = 0;
+
+  // Checks that the callbacks are serialized by the application strand.
+  auto enter_callback = [&] {
+    if (callbacks_running.fetch_add(1) != 0) {
+      overlap_count++;
+    }
+  };
+  auto leave_callback = [&] {
+    callbacks_running.fetch_sub(1);
+  };
+
+  LineBasedServer server(
+    server_ctx,
+    0,
+    [&](boost::asio::ip::tcp::socket&) {
+      enter_callback();
+      leave_callback();
+      return std::string("welcome");
+    },
+    [&](boost::asio::ip::tcp::socket&) {
+      enter_callback();
+      leave_callback();
+    },
+    [&](boost::asio::ip::tcp::socket&, std::string_view request) {
+      enter_callback();
+      std::string response;
+      if (request == "slow") {
+        std::this_thread::sleep_for(std::chrono::milliseconds(slow_request_ms));
+        slow_request_count++;
+        response = "done";
+      } else if (request == "count") {
+        app_request_count++;
+        response = std::to_string(app_request_count);
+      } else {
+        response = "ERROR: unknown request '" + std::string(request) + "'";
+      }
+      leave_callback();
+      return response;
+    });
+
+  std::vector<std::future<void>> server_threads;
+  for (int i = 0; i < server_thread_count; i++) {
+    server_threads.push_back(std::async(std::launch::async, [&server_ctx]{server_ctx.run();}));
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  // The clients
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  boost::asio::io_context client_ctx;
+  boost::asio::ip::tcp::endpoint server_endpoint(boost::asio::ip::make_address("127.0.0.1"), server.getPort());
+  auto end_time = std::chrono::steady_clock::now() + std::chrono::seconds(duration_s);
+  LatencyHistogram ping_rtt("ping round trip");
+  LatencyHistogram app_request_rtt("count round trip");
+  int failed_client_count = 0;
+
+  auto run_client = [&](bool is_slow_client) -> boost::asio::awaitable<void> {
+    boost::asio::ip::tcp::socket sock(client_ctx);
+    boost::asio::streambuf streambuf;
+    try {
+      co_await sock.async_connect(server_endpoint, boost::asio::use_awaitable);
+      co_await read_line(sock, streambuf);  // the welcome message
+      int iteration = 0;
+      while (std::chrono::steady_clock::now() < end_time) {
+        std::string request = is_slow_client ? "slow" : (++iteration % 10 == 0 ? "count" : "ping");
+        std::string line = request + "\n";
+        auto start = std::chrono::steady_clock::now();
+        co_await boost::asio::async_write(sock, boost::asio::buffer(line), boost::asio::use_awaitable);
+        co_await read_line(sock, streambuf);
+        int64_t rtt_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        if (request == "ping") {
+          ping_rtt.add(rtt_us);
+        } else if (request == "count") {
+          app_request_rtt.add(rtt_us);
+        }
+      }
+    }
+    catch(const std::exception& e) {
+      BOOST_LOG_TRIVIAL(error) << "A client failed: " << e.what();
+      failed_client_count++;
+    }
+  };
+
+  BOOST_LOG_TRIVIAL(info) << "Running " << client_count << " clients against a server with " << server_thread_count
+                          << " threads for " << duration_s << " seconds...";
+  boost::asio::co_spawn(client_ctx, run_client(true), boost::asio::detached);
+  for (int i = 0; i < client_count; i++) {
+    boost::asio::co_spawn(client_ctx, run_client(false), boost::asio::detached);
+  }
+  client_ctx.run();
+
+  // Give the server a moment to notice that the clients are gone.
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  server_ctx.stop();
+  for (std::future<void>& server_thread : server_threads) {
+    server_thread.get();
+  }
+
+  std::cout << "slow requests: " << slow_request_count << " count requests: " << app_request_count
+            << " failed clients: " << failed_client_count << " overlapping callbacks: " << overlap_count << std::endl;
+  ping_rtt.report();
+  app_request_rtt.report();
+
+  int exit_code = 0;
+  if (overlap_count > 0) {
+    std::cout << "FAILED: the callbacks were not serialized" << std::endl;
+    exit_code = 1;
+  }
+  if (failed_client_count > 0) {
+    std::cout << "FAILED: " << failed_client_count << " clients failed" << std::endl;
+    exit_code = 1;
+  }
+  if (expect_max_ping_ms > 0 && ping_rtt.percentile(0.99) > (int64_t)expect_max_ping_ms * 1000) {
+    std::cout << "FAILED: the p99 ping round trip time is higher than " << expect_max_ping_ms << "ms" << std::endl;
+    exit_code = 1;
+  }
+  return exit_code;
+}
+
+
+}
+
+
+int main(int argc, char** argv) {
+    return snowrobot::main(argc, argv);
+}
@@ -0,0 +1,230 @@
+#include "../common/controlchannel.h"
+#include "../common/linebasedserver.h"
+#include "latencyhistogram.h"
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <unordered_map>
+
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/program_options.hpp>
+
+
+// This benchmark measures how old the drive command at the motors is when the udp control channel loses packets. A
+// ControlChannelClient sends commands at a fixed rate to a ControlChannelServer over the loopback interface, and drops
+// a random fraction of them before they are sent. The "actuator" is sampled every millisecond, and the age of the
+// command it is running (now - the command's send timestamp) is added to a histogram. The samples where the deadman
+// has stopped the motors are counted separately.
+//
+// With --operator-resets, it then checks what happens when the operator's command-port connection is reset. The
+// operator connects to a LineBasedServer that hands out the control channel like the server's command port does, with
+// a ControlChannelOwnership, and resets its tcp connection while it keeps sending drive commands. The commands that
+// arrive after the reset must be rejected, and the next client that connects must be able to take over the channel.
+
+
+namespace snowrobot {
+
+
+// Resets the operator's command-port connection reset_count times, see the comment at the top. Returns false if a
+// check failed.
+static bool runOperatorResets(boost::asio::io_context& ctx, ControlChannelServer& server, ControlChannelClient& client,
+                              int reset_count) {
+  // The command port. Like the server's, it looks up each client's endpoint when the client connects, since
+  // remote_endpoint() throws once the connection has been reset.
+  ControlChannelOwnership ownership(server);
+  std::unordered_map<const boost::asio::ip::tcp::socket*, std::string> client_ids;
+  LineBasedServer command_port(
+    ctx,
+    0,
+    [&](boost::asio::ip::tcp::socket& sock) {
+      std::ostringstream client_id;
+      client_id << sock.remote_endpoint();
+      client_ids[&sock] = client_id.str();
+      return std::string("welcome");
+    },
+    [&](boost::asio::ip::tcp::socket& sock) {
+      ownership.release(client_ids[&sock]);
+      client_ids.erase(&sock);
+    },
+    [&](boost::asio::ip::tcp::socket& sock, std::string_view request) {
+      if (request != "claim") {
+        return std::string("ERROR");
+      }
+      boost::asio::ip::udp::endpoint endpoint(boost::asio::ip::make_address("127.0.0.1"), client.getLocalPort());
+      return std::string(ownership.claim(client_ids[&sock], endpoint) ? "ok" : "busy");
+    });
+
+  // The first run's operator is still set, so it is cleared before the first client claims the channel.
+  server.clearOperator();
+  bool passed = true;
+  boost::asio::co_spawn(ctx, [&]() -> boost::asio::awaitable<void> {
+    boost::asio::steady_timer timer(ctx);
+    // Sends drive commands for a while, and returns how many of them the server applied.
+    auto drive = [&](std::chrono::milliseconds duration) -> boost::asio::awaitable<uint64_t> {
+      uint64_t applied_before = server.getStats().applied;
+      auto end_time = std::chrono::steady_clock::now() + duration;
+      while (std::chrono::steady_clock::now() < end_time) {
+        client.send(100, 500);
+        timer.expires_after(std::chrono::milliseconds(10));
+        co_await timer.async_wait(boost::asio::use_awaitable);
+      }
+      co_return server.getStats().applied - applied_before;
+    };
+
+    for (int i = 0; i < reset_count && passed; i++) {
+      boost::asio::ip::tcp::socket sock(ctx);
+      co_await sock.async_connect(
+        boost::asio::ip::tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), command_port.getPort()),
+        boost::asio::use_awaitable);
+      boost::asio::streambuf streambuf;
+      co_await boost::asio::async_read_until(sock, streambuf, "\n", boost::asio::use_awaitable);  // the welcome
+      streambuf.consume(streambuf.size());
+      co_await boost::asio::async_write(sock, boost::asio::buffer(std::string("claim\n")), boost::asio::use_awaitable);
+      size_t size = co_await boost::asio::async_read_until(sock, streambuf, "\n", boost::asio::use_awaitable);
+      std::string response(boost::asio::buffers_begin(streambuf.data()), boost::asio::buffers_begin(streambuf.data()) + size - 1);
+      if (response != "ok") {
+        std::cout << "FAILED: client " << i << " couldn't take over the control channel after the reset: " << response << std::endl;
+        passed = false;
+        break;
+      }
+      if (co_await drive(std::chrono::milliseconds(200)) == 0) {
+        std::cout << "FAILED: client " << i << "'s drive commands weren't applied" << std::endl;
+        passed = false;
+        break;
+      }
+
+      // Reset the connection (a close with a zero linger time sends a RST), and keep driving.
+      sock.set_option(boost::asio::socket_base::linger(true, 0));
+      sock.close();
+      timer.expires_after(std::chrono::milliseconds(100));
+      co_await timer.async_wait(boost::asio::use_awaitable);
+      uint64_t applied_after_reset = co_await drive(std::chrono::milliseconds(200));
+      if (applied_after_reset > 0 || !ownership.getOwner().empty()) {
+        std::cout << "FAILED: " << applied_after_reset << " drive commands were applied after the operator's connection "
+                  << "was reset, owner: '" << ownership.getOwner() << "'" << std::endl;
+        passed = false;
+      }
+    }
+    ctx.stop();
+  }, boost::asio::detached);
+
+  ctx.restart();
+  ctx.run();
+  std::cout << "operator resets: " << reset_count << (passed ? " ok" : " FAILED") << std::endl;
+  return passed;
+}
+
+
+int main(int argc, char** argv)
+{
+  int duration_s;
+  int rate_hz;
+  double drop_probability;
+  int deadman_timeout_ms;
+  int expect_max_age_ms;
+  int operator_reset_count;
+  boost::program_options::options_description desc("Allowed options");
+  desc.add_options()
+      ("duration", boost::program_options::value<int>(&duration_s)->default_value(10), "how many seconds to run the benchmark")
+      ("rate", boost::program_options::value<int>(&rate_hz)->default_value(50), "how many drive commands to send per second")
+      ("drop-probability", boost::program_options::value<double>(&drop_probability)->default_value(0.2), "the fraction of the drive commands to drop (0.0-1.0)")
+      ("deadman-timeout", boost::program_options::value<int>(&deadman_timeout_ms)->default_value(200), "the server's deadman timeout in ms")
+      ("expect-max-age", boost::program_options::value<int>(&expect_max_age_ms)->default_value(0), "fail if the p99 command age at the actuator is higher than this many ms")
+      ("operator-resets", boost::program_options::value<int>(&operator_reset_count)->default_value(0), "how many times to reset the operator's command-port connection after the run")
+  ;
+  boost::program_options::variables_map vm;
+  boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+  boost::program_options::notify(vm);
+
+  boost::asio::io_context ctx;
+
+  // The actuator just remembers the last command it got.
+  DrivePayload actuator_command;
+  LatencyHistogram apply_latency("send->applied");
+  ControlChannelServer server(ctx, 0, std::chrono::milliseconds(deadman_timeout_ms), [&](const DrivePayload& command) {
+    actuator_command = command;
+    if (command.steering != 0 || command.throttle != 0) {
+      apply_latency.add((int64_t)unix_time_us() - (int64_t)command.timestamp_us);
+    }
+  });
+  ControlChannelClient client(ctx, boost::asio::ip::udp::endpoint(boost::asio::ip::make_address("127.0.0.1"), server.getPort()));
+  server.setOperator(boost::asio::ip::udp::endpoint(boost::asio::ip::make_address("127.0.0.1"), client.getLocalPort()));
+
+  auto end_time = std::chrono::steady_clock::now() + std::chrono::seconds(duration_s);
+  int sent_count = 0;
+  int dropped_count = 0;
+
+  boost::asio::co_spawn(ctx, [&]() -> boost::asio::awaitable<void> {
+    std::mt19937 random_generator(42);
+    std::uniform_real_distribution<double> distribution(0.0, 1.0);
+    boost::asio::steady_timer timer(ctx);
+    auto next_send_time = std::chrono::steady_clock::now();
+    while (next_send_time < end_time) {
+      // Never send an all-zero command, since the actuator uses that to recognize that the deadman has tripped.
+      if (distribution(random_generator) < drop_probability) {
+        client.skip(100, 500);
+        dropped_count++;
+      } else {
+        client.send(100, 500);
+        sent_count++;
+      }
+      next_send_time += std::chrono::microseconds(1000000 / rate_hz);
+      timer.expires_at(next_send_time);
+      co_await timer.async_wait(boost::asio::use_awaitable);
+    }
+  }, boost::asio::detached);
+
+  LatencyHistogram command_age("command age at actuator");
+  int stopped_sample_count = 0;
+  boost::asio::co_spawn(ctx, [&]() -> boost::asio::awaitable<void> {
+    boost::asio::steady_timer timer(ctx);
+    // Give the first command a moment to arrive.
+    auto next_sample_time = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+    while (next_sample_time < end_time) {
+      timer.expires_at(next_sample_time);
+      co_await timer.async_wait(boost::asio::use_awaitable);
+      if (server.isStopped()) {
+        stopped_sample_count++;
+      } else {
+        command_age.add((int64_t)unix_time_us() - (int64_t)actuator_command.timestamp_us);
+      }
+      next_sample_time += std::chrono::milliseconds(1);
+    }
+    ctx.stop();
+  }, boost::asio::detached);
+
+  ctx.run();
+
+  const ControlChannelServer::Stats& stats = server.getStats();
+  std::cout << "sent:" << sent_count << " dropped:" << dropped_count << " applied:" << stats.applied
+            << " stale:" << stats.stale << " rejected:" << stats.rejected << " deadman stops:" << stats.deadman_stops
+            << " samples with stopped motors:" << stopped_sample_count << std::endl;
+  apply_latency.report();
+  command_age.report();
+
+  int exit_code = 0;
+  if (expect_max_age_ms > 0 && command_age.percentile(0.99) > (int64_t)expect_max_age_ms * 1000) {
+    std::cout << "FAILED: the p99 command age at the actuator is higher than " << expect_max_age_ms << "ms" << std::endl;
+    exit_code = 1;
+  }
+  if (operator_reset_count > 0 && !runOperatorResets(ctx, server, client, operator_reset_count)) {
+    exit_code = 1;
+  }
+  return exit_code;
+}
+
+
+}
+
+
+int main(int argc, char** argv) {
+    return snowrobot::main(argc, argv);
+}
@@ -0,0 +1,207 @@
+#include "../common/requestdispatcher.h"
+#include "allocationcounter.h"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/json/object.hpp>
+#include <boost/json/parse.hpp>
+#include <boost/program_options.hpp>
+
+
+// This benchmark compares the cost of dispatching the command port's and the debug ports' requests with the chain of
+// ifs and boost::json::parse() the server and the client used to have, with the RequestDispatcher in
+// common/requestdispatcher.h. Both paths do the same work for each request: find the handler, read the request's
+// members and return a short response. It uses three requests:
+//   ping:              a plain text request, like the keepalives
+//   select-resolution: a small json request
+//   welcome-response:  a larger json request with an array of cameras, like the one each client sends when it connects
+//
+// It reports the time and the number of heap allocations per request, and fails if the dispatcher allocates when the
+// handlers are plain functions, like the debug ports' handlers. With coroutine handlers, like the command port's, the
+// dispatching doesn't allocate either, but the coroutine frames do unless asio's frame recycling can reuse them, so
+// those allocations are only reported.
+
+
+namespace snowrobot {
+
+
+struct BenchmarkResult {
+  double ns_per_request;
+  double allocations_per_request;
+  int64_t checksum;  // keeps the compiler from optimizing the handlers away
+};
+
+
+template<typename Func>
+static BenchmarkResult run(int request_count, Func handle_one) {
+  int64_t checksum = 0;
+  size_t allocations_before = allocation_count;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < request_count; i++) {
+    checksum += handle_one().size();
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  size_t allocations = allocation_count - allocations_before;
+  return BenchmarkResult{
+    (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / request_count,
+    (double)allocations / request_count,
+    checksum
+  };
+}
+
+
+// The handlers' work, which is the same for both paths. The arguments are string_views, so it doesn't matter whether
+// the caller has copied the members into std::strings or not.
+static std::string selectResolution(std::string_view camera, std::string_view resolution) {
+  return camera.size() + resolution.size() > 0 ? "ok" : "error";
+}
+
+static std::string attach(size_t camera_count, int64_t control_udp_port) {
+  return camera_count > 0 && control_udp_port > 0 ? "attached" : "error";
+}
+
+
+// The way the requests used to be dispatched.
+static std::string dispatchWithIfs(const std::string& request) {
+  std::string response;
+  if (request == "ping") {
+    response = "pong";
+  } else {
+    boost::json::object request_obj = boost::json::parse(request).as_object();
+    std::string request_type(request_obj.at("type").as_string());
+    if (request_type == "select-resolution") {
+      std::string camera_name(request_obj.at("camera").as_string());
+      std::string resolution(request_obj.at("resolution").as_string());
+      response = selectResolution(camera_name, resolution);
+    } else if (request_type == "welcome-response") {
+      boost::json::array camera_responses = request_obj.at("cameras").as_array();
+      size_t camera_count = 0;
+      for (boost::json::value& value : camera_responses) {
+        std::string camera_name(value.as_object().at("name").as_string());
+        camera_count += camera_name.empty() ? 0 : 1;
+      }
+      response = attach(camera_count, request_obj.at("control_udp_port").as_int64());
+    } else {
+      std::ostringstream msg;
+      msg << "Unknown request type: '" << request_type << "'";
+      throw std::runtime_error(msg.str());
+    }
+  }
+  return response;
+}
+
+
+static size_t countCameras(const boost::json::object& request) {
+  size_t camera_count = 0;
+  for (const boost::json::value& value : request.at("cameras").as_array()) {
+    camera_count += value.as_object().at("name").as_string().empty() ? 0 : 1;
+  }
+  return camera_count;
+}
+
+
+int main(int argc, char** argv)
+{
+  int request_count;
+  boost::program_options::options_description desc("Allowed options");
+  desc.add_options()
+      ("requests", boost::program_options::value<int>(&request_count)->default_value(1000000), "how many of each request to dispatch with each path")
+  ;
+  boost::program_options::variables_map vm;
+  boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+  boost::program_options::notify(vm);
+
+  const std::vector<std::pair<std::string, std::string>> requests = {
+    {"ping", "ping"},
+    {"select-resolution", R"({"type":"select-resolution","camera":"/dev/video0","resolution":"1280x720@30"})"},
+    {"welcome-response", R"({"type":"welcome-response","control_udp_port":40123,"cameras":[)"
+                         R"({"name":"/dev/video0","rtp_video_udp_port":40124,"rtcp_video_udp_port":40125,"fec":10},)"
+                         R"({"name":"/dev/video2","rtp_video_udp_port":40126,"rtcp_video_udp_port":40127,"fec":10}],)"
+                         R"("microphones":[{"name":"hw:1","rtp_audio_udp_port":40128,"rtcp_audio_udp_port":40129}]})"},
+  };
+
+  int socket = 0;  // stands in for the socket the handlers get in the server
+  auto dispatcher = makeRequestDispatcher<std::string>(
+    onText<"ping">([](int& sock) { return std::string("pong"); }),
+    onJson<"select-resolution">([](const boost::json::object& request, int& sock) {
+      return selectResolution(request.at("camera").as_string(), request.at("resolution").as_string());
+    }),
+    onJson<"welcome-response">([](const boost::json::object& request, int& sock) {
+      return attach(countCameras(request), request.at("control_udp_port").as_int64());
+    }));
+
+  auto async_dispatcher = makeRequestDispatcher<boost::asio::awaitable<std::string>>(
+    onText<"ping">([](int& sock) -> boost::asio::awaitable<std::string> {
+      co_return "pong";
+    }),
+    onJson<"select-resolution">([](const boost::json::object& request, int& sock) -> boost::asio::awaitable<std::string> {
+      co_return selectResolution(request.at("camera").as_string(), request.at("resolution").as_string());
+    }),
+    onJson<"welcome-response">([](const boost::json::object& request, int& sock) -> boost::asio::awaitable<std::string> {
+      co_return attach(countCameras(request), request.at("control_udp_port").as_int64());
+    }));
+
+  int exit_code = 0;
+  std::cout << std::fixed << std::setprecision(1);
+  for (const auto& [name, request] : requests) {
+    // One round first, so the arena and the parser's stack have been set up before we count.
+    dispatcher.dispatch(request, socket);
+    BenchmarkResult ifs_result = run(request_count, [&] { return dispatchWithIfs(request); });
+    BenchmarkResult dispatcher_result = run(request_count, [&] { return dispatcher.dispatch(request, socket); });
+
+    // The coroutine handlers are run like the command port runs them, from a coroutine on an io_context.
+    BenchmarkResult async_result{};
+    boost::asio::io_context ctx;
+    boost::asio::co_spawn(ctx, [&]() -> boost::asio::awaitable<void> {
+      co_await async_dispatcher.asyncDispatch(request, socket);
+      int64_t checksum = 0;
+      size_t allocations_before = allocation_count;
+      auto start = std::chrono::steady_clock::now();
+      for (int i = 0; i < request_count; i++) {
+        std::string response = co_await async_dispatcher.asyncDispatch(request, socket);
+        checksum += response.size();
+      }
+      auto elapsed = std::chrono::steady_clock::now() - start;
+      async_result = BenchmarkResult{
+        (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / request_count,
+        (double)(allocation_count - allocations_before) / request_count,
+        checksum
+      };
+    }, boost::asio::detached);
+    ctx.run();
+
+    if (ifs_result.checksum != dispatcher_result.checksum || ifs_result.checksum != async_result.checksum) {
+      std::cout << "FAILED: the paths gave different responses to " << name << std::endl;
+      exit_code = 1;
+    }
+    std::cout << std::left << std::setw(18) << name << std::right
+              << " ifs: " << std::setw(8) << ifs_result.ns_per_request << " ns/request "
+              << std::setw(6) << ifs_result.allocations_per_request << " allocations/request"
+              << "   dispatcher: " << std::setw(8) << dispatcher_result.ns_per_request << " ns/request "
+              << std::setw(6) << dispatcher_result.allocations_per_request << " allocations/request"
+              << "   async: " << std::setw(8) << async_result.ns_per_request << " ns/request "
+              << std::setw(6) << async_result.allocations_per_request << " allocations/request" << std::endl;
+    if (dispatcher_result.allocations_per_request > 0) {
+      std::cout << "FAILED: the dispatcher allocated memory while handling " << name << std::endl;
+      exit_code = 1;
+    }
+  }
+  return exit_code;
+}
+
+
+}
+
+
+int main(int argc, char** argv) {
+    return snowrobot::main(argc, argv);
+}
@@ -0,0 +1,135 @@
+#ifndef SNOWROBOT_REMOTECONTROL_BENCHMARKS_FAKEROMEOBOARD_H
+#define SNOWROBOT_REMOTECONTROL_BENCHMARKS_FAKEROMEOBOARD_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+
+namespace snowrobot {
+
+
+// Pretends to be the Romeo BLE Quad board at the other end of a pseudo terminal, so the MotorBridge can be tested
+// without the hardware. getDevice() is the path of the pty's slave side, which the MotorBridge opens like a serial
+// device. The board runs the same parser as romeo_ble_quad.ino, byte for byte, on a thread of its own: it collects the
+// bytes until a zero that ends a message, answers each message with an ack or a nack, and stops the motors if it
+// hasn't got a movement message for a second.
+class FakeRomeoBoard {
+  public:
+    struct Movement {
+      uint8_t sequence_nr;
+      uint8_t steering;
+      uint8_t throttle;
+      int64_t received_ns;  // on the steady clock
+    };
+    // Called on the board's thread for each movement message it accepts.
+    using MovementFunc = std::function<void(const Movement&)>;
+
+    explicit FakeRomeoBoard(MovementFunc movement_func) : movement_func_(std::move(movement_func)) {
+      this->master_fd_ = posix_openpt(O_RDWR | O_NOCTTY);
+      if (this->master_fd_ < 0 || grantpt(this->master_fd_) != 0 || unlockpt(this->master_fd_) != 0) {
+        throw std::runtime_error(std::string("FakeRomeoBoard: failed to create a pty: ") + strerror(errno));
+      }
+      this->device_ = ptsname(this->master_fd_);
+      this->thread_ = std::thread([this] { this->run(); });
+    }
+
+    ~FakeRomeoBoard() {
+      this->stopping_ = true;
+      this->thread_.join();
+      ::close(this->master_fd_);
+    }
+
+    const std::string& getDevice() const {
+      return this->device_;
+    }
+
+    uint64_t getAcks() const { return this->acks_; }
+    uint64_t getNacks() const { return this->nacks_; }
+    uint64_t getDeadmanStops() const { return this->deadman_stops_; }
+
+  private:
+    void run() {
+      std::array<uint8_t, 256> buffer;
+      // Like the firmware's currentCmd. It is a bit larger, since the firmware's can overflow.
+      std::array<uint8_t, 32> message;
+      size_t message_size = 0;
+      int64_t last_movement_ns = 0;
+      while (!this->stopping_) {
+        pollfd fd{this->master_fd_, POLLIN, 0};
+        int ready = ::poll(&fd, 1, 10);
+        int64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        if (last_movement_ns != 0 && now_ns - last_movement_ns > 1000000000ll) {
+          this->deadman_stops_++;
+          last_movement_ns = 0;
+        }
+        if (ready <= 0 || !(fd.revents & POLLIN)) {
+          if (ready > 0) {
+            // Nobody has the slave side open (POLLHUP), so there is nothing to read until the bridge opens it.
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+          }
+          continue;
+        }
+        ssize_t size = ::read(this->master_fd_, buffer.data(), buffer.size());
+        for (ssize_t i = 0; i < size; i++) {
+          uint8_t byte = buffer[i];
+          message[message_size++] = byte;
+          if (byte != 0) {
+            if (message_size == message.size()) {
+              message_size = 0;
+            }
+            continue;
+          }
+          if (message_size <= 2) {
+            continue;
+          }
+          uint8_t response_code = 201;
+          if (message[2] == 100 && message_size == 6) {
+            last_movement_ns = now_ns;
+            response_code = 200;
+            this->movement_func_(Movement{message[1], message[3], message[4], now_ns});
+          }
+          else if (message[2] == 101) {
+            response_code = 200;
+          }
+          if (response_code == 200) {
+            this->acks_++;
+          }
+          else {
+            this->nacks_++;
+          }
+          uint8_t response[4] = {0, message[1], response_code, 0};
+          message_size = 0;
+          if (::write(this->master_fd_, response, sizeof(response)) != sizeof(response)) {
+            // The bridge isn't reading, so the response is lost like it would be on a real serial line.
+          }
+        }
+      }
+    }
+
+    MovementFunc movement_func_;
+    int master_fd_ = -1;
+    std::string device_;
+    std::atomic<bool> stopping_{false};
+    std::atomic<uint64_t> acks_{0};
+    std::atomic<uint64_t> nacks_{0};
+    std::atomic<uint64_t> deadman_stops_{0};
+    std::thread thread_;
+};
+
+
+}
+
+#endif
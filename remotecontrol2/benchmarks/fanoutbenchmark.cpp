@@ -0,0 +1,279 @@
+#include "../server/camerainfo.h"
+#include "../common/gst_wrappers.h"
+#include "processcputime.h"
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gst/gst.h>
+
+#include <boost/json/object.hpp>
+#include <boost/log/trivial.hpp>
+#include <boost/program_options.hpp>
+
+
+// This benchmark checks that the server encodes each camera once, no matter how many clients that watch it. It runs
+// the CameraInfo pipeline from the server with a videotestsrc, and a receiver pipeline with one rtp-session per viewer.
+// The receivers don't decode the video, they only count the rtp packets and send receiver reports back to the server.
+//
+// The benchmark first runs with a single viewer, and then attaches the rest of the viewers to the running pipeline.
+// The cpu usage of the process is measured in both phases, and the benchmark fails if it grows by more than
+// --max-cpu-increase. The cpu usage includes the receivers, but they are cheap compared to the encoder. It also fails
+// if a viewer doesn't get any video, or if the server hasn't got separate receiver reports from each of the viewers.
+
+
+namespace snowrobot {
+
+
+// The receiving end of one viewer.
+struct Viewer {
+  GstElement* rtp_udpsrc = nullptr;
+  gint rtp_udpsrc_port = 0;
+  GstElement* rtcp_udpsrc = nullptr;
+  gint rtcp_udpsrc_port = 0;
+  GstElement* rtcp_udpsink = nullptr;
+  GstElement* fakesink = nullptr;
+  guint rtcp_ssrc = 0;
+  std::atomic<int> packet_count{0};
+};
+
+
+static void
+receiver_pad_added_handler(GstElement* rtpbin, GstPad* pad, gpointer data)
+{
+  std::vector<std::unique_ptr<Viewer>>& viewers = *(std::vector<std::unique_ptr<Viewer>>*)data;
+  std::string pad_name = string_from_gchar(gst_pad_get_name(pad));
+  for (size_t i = 0; i < viewers.size(); i++) {
+    std::string prefix = "recv_rtp_src_" + std::to_string(i) + "_";
+    if (pad_name.find(prefix) == 0) {
+      GstPad* sink_pad = gst_element_get_static_pad(viewers[i]->fakesink, "sink");
+      ASSERT_NOT_NULL(sink_pad);
+      if (gst_pad_link(pad, sink_pad) != GST_PAD_LINK_OK) {
+        BOOST_LOG_TRIVIAL(error) << "receiver_pad_added_handler(): failed to link the pad '" << pad_name << "'";
+      }
+      gst_object_unref(sink_pad);
+    }
+  }
+}
+
+
+static void
+cb_error(GstBus* bus, GstMessage* message, gpointer data)
+{
+  GError* error = NULL;
+  gst_message_parse_error(message, &error, NULL);
+  BOOST_LOG_TRIVIAL(error) << "cb_error:" << GST_OBJECT_NAME(message->src) << ": " << error->message;
+  g_error_free(error);
+  g_main_loop_quit((GMainLoop*)data);
+}
+
+
+// Waits for the warmup, and then returns the cpu usage during the next duration_s seconds as a percentage of one core.
+static double measure_cpu_percent(int warmup_s, int duration_s) {
+  std::this_thread::sleep_for(std::chrono::seconds(warmup_s));
+  int64_t start_cpu = process_cpu_time_us();
+  auto start_time = std::chrono::steady_clock::now();
+  std::this_thread::sleep_for(std::chrono::seconds(duration_s));
+  int64_t used_cpu = process_cpu_time_us() - start_cpu;
+  int64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time).count();
+  return 100.0 * used_cpu / elapsed;
+}
+
+
+int main(int argc, char** argv)
+{
+  gst_init(&argc, &argv);
+
+  int viewer_count;
+  int duration_s;
+  int warmup_s;
+  double max_cpu_increase;
+  std::string encoder_backend_name;
+  boost::program_options::options_description desc("Allowed options");
+  desc.add_options()
+      ("viewers", boost::program_options::value<int>(&viewer_count)->default_value(4), "how many viewers to attach in the second phase")
+      ("duration", boost::program_options::value<int>(&duration_s)->default_value(10), "how many seconds to measure the cpu usage in each phase")
+      ("warmup", boost::program_options::value<int>(&warmup_s)->default_value(2), "how many seconds to wait before measuring in each phase")
+      ("max-cpu-increase", boost::program_options::value<double>(&max_cpu_increase)->default_value(0.25), "fail if the cpu usage with all the viewers is more than this fraction higher than with one viewer")
+      ("encoder", boost::program_options::value<std::string>(&encoder_backend_name)->default_value("auto"), "the h264 encoder to use: auto, x264, v4l2 or camera")
+  ;
+  boost::program_options::variables_map vm;
+  boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+  boost::program_options::notify(vm);
+  if (viewer_count < 1) {
+    THROW_RUNTIME_ERROR("--viewers must be at least 1, got " << viewer_count);
+  }
+
+  GMainLoop* loop = g_main_loop_new(NULL, FALSE);
+  ASSERT_NOT_NULL(loop);
+
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  // The server pipeline
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  GstElement* server_pipeline = gst_pipeline_new("server");
+  ASSERT_NOT_NULL(server_pipeline);
+  GstElement* server_rtpbin = gst_element_factory_make("rtpbin", NULL);
+  ASSERT_NOT_NULL(server_rtpbin);
+  ASSERT_TRUE(gst_bin_add(GST_BIN_CAST(server_pipeline), server_rtpbin));
+
+  CameraSettings camera_settings;
+  camera_settings.encoder_backend = encoderBackendFromString(encoder_backend_name);
+  CameraInfo camera_info;
+  boost::json::object camera = camera_info.initialize(GST_BIN_CAST(server_pipeline), server_rtpbin, nullptr, 0, camera_settings);
+  std::cout << "Encoder backend: " << to_string(camera_info.getEncoderBackend()) << std::endl;
+
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  // The receiver pipeline, with one rtp-session per viewer
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  GstElement* receiver_pipeline = gst_pipeline_new("receivers");
+  ASSERT_NOT_NULL(receiver_pipeline);
+  GstElement* receiver_rtpbin = gst_element_factory_make("rtpbin", NULL);
+  ASSERT_NOT_NULL(receiver_rtpbin);
+  ASSERT_TRUE(gst_bin_add(GST_BIN_CAST(receiver_pipeline), receiver_rtpbin));
+
+  std::vector<std::unique_ptr<Viewer>> viewers;
+  auto rtp_caps = make_GstCaps_ptr(gst_caps_from_string(
+    "application/x-rtp,media=(string)video,clock-rate=(int)90000,encoding-name=(string)H264"));
+  for (int i = 0; i < viewer_count; i++) {
+    auto viewer = std::make_unique<Viewer>();
+    viewer->rtp_udpsrc = gst_element_factory_make("udpsrc", NULL);
+    ASSERT_NOT_NULL(viewer->rtp_udpsrc);
+    g_object_set(viewer->rtp_udpsrc, "port", 0, NULL);
+    g_object_set(viewer->rtp_udpsrc, "caps", rtp_caps.get(), NULL);
+    gst_element_set_state(viewer->rtp_udpsrc, GST_STATE_PAUSED);
+    g_object_get(viewer->rtp_udpsrc, "port", &viewer->rtp_udpsrc_port, NULL);
+
+    viewer->rtcp_udpsrc = gst_element_factory_make("udpsrc", NULL);
+    ASSERT_NOT_NULL(viewer->rtcp_udpsrc);
+    g_object_set(viewer->rtcp_udpsrc, "port", 0, NULL);
+    gst_element_set_state(viewer->rtcp_udpsrc, GST_STATE_PAUSED);
+    g_object_get(viewer->rtcp_udpsrc, "port", &viewer->rtcp_udpsrc_port, NULL);
+
+    viewer->rtcp_udpsink = gst_element_factory_make("udpsink", NULL);
+    ASSERT_NOT_NULL(viewer->rtcp_udpsink);
+    g_object_set(viewer->rtcp_udpsink, "host", "127.0.0.1", NULL);
+    g_object_set(viewer->rtcp_udpsink, "port", (gint)camera.at("video_rtcp_udpsrc_port").as_int64(), NULL);
+    g_object_set(viewer->rtcp_udpsink, "sync", FALSE, NULL);
+    g_object_set(viewer->rtcp_udpsink, "async", FALSE, NULL);
+
+    viewer->fakesink = gst_element_factory_make("fakesink", NULL);
+    ASSERT_NOT_NULL(viewer->fakesink);
+    g_object_set(viewer->fakesink, "sync", FALSE, NULL);
+
+    gst_bin_add_many(GST_BIN_CAST(receiver_pipeline), viewer->rtp_udpsrc, viewer->rtcp_udpsrc, viewer->rtcp_udpsink,
+                     viewer->fakesink, NULL);
+    std::string recv_rtp_sink_pad_name = "recv_rtp_sink_" + std::to_string(i);
+    ASSERT_TRUE(gst_element_link_pads(viewer->rtp_udpsrc, "src", receiver_rtpbin, recv_rtp_sink_pad_name.c_str()));
+    std::string recv_rtcp_sink_pad_name = "recv_rtcp_sink_" + std::to_string(i);
+    ASSERT_TRUE(gst_element_link_pads(viewer->rtcp_udpsrc, "src", receiver_rtpbin, recv_rtcp_sink_pad_name.c_str()));
+    std::string send_rtcp_src_pad_name = "send_rtcp_src_" + std::to_string(i);
+    ASSERT_TRUE(gst_element_link_pads(receiver_rtpbin, send_rtcp_src_pad_name.c_str(), viewer->rtcp_udpsink, "sink"));
+
+    GstPad* udpsrc_pad = gst_element_get_static_pad(viewer->rtp_udpsrc, "src");
+    ASSERT_NOT_NULL(udpsrc_pad);
+    gst_pad_add_probe(udpsrc_pad, GST_PAD_PROBE_TYPE_BUFFER, [](GstPad*, GstPadProbeInfo*, gpointer user_data) -> GstPadProbeReturn {
+      ((Viewer*)user_data)->packet_count++;
+      return GST_PAD_PROBE_OK;
+    }, viewer.get(), NULL);
+    gst_object_unref(udpsrc_pad);
+
+    // Like the client, send receiver reports every second and tell the server which ssrc we send them with.
+    GObject* session = nullptr;
+    g_signal_emit_by_name(receiver_rtpbin, "get-internal-session", (guint)i, &session);
+    ASSERT_NOT_NULL(session);
+    g_object_set(session, "rtcp-min-interval", (guint64)GST_SECOND, NULL);
+    g_object_get(session, "internal-ssrc", &viewer->rtcp_ssrc, NULL);
+    g_object_unref(session);
+
+    viewers.push_back(std::move(viewer));
+  }
+  g_signal_connect(receiver_rtpbin, "pad-added", G_CALLBACK(receiver_pad_added_handler), &viewers);
+
+  for (GstElement* pipeline : {receiver_pipeline, server_pipeline}) {
+    GstBus* bus = gst_element_get_bus(pipeline);
+    g_signal_connect(bus, "message::error", G_CALLBACK(cb_error), loop);
+    gst_bus_add_signal_watch(bus);
+    gst_object_unref(bus);
+  }
+
+  auto attach_viewer = [&](int i) {
+    boost::json::object client_info;
+    client_info["video_rtp_udpsrc_port"] = viewers[i]->rtp_udpsrc_port;
+    client_info["video_rtcp_udpsrc_port"] = viewers[i]->rtcp_udpsrc_port;
+    client_info["rtcp_ssrc"] = viewers[i]->rtcp_ssrc;
+    camera_info.addClient("viewer" + std::to_string(i), "127.0.0.1", client_info);
+  };
+
+  ASSERT_TRUE(gst_element_set_state(receiver_pipeline, GST_STATE_PLAYING) != GST_STATE_CHANGE_FAILURE);
+  ASSERT_TRUE(gst_element_set_state(server_pipeline, GST_STATE_PLAYING) != GST_STATE_CHANGE_FAILURE);
+  auto loop_runner_future = std::async(std::launch::async, [loop]{ g_main_loop_run(loop); });
+
+  BOOST_LOG_TRIVIAL(info) << "Measuring the cpu usage with 1 viewer for " << duration_s << " seconds...";
+  attach_viewer(0);
+  double single_viewer_cpu = measure_cpu_percent(warmup_s, duration_s);
+
+  BOOST_LOG_TRIVIAL(info) << "Measuring the cpu usage with " << viewer_count << " viewers for " << duration_s << " seconds...";
+  for (int i = 1; i < viewer_count; i++) {
+    attach_viewer(i);
+  }
+  std::vector<int> packet_counts_before;
+  for (const auto& viewer : viewers) {
+    packet_counts_before.push_back(viewer->packet_count);
+  }
+  double all_viewers_cpu = measure_cpu_percent(warmup_s, duration_s);
+
+  g_main_loop_quit(loop);
+  loop_runner_future.get();
+  gst_element_set_state(server_pipeline, GST_STATE_NULL);
+  gst_element_set_state(receiver_pipeline, GST_STATE_NULL);
+
+  int exit_code = 0;
+  std::cout << std::fixed << std::setprecision(1);
+  std::cout << "cpu usage with 1 viewer:  " << single_viewer_cpu << "%" << std::endl;
+  std::cout << "cpu usage with " << viewer_count << " viewers: " << all_viewers_cpu << "%" << std::endl;
+  if (all_viewers_cpu > single_viewer_cpu * (1.0 + max_cpu_increase)) {
+    std::cout << "FAILED: the cpu usage grew by more than " << max_cpu_increase * 100 << "% when the viewers were added" << std::endl;
+    exit_code = 1;
+  }
+
+  for (size_t i = 0; i < viewers.size(); i++) {
+    int packet_count = viewers[i]->packet_count - packet_counts_before[i];
+    std::cout << "viewer" << i << ": " << packet_count << " rtp packets in the second phase" << std::endl;
+    if (packet_count == 0) {
+      std::cout << "FAILED: viewer" << i << " didn't get any video" << std::endl;
+      exit_code = 1;
+    }
+  }
+
+  std::vector<ViewerStats> viewer_stats = camera_info.getViewerStats();
+  for (const ViewerStats& stats : viewer_stats) {
+    std::cout << "receiver reports from ssrc " << stats.rtcp_ssrc << " (" << stats.client_id << "): "
+              << stats.report_count << " reports, fraction_lost:" << stats.last_report.fraction_lost
+              << " bitrate:" << stats.bitrate_kbps << " kbit/s" << std::endl;
+  }
+  if (viewer_stats.size() != viewers.size()) {
+    std::cout << "FAILED: the server tracks the receiver reports from " << viewer_stats.size() << " ssrcs, expected "
+              << viewers.size() << std::endl;
+    exit_code = 1;
+  }
+
+  gst_object_unref(server_pipeline);
+  gst_object_unref(receiver_pipeline);
+  g_main_loop_unref(loop);
+  return exit_code;
+}
+
+
+}
+
+
+int main(int argc, char** argv) {
+    return snowrobot::main(argc, argv);
+}
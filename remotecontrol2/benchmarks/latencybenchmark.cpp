@@ -0,0 +1,905 @@
+#include "../server/camerainfo.h"
+#include "../server/pipelinestats.h"
+#include "../common/decoderbackend.h"
+#include "../common/fec.h"
+#include "../common/gst_wrappers.h"
+#include "latencyhistogram.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <gst/gst.h>
+#include <gst/rtp/rtp.h>
+
+#include <boost/json/array.hpp>
+#include <boost/json/object.hpp>
+#include <boost/json/serialize.hpp>
+#include <boost/log/trivial.hpp>
+#include <boost/program_options.hpp>
+
+
+// This benchmark measures the latency of the server's video pipeline. It runs the CameraInfo pipeline from the server
+// with a videotestsrc instead of a real camera, and a receiver pipeline that is similar to the one in the client. The
+// two pipelines talk to each other via rtp/rtcp over the loopback interface, just like the real server and client.
+//
+// Pad-probes on each stage of the pipelines record when each video frame passes, and the latencies are reported as
+// p50/p99/max values when the benchmark finishes. The stages are:
+//   captured:   the frame left the video source
+//   encoded:    the encoded frame left the encoder
+//   packetized: the last rtp packet of the frame left the payloader
+//   received:   the last rtp packet of the frame was received by the receiver's udpsrc
+//   playout:    the last rtp packet of the frame left the receiver's jitterbuffer
+//   decoded:    the decoded frame left the decoder
+//
+// The server side frames are identified by their pts. The receiver's rtpbin restamps the buffers, so the receiver
+// side frames are identified by their rtp timestamp instead. The payloader probe joins the two.
+//
+// The --drop-probability option drops a random fraction of the rtp packets before they reach the receiver's rtpbin.
+// This is used to check that the bitrate controller backs off when the link is lossy. With --expect-max-bitrate the
+// benchmark fails if the encoder bitrate hasn't converged to below the given value at the end of the run.
+//
+// The --reconnects option detaches and reattaches the receiver the given number of times after the warmup, and
+// reports the time from the reattach to the first decoded frame. This is what the user sees when the client
+// reconnects. With --cold the server pipeline is also stopped and restarted on each reconnect, which is what the
+// server used to do before it kept the pipeline running between the clients.
+//
+// The --resolution-switches option switches the camera between 640x480 and 320x240 the given number of times after the
+// warmup, like the client does when the user picks another resolution, and reports the time from the switch until the
+// decoder outputs the new resolution.
+//
+// The --loss-bursts option drops all the rtp packets for --loss-burst-ms the given number of times after the warmup,
+// and reports the time from the end of each burst until the receiver decodes a picture again. The receiver asks for a
+// keyframe with a PLI as soon as it notices the loss, like the client does, so this should be about a round trip and a
+// frame, not the time until the next regular keyframe. With --expect-max-recovery the benchmark fails if a recovery
+// takes longer than the given number of ms. Use --intra-refresh and --keyframe-interval to try the encoder's keyframe
+// settings, and compare the "rtp packets per frame" line to see how bursty the stream is.
+//
+// The --decoder option picks the receiver's h264 decoder like the client does, and falls back to avdec_h264 if the
+// requested hardware decoder isn't available.
+//
+// The --fec-percentage option makes the server add ULPFEC packets to the stream, and the receiver rebuild the lost
+// packets from them. Combine it with --drop-probability to see how many more frames get through, and at what cost in
+// bandwidth.
+//
+// The --record option writes the server's rtp and rtcp packets to a capture file like the server's --record does. The
+// ctest uses this to make a capture for the rtpreplay test.
+//
+// The --record-dir option records the video to disk next to the live stream, like the server's --record-dir, with a
+// file every 2 seconds. The recording gets the encoded video from a tee in front of the payloader, so compare the
+// encode->packetize stage with and without it. With --expect-max-packetize the benchmark fails if its p99 is longer
+// than the given number of ms.
+//
+// The --pipeline-stats option puts the server's PipelineStats probes on the server pipeline and collects the stats once
+// a second, like a scraper of the server's debug port does. Compare the latencies with and without it to see what the
+// probes cost, and the "collect()" line for the time each collect takes. The last stats are printed at the end.
+
+
+namespace snowrobot {
+
+
+// Timestamps from g_get_monotonic_time() (in microseconds). Zero means that the frame never reached the stage.
+struct FrameTimes {
+  gint64 captured = 0;
+  gint64 encoded = 0;
+  gint64 packetized = 0;
+};
+
+struct ReceivedFrameTimes {
+  gint64 received = 0;
+  gint64 playout = 0;
+  gint64 decoded = 0;
+};
+
+
+template<typename Func>
+void for_each_buffer(GstPadProbeInfo* info, Func func) {
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+    func(GST_PAD_PROBE_INFO_BUFFER(info));
+  } else if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+    GstBufferList* buffer_list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+    guint length = gst_buffer_list_length(buffer_list);
+    for (guint i = 0; i < length; i++) {
+      func(gst_buffer_list_get(buffer_list, i));
+    }
+  }
+}
+
+
+bool read_rtp_header(GstBuffer* buffer, guint32& rtp_timestamp, bool& marker) {
+  GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+  if (!gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp)) {
+    return false;
+  }
+  rtp_timestamp = gst_rtp_buffer_get_timestamp(&rtp);
+  marker = gst_rtp_buffer_get_marker(&rtp);
+  gst_rtp_buffer_unmap(&rtp);
+  return true;
+}
+
+
+class LatencyProbes {
+  public:
+    void attach_to_server(const CameraInfo& camera_info) {
+      add_probe(camera_info.getVideoSource(), "src", GST_PAD_PROBE_TYPE_BUFFER, &LatencyProbes::on_captured);
+      add_probe(camera_info.getEncoder(), "src", GST_PAD_PROBE_TYPE_BUFFER, &LatencyProbes::on_encoded);
+      add_probe(camera_info.getPayloader(), "src",
+                (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                &LatencyProbes::on_packetized);
+    }
+
+    void attach_to_receiver(GstElement* rtp_source, GstElement* depay, GstElement* decoder) {
+      add_probe(rtp_source, "src", (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                &LatencyProbes::on_received);
+      add_probe(depay, "sink", (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                &LatencyProbes::on_playout);
+      add_probe(depay, "src", GST_PAD_PROBE_TYPE_BUFFER, &LatencyProbes::on_depayloaded);
+      add_probe(decoder, "src", GST_PAD_PROBE_TYPE_BUFFER, &LatencyProbes::on_decoded);
+    }
+
+    // Only frames that were captured after warmup_end_time are included in the report. The first frames are
+    // always slow, since the encoder and jitterbuffer need some time to get going. Returns the p99 of the
+    // encode->packetize stage in us, which is where the recording tee sits.
+    int64_t report(gint64 warmup_end_time) {
+      std::lock_guard guard(lock_);
+      size_t max_packets_per_frame = 0;
+      size_t total_packets = 0;
+      for (const auto& [rtp_timestamp, packet_count] : packets_per_frame_) {
+        max_packets_per_frame = std::max(max_packets_per_frame, packet_count);
+        total_packets += packet_count;
+      }
+      LatencyHistogram capture_to_encode("capture->encode");
+      LatencyHistogram encode_to_packetize("encode->packetize");
+      LatencyHistogram packetize_to_receive("packetize->receive");
+      LatencyHistogram receive_to_playout("receive->playout");
+      LatencyHistogram playout_to_decode("playout->decode");
+      LatencyHistogram capture_to_decode("capture->decode (total)");
+      size_t captured_count = 0;
+      for (const auto& [pts, frame] : frames_) {
+        if (frame.captured >= warmup_end_time) {
+          captured_count++;
+        }
+      }
+
+      for (const auto& [rtp_timestamp, pts] : rtp_timestamp_to_pts_) {
+        auto frame_find = frames_.find(pts);
+        auto received_find = received_frames_.find(rtp_timestamp);
+        if (frame_find == frames_.end() || received_find == received_frames_.end()) {
+          continue;
+        }
+        const FrameTimes& frame = frame_find->second;
+        const ReceivedFrameTimes& received = received_find->second;
+        if (frame.captured < warmup_end_time || frame.encoded == 0 || frame.packetized == 0 ||
+            received.received == 0 || received.playout == 0 || received.decoded == 0) {
+          continue;
+        }
+        capture_to_encode.add(frame.encoded - frame.captured);
+        encode_to_packetize.add(frame.packetized - frame.encoded);
+        packetize_to_receive.add(received.received - frame.packetized);
+        receive_to_playout.add(received.playout - received.received);
+        playout_to_decode.add(received.decoded - received.playout);
+        capture_to_decode.add(received.decoded - frame.captured);
+      }
+
+      std::cout << "Frames captured: " << captured_count << ", decoded: " << capture_to_decode.count();
+      if (captured_count > 0) {
+        std::cout << " (" << std::fixed << std::setprecision(1) << 100.0 * capture_to_decode.count() / captured_count << "%)";
+      }
+      std::cout << std::endl;
+      capture_to_encode.report();
+      encode_to_packetize.report();
+      packetize_to_receive.report();
+      receive_to_playout.report();
+      playout_to_decode.report();
+      capture_to_decode.report();
+      if (!packets_per_frame_.empty()) {
+        std::cout << "Rtp packets per frame: average " << (double)total_packets / packets_per_frame_.size()
+                  << ", max " << max_packets_per_frame << std::endl;
+      }
+      return encode_to_packetize.percentile(0.99);
+    }
+
+  private:
+    using ProbeFunc = void (LatencyProbes::*)(GstPadProbeInfo* info, gint64 now);
+
+    struct ProbeData {
+      LatencyProbes* self;
+      ProbeFunc func;
+    };
+
+    void add_probe(GstElement* element, const char* pad_name, GstPadProbeType probe_type, ProbeFunc func) {
+      GstPad* pad = gst_element_get_static_pad(element, pad_name);
+      ASSERT_NOT_NULL(pad);
+      ProbeData* probe_data = new ProbeData{this, func};
+      gst_pad_add_probe(pad, probe_type,
+        [](GstPad* pad, GstPadProbeInfo* info, gpointer user_data) -> GstPadProbeReturn {
+          ProbeData* probe_data = (ProbeData*)user_data;
+          gint64 now = g_get_monotonic_time();
+          std::lock_guard guard(probe_data->self->lock_);
+          (probe_data->self->*(probe_data->func))(info, now);
+          return GST_PAD_PROBE_OK;
+        },
+        probe_data,
+        [](gpointer user_data) { delete (ProbeData*)user_data; });
+      gst_object_unref(pad);
+    }
+
+    void on_captured(GstPadProbeInfo* info, gint64 now) {
+      GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+      frames_[GST_BUFFER_PTS(buffer)].captured = now;
+    }
+
+    void on_encoded(GstPadProbeInfo* info, gint64 now) {
+      GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+      auto find = frames_.find(GST_BUFFER_PTS(buffer));
+      if (find != frames_.end() && find->second.encoded == 0) {
+        find->second.encoded = now;
+      }
+    }
+
+    void on_packetized(GstPadProbeInfo* info, gint64 now) {
+      for_each_buffer(info, [&](GstBuffer* buffer) {
+        guint32 rtp_timestamp;
+        bool marker;
+        if (!read_rtp_header(buffer, rtp_timestamp, marker)) {
+          return;
+        }
+        GstClockTime pts = GST_BUFFER_PTS(buffer);
+        rtp_timestamp_to_pts_[rtp_timestamp] = pts;
+        packets_per_frame_[rtp_timestamp]++;
+        if (marker) {
+          auto find = frames_.find(pts);
+          if (find != frames_.end()) {
+            find->second.packetized = now;
+          }
+        }
+      });
+    }
+
+    void on_received(GstPadProbeInfo* info, gint64 now) {
+      for_each_buffer(info, [&](GstBuffer* buffer) {
+        guint32 rtp_timestamp;
+        bool marker;
+        if (read_rtp_header(buffer, rtp_timestamp, marker) && marker) {
+          received_frames_[rtp_timestamp].received = now;
+        }
+      });
+    }
+
+    void on_playout(GstPadProbeInfo* info, gint64 now) {
+      for_each_buffer(info, [&](GstBuffer* buffer) {
+        guint32 rtp_timestamp;
+        bool marker;
+        if (read_rtp_header(buffer, rtp_timestamp, marker) && marker) {
+          received_frames_[rtp_timestamp].playout = now;
+          last_playout_rtp_timestamp_ = rtp_timestamp;
+        }
+      });
+    }
+
+    // The depayloader pushes the complete frame when it gets the packet with the marker bit, so the frame that leaves
+    // the depayloader belongs to the last rtp timestamp we saw in on_playout().
+    void on_depayloaded(GstPadProbeInfo* info, gint64 now) {
+      GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+      receiver_pts_to_rtp_timestamp_[GST_BUFFER_PTS(buffer)] = last_playout_rtp_timestamp_;
+    }
+
+    void on_decoded(GstPadProbeInfo* info, gint64 now) {
+      GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+      auto find = receiver_pts_to_rtp_timestamp_.find(GST_BUFFER_PTS(buffer));
+      if (find != receiver_pts_to_rtp_timestamp_.end()) {
+        ReceivedFrameTimes& received = received_frames_[find->second];
+        if (received.decoded == 0) {
+          received.decoded = now;
+        }
+      }
+    }
+
+    std::mutex lock_;
+    std::map<GstClockTime, FrameTimes> frames_;
+    std::map<guint32, GstClockTime> rtp_timestamp_to_pts_;
+    std::map<guint32, size_t> packets_per_frame_;
+    std::map<guint32, ReceivedFrameTimes> received_frames_;
+    std::map<GstClockTime, guint32> receiver_pts_to_rtp_timestamp_;
+    guint32 last_playout_rtp_timestamp_ = 0;
+};
+
+
+static void
+receiver_pad_added_handler(GstElement* rtpbin, GstPad* pad, gpointer data)
+{
+  std::string pad_name = string_from_gchar(gst_pad_get_name(pad));
+  if (pad_name.find("recv_rtp_src_0_") == 0) {
+    GstElement* depay = (GstElement*)data;
+    GstPad* sink_pad = gst_element_get_static_pad(depay, "sink");
+    ASSERT_NOT_NULL(sink_pad);
+    if (gst_pad_link(pad, sink_pad) != GST_PAD_LINK_OK) {
+      BOOST_LOG_TRIVIAL(error) << "receiver_pad_added_handler(): failed to link the pad '" << pad_name << "'";
+    }
+    gst_object_unref(sink_pad);
+  }
+}
+
+
+// Measures the time from the receiver is attached to the server until the first frame is decoded.
+class ReconnectProbe {
+  public:
+    void attach(GstElement* decoder) {
+      GstPad* pad = gst_element_get_static_pad(decoder, "src");
+      ASSERT_NOT_NULL(pad);
+      gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, on_decoded, this, NULL);
+      gst_object_unref(pad);
+    }
+
+    void start() {
+      std::lock_guard<std::mutex> guard(lock_);
+      attach_time_ = g_get_monotonic_time();
+    }
+
+    void report() const {
+      histogram_.report();
+    }
+
+  private:
+    static GstPadProbeReturn on_decoded(GstPad* pad, GstPadProbeInfo* info, gpointer user_data) {
+      ReconnectProbe* self = (ReconnectProbe*)user_data;
+      std::lock_guard<std::mutex> guard(self->lock_);
+      if (self->attach_time_ != 0) {
+        self->histogram_.add(g_get_monotonic_time() - self->attach_time_);
+        self->attach_time_ = 0;
+      }
+      return GST_PAD_PROBE_OK;
+    }
+
+    std::mutex lock_;
+    gint64 attach_time_ = 0;
+    LatencyHistogram histogram_{"reconnect->decoded"};
+};
+
+
+// Measures the time from the camera is switched to another resolution until the decoder outputs the new resolution.
+class ResolutionSwitchProbe {
+  public:
+    void attach(GstElement* decoder) {
+      GstPad* pad = gst_element_get_static_pad(decoder, "src");
+      ASSERT_NOT_NULL(pad);
+      gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, on_event, this, NULL);
+      gst_object_unref(pad);
+    }
+
+    void start(int width) {
+      std::lock_guard<std::mutex> guard(lock_);
+      switch_time_ = g_get_monotonic_time();
+      expected_width_ = width;
+    }
+
+    void report() const {
+      histogram_.report();
+    }
+
+  private:
+    static GstPadProbeReturn on_event(GstPad* pad, GstPadProbeInfo* info, gpointer user_data) {
+      GstEvent* event = GST_PAD_PROBE_INFO_EVENT(info);
+      if (GST_EVENT_TYPE(event) != GST_EVENT_CAPS) {
+        return GST_PAD_PROBE_OK;
+      }
+      GstCaps* caps = nullptr;
+      gst_event_parse_caps(event, &caps);
+      gint width = 0;
+      gst_structure_get_int(gst_caps_get_structure(caps, 0), "width", &width);
+      ResolutionSwitchProbe* self = (ResolutionSwitchProbe*)user_data;
+      std::lock_guard<std::mutex> guard(self->lock_);
+      if (self->switch_time_ != 0 && width == self->expected_width_) {
+        self->histogram_.add(g_get_monotonic_time() - self->switch_time_);
+        self->switch_time_ = 0;
+      }
+      return GST_PAD_PROBE_OK;
+    }
+
+    std::mutex lock_;
+    gint64 switch_time_ = 0;
+    int expected_width_ = 0;
+    LatencyHistogram histogram_{"resolution switch->decoded"};
+};
+
+
+// Counts the bytes of the video and FEC packets that are sent to the receiver, before any of them are dropped.
+class BandwidthProbe {
+  public:
+    void attach(GstElement* rtp_source) {
+      GstPad* pad = gst_element_get_static_pad(rtp_source, "src");
+      ASSERT_NOT_NULL(pad);
+      gst_pad_add_probe(pad, (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST), on_packets, this, NULL);
+      gst_object_unref(pad);
+    }
+
+    void report() const {
+      std::lock_guard<std::mutex> guard(lock_);
+      std::cout << "Video bytes: " << video_bytes_ << ", FEC bytes: " << fec_bytes_;
+      if (video_bytes_ > 0) {
+        std::cout << " (+" << std::fixed << std::setprecision(1) << 100.0 * fec_bytes_ / video_bytes_ << "% bandwidth)";
+      }
+      std::cout << std::endl;
+    }
+
+  private:
+    static GstPadProbeReturn on_packets(GstPad* pad, GstPadProbeInfo* info, gpointer user_data) {
+      BandwidthProbe* self = (BandwidthProbe*)user_data;
+      std::lock_guard<std::mutex> guard(self->lock_);
+      for_each_buffer(info, [&](GstBuffer* buffer) {
+        GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+        if (!gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp)) {
+          return;
+        }
+        if (gst_rtp_buffer_get_payload_type(&rtp) == ulpfec_payload_type) {
+          self->fec_bytes_ += gst_buffer_get_size(buffer);
+        } else {
+          self->video_bytes_ += gst_buffer_get_size(buffer);
+        }
+        gst_rtp_buffer_unmap(&rtp);
+      });
+      return GST_PAD_PROBE_OK;
+    }
+
+    mutable std::mutex lock_;
+    uint64_t video_bytes_ = 0;
+    uint64_t fec_bytes_ = 0;
+};
+
+
+// Measures the time from a burst of packet loss ends until the receiver decodes a picture again. The depayloader drops
+// the frames until it gets a keyframe, so the first decoded frame after a keyframe is the first correct picture.
+class RecoveryProbe {
+  public:
+    void attach(GstElement* depay, GstElement* decoder) {
+      GstPad* pad = gst_element_get_static_pad(depay, "src");
+      ASSERT_NOT_NULL(pad);
+      gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, on_depayloaded, this, NULL);
+      gst_object_unref(pad);
+      pad = gst_element_get_static_pad(decoder, "src");
+      ASSERT_NOT_NULL(pad);
+      gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, on_decoded, this, NULL);
+      gst_object_unref(pad);
+    }
+
+    void start() {
+      std::lock_guard<std::mutex> guard(lock_);
+      loss_end_time_ = g_get_monotonic_time();
+      got_keyframe_ = false;
+    }
+
+    const LatencyHistogram& histogram() const {
+      return histogram_;
+    }
+
+  private:
+    static GstPadProbeReturn on_depayloaded(GstPad* pad, GstPadProbeInfo* info, gpointer user_data) {
+      RecoveryProbe* self = (RecoveryProbe*)user_data;
+      GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+      std::lock_guard<std::mutex> guard(self->lock_);
+      if (self->loss_end_time_ != 0 && !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+        self->got_keyframe_ = true;
+      }
+      return GST_PAD_PROBE_OK;
+    }
+
+    static GstPadProbeReturn on_decoded(GstPad* pad, GstPadProbeInfo* info, gpointer user_data) {
+      RecoveryProbe* self = (RecoveryProbe*)user_data;
+      std::lock_guard<std::mutex> guard(self->lock_);
+      if (self->loss_end_time_ != 0 && self->got_keyframe_) {
+        self->histogram_.add(g_get_monotonic_time() - self->loss_end_time_);
+        self->loss_end_time_ = 0;
+      }
+      return GST_PAD_PROBE_OK;
+    }
+
+    std::mutex lock_;
+    gint64 loss_end_time_ = 0;
+    bool got_keyframe_ = false;
+    LatencyHistogram histogram_{"packet loss->recovered"};
+};
+
+
+static void
+cb_error(GstBus* bus, GstMessage* message, gpointer data)
+{
+  GError* error = NULL;
+  gst_message_parse_error(message, &error, NULL);
+  BOOST_LOG_TRIVIAL(error) << "cb_error:" << GST_OBJECT_NAME(message->src) << ": " << error->message;
+  g_error_free(error);
+  g_main_loop_quit((GMainLoop*)data);
+}
+
+
+int main(int argc, char** argv)
+{
+  gst_init(&argc, &argv);
+
+  int duration_s;
+  int warmup_s;
+  int latency_ms;
+  double drop_probability;
+  int expect_max_bitrate_kbps;
+  int reconnects;
+  int resolution_switches;
+  int loss_bursts;
+  int loss_burst_ms;
+  int expect_max_recovery_ms;
+  int fec_percentage;
+  bool cold = false;
+  std::string encoder_backend_name;
+  std::string decoder_backend_name;
+  std::string record_path;
+  RecordingSettings recording_settings;
+  int expect_max_packetize_ms;
+  bool pipeline_stats_enabled = false;
+  CameraSettings camera_settings;
+  boost::program_options::options_description desc("Allowed options");
+  desc.add_options()
+      ("duration", boost::program_options::value<int>(&duration_s)->default_value(10), "how many seconds to run the benchmark")
+      ("warmup", boost::program_options::value<int>(&warmup_s)->default_value(2), "how many seconds at the start to exclude from the report")
+      ("latency", boost::program_options::value<int>(&latency_ms)->default_value(200), "the receiver's jitterbuffer latency in ms")
+      ("drop-probability", boost::program_options::value<double>(&drop_probability)->default_value(0.0), "the fraction of the rtp packets to drop (0.0-1.0)")
+      ("encoder", boost::program_options::value<std::string>(&encoder_backend_name)->default_value("auto"), "the h264 encoder to use: auto, x264, v4l2 or camera")
+      ("decoder", boost::program_options::value<std::string>(&decoder_backend_name)->default_value("software"), "the h264 decoder to use: auto, software, d3d11, vaapi, nvdec or v4l2")
+      ("expect-max-bitrate", boost::program_options::value<int>(&expect_max_bitrate_kbps)->default_value(0), "fail if the final video bitrate (kbit/s) is higher than this")
+      ("reconnects", boost::program_options::value<int>(&reconnects)->default_value(0), "how many times to detach and reattach the receiver after the warmup")
+      ("cold", boost::program_options::bool_switch(&cold), "restart the server pipeline on each reconnect, like the server used to do")
+      ("resolution-switches", boost::program_options::value<int>(&resolution_switches)->default_value(0), "how many times to switch the camera's resolution after the warmup")
+      ("loss-bursts", boost::program_options::value<int>(&loss_bursts)->default_value(0), "how many times to drop all the rtp packets for a while after the warmup")
+      ("loss-burst-ms", boost::program_options::value<int>(&loss_burst_ms)->default_value(200), "how long each loss burst lasts")
+      ("expect-max-recovery", boost::program_options::value<int>(&expect_max_recovery_ms)->default_value(0), "fail if it takes longer than this (ms) to decode a picture after a loss burst")
+      ("fec-percentage", boost::program_options::value<int>(&fec_percentage)->default_value(0), "the ULPFEC protection to add, in percent of the video packets")
+      ("keyframe-interval", boost::program_options::value<int>(&camera_settings.keyframes.keyframe_interval)->default_value(0), "the number of frames between the keyframes (0 uses the encoder's default)")
+      ("intra-refresh", boost::program_options::bool_switch(&camera_settings.keyframes.intra_refresh), "refresh the picture gradually instead of with whole keyframes")
+      ("record", boost::program_options::value<std::string>(&record_path), "write the server's rtp and rtcp packets to this capture file")
+      ("record-dir", boost::program_options::value<std::string>(&recording_settings.directory), "record the video to files in this directory, like the server's --record-dir")
+      ("record-format", boost::program_options::value<std::string>(&recording_settings.format)->default_value(recording_settings.format), "the format of the recorded files: mkv or mp4")
+      ("pipeline-stats", boost::program_options::bool_switch(&pipeline_stats_enabled), "collect the server's pipeline stats once a second, like the debug port's stats request")
+      ("expect-max-packetize", boost::program_options::value<int>(&expect_max_packetize_ms)->default_value(0), "fail if the p99 of the encode->packetize stage is longer than this many ms")
+  ;
+  boost::program_options::variables_map vm;
+  boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+  boost::program_options::notify(vm);
+  if (reconnects > 0) {
+    // Each reconnect takes two seconds, see below.
+    duration_s = std::max(duration_s, warmup_s + 2 * reconnects + 1);
+  }
+  if (resolution_switches > 0) {
+    // Each switch gets two seconds too.
+    duration_s = std::max(duration_s, warmup_s + 2 * resolution_switches + 1);
+  }
+  if (loss_bursts > 0) {
+    // And so does each loss burst.
+    duration_s = std::max(duration_s, warmup_s + 2 * loss_bursts + 1);
+  }
+
+  GMainLoop* loop = g_main_loop_new(NULL, FALSE);
+  ASSERT_NOT_NULL(loop);
+
+  LatencyProbes probes;
+
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  // The receiver pipeline
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  GstElement* receiver_pipeline = gst_pipeline_new("receiver");
+  ASSERT_NOT_NULL(receiver_pipeline);
+  GstElement* receiver_rtpbin = gst_element_factory_make("rtpbin", NULL);
+  ASSERT_NOT_NULL(receiver_rtpbin);
+  g_object_set(receiver_rtpbin, "latency", latency_ms, "rtp-profile", GST_RTP_PROFILE_AVPF, NULL);
+  FecReceiver fec_receiver(receiver_rtpbin, (GstClockTime)latency_ms * GST_MSECOND);
+  if (fec_percentage > 0) {
+    // This must be done before the session is created below.
+    fec_receiver.enableSession(0);
+  }
+
+  GstElement* video_rtp_udpsrc = gst_element_factory_make("udpsrc", NULL);
+  ASSERT_NOT_NULL(video_rtp_udpsrc);
+  g_object_set(video_rtp_udpsrc, "port", 0, NULL);
+  auto video_rtp_udpsrc_caps = make_GstCaps_ptr(gst_caps_from_string(
+    "application/x-rtp,media=(string)video,clock-rate=(int)90000,encoding-name=(string)H264"));
+  g_object_set(video_rtp_udpsrc, "caps", video_rtp_udpsrc_caps.get(), NULL);
+  gst_element_set_state(video_rtp_udpsrc, GST_STATE_PAUSED);
+  gint video_rtp_udpsrc_port;
+  g_object_get(video_rtp_udpsrc, "port", &video_rtp_udpsrc_port, NULL);
+
+  GstElement* video_rtcp_udpsrc = gst_element_factory_make("udpsrc", NULL);
+  ASSERT_NOT_NULL(video_rtcp_udpsrc);
+  g_object_set(video_rtcp_udpsrc, "port", 0, NULL);
+  gst_element_set_state(video_rtcp_udpsrc, GST_STATE_PAUSED);
+  gint video_rtcp_udpsrc_port;
+  g_object_get(video_rtcp_udpsrc, "port", &video_rtcp_udpsrc_port, NULL);
+
+  GstElement* packet_loss = gst_element_factory_make("identity", NULL);
+  ASSERT_NOT_NULL(packet_loss);
+  g_object_set(packet_loss, "drop-probability", (gfloat)drop_probability, NULL);
+
+  GstElement* video_rtcp_udpsink = gst_element_factory_make("udpsink", NULL);
+  ASSERT_NOT_NULL(video_rtcp_udpsink);
+
+  GstElement* depay = gst_element_factory_make("rtph264depay", NULL);
+  ASSERT_NOT_NULL(depay);
+  // Like the client, drop the broken frames after a packet loss and ask the server for a keyframe.
+  g_object_set(depay, "wait-for-keyframe", TRUE, "request-keyframe", TRUE, NULL);
+  DecoderCapabilities decoder_capabilities = DecoderCapabilities::probe();
+  DecoderBackend decoder_backend = chooseDecoderBackend(decoderBackendFromString(decoder_backend_name), decoder_capabilities);
+  std::cout << "Decoder backend: " << to_string(decoder_backend) << std::endl;
+  GstElement* decoder = createDecoder(decoder_backend, decoder_capabilities);
+  GstElement* videosink = gst_element_factory_make("fakesink", NULL);
+  ASSERT_NOT_NULL(videosink);
+  // We measure when the frames leave the decoder, and a syncing sink would block the decoder until each frame
+  // is due for rendering.
+  g_object_set(videosink, "sync", FALSE, NULL);
+
+  gst_bin_add_many(GST_BIN_CAST(receiver_pipeline), receiver_rtpbin, video_rtp_udpsrc, packet_loss, video_rtcp_udpsrc,
+                   video_rtcp_udpsink, depay, decoder, videosink, NULL);
+  ASSERT_TRUE(gst_element_link(video_rtp_udpsrc, packet_loss));
+  ASSERT_TRUE(gst_element_link_pads(packet_loss, "src", receiver_rtpbin, "recv_rtp_sink_0"));
+  ASSERT_TRUE(gst_element_link_pads(video_rtcp_udpsrc, "src", receiver_rtpbin, "recv_rtcp_sink_0"));
+  ASSERT_TRUE(gst_element_link_pads(receiver_rtpbin, "send_rtcp_src_0", video_rtcp_udpsink, "sink"));
+  ASSERT_TRUE(gst_element_link_many(depay, decoder, videosink, NULL));
+  g_signal_connect(receiver_rtpbin, "pad-added", G_CALLBACK(receiver_pad_added_handler), depay);
+  probes.attach_to_receiver(packet_loss, depay, decoder);
+  BandwidthProbe bandwidth_probe;
+  bandwidth_probe.attach(video_rtp_udpsrc);
+
+  // Send receiver reports every second instead of every five seconds, like the client does, so that the bitrate
+  // controller gets feedback quickly.
+  GObject* receiver_session = nullptr;
+  g_signal_emit_by_name(receiver_rtpbin, "get-internal-session", 0u, &receiver_session);
+  ASSERT_NOT_NULL(receiver_session);
+  g_object_set(receiver_session, "rtcp-min-interval", (guint64)GST_SECOND, NULL);
+  g_object_unref(receiver_session);
+
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  // The server pipeline
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  GstElement* server_pipeline = gst_pipeline_new("server");
+  ASSERT_NOT_NULL(server_pipeline);
+  GstElement* server_rtpbin = gst_element_factory_make("rtpbin", NULL);
+  ASSERT_NOT_NULL(server_rtpbin);
+  g_object_set(server_rtpbin, "rtp-profile", GST_RTP_PROFILE_AVPF, NULL);
+  ASSERT_TRUE(gst_bin_add(GST_BIN_CAST(server_pipeline), server_rtpbin));
+  std::unique_ptr<PipelineStats> pipeline_stats;
+  if (pipeline_stats_enabled) {
+    pipeline_stats = std::make_unique<PipelineStats>(server_pipeline);
+  }
+
+  camera_settings.encoder_backend = encoderBackendFromString(encoder_backend_name);
+  camera_settings.fec_max_percentage = fec_percentage;
+  if (!record_path.empty()) {
+    camera_settings.capture = std::make_shared<RtpCaptureWriter>(record_path);
+  }
+  if (!recording_settings.directory.empty()) {
+    // Short files, so that a short run rotates through a few of them.
+    recording_settings.segment_s = 2;
+    camera_settings.recorder = std::make_shared<VideoRecorder>(recording_settings);
+  }
+  CameraInfo camera_info;
+  boost::json::object camera = camera_info.initialize(GST_BIN_CAST(server_pipeline), server_rtpbin, nullptr, 0, camera_settings);
+  std::cout << "Encoder backend: " << to_string(camera_info.getEncoderBackend()) << std::endl;
+
+  g_object_set(video_rtcp_udpsink, "host", "127.0.0.1", NULL);
+  g_object_set(video_rtcp_udpsink, "port", (gint)camera.at("video_rtcp_udpsrc_port").as_int64(), NULL);
+  g_object_set(video_rtcp_udpsink, "sync", FALSE, NULL);
+  g_object_set(video_rtcp_udpsink, "async", FALSE, NULL);
+
+  boost::json::object client_info;
+  client_info["video_rtp_udpsrc_port"] = video_rtp_udpsrc_port;
+  client_info["video_rtcp_udpsrc_port"] = video_rtcp_udpsrc_port;
+  if (fec_percentage > 0) {
+    client_info["fec_percentage"] = fec_percentage;
+  }
+  camera_info.addClient("benchmark", "127.0.0.1", client_info);
+  probes.attach_to_server(camera_info);
+  ReconnectProbe reconnect_probe;
+  reconnect_probe.attach(decoder);
+  ResolutionSwitchProbe resolution_switch_probe;
+  resolution_switch_probe.attach(decoder);
+  RecoveryProbe recovery_probe;
+  recovery_probe.attach(depay, decoder);
+
+  for (GstElement* pipeline : {receiver_pipeline, server_pipeline}) {
+    GstBus* bus = gst_element_get_bus(pipeline);
+    g_signal_connect(bus, "message::error", G_CALLBACK(cb_error), loop);
+    gst_bus_add_signal_watch(bus);
+    gst_object_unref(bus);
+  }
+
+  ASSERT_TRUE(gst_element_set_state(receiver_pipeline, GST_STATE_PLAYING) != GST_STATE_CHANGE_FAILURE);
+  ASSERT_TRUE(gst_element_set_state(server_pipeline, GST_STATE_PLAYING) != GST_STATE_CHANGE_FAILURE);
+  gint64 warmup_end_time = g_get_monotonic_time() + (gint64)warmup_s * G_USEC_PER_SEC;
+
+  BOOST_LOG_TRIVIAL(info) << "Running the latency benchmark for " << duration_s << " seconds...";
+  g_timeout_add_seconds(duration_s, [](gpointer data) -> gboolean {
+    g_main_loop_quit((GMainLoop*)data);
+    return G_SOURCE_REMOVE;
+  }, loop);
+  std::vector<int> bitrate_samples;
+  LatencyHistogram collect_times("collect()");
+  boost::json::object last_stats;
+  g_timeout_add_seconds(1, function_pointer<gboolean(gpointer)>([&](gpointer) -> gboolean {
+    bitrate_samples.push_back(camera_info.getBitrate());
+    if (pipeline_stats) {
+      gint64 start_time = g_get_monotonic_time();
+      last_stats = pipeline_stats->collect();
+      last_stats["cameras"] = boost::json::array{camera_info.getStats()};
+      collect_times.add(g_get_monotonic_time() - start_time);
+    }
+    return G_SOURCE_CONTINUE;
+  }), nullptr);
+  // Each reconnect takes two seconds: the receiver is detached for one second, and then gets one second to receive
+  // the first frame before the next reconnect.
+  bool attached = true;
+  int reconnects_left = reconnects;
+  if (reconnects > 0) {
+    g_timeout_add_seconds(warmup_s, function_pointer<gboolean(gpointer)>([&](gpointer) -> gboolean {
+      g_timeout_add_seconds(1, function_pointer<gboolean(gpointer)>([&](gpointer) -> gboolean {
+        if (attached) {
+          if (reconnects_left == 0) {
+            return G_SOURCE_REMOVE;
+          }
+          camera_info.removeClient("benchmark");
+          if (cold) {
+            gst_element_set_state(server_pipeline, GST_STATE_NULL);
+          }
+          attached = false;
+        } else {
+          reconnect_probe.start();
+          if (cold) {
+            gst_element_set_state(server_pipeline, GST_STATE_PLAYING);
+          }
+          camera_info.addClient("benchmark", "127.0.0.1", client_info);
+          attached = true;
+          --reconnects_left;
+        }
+        return G_SOURCE_CONTINUE;
+      }), nullptr);
+      return G_SOURCE_REMOVE;
+    }), nullptr);
+  }
+  // The switches alternate between a small and the default resolution, and are two seconds apart.
+  int resolution_switches_left = resolution_switches;
+  if (resolution_switches > 0) {
+    g_timeout_add_seconds(warmup_s, function_pointer<gboolean(gpointer)>([&](gpointer) -> gboolean {
+      g_timeout_add_seconds(2, function_pointer<gboolean(gpointer)>([&](gpointer) -> gboolean {
+        if (resolution_switches_left == 0) {
+          return G_SOURCE_REMOVE;
+        }
+        int width = resolution_switches_left % 2 == resolution_switches % 2 ? 320 : 640;
+        int height = width == 320 ? 240 : 480;
+        std::ostringstream resolution;
+        resolution << "video/x-raw, format=(string)YUY2, width=(int)" << width << ", height=(int)" << height;
+        resolution_switch_probe.start(width);
+        try {
+          camera_info.selectResolution(resolution.str());
+        }
+        catch(const std::exception& e) {
+          BOOST_LOG_TRIVIAL(error) << "Failed to switch the resolution: " << e.what();
+          g_main_loop_quit(loop);
+          return G_SOURCE_REMOVE;
+        }
+        --resolution_switches_left;
+        return G_SOURCE_CONTINUE;
+      }), nullptr);
+      return G_SOURCE_REMOVE;
+    }), nullptr);
+  }
+  // The loss bursts start two seconds apart. The packets are dropped before they reach the receiver's rtpbin, so the
+  // jitterbuffer sees a gap just like on a real link.
+  int loss_bursts_left = loss_bursts;
+  if (loss_bursts > 0) {
+    g_timeout_add_seconds(warmup_s, function_pointer<gboolean(gpointer)>([&](gpointer) -> gboolean {
+      g_timeout_add_seconds(2, function_pointer<gboolean(gpointer)>([&](gpointer) -> gboolean {
+        if (loss_bursts_left == 0) {
+          return G_SOURCE_REMOVE;
+        }
+        g_object_set(packet_loss, "drop-probability", (gfloat)1.0, NULL);
+        g_timeout_add(loss_burst_ms, function_pointer<gboolean(gpointer)>([&](gpointer) -> gboolean {
+          g_object_set(packet_loss, "drop-probability", (gfloat)drop_probability, NULL);
+          recovery_probe.start();
+          return G_SOURCE_REMOVE;
+        }), nullptr);
+        --loss_bursts_left;
+        return G_SOURCE_CONTINUE;
+      }), nullptr);
+      return G_SOURCE_REMOVE;
+    }), nullptr);
+  }
+  g_main_loop_run(loop);
+
+  gst_element_set_state(server_pipeline, GST_STATE_NULL);
+  gst_element_set_state(receiver_pipeline, GST_STATE_NULL);
+
+  int64_t encode_to_packetize_p99_us = probes.report(warmup_end_time);
+  if (camera_settings.capture) {
+    camera_settings.capture->flush();
+    std::cout << "Recorded " << camera_settings.capture->getRecordCount() << " packets ("
+              << camera_settings.capture->getByteCount() / 1024 << " KiB) to '" << record_path << "'" << std::endl;
+  }
+  uint64_t recorded_files = 0;
+  uint64_t recorded_bytes = 0;
+  if (camera_settings.recorder) {
+    for (const RecordingSegment& segment : camera_settings.recorder->getSegments("", 0, INT64_MAX)) {
+      recorded_files++;
+      recorded_bytes += std::filesystem::file_size(segment.path);
+    }
+    std::cout << "Recorded " << recorded_files << " files (" << recorded_bytes / 1024 << " KiB) to '"
+              << recording_settings.directory << "'" << std::endl;
+  }
+  if (reconnects > 0) {
+    reconnect_probe.report();
+  }
+  if (resolution_switches > 0) {
+    resolution_switch_probe.report();
+  }
+  if (loss_bursts > 0) {
+    recovery_probe.histogram().report();
+    std::cout << "Keyframes forced by PLI/FIR: " << camera_info.getRequestedKeyframeCount() << std::endl;
+  }
+
+  bandwidth_probe.report();
+  if (fec_percentage > 0) {
+    std::cout << "Packets recovered by FEC: " << fec_receiver.getRecoveredPacketCount()
+              << ", unrecovered: " << fec_receiver.getUnrecoveredPacketCount() << std::endl;
+  }
+
+  if (pipeline_stats) {
+    std::cout << "Pipeline stats: " << boost::json::serialize(last_stats) << std::endl;
+    collect_times.report();
+  }
+
+  std::cout << "Video bitrate (kbit/s) per second:";
+  for (int bitrate : bitrate_samples) {
+    std::cout << " " << bitrate;
+  }
+  std::cout << std::endl;
+
+  int exit_code = 0;
+  if (expect_max_bitrate_kbps > 0 && camera_info.getBitrate() > expect_max_bitrate_kbps) {
+    std::cout << "FAILED: the final video bitrate " << camera_info.getBitrate() << " kbit/s is higher than the expected "
+              << expect_max_bitrate_kbps << " kbit/s" << std::endl;
+    exit_code = 1;
+  }
+  if (loss_bursts > 0 && expect_max_recovery_ms > 0) {
+    const LatencyHistogram& recoveries = recovery_probe.histogram();
+    if ((int)recoveries.count() < loss_bursts) {
+      std::cout << "FAILED: the receiver only recovered from " << recoveries.count() << " of the " << loss_bursts
+                << " loss bursts" << std::endl;
+      exit_code = 1;
+    } else if (recoveries.max() > (int64_t)expect_max_recovery_ms * 1000) {
+      std::cout << "FAILED: the slowest recovery took " << recoveries.max() / 1000 << " ms, more than the expected "
+                << expect_max_recovery_ms << " ms" << std::endl;
+      exit_code = 1;
+    }
+  }
+
+  if (expect_max_packetize_ms > 0 && encode_to_packetize_p99_us > (int64_t)expect_max_packetize_ms * 1000) {
+    std::cout << "FAILED: the p99 of encode->packetize is " << encode_to_packetize_p99_us / 1000.0 << " ms, more than the expected "
+              << expect_max_packetize_ms << " ms" << std::endl;
+    exit_code = 1;
+  }
+  if (camera_settings.recorder && recorded_bytes == 0) {
+    std::cout << "FAILED: nothing was recorded to '" << recording_settings.directory << "'" << std::endl;
+    exit_code = 1;
+  }
+
+  gst_object_unref(server_pipeline);
+  gst_object_unref(receiver_pipeline);
+  g_main_loop_unref(loop);
+  return exit_code;
+}
+
+
+}
+
+
+int main(int argc, char** argv) {
+    return snowrobot::main(argc, argv);
+}
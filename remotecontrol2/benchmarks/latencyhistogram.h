@@ -0,0 +1,65 @@
+#ifndef SNOWROBOT_REMOTECONTROL_BENCHMARKS_LATENCYHISTOGRAM_H
+#define SNOWROBOT_REMOTECONTROL_BENCHMARKS_LATENCYHISTOGRAM_H
+
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+namespace snowrobot {
+
+
+// A simple collection of latency samples (in microseconds) that can print the p50/p99/max values. The benchmarks only
+// run for a few seconds, so we just keep all the samples and sort them when the report is printed.
+class LatencyHistogram {
+  public:
+    explicit LatencyHistogram(const std::string& name) : name_(name) {
+    }
+
+    void add(int64_t latency_us) {
+      samples_.push_back(latency_us);
+    }
+
+    size_t count() const {
+      return samples_.size();
+    }
+
+    int64_t percentile(double p) const {
+      if (samples_.empty()) {
+        return 0;
+      }
+      std::vector<int64_t> sorted = samples_;
+      std::sort(sorted.begin(), sorted.end());
+      size_t index = std::min(sorted.size() - 1, (size_t)(p * (sorted.size() - 1) + 0.5));
+      return sorted[index];
+    }
+
+    int64_t max() const {
+      if (samples_.empty()) {
+        return 0;
+      }
+      return *std::max_element(samples_.begin(), samples_.end());
+    }
+
+    // Prints a single line with the results. The line is easy to grep for in the ci-logs.
+    void report(std::ostream& os = std::cout) const {
+      os << std::left << std::setw(28) << name_ << std::right
+         << " count:" << std::setw(6) << count()
+         << " p50:" << std::setw(8) << std::fixed << std::setprecision(2) << percentile(0.50) / 1000.0 << "ms"
+         << " p99:" << std::setw(8) << percentile(0.99) / 1000.0 << "ms"
+         << " max:" << std::setw(8) << max() / 1000.0 << "ms"
+         << std::endl;
+    }
+
+  private:
+    std::string name_;
+    std::vector<int64_t> samples_;
+};
+
+
+}
+
+#endif
@@ -0,0 +1,146 @@
+#include "../common/linebasedserver.h"
+#include "allocationcounter.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/program_options.hpp>
+
+
+// This benchmark measures how many pipelined requests per second a LineBasedServer can handle on one connection. The
+// client sends --pipeline lines at a time with a single write, and waits for all the responses before it sends the
+// next batch. It runs two kinds of requests:
+//   ping: answered by the server itself, on the connection's strand, so it measures the line parsing and the writes
+//   get:  answered by the request callback on the app executor, like the command port's requests
+//
+// It reports the requests per second and the heap allocations per request. The client uses preallocated buffers and
+// blocking socket calls, so the allocations are the server's.
+
+
+namespace snowrobot {
+
+
+struct ThroughputResult {
+  double requests_per_s;
+  double allocations_per_request;
+};
+
+
+// Sends the request in batches of pipeline_depth lines, and reads the responses.
+static ThroughputResult run(boost::asio::ip::tcp::socket& sock, const std::string& request, int request_count,
+                            int pipeline_depth) {
+  std::string batch;
+  for (int i = 0; i < pipeline_depth; i++) {
+    batch += request + "\n";
+  }
+  std::vector<char> receive_buffer(64 * 1024);
+  int batch_count = request_count / pipeline_depth;
+
+  size_t allocations_before = allocation_count;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < batch_count; i++) {
+    boost::asio::write(sock, boost::asio::buffer(batch));
+    int response_count = 0;
+    while (response_count < pipeline_depth) {
+      size_t size = sock.read_some(boost::asio::buffer(receive_buffer));
+      response_count += std::count(receive_buffer.begin(), receive_buffer.begin() + size, '\n');
+    }
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  size_t allocations = allocation_count - allocations_before;
+  int handled = batch_count * pipeline_depth;
+  return ThroughputResult{
+    handled / std::chrono::duration<double>(elapsed).count(),
+    (double)allocations / handled
+  };
+}
+
+
+int main(int argc, char** argv)
+{
+  int request_count;
+  int pipeline_depth;
+  int server_thread_count;
+  double expect_min_rate;
+  boost::program_options::options_description desc("Allowed options");
+  desc.add_options()
+      ("requests", boost::program_options::value<int>(&request_count)->default_value(200000), "how many requests of each kind to send")
+      ("pipeline", boost::program_options::value<int>(&pipeline_depth)->default_value(64), "how many requests to send before waiting for the responses")
+      ("server-threads", boost::program_options::value<int>(&server_thread_count)->default_value(2), "how many threads run the server's io_context")
+      ("expect-min-rate", boost::program_options::value<double>(&expect_min_rate)->default_value(0), "fail if fewer than this many get requests per second are handled")
+  ;
+  boost::program_options::variables_map vm;
+  boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+  boost::program_options::notify(vm);
+
+  boost::asio::io_context server_ctx;
+  LineBasedServer server(
+    server_ctx,
+    0,
+    [](boost::asio::ip::tcp::socket&) {
+      return std::string("welcome");
+    },
+    [](boost::asio::ip::tcp::socket&) {
+    },
+    [](boost::asio::ip::tcp::socket&, std::string_view request) {
+      return std::string(request == "get" ? "ok" : "ERROR");
+    });
+  std::vector<std::future<void>> server_threads;
+  for (int i = 0; i < server_thread_count; i++) {
+    server_threads.push_back(std::async(std::launch::async, [&server_ctx]{server_ctx.run();}));
+  }
+
+  boost::asio::io_context client_ctx;
+  boost::asio::ip::tcp::socket sock(client_ctx);
+  sock.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), server.getPort()));
+  sock.set_option(boost::asio::ip::tcp::no_delay(true));
+  // Read the welcome message.
+  std::array<char, 64> welcome;
+  size_t welcome_size = 0;
+  while (welcome_size == 0 || welcome[welcome_size - 1] != '\n') {
+    welcome_size += sock.read_some(boost::asio::buffer(welcome.data() + welcome_size, welcome.size() - welcome_size));
+  }
+
+  // A short warmup, so the connection's buffers have grown to their working size before we count.
+  run(sock, "ping", pipeline_depth * 100, pipeline_depth);
+  run(sock, "get", pipeline_depth * 100, pipeline_depth);
+  ThroughputResult ping_result = run(sock, "ping", request_count, pipeline_depth);
+  ThroughputResult get_result = run(sock, "get", request_count, pipeline_depth);
+
+  sock.close();
+  server_ctx.stop();
+  for (std::future<void>& server_thread : server_threads) {
+    server_thread.wait();
+  }
+
+  std::cout << std::fixed << std::setprecision(1);
+  std::cout << "ping: " << std::setw(10) << ping_result.requests_per_s << " requests/s "
+            << std::setw(6) << ping_result.allocations_per_request << " allocations/request" << std::endl;
+  std::cout << "get:  " << std::setw(10) << get_result.requests_per_s << " requests/s "
+            << std::setw(6) << get_result.allocations_per_request << " allocations/request" << std::endl;
+
+  if (expect_min_rate > 0 && get_result.requests_per_s < expect_min_rate) {
+    std::cout << "FAILED: fewer than " << expect_min_rate << " get requests per second" << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+
+}
+
+
+int main(int argc, char** argv) {
+    return snowrobot::main(argc, argv);
+}
@@ -0,0 +1,195 @@
+#include "../common/controlchannel.h"
+#include "../common/motorbridge.h"
+#include "../common/motorloop.h"
+#include "fakeromeoboard.h"
+#include "allocationcounter.h"
+#include "latencyhistogram.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/program_options.hpp>
+
+
+// This benchmark measures the whole way from the operator's stick to the motor board: a ControlChannelClient sends
+// drive commands over the loopback interface to a ControlChannelServer, which posts them to a MotorLoop, which hands
+// each tick's output to a MotorBridge, which writes it to a pseudo terminal where a FakeRomeoBoard parses it like the
+// firmware does and acks it.
+//
+// Each command has a throttle that maps to its own byte on the wire (they repeat once per 200 commands), so the board
+// can tell which command a movement message carries, and the benchmark reports the send->board latency. It also
+// reports the ack round trip times the bridge measures, and how many commands were coalesced into each write, since
+// the commands are sent faster than the loop ticks by default. It fails if the board nacks anything, if there is more
+// than one write per tick, or if the bridge's apply() allocates.
+
+
+namespace snowrobot {
+
+
+static int64_t steadyNanoseconds() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+int main(int argc, char** argv)
+{
+  int duration_s;
+  int command_rate_hz;
+  MotorLoopSettings loop_settings;
+  MotorBridgeSettings bridge_settings;
+  int keepalive_ms;
+  int expect_max_latency_ms;
+  int expect_max_round_trip_ms;
+  boost::program_options::options_description desc("Allowed options");
+  desc.add_options()
+      ("duration", boost::program_options::value<int>(&duration_s)->default_value(10), "how many seconds to run the benchmark")
+      ("rate", boost::program_options::value<int>(&command_rate_hz)->default_value(250), "how many drive commands to send per second")
+      ("loop-rate", boost::program_options::value<int>(&loop_settings.rate_hz)->default_value(100), "how many times per second the motor loop ticks")
+      ("baud", boost::program_options::value<int>(&bridge_settings.baud_rate)->default_value(115200), "the baud rate of the serial device")
+      ("keepalive", boost::program_options::value<int>(&keepalive_ms)->default_value(250), "how often an unchanged output is sent again, in ms")
+      ("expect-max-latency", boost::program_options::value<int>(&expect_max_latency_ms)->default_value(0), "fail if the p99 send->board latency is higher than this many ms")
+      ("expect-max-round-trip", boost::program_options::value<int>(&expect_max_round_trip_ms)->default_value(0), "fail if the highest ack round trip time is higher than this many ms")
+  ;
+  boost::program_options::variables_map vm;
+  boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+  boost::program_options::notify(vm);
+  // The throttle jumps between the commands, so it mustn't be rate limited, or the board would see the limited values.
+  loop_settings.max_change_per_s = 0;
+  loop_settings.realtime_priority = false;
+  bridge_settings.keepalive_interval = std::chrono::milliseconds(keepalive_ms);
+
+  // When the latest command with each throttle byte was sent, on the steady clock.
+  std::array<std::atomic<int64_t>, 256> send_times_ns{};
+  std::mutex latency_mutex;
+  LatencyHistogram board_latency("send->board");
+  FakeRomeoBoard board([&](const FakeRomeoBoard::Movement& movement) {
+    int64_t send_time_ns = send_times_ns[movement.throttle].load();
+    if (send_time_ns != 0) {
+      std::lock_guard<std::mutex> lock(latency_mutex);
+      board_latency.add((movement.received_ns - send_time_ns) / 1000);
+    }
+  });
+
+  // Only the loop thread's allocations are counted, from its first tick on.
+  count_all_threads = false;
+  allocation_count = 0;
+
+  boost::asio::io_context ctx;
+  bridge_settings.device = board.getDevice();
+  MotorBridge bridge(ctx, bridge_settings);
+  auto motor_loop = std::make_unique<MotorLoop>(loop_settings, [&bridge](const MotorOutput& output) {
+    count_this_thread = true;
+    bridge.apply(output);
+  });
+
+  ControlChannelServer server(ctx, 0, std::chrono::milliseconds(500), [&](const DrivePayload& command) {
+    motor_loop->post(command);
+  });
+  boost::asio::ip::udp::endpoint server_endpoint(boost::asio::ip::make_address("127.0.0.1"), server.getPort());
+  ControlChannelClient client(ctx, server_endpoint);
+  server.setOperator(boost::asio::ip::udp::endpoint(boost::asio::ip::make_address("127.0.0.1"), client.getLocalPort()));
+
+  auto end_time = std::chrono::steady_clock::now() + std::chrono::seconds(duration_s);
+  std::atomic<bool> done{false};
+  int sent_count = 0;
+  boost::asio::co_spawn(ctx, [&]() -> boost::asio::awaitable<void> {
+    boost::asio::steady_timer timer(ctx);
+    auto next_send_time = std::chrono::steady_clock::now();
+    while (next_send_time < end_time) {
+      // The throttle bytes 28..227, which stay clear of the board's zero (128).
+      uint8_t throttle_byte = 28 + sent_count % 200;
+      if (throttle_byte == 128) {
+        throttle_byte = 228;
+      }
+      send_times_ns[throttle_byte] = steadyNanoseconds();
+      client.send(0, romeo::decodeSpeed(throttle_byte));
+      sent_count++;
+      next_send_time += std::chrono::microseconds(1000000 / command_rate_hz);
+      timer.expires_at(next_send_time);
+      co_await timer.async_wait(boost::asio::use_awaitable);
+    }
+    done = true;
+  }, boost::asio::detached);
+
+  std::thread io_thread([&ctx] {
+    while (!ctx.stopped()) {
+      ctx.run_for(std::chrono::milliseconds(100));
+    }
+  });
+  while (!done) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  // Let the last messages and their acks through before everything is stopped.
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  MotorLoop::Stats loop_stats = motor_loop->getStats();
+  motor_loop.reset();
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  ctx.stop();
+  io_thread.join();
+
+  MotorBridge::Stats bridge_stats = bridge.getStats();
+  const ControlChannelServer::Stats& server_stats = server.getStats();
+  std::cout << "sent:" << sent_count << " applied:" << server_stats.applied << " loop ticks:" << loop_stats.ticks
+            << " commands picked up:" << loop_stats.commands << std::endl;
+  std::cout << "bridge writes:" << bridge_stats.writes << " coalesced ticks:" << bridge_stats.coalesced
+            << " write failures:" << bridge_stats.write_failures << " acks:" << bridge_stats.acks
+            << " nacks:" << bridge_stats.nacks << " unknown responses:" << bridge_stats.unknown_responses
+            << " max ack round trip:" << bridge_stats.max_round_trip_us << "us" << std::endl;
+  std::cout << "board acks:" << board.getAcks() << " nacks:" << board.getNacks()
+            << " deadman stops:" << board.getDeadmanStops()
+            << " allocations on the loop thread:" << allocation_count << std::endl;
+  if (bridge_stats.writes > 0) {
+    std::cout << "commands per write:" << (double)sent_count / bridge_stats.writes << std::endl;
+  }
+  board_latency.report();
+
+  int exit_code = 0;
+  if (allocation_count > 0) {
+    std::cout << "FAILED: the motor loop or the bridge allocated memory" << std::endl;
+    exit_code = 1;
+  }
+  if (board.getNacks() > 0 || bridge_stats.nacks > 0) {
+    std::cout << "FAILED: the board rejected some of the messages" << std::endl;
+    exit_code = 1;
+  }
+  if (bridge_stats.writes + bridge_stats.write_failures > loop_stats.ticks) {
+    std::cout << "FAILED: the bridge wrote more than one message per tick" << std::endl;
+    exit_code = 1;
+  }
+  if (board.getDeadmanStops() > 0) {
+    std::cout << "FAILED: the board's deadman stopped the motors while the commands were flowing" << std::endl;
+    exit_code = 1;
+  }
+  if (board_latency.count() == 0) {
+    std::cout << "FAILED: no command reached the board" << std::endl;
+    exit_code = 1;
+  }
+  if (expect_max_latency_ms > 0 && board_latency.percentile(0.99) > (int64_t)expect_max_latency_ms * 1000) {
+    std::cout << "FAILED: the p99 send->board latency is higher than " << expect_max_latency_ms << "ms" << std::endl;
+    exit_code = 1;
+  }
+  if (expect_max_round_trip_ms > 0 && bridge_stats.max_round_trip_us > (int64_t)expect_max_round_trip_ms * 1000) {
+    std::cout << "FAILED: the highest ack round trip time is higher than " << expect_max_round_trip_ms << "ms" << std::endl;
+    exit_code = 1;
+  }
+  return exit_code;
+}
+
+
+}
+
+
+int main(int argc, char** argv) {
+    return snowrobot::main(argc, argv);
+}
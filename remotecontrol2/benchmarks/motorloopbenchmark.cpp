@@ -0,0 +1,275 @@
+#include "../common/controlchannel.h"
+#include "../common/motorloop.h"
+#include "allocationcounter.h"
+#include "latencyhistogram.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/program_options.hpp>
+
+
+// This benchmark measures how long it takes from the operator sends a drive command until the MotorLoop applies it,
+// and how evenly the loop ticks, while the io threads are busy with network traffic. A ControlChannelClient sends
+// commands at a fixed rate to a ControlChannelServer over the loopback interface, and the server posts them to a
+// MotorLoop like the server does. With --flood-senders the control port is also flooded with --flood-rate datagrams per
+// second from other sockets, which the control channel has to receive and reject on the same io threads. An unpaced
+// flood just fills the socket's receive buffer, so the kernel drops the operator's datagrams too, which isn't what we
+// want to measure.
+//
+// It reports the send->posted latency (the network and the io threads), the send->actuated latency (including the wait
+// for the next tick), and the deviation of each tick interval from the period. It also counts the heap allocations
+// made on the loop thread, which must be zero.
+//
+// Afterwards it posts a full reverse straight after a full forward to a MotorLoop of its own, and checks that the
+// throttle goes through zero right away instead of being rate limited all the way down.
+
+
+namespace snowrobot {
+
+
+// Drives full forward until the throttle has ramped up, then full reverse, and checks that the first tick that applies
+// the reverse command goes to zero and at most one step beyond. Returns false if it doesn't.
+static bool checkReversal(MotorLoopSettings settings) {
+  settings.realtime_priority = false;
+  const int max_step = settings.max_change_per_s / settings.rate_hz;
+  const auto ramp_up_time = std::chrono::milliseconds(1000 * 1000 / settings.max_change_per_s + 100);
+  const auto reverse_time = std::chrono::milliseconds(100);
+  const size_t max_ticks = (size_t)((ramp_up_time + reverse_time).count() * settings.rate_hz / 1000) + settings.rate_hz;
+  std::vector<MotorOutput> outputs(max_ticks);
+  std::atomic<size_t> output_count{0};
+  auto motor_loop = std::make_unique<MotorLoop>(settings, [&](const MotorOutput& output) {
+    size_t i = output_count.load(std::memory_order_relaxed);
+    if (i < max_ticks) {
+      outputs[i] = output;
+      output_count.store(i + 1, std::memory_order_release);
+    }
+  });
+
+  // The commands are posted every tick, so the loop's deadman doesn't trip while the throttle ramps up.
+  uint32_t sequence_nr = 0;
+  auto drive = [&](int16_t throttle, std::chrono::milliseconds duration) {
+    auto end_time = std::chrono::steady_clock::now() + duration;
+    while (std::chrono::steady_clock::now() < end_time) {
+      motor_loop->post(DrivePayload{++sequence_nr, 0, throttle, unix_time_us()});
+      std::this_thread::sleep_for(std::chrono::milliseconds(1000 / settings.rate_hz));
+    }
+  };
+  drive(1000, ramp_up_time);
+  uint32_t first_reverse_nr = sequence_nr + 1;
+  drive(-1000, reverse_time);
+  motor_loop.reset();
+
+  size_t count = output_count.load(std::memory_order_acquire);
+  for (size_t i = 1; i < count; i++) {
+    if (outputs[i].sequence_nr < first_reverse_nr) {
+      continue;
+    }
+    std::cout << "reversal: the throttle went from " << outputs[i - 1].throttle << " to " << outputs[i].throttle
+              << " on the first reverse tick, with a max step of " << max_step << std::endl;
+    if (outputs[i - 1].throttle != 1000) {
+      std::cout << "FAILED: the throttle didn't reach full forward before the reversal" << std::endl;
+      return false;
+    }
+    if (outputs[i].throttle > 0 || outputs[i].throttle < -max_step) {
+      std::cout << "FAILED: the reversal wasn't applied as a stop followed by a rate limited speed-up" << std::endl;
+      return false;
+    }
+    return true;
+  }
+  std::cout << "FAILED: the loop never applied the reverse command" << std::endl;
+  return false;
+}
+
+
+int main(int argc, char** argv)
+{
+  int duration_s;
+  int command_rate_hz;
+  int io_thread_count;
+  int flood_senders;
+  int flood_rate;
+  MotorLoopSettings loop_settings;
+  int deadman_timeout_ms;
+  bool realtime = false;
+  int expect_max_latency_ms;
+  int expect_max_jitter_us;
+  boost::program_options::options_description desc("Allowed options");
+  desc.add_options()
+      ("duration", boost::program_options::value<int>(&duration_s)->default_value(10), "how many seconds to run the benchmark")
+      ("rate", boost::program_options::value<int>(&command_rate_hz)->default_value(50), "how many drive commands to send per second")
+      ("loop-rate", boost::program_options::value<int>(&loop_settings.rate_hz)->default_value(100), "how many times per second the motor loop ticks")
+      ("deadman-timeout", boost::program_options::value<int>(&deadman_timeout_ms)->default_value(200), "the deadman timeout in ms")
+      ("io-threads", boost::program_options::value<int>(&io_thread_count)->default_value(2), "how many threads run the io_context")
+      ("flood-senders", boost::program_options::value<int>(&flood_senders)->default_value(0), "how many sockets flood the control port with datagrams")
+      ("flood-rate", boost::program_options::value<int>(&flood_rate)->default_value(20000), "how many datagrams per second the flood senders send together")
+      ("realtime", boost::program_options::bool_switch(&realtime), "run the motor loop with a real-time priority, like the server does")
+      ("expect-max-latency", boost::program_options::value<int>(&expect_max_latency_ms)->default_value(0), "fail if the p99 send->actuated latency is higher than this many ms")
+      ("expect-max-jitter", boost::program_options::value<int>(&expect_max_jitter_us)->default_value(0), "fail if the p99 tick interval deviation is higher than this many us")
+  ;
+  boost::program_options::variables_map vm;
+  boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+  boost::program_options::notify(vm);
+  loop_settings.deadman_timeout = std::chrono::milliseconds(deadman_timeout_ms);
+  loop_settings.realtime_priority = realtime;
+
+  // Only the loop thread's allocations are counted, from its first tick on.
+  count_all_threads = false;
+  allocation_count = 0;
+
+  // The loop thread records into preallocated arrays, so the recording doesn't allocate either. They are only read
+  // after the loop has been stopped.
+  const size_t max_ticks = (size_t)(duration_s + 2) * loop_settings.rate_hz;
+  std::vector<int64_t> actuation_latencies_us(max_ticks);
+  std::vector<int64_t> tick_deviations_us(max_ticks);
+  size_t actuation_count = 0;
+  size_t tick_count = 0;
+  int64_t previous_tick_us = 0;
+  const int64_t period_us = 1000000 / loop_settings.rate_hz;
+
+  boost::asio::io_context ctx;
+  std::atomic<bool> stopped_by_deadman{false};
+  auto motor_loop = std::make_unique<MotorLoop>(loop_settings, [&](const MotorOutput& output) {
+    count_this_thread = true;
+    int64_t now_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    if (previous_tick_us != 0 && tick_count < max_ticks) {
+      tick_deviations_us[tick_count++] = std::abs(now_us - previous_tick_us - period_us);
+    }
+    previous_tick_us = now_us;
+    if (output.is_new_command && output.sequence_nr != 0 && actuation_count < max_ticks) {
+      actuation_latencies_us[actuation_count++] = (int64_t)unix_time_us() - (int64_t)output.command_timestamp_us;
+    }
+    if (output.deadman && output.sequence_nr != 0) {
+      stopped_by_deadman = true;
+    }
+  });
+
+  LatencyHistogram post_latency("send->posted");
+  ControlChannelServer server(ctx, 0, std::chrono::milliseconds(deadman_timeout_ms), [&](const DrivePayload& command) {
+    if (command.steering != 0 || command.throttle != 0) {
+      post_latency.add((int64_t)unix_time_us() - (int64_t)command.timestamp_us);
+    }
+    motor_loop->post(command);
+  });
+  boost::asio::ip::udp::endpoint server_endpoint(boost::asio::ip::make_address("127.0.0.1"), server.getPort());
+  ControlChannelClient client(ctx, server_endpoint);
+  server.setOperator(boost::asio::ip::udp::endpoint(boost::asio::ip::make_address("127.0.0.1"), client.getLocalPort()));
+
+  auto end_time = std::chrono::steady_clock::now() + std::chrono::seconds(duration_s);
+  std::atomic<bool> done{false};
+  int sent_count = 0;
+  boost::asio::co_spawn(ctx, [&]() -> boost::asio::awaitable<void> {
+    boost::asio::steady_timer timer(ctx);
+    auto next_send_time = std::chrono::steady_clock::now();
+    while (next_send_time < end_time) {
+      client.send(100, 500);
+      sent_count++;
+      next_send_time += std::chrono::microseconds(1000000 / command_rate_hz);
+      timer.expires_at(next_send_time);
+      co_await timer.async_wait(boost::asio::use_awaitable);
+    }
+    done = true;
+  }, boost::asio::detached);
+
+  // The flooders send bursts of drive messages from sockets that aren't the operator's, every millisecond.
+  std::atomic<uint64_t> flood_count{0};
+  std::vector<std::unique_ptr<ControlChannelClient>> flooders;
+  const int burst_size = std::max(1, flood_rate / 1000 / std::max(1, flood_senders));
+  for (int i = 0; i < flood_senders; i++) {
+    flooders.push_back(std::make_unique<ControlChannelClient>(ctx, server_endpoint));
+    ControlChannelClient* flooder = flooders.back().get();
+    boost::asio::co_spawn(ctx, [&, flooder]() -> boost::asio::awaitable<void> {
+      boost::asio::steady_timer timer(ctx);
+      auto next_burst_time = std::chrono::steady_clock::now();
+      while (!done) {
+        for (int j = 0; j < burst_size; j++) {
+          flooder->send(-1000, -1000);
+        }
+        flood_count += burst_size;
+        next_burst_time += std::chrono::milliseconds(1);
+        timer.expires_at(next_burst_time);
+        co_await timer.async_wait(boost::asio::use_awaitable);
+      }
+    }, boost::asio::detached);
+  }
+
+  std::vector<std::thread> io_threads;
+  for (int i = 0; i < io_thread_count; i++) {
+    io_threads.emplace_back([&ctx] {
+      while (!ctx.stopped()) {
+        ctx.run_for(std::chrono::milliseconds(100));
+      }
+    });
+  }
+  while (!done) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  // Let the last command reach the motors before the loop is stopped.
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  ctx.stop();
+  for (std::thread& io_thread : io_threads) {
+    io_thread.join();
+  }
+  MotorLoop::Stats loop_stats = motor_loop->getStats();
+  motor_loop.reset();
+
+  LatencyHistogram actuation_latency("send->actuated");
+  for (size_t i = 0; i < actuation_count; i++) {
+    actuation_latency.add(actuation_latencies_us[i]);
+  }
+  LatencyHistogram tick_jitter("tick interval deviation");
+  for (size_t i = 0; i < tick_count; i++) {
+    tick_jitter.add(tick_deviations_us[i]);
+  }
+
+  const ControlChannelServer::Stats& server_stats = server.getStats();
+  std::cout << "sent:" << sent_count << " flood datagrams:" << flood_count << " applied:" << server_stats.applied
+            << " rejected:" << server_stats.rejected << std::endl;
+  std::cout << "loop ticks:" << loop_stats.ticks << " commands picked up:" << loop_stats.commands
+            << " deadman stops:" << loop_stats.deadman_stops << " overruns:" << loop_stats.overruns
+            << " max lateness:" << loop_stats.max_lateness_us << "us"
+            << " allocations on the loop thread:" << allocation_count << std::endl;
+  post_latency.report();
+  actuation_latency.report();
+  tick_jitter.report();
+
+  int exit_code = 0;
+  if (allocation_count > 0) {
+    std::cout << "FAILED: the motor loop allocated memory" << std::endl;
+    exit_code = 1;
+  }
+  if (stopped_by_deadman) {
+    std::cout << "FAILED: the loop's deadman stopped the motors while the commands were flowing" << std::endl;
+    exit_code = 1;
+  }
+  if (expect_max_latency_ms > 0 && actuation_latency.percentile(0.99) > (int64_t)expect_max_latency_ms * 1000) {
+    std::cout << "FAILED: the p99 send->actuated latency is higher than " << expect_max_latency_ms << "ms" << std::endl;
+    exit_code = 1;
+  }
+  if (expect_max_jitter_us > 0 && tick_jitter.percentile(0.99) > expect_max_jitter_us) {
+    std::cout << "FAILED: the p99 tick interval deviation is higher than " << expect_max_jitter_us << "us" << std::endl;
+    exit_code = 1;
+  }
+  if (loop_settings.max_change_per_s > 0 && !checkReversal(loop_settings)) {
+    exit_code = 1;
+  }
+  return exit_code;
+}
+
+
+}
+
+
+int main(int argc, char** argv) {
+    return snowrobot::main(argc, argv);
+}
@@ -0,0 +1,315 @@
+#include "../common/linebasedserver.h"
+#include "latencyhistogram.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/this_coro.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/program_options.hpp>
+
+
+// This benchmark checks the request pipelining on a LineBasedServer with a coroutine callback, like the command port's.
+// The callback answers "sleep <ms>" after waiting that long, like a pipeline start that waits for a gstreamer state
+// change, and "get" right away. It runs three phases on one connection:
+//   head-of-line: sends a slow request and then a "ping", and measures how long the pong takes. The pong must not
+//                 wait for the slow request.
+//   ids:          sends "#1 sleep <ms>" and then "#2 get", and measures how long the response to #2 takes. It must
+//                 come first, since the requests with ids are handled concurrently.
+//   backpressure: sends "#<n> get" requests without reading any responses, until the socket won't take any more. The
+//                 server must stop reading at some point, or it would buffer the responses without a limit. Then it
+//                 reads all the responses and checks that each request got exactly one.
+//   stuck client: another connection does the same, but never reads the responses. The server's watchdog must close
+//                 it after --timeout seconds and call the connection lost callback, even though the writes of the
+//                 responses are stuck.
+
+
+namespace snowrobot {
+
+
+// Reads the lines from a blocking socket.
+class LineReader {
+  public:
+    explicit LineReader(boost::asio::ip::tcp::socket& sock) : sock_(sock) {
+    }
+
+    std::string readLine() {
+      for (;;) {
+        size_t line_end = this->buffer_.find('\n', this->offset_);
+        if (line_end != std::string::npos) {
+          std::string line = this->buffer_.substr(this->offset_, line_end - this->offset_);
+          this->offset_ = line_end + 1;
+          return line;
+        }
+        this->buffer_.erase(0, this->offset_);
+        this->offset_ = 0;
+        char chunk[64 * 1024];
+        size_t size = this->sock_.read_some(boost::asio::buffer(chunk));
+        this->buffer_.append(chunk, size);
+      }
+    }
+
+  private:
+    boost::asio::ip::tcp::socket& sock_;
+    std::string buffer_;
+    size_t offset_ = 0;
+};
+
+
+// Sends "#<n> get" requests without reading the responses, until the socket won't take any more or max_size bytes have
+// been sent. Only the requests that were sent whole are counted. Returns true if the socket blocked, which means that
+// the server has stopped reading.
+static bool sendUntilBlocked(boost::asio::ip::tcp::socket& sock, size_t max_size, size_t& sent_size,
+                             int64_t& request_count, int64_t& id_sum) {
+  sock.non_blocking(true);
+  std::string batch;
+  std::vector<size_t> line_ends;
+  bool blocked = false;
+  int would_block_count = 0;
+  while (!blocked && sent_size < max_size) {
+    batch.clear();
+    line_ends.clear();
+    for (int64_t id = request_count + 1; id <= request_count + 100; id++) {
+      batch += "#" + std::to_string(id) + " get\n";
+      line_ends.push_back(batch.size());
+    }
+    size_t batch_offset = 0;
+    while (batch_offset < batch.size() && !blocked) {
+      boost::system::error_code ec;
+      batch_offset += sock.write_some(boost::asio::buffer(batch.data() + batch_offset, batch.size() - batch_offset), ec);
+      if (ec == boost::asio::error::would_block) {
+        // Give the server a moment to read more, in case it was just busy.
+        blocked = ++would_block_count > 1;
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+      } else if (ec) {
+        throw boost::system::system_error(ec);
+      }
+    }
+    for (size_t line_end : line_ends) {
+      if (line_end <= batch_offset) {
+        request_count++;
+        id_sum += request_count;
+      }
+    }
+    sent_size += batch_offset;
+  }
+  sock.non_blocking(false);
+  return blocked;
+}
+
+
+static int64_t elapsedMicroseconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+int main(int argc, char** argv)
+{
+  int round_count;
+  int slow_request_ms;
+  int server_thread_count;
+  int expect_max_rtt_ms;
+  size_t max_backlog_mb;
+  int timeout_s;
+  boost::program_options::options_description desc("Allowed options");
+  desc.add_options()
+      ("rounds", boost::program_options::value<int>(&round_count)->default_value(10), "how many slow requests to send in each of the first two phases")
+      ("slow-request", boost::program_options::value<int>(&slow_request_ms)->default_value(200), "how many ms each slow request takes")
+      ("server-threads", boost::program_options::value<int>(&server_thread_count)->default_value(2), "how many threads run the server's io_context")
+      ("expect-max-rtt", boost::program_options::value<int>(&expect_max_rtt_ms)->default_value(0), "fail if a ping or a fast request behind a slow one takes longer than this many ms")
+      ("max-backlog", boost::program_options::value<size_t>(&max_backlog_mb)->default_value(64), "fail if the server takes more than this many MB of requests without the responses being read")
+      ("timeout", boost::program_options::value<int>(&timeout_s)->default_value(2), "the server's connection timeout in seconds")
+  ;
+  boost::program_options::variables_map vm;
+  boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+  boost::program_options::notify(vm);
+
+  boost::asio::io_context server_ctx;
+  // The server's sockets of the latest connection, and of the connections that have been lost, so that we can tell
+  // which connection the watchdog closed.
+  std::mutex connections_mutex;
+  const boost::asio::ip::tcp::socket* latest_connection = nullptr;
+  std::set<const boost::asio::ip::tcp::socket*> lost_connections;
+  LineBasedServer server(
+    server_ctx,
+    0,
+    [&](boost::asio::ip::tcp::socket& sock) {
+      std::lock_guard<std::mutex> lock(connections_mutex);
+      latest_connection = &sock;
+      return std::string("welcome");
+    },
+    [&](boost::asio::ip::tcp::socket& sock) {
+      std::lock_guard<std::mutex> lock(connections_mutex);
+      lost_connections.insert(&sock);
+    },
+    [](boost::asio::ip::tcp::socket&, std::string_view request) -> boost::asio::awaitable<std::string> {
+      if (request == "get") {
+        co_return "ok";
+      }
+      if (request.starts_with("sleep ")) {
+        std::string ms(request.substr(6));
+        boost::asio::steady_timer timer(co_await boost::asio::this_coro::executor);
+        timer.expires_after(std::chrono::milliseconds(std::atoi(ms.c_str())));
+        co_await timer.async_wait(boost::asio::use_awaitable);
+        co_return "slept " + ms;
+      }
+      co_return "ERROR: unknown request '" + std::string(request) + "'";
+    });
+  server.setTimeout(std::chrono::seconds(timeout_s));
+  std::vector<std::future<void>> server_threads;
+  for (int i = 0; i < server_thread_count; i++) {
+    server_threads.push_back(std::async(std::launch::async, [&server_ctx]{server_ctx.run();}));
+  }
+
+  boost::asio::io_context client_ctx;
+  boost::asio::ip::tcp::socket sock(client_ctx);
+  sock.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), server.getPort()));
+  sock.set_option(boost::asio::ip::tcp::no_delay(true));
+  LineReader reader(sock);
+  reader.readLine();  // the welcome message
+
+  int exit_code = 0;
+  std::string slow_request = "sleep " + std::to_string(slow_request_ms);
+  std::string slow_response = "slept " + std::to_string(slow_request_ms);
+
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  // head-of-line
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  LatencyHistogram ping_rtt("ping round trip");
+  for (int i = 0; i < round_count; i++) {
+    boost::asio::write(sock, boost::asio::buffer(slow_request + "\n"));
+    auto start = std::chrono::steady_clock::now();
+    boost::asio::write(sock, boost::asio::buffer(std::string("ping\n")));
+    std::string first = reader.readLine();
+    ping_rtt.add(elapsedMicroseconds(start));
+    std::string second = reader.readLine();
+    if (first != "pong" || second != slow_response) {
+      std::cout << "FAILED: expected 'pong' and then '" << slow_response << "', got '" << first << "' and '" << second
+                << "'" << std::endl;
+      exit_code = 1;
+    }
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  // ids
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  LatencyHistogram fast_rtt("fast request round trip");
+  for (int i = 0; i < round_count; i++) {
+    boost::asio::write(sock, boost::asio::buffer("#1 " + slow_request + "\n"));
+    auto start = std::chrono::steady_clock::now();
+    boost::asio::write(sock, boost::asio::buffer(std::string("#2 get\n")));
+    std::string first = reader.readLine();
+    fast_rtt.add(elapsedMicroseconds(start));
+    std::string second = reader.readLine();
+    if (first != "#2 ok" || second != "#1 " + slow_response) {
+      std::cout << "FAILED: expected '#2 ok' and then '#1 " << slow_response << "', got '" << first << "' and '"
+                << second << "'" << std::endl;
+      exit_code = 1;
+    }
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  // backpressure
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  size_t max_backlog_size = max_backlog_mb * 1024 * 1024;
+  size_t sent_size = 0;
+  int64_t request_count = 0;
+  int64_t id_sum = 0;
+  bool blocked = sendUntilBlocked(sock, max_backlog_size, sent_size, request_count, id_sum);
+  std::cout << "the server stopped taking requests after " << request_count << " requests ("
+            << sent_size / 1024 << " KB)" << std::endl;
+  if (!blocked) {
+    std::cout << "FAILED: the server took " << max_backlog_mb << " MB of requests without the responses being read"
+              << std::endl;
+    exit_code = 1;
+  }
+
+  // Now read all the responses. Each id must be answered once, so the ids must add up.
+  int64_t response_count = 0;
+  int64_t response_id_sum = 0;
+  auto drain_start = std::chrono::steady_clock::now();
+  while (response_count < request_count) {
+    std::string line = reader.readLine();
+    size_t space = line.find(' ');
+    if (line.empty() || line[0] != '#' || space == std::string::npos || line.substr(space + 1) != "ok") {
+      std::cout << "FAILED: got an unexpected response: '" << line << "'" << std::endl;
+      exit_code = 1;
+      break;
+    }
+    response_id_sum += std::atoll(line.c_str() + 1);
+    response_count++;
+  }
+  std::cout << "read " << response_count << " responses in " << elapsedMicroseconds(drain_start) / 1000 << " ms"
+            << std::endl;
+  if (response_id_sum != id_sum) {
+    std::cout << "FAILED: the responses' ids don't match the requests' ids" << std::endl;
+    exit_code = 1;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  // stuck client
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  boost::asio::ip::tcp::socket stuck_sock(client_ctx);
+  stuck_sock.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), server.getPort()));
+  LineReader(stuck_sock).readLine();  // the welcome message
+  size_t stuck_sent_size = 0;
+  int64_t stuck_request_count = 0;
+  int64_t stuck_id_sum = 0;
+  sendUntilBlocked(stuck_sock, max_backlog_size, stuck_sent_size, stuck_request_count, stuck_id_sum);
+  const boost::asio::ip::tcp::socket* stuck_connection;
+  {
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    stuck_connection = latest_connection;
+  }
+  auto is_stuck_connection_lost = [&] {
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    return lost_connections.contains(stuck_connection);
+  };
+  auto stuck_start = std::chrono::steady_clock::now();
+  while (!is_stuck_connection_lost() && std::chrono::steady_clock::now() - stuck_start < std::chrono::seconds(timeout_s + 5)) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  if (!is_stuck_connection_lost()) {
+    std::cout << "FAILED: the server didn't drop the client that stopped reading within " << timeout_s + 5
+              << " seconds" << std::endl;
+    exit_code = 1;
+  } else {
+    std::cout << "the server dropped the client that stopped reading after " << elapsedMicroseconds(stuck_start) / 1000
+              << " ms" << std::endl;
+  }
+
+  stuck_sock.close();
+  sock.close();
+  server_ctx.stop();
+  for (std::future<void>& server_thread : server_threads) {
+    server_thread.wait();
+  }
+
+  ping_rtt.report();
+  fast_rtt.report();
+  if (expect_max_rtt_ms > 0 && std::max(ping_rtt.max(), fast_rtt.max()) > (int64_t)expect_max_rtt_ms * 1000) {
+    std::cout << "FAILED: a ping or a fast request waited for a slow request (more than " << expect_max_rtt_ms
+              << " ms)" << std::endl;
+    exit_code = 1;
+  }
+  return exit_code;
+}
+
+
+}
+
+
+int main(int argc, char** argv) {
+    return snowrobot::main(argc, argv);
+}
@@ -0,0 +1,258 @@
+#include "../common/playoutcontroller.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+
+// This benchmark replays a jitter trace through a model of the receiver's jitterbuffer, once with a fixed latency and
+// once with the PlayoutController, and reports the latency versus late-packet tradeoff of both. It doesn't need
+// gstreamer or a network, so the results are the same on every run.
+//
+// A trace is the send and arrival time of each rtp packet. The --trace option picks one of the built-in synthetic
+// traces (lan or lte), or reads a file with one "<send_ms> <arrival_ms>" line per packet, where the arrival is "-" for
+// a lost packet. The rtpreplay tool can write such a file from a recorded session.
+//
+// The jitterbuffer model plays each packet out at its send time plus the smallest transit time seen so far plus the
+// latency, like rtpjitterbuffer does with its clock skew estimation. A packet that arrives after its playout time is
+// dropped as late, and a frame is late if any of its packets is. Every second of trace time the controller gets the
+// interarrival jitter (RFC 3550) and the late and lost packets of that second.
+
+
+namespace snowrobot {
+
+
+struct TracePacket {
+  double send_ms = 0.0;
+  double arrival_ms = -1.0;  // negative if the packet was lost
+  int frame = 0;
+};
+
+
+// The video is sent as 30 frames per second of a few packets each.
+constexpr int trace_framerate = 30;
+constexpr int trace_packets_per_frame = 4;
+
+
+// A wired LAN: about a ms of transit time, with a fraction of a ms of jitter.
+static std::vector<TracePacket> make_lan_trace(int duration_s, std::mt19937& random) {
+  std::exponential_distribution<double> queuing(2.0);
+  std::vector<TracePacket> trace;
+  for (int frame = 0; frame < duration_s * trace_framerate; frame++) {
+    double frame_ms = frame * 1000.0 / trace_framerate;
+    for (int i = 0; i < trace_packets_per_frame; i++) {
+      double send_ms = frame_ms + i * 0.1;
+      trace.push_back(TracePacket{send_ms, send_ms + 1.0 + queuing(random), frame});
+    }
+  }
+  return trace;
+}
+
+
+// An LTE uplink: 40 ms of transit time with 5-15 ms of jitter, and now and then a few hundred ms where the modem queues
+// up the packets (a handover or a scheduling hiccup) and delivers them in a burst. 0.5% of the packets are lost.
+static std::vector<TracePacket> make_lte_trace(int duration_s, std::mt19937& random) {
+  std::normal_distribution<double> jitter(0.0, 8.0);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  std::vector<TracePacket> trace;
+  double stall_until_ms = -1.0;
+  for (int frame = 0; frame < duration_s * trace_framerate; frame++) {
+    double frame_ms = frame * 1000.0 / trace_framerate;
+    if (frame_ms > stall_until_ms && uniform(random) < 0.003) {
+      stall_until_ms = frame_ms + 100.0 + 200.0 * uniform(random);
+    }
+    for (int i = 0; i < trace_packets_per_frame; i++) {
+      double send_ms = frame_ms + i * 0.5;
+      double arrival_ms = send_ms + 40.0 + std::abs(jitter(random));
+      if (send_ms < stall_until_ms) {
+        // The stalled packets all come out when the stall ends.
+        arrival_ms = std::max(arrival_ms, stall_until_ms + 40.0 + i * 0.5);
+      }
+      if (uniform(random) < 0.005) {
+        arrival_ms = -1.0;
+      }
+      trace.push_back(TracePacket{send_ms, arrival_ms, frame});
+    }
+  }
+  return trace;
+}
+
+
+// Reads a trace file. The packets that were sent within 1 ms of each other belong to the same frame.
+static std::vector<TracePacket> read_trace(const std::string& path) {
+  std::ifstream file(path);
+  if (!file) {
+    throw std::runtime_error("Failed to open the trace file '" + path + "'");
+  }
+  std::vector<TracePacket> trace;
+  std::string line;
+  int frame = 0;
+  while (std::getline(file, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream is(line);
+    TracePacket packet;
+    std::string arrival;
+    is >> packet.send_ms >> arrival;
+    packet.arrival_ms = arrival == "-" ? -1.0 : std::stod(arrival);
+    if (!trace.empty() && packet.send_ms - trace.back().send_ms > 1.0) {
+      frame++;
+    }
+    packet.frame = frame;
+    trace.push_back(packet);
+  }
+  return trace;
+}
+
+
+struct PlayoutResult {
+  double average_latency_ms = 0.0;  // the jitterbuffer latency, averaged over the packets
+  double late_packet_percent = 0.0;
+  double late_frame_percent = 0.0;
+  int min_latency_ms = 0;
+  int max_latency_ms = 0;
+};
+
+
+// Plays the trace through the jitterbuffer model. If adaptive is false the latency stays at the start latency.
+static PlayoutResult simulate(const std::vector<TracePacket>& trace, const PlayoutSettings& settings, bool adaptive) {
+  PlayoutController controller(settings);
+  int latency_ms = controller.getLatency();
+  PlayoutResult result;
+  result.min_latency_ms = latency_ms;
+  result.max_latency_ms = latency_ms;
+
+  double min_transit_ms = -1.0;
+  double jitter_ms = 0.0;
+  double previous_transit_ms = -1.0;
+  double next_update_ms = 1000.0;
+  PlayoutSample sample;
+  double latency_sum = 0.0;
+  uint64_t packet_count = 0;
+  uint64_t late_count = 0;
+  std::vector<bool> late_frames;
+
+  for (const TracePacket& packet : trace) {
+    while (adaptive && packet.send_ms >= next_update_ms) {
+      sample.jitter_ms = jitter_ms;
+      latency_ms = controller.update(sample);
+      result.min_latency_ms = std::min(result.min_latency_ms, latency_ms);
+      result.max_latency_ms = std::max(result.max_latency_ms, latency_ms);
+      sample = PlayoutSample();
+      next_update_ms += 1000.0;
+    }
+    if ((int)late_frames.size() <= packet.frame) {
+      late_frames.resize(packet.frame + 1, false);
+    }
+    packet_count++;
+    sample.packets++;
+    latency_sum += latency_ms;
+    if (packet.arrival_ms < 0.0) {
+      sample.lost_packets++;
+      continue;
+    }
+    double transit_ms = packet.arrival_ms - packet.send_ms;
+    if (min_transit_ms < 0.0 || transit_ms < min_transit_ms) {
+      min_transit_ms = transit_ms;
+    }
+    if (previous_transit_ms >= 0.0) {
+      jitter_ms += (std::abs(transit_ms - previous_transit_ms) - jitter_ms) / 16.0;
+    }
+    previous_transit_ms = transit_ms;
+    if (packet.arrival_ms > packet.send_ms + min_transit_ms + latency_ms) {
+      sample.late_packets++;
+      late_count++;
+      late_frames[packet.frame] = true;
+    }
+  }
+
+  if (packet_count > 0) {
+    result.average_latency_ms = latency_sum / packet_count;
+    result.late_packet_percent = 100.0 * late_count / packet_count;
+  }
+  if (!late_frames.empty()) {
+    result.late_frame_percent = 100.0 * std::count(late_frames.begin(), late_frames.end(), true) / late_frames.size();
+  }
+  return result;
+}
+
+
+static void report(const std::string& name, const PlayoutResult& result) {
+  std::cout << std::left << std::setw(10) << name << std::right << std::fixed << std::setprecision(1)
+            << " latency avg:" << std::setw(6) << result.average_latency_ms << "ms"
+            << " min:" << std::setw(4) << result.min_latency_ms << "ms"
+            << " max:" << std::setw(4) << result.max_latency_ms << "ms"
+            << "  late packets:" << std::setprecision(2) << std::setw(6) << result.late_packet_percent << "%"
+            << " late frames:" << std::setw(6) << result.late_frame_percent << "%"
+            << std::endl;
+}
+
+
+int main(int argc, char** argv)
+{
+  std::string trace_name;
+  int duration_s;
+  double expect_max_latency_ms;
+  double expect_max_late_percent;
+  PlayoutSettings settings;
+  boost::program_options::options_description desc("Allowed options");
+  desc.add_options()
+      ("trace", boost::program_options::value<std::string>(&trace_name)->default_value("lte"), "lan, lte or the path of a trace file")
+      ("duration", boost::program_options::value<int>(&duration_s)->default_value(120), "the length of the synthetic traces in seconds")
+      ("min-latency", boost::program_options::value<int>(&settings.min_latency_ms)->default_value(settings.min_latency_ms), "the lowest latency (ms) the adaptive playout will use")
+      ("start-latency", boost::program_options::value<int>(&settings.start_latency_ms)->default_value(settings.start_latency_ms), "the fixed latency, and the one the adaptive playout starts out with (ms)")
+      ("max-latency", boost::program_options::value<int>(&settings.max_latency_ms)->default_value(settings.max_latency_ms), "the highest latency (ms) the adaptive playout will use")
+      ("expect-max-latency", boost::program_options::value<double>(&expect_max_latency_ms)->default_value(0.0), "fail if the adaptive playout's average latency is higher than this many ms")
+      ("expect-max-late", boost::program_options::value<double>(&expect_max_late_percent)->default_value(-1.0), "fail if the adaptive playout drops more than this percentage of the frames as late")
+  ;
+  boost::program_options::variables_map vm;
+  boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+  boost::program_options::notify(vm);
+
+  // The seed is fixed, so the synthetic traces are the same every time.
+  std::mt19937 random(42);
+  std::vector<TracePacket> trace;
+  if (trace_name == "lan") {
+    trace = make_lan_trace(duration_s, random);
+  } else if (trace_name == "lte") {
+    trace = make_lte_trace(duration_s, random);
+  } else {
+    trace = read_trace(trace_name);
+  }
+  std::cout << "Trace '" << trace_name << "': " << trace.size() << " packets" << std::endl;
+
+  PlayoutResult fixed = simulate(trace, settings, false);
+  PlayoutResult adaptive = simulate(trace, settings, true);
+  report("fixed", fixed);
+  report("adaptive", adaptive);
+
+  int exit_code = 0;
+  if (expect_max_latency_ms > 0.0 && adaptive.average_latency_ms > expect_max_latency_ms) {
+    std::cout << "FAILED: the average adaptive latency " << adaptive.average_latency_ms << " ms is higher than the expected "
+              << expect_max_latency_ms << " ms" << std::endl;
+    exit_code = 1;
+  }
+  if (expect_max_late_percent >= 0.0 && adaptive.late_frame_percent > expect_max_late_percent) {
+    std::cout << "FAILED: the adaptive playout dropped " << adaptive.late_frame_percent << "% of the frames as late, more than the expected "
+              << expect_max_late_percent << "%" << std::endl;
+    exit_code = 1;
+  }
+  return exit_code;
+}
+
+
+}
+
+
+int main(int argc, char** argv) {
+    return snowrobot::main(argc, argv);
+}
@@ -0,0 +1,44 @@
+#ifndef SNOWROBOT_REMOTECONTROL_BENCHMARKS_PROCESSCPUTIME_H
+#define SNOWROBOT_REMOTECONTROL_BENCHMARKS_PROCESSCPUTIME_H
+
+#include <cstdint>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX  // the benchmarks use std::min and std::max
+#endif
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+
+namespace snowrobot {
+
+
+// Returns the user+system cpu time this process has used so far, in microseconds. The benchmarks divide the difference
+// between two calls by the wall time to get the cpu usage in percent of one core.
+inline int64_t process_cpu_time_us() {
+#ifdef _WIN32
+  FILETIME creation_time, exit_time, kernel_time, user_time;
+  if (!GetProcessTimes(GetCurrentProcess(), &creation_time, &exit_time, &kernel_time, &user_time)) {
+    return 0;
+  }
+  auto to_us = [](const FILETIME& time) {
+    return (int64_t)(((uint64_t)time.dwHighDateTime << 32) | time.dwLowDateTime) / 10;  // in units of 100 ns
+  };
+  return to_us(kernel_time) + to_us(user_time);
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+  return (int64_t)usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec +
+         (int64_t)usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec;
+#endif
+}
+
+
+}
+
+#endif
@@ -0,0 +1,126 @@
+#include "../common/network.h"
+#include "allocationcounter.h"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <istream>
+#include <string>
+#include <vector>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/streambuf.hpp>
+#include <boost/json/object.hpp>
+#include <boost/json/parse.hpp>
+#include <boost/json/serialize.hpp>
+#include <boost/program_options.hpp>
+
+
+// This benchmark compares the cost of receiving a drive command via the line-based json protocol with the binary
+// protocol in network.h. Both paths do the same work as LineBasedServer does for each message, minus the socket io:
+//   json:   the line is appended to a streambuf, read back with std::getline() and parsed with boost::json::parse()
+//   binary: the message is decoded in-place from the receive buffer with Message::decode()
+//
+// It reports the time and the number of heap allocations per message, and fails if the binary path allocates.
+
+
+namespace snowrobot {
+
+
+struct BenchmarkResult {
+  double ns_per_message;
+  double allocations_per_message;
+  int64_t checksum;  // keeps the compiler from optimizing the decoding away
+};
+
+
+template<typename Func>
+static BenchmarkResult run(int message_count, Func decode_one) {
+  int64_t checksum = 0;
+  size_t allocations_before = allocation_count;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < message_count; i++) {
+    checksum += decode_one(i);
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  size_t allocations = allocation_count - allocations_before;
+  return BenchmarkResult{
+    (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / message_count,
+    (double)allocations / message_count,
+    checksum
+  };
+}
+
+
+int main(int argc, char** argv)
+{
+  int message_count;
+  boost::program_options::options_description desc("Allowed options");
+  desc.add_options()
+      ("messages", boost::program_options::value<int>(&message_count)->default_value(1000000), "how many messages to decode with each protocol")
+  ;
+  boost::program_options::variables_map vm;
+  boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+  boost::program_options::notify(vm);
+
+  // The json path.
+  boost::json::object drive_json;
+  drive_json["type"] = "drive";
+  drive_json["sequence_nr"] = 12345;
+  drive_json["steering"] = -250;
+  drive_json["throttle"] = 800;
+  std::string line = boost::json::serialize(drive_json) + "\n";
+  boost::asio::streambuf streambuf;
+  BenchmarkResult json_result = run(message_count, [&](int i) -> int64_t {
+    auto buffers = streambuf.prepare(line.size());
+    boost::asio::buffer_copy(buffers, boost::asio::buffer(line));
+    streambuf.commit(line.size());
+    std::string request;
+    std::istream is(&streambuf);
+    std::getline(is, request, '\n');
+    boost::json::object request_obj = boost::json::parse(request).as_object();
+    return request_obj.at("sequence_nr").as_int64() + request_obj.at("steering").as_int64() + request_obj.at("throttle").as_int64();
+  });
+
+  // The binary path. The receive buffer is filled with a batch of messages, like a socket read would do.
+  constexpr int batch_size = 64;
+  std::vector<uint8_t> receive_buffer;
+  for (int i = 0; i < batch_size; i++) {
+    Message::encode(DrivePayload{12345, -250, 800}, receive_buffer);
+  }
+  size_t offset = 0;
+  Message message;
+  BenchmarkResult binary_result = run(message_count, [&](int i) -> int64_t {
+    if (offset == receive_buffer.size()) {
+      offset = 0;
+    }
+    offset += Message::decode(std::span<const uint8_t>(receive_buffer.data() + offset, receive_buffer.size() - offset), message);
+    DrivePayload drive = message.as<DrivePayload>();
+    return drive.sequence_nr + drive.steering + drive.throttle;
+  });
+
+  if (json_result.checksum != binary_result.checksum) {
+    std::cout << "FAILED: the two protocols decoded different values" << std::endl;
+    return 1;
+  }
+
+  std::cout << std::fixed << std::setprecision(1);
+  std::cout << "json:   " << std::setw(8) << json_result.ns_per_message << " ns/message "
+            << std::setw(6) << json_result.allocations_per_message << " allocations/message" << std::endl;
+  std::cout << "binary: " << std::setw(8) << binary_result.ns_per_message << " ns/message "
+            << std::setw(6) << binary_result.allocations_per_message << " allocations/message" << std::endl;
+
+  if (binary_result.allocations_per_message > 0) {
+    std::cout << "FAILED: the binary protocol allocated memory while decoding" << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+
+}
+
+
+int main(int argc, char** argv) {
+    return snowrobot::main(argc, argv);
+}
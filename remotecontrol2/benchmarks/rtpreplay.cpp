@@ -0,0 +1,434 @@
+#include "../common/decoderbackend.h"
+#include "../common/gst_wrappers.h"
+#include "../common/playoutcontroller.h"
+#include "../common/rtpcapture.h"
+#include "latencyhistogram.h"
+#include "processcputime.h"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gst/gst.h>
+#include <gst/rtp/rtp.h>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/log/trivial.hpp>
+#include <boost/program_options.hpp>
+
+
+// Plays a capture file from the server's --record option back into a receiver, so that a session from the field can
+// be used as a repeatable decode and jitterbuffer benchmark.
+//
+// The receiver is the same chain as in the headlessclient: a rtpbin with a jitterbuffer per stream, rtph264depay, the
+// decoder picked with --decoder and a fakesink. The packets are sent to it over the loopback interface with the same
+// spacing as when they were recorded, or --speed times faster. At the end it prints the decoded frames, the decode
+// latency and the jitterbuffer's late and lost packets for each stream, and the cpu usage of the whole replay.
+//
+// The jitterbuffer latency is set with --min-latency, --start-latency and --max-latency like in the client. Give them
+// all the same value to replay with a fixed latency.
+//
+// The jitterbuffer paces its output by the rtp timestamps, so its late and lost numbers only mean something at --speed 1.
+// The faster speeds are for benchmarking the decoder.
+//
+// With --export-trace the replay is skipped, and the send and arrival time of each rtp packet of a stream is written
+// as a trace for the playoutbenchmark instead. The send time comes from the rtp timestamp, and the arrival time is
+// when the packet was recorded, so a recording from the server's side of the link gives the jitter of the encoder and
+// the pipeline, not of the network.
+
+
+namespace snowrobot {
+
+
+// Receives and decodes one of the recorded streams.
+class ReplayReceiver {
+  public:
+    ReplayReceiver(GstBin* pipeline, GstElement* rtpbin, int stream, DecoderBackend decoder_backend,
+                   const DecoderCapabilities& decoder_capabilities)
+      : stream_(stream)
+    {
+      rtp_udpsrc_ = gst_element_factory_make("udpsrc", NULL);
+      ASSERT_NOT_NULL(rtp_udpsrc_);
+      g_object_set(rtp_udpsrc_, "port", 0, NULL);
+      // The replay can send the packets faster than they were recorded, so give the socket some room.
+      g_object_set(rtp_udpsrc_, "buffer-size", 4 * 1024 * 1024, NULL);
+      auto rtp_udpsrc_caps = make_GstCaps_ptr(gst_caps_from_string(
+        "application/x-rtp,media=(string)video,clock-rate=(int)90000,encoding-name=(string)H264"));
+      g_object_set(rtp_udpsrc_, "caps", rtp_udpsrc_caps.get(), NULL);
+      gst_element_set_state(rtp_udpsrc_, GST_STATE_PAUSED);
+      g_object_get(rtp_udpsrc_, "port", &rtp_port_, NULL);
+
+      rtcp_udpsrc_ = gst_element_factory_make("udpsrc", NULL);
+      ASSERT_NOT_NULL(rtcp_udpsrc_);
+      g_object_set(rtcp_udpsrc_, "port", 0, NULL);
+      gst_element_set_state(rtcp_udpsrc_, GST_STATE_PAUSED);
+      g_object_get(rtcp_udpsrc_, "port", &rtcp_port_, NULL);
+
+      depay_ = gst_element_factory_make("rtph264depay", NULL);
+      ASSERT_NOT_NULL(depay_);
+      // There is no server to send a PLI to, so the broken frames are just dropped until the next keyframe.
+      g_object_set(depay_, "wait-for-keyframe", TRUE, NULL);
+      decoder_ = createDecoder(decoder_backend, decoder_capabilities);
+      videosink_ = gst_element_factory_make("fakesink", NULL);
+      ASSERT_NOT_NULL(videosink_);
+      g_object_set(videosink_, "sync", FALSE, NULL);
+
+      for (GstElement* element : {rtp_udpsrc_, rtcp_udpsrc_, depay_, decoder_, videosink_}) {
+        ASSERT_TRUE(gst_bin_add(pipeline, element));
+      }
+      ASSERT_TRUE(gst_element_link_many(depay_, decoder_, videosink_, NULL));
+      std::string recv_rtcp_sink_pad_name = "recv_rtcp_sink_" + std::to_string(stream);
+      ASSERT_TRUE(gst_element_link_pads(rtcp_udpsrc_, "src", rtpbin, recv_rtcp_sink_pad_name.c_str()));
+      std::string recv_rtp_sink_pad_name = "recv_rtp_sink_" + std::to_string(stream);
+      ASSERT_TRUE(gst_element_link_pads(rtp_udpsrc_, "src", rtpbin, recv_rtp_sink_pad_name.c_str()));
+
+      GstPad* depay_src_pad = gst_element_get_static_pad(depay_, "src");
+      ASSERT_NOT_NULL(depay_src_pad);
+      gst_pad_add_probe(depay_src_pad, GST_PAD_PROBE_TYPE_BUFFER, ReplayReceiver::onDepayloaded, this, NULL);
+      gst_object_unref(depay_src_pad);
+      GstPad* decoder_src_pad = gst_element_get_static_pad(decoder_, "src");
+      ASSERT_NOT_NULL(decoder_src_pad);
+      gst_pad_add_probe(decoder_src_pad, GST_PAD_PROBE_TYPE_BUFFER, ReplayReceiver::onDecoded, this, NULL);
+      gst_object_unref(decoder_src_pad);
+
+      g_signal_connect(rtpbin, "pad-added", G_CALLBACK(ReplayReceiver::onPadAdded), this);
+    }
+
+    int getRtpPort() const { return rtp_port_; }
+    int getRtcpPort() const { return rtcp_port_; }
+
+    uint64_t getDecodedFrames() const {
+      return decoded_frames_;
+    }
+
+    void reportDecodeLatency() {
+      std::lock_guard<std::mutex> guard(lock_);
+      decode_latency_.report();
+    }
+
+  private:
+    static void onPadAdded(GstElement* rtpbin, GstPad* pad, gpointer data) {
+      ReplayReceiver* self = (ReplayReceiver*)data;
+      std::string pad_name = string_from_gchar(gst_pad_get_name(pad));
+      std::string prefix = "recv_rtp_src_" + std::to_string(self->stream_) + "_";
+      if (pad_name.find(prefix) == 0) {
+        GstPad* sink_pad = gst_element_get_static_pad(self->depay_, "sink");
+        ASSERT_NOT_NULL(sink_pad);
+        if (gst_pad_link(pad, sink_pad) != GST_PAD_LINK_OK) {
+          BOOST_LOG_TRIVIAL(error) << "ReplayReceiver::onPadAdded(): failed to link the pad '" << pad_name << "'";
+        }
+        gst_object_unref(sink_pad);
+      }
+    }
+
+    static GstPadProbeReturn onDepayloaded(GstPad* pad, GstPadProbeInfo* info, gpointer user_data) {
+      ReplayReceiver* self = (ReplayReceiver*)user_data;
+      GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+      std::lock_guard<std::mutex> guard(self->lock_);
+      self->depayloaded_times_[GST_BUFFER_PTS(buffer)] = g_get_monotonic_time();
+      return GST_PAD_PROBE_OK;
+    }
+
+    static GstPadProbeReturn onDecoded(GstPad* pad, GstPadProbeInfo* info, gpointer user_data) {
+      ReplayReceiver* self = (ReplayReceiver*)user_data;
+      GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+      self->decoded_frames_++;
+      std::lock_guard<std::mutex> guard(self->lock_);
+      auto find = self->depayloaded_times_.find(GST_BUFFER_PTS(buffer));
+      if (find != self->depayloaded_times_.end()) {
+        self->decode_latency_.add(g_get_monotonic_time() - find->second);
+        self->depayloaded_times_.erase(self->depayloaded_times_.begin(), std::next(find));
+      }
+      return GST_PAD_PROBE_OK;
+    }
+
+    int stream_;
+    gint rtp_port_ = 0;
+    gint rtcp_port_ = 0;
+    GstElement* rtp_udpsrc_ = nullptr;
+    GstElement* rtcp_udpsrc_ = nullptr;
+    GstElement* depay_ = nullptr;
+    GstElement* decoder_ = nullptr;
+    GstElement* videosink_ = nullptr;
+
+    // These are updated by the streaming threads.
+    std::atomic<uint64_t> decoded_frames_ = 0;
+    std::mutex lock_;
+    std::map<GstClockTime, gint64> depayloaded_times_;
+    LatencyHistogram decode_latency_{"decode"};
+};
+
+
+// What the capture file contains, per stream.
+struct CapturedStream {
+  uint64_t rtp_packets = 0;
+  uint64_t rtcp_packets = 0;
+  std::string info;  // the last StreamInfo record
+};
+
+
+// Writes the "<send_ms> <arrival_ms>" trace of the stream's rtp packets. The missing sequence numbers are written as
+// lost packets. Returns the number of lines.
+static uint64_t export_trace(RtpCaptureReader& reader, int stream, const std::string& path) {
+  std::ofstream trace(path);
+  if (!trace) {
+    THROW_RUNTIME_ERROR("Failed to create the trace file '" << path << "'");
+  }
+  trace << "# send_ms arrival_ms" << std::endl;
+  trace << std::fixed << std::setprecision(3);
+  bool first = true;
+  uint64_t first_time_us = 0;
+  uint32_t first_rtp_time = 0;
+  int64_t rtp_time_wraps = 0;  // the rtp timestamps wrap around every 13 hours at 90kHz
+  uint32_t previous_rtp_time = 0;
+  uint16_t previous_seq = 0;
+  uint64_t lines = 0;
+  RtpCaptureRecord record;
+  reader.rewind();
+  while (reader.next(record)) {
+    if (record.stream != stream || record.kind != RtpCaptureKind::Rtp) {
+      continue;
+    }
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+    GstBuffer* buffer = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY, (gpointer)record.data, record.size, 0,
+                                                    record.size, NULL, NULL);
+    if (!gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp)) {
+      gst_buffer_unref(buffer);
+      continue;
+    }
+    uint32_t rtp_time = gst_rtp_buffer_get_timestamp(&rtp);
+    uint16_t seq = gst_rtp_buffer_get_seq(&rtp);
+    gst_rtp_buffer_unmap(&rtp);
+    gst_buffer_unref(buffer);
+
+    if (first) {
+      first = false;
+      first_time_us = record.time_us;
+      first_rtp_time = rtp_time;
+    } else {
+      if (rtp_time < previous_rtp_time && previous_rtp_time - rtp_time > 0x80000000u) {
+        rtp_time_wraps++;
+      }
+      uint16_t missing = (uint16_t)(seq - previous_seq - 1);
+      if (missing < 1000) {  // a larger jump is a new ssrc or a restarted server, not loss
+        double previous_send_ms = ((rtp_time_wraps << 32) + (int64_t)previous_rtp_time - first_rtp_time) / 90.0;
+        for (uint16_t i = 0; i < missing; i++) {
+          trace << previous_send_ms << " -" << std::endl;
+          lines++;
+        }
+      }
+    }
+    double send_ms = ((rtp_time_wraps << 32) + (int64_t)rtp_time - first_rtp_time) / 90.0;
+    double arrival_ms = (record.time_us - first_time_us) / 1000.0;
+    trace << send_ms << " " << arrival_ms << std::endl;
+    lines++;
+    previous_rtp_time = rtp_time;
+    previous_seq = seq;
+  }
+  return lines;
+}
+
+
+static void
+cb_error(GstBus* bus, GstMessage* message, gpointer data)
+{
+  GError* error = NULL;
+  gst_message_parse_error(message, &error, NULL);
+  BOOST_LOG_TRIVIAL(error) << "cb_error:" << GST_OBJECT_NAME(message->src) << ": " << error->message;
+  g_error_free(error);
+  g_main_loop_quit((GMainLoop*)data);
+}
+
+
+int main(int argc, char** argv)
+{
+  gst_init(&argc, &argv);
+
+  std::string capture_path;
+  double speed;
+  int only_stream;
+  std::string decoder_backend_name;
+  std::string trace_path;
+  double expect_min_frames_percent;
+  PlayoutSettings playout_settings;
+  boost::program_options::options_description desc("Allowed options");
+  desc.add_options()
+      ("capture", boost::program_options::value<std::string>(&capture_path)->required(), "the capture file to replay")
+      ("speed", boost::program_options::value<double>(&speed)->default_value(1.0), "replay this many times faster than the packets were recorded")
+      ("stream", boost::program_options::value<int>(&only_stream)->default_value(-1), "only replay this stream (the camera's rtp session index), -1 replays all of them")
+      ("decoder", boost::program_options::value<std::string>(&decoder_backend_name)->default_value("software"), "the h264 decoder to use: auto, software, d3d11, vaapi, nvdec or v4l2")
+      ("min-latency", boost::program_options::value<int>(&playout_settings.min_latency_ms)->default_value(playout_settings.min_latency_ms), "the lowest jitterbuffer latency (ms)")
+      ("start-latency", boost::program_options::value<int>(&playout_settings.start_latency_ms)->default_value(playout_settings.start_latency_ms), "the jitterbuffer latency (ms) to start out with")
+      ("max-latency", boost::program_options::value<int>(&playout_settings.max_latency_ms)->default_value(playout_settings.max_latency_ms), "the highest jitterbuffer latency (ms)")
+      ("export-trace", boost::program_options::value<std::string>(&trace_path), "write a playoutbenchmark trace of the stream (default the first one) to this file instead of replaying")
+      ("expect-min-frames", boost::program_options::value<double>(&expect_min_frames_percent)->default_value(0.0), "fail if fewer frames than this percentage of the recorded ones are decoded")
+  ;
+  boost::program_options::variables_map vm;
+  boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+  boost::program_options::notify(vm);
+  if (speed <= 0.0) {
+    THROW_RUNTIME_ERROR("The --speed must be larger than 0");
+  }
+
+  RtpCaptureReader reader(capture_path);
+  std::map<int, CapturedStream> streams;
+  uint64_t first_time_us = 0;
+  uint64_t last_time_us = 0;
+  bool first = true;
+  RtpCaptureRecord record;
+  while (reader.next(record)) {
+    if (first) {
+      first_time_us = record.time_us;
+      first = false;
+    }
+    last_time_us = record.time_us;
+    CapturedStream& stream = streams[record.stream];
+    if (record.kind == RtpCaptureKind::Rtp) {
+      stream.rtp_packets++;
+    } else if (record.kind == RtpCaptureKind::Rtcp) {
+      stream.rtcp_packets++;
+    } else if (record.kind == RtpCaptureKind::StreamInfo) {
+      stream.info.assign((const char*)record.data, record.size);
+    }
+  }
+  double capture_duration_s = (last_time_us - first_time_us) / 1e6;
+  std::cout << "Capture '" << capture_path << "': " << std::fixed << std::setprecision(1) << capture_duration_s
+            << " seconds" << (reader.isTruncated() ? " (the last record is cut short)" : "") << std::endl;
+  for (const auto& item : streams) {
+    std::cout << "  stream " << item.first << ": " << item.second.rtp_packets << " rtp packets, "
+              << item.second.rtcp_packets << " rtcp packets " << item.second.info << std::endl;
+  }
+
+  if (!trace_path.empty()) {
+    int stream = only_stream >= 0 ? only_stream : (streams.empty() ? 0 : streams.begin()->first);
+    uint64_t lines = export_trace(reader, stream, trace_path);
+    std::cout << "Wrote " << lines << " packets of stream " << stream << " to '" << trace_path << "'" << std::endl;
+    return lines > 0 ? 0 : 1;
+  }
+
+  GstElement* pipeline = gst_pipeline_new("replay");
+  ASSERT_NOT_NULL(pipeline);
+  GstElement* rtpbin = gst_element_factory_make("rtpbin", NULL);
+  ASSERT_NOT_NULL(rtpbin);
+  g_object_set(rtpbin, "rtp-profile", GST_RTP_PROFILE_AVPF, NULL);
+  ASSERT_TRUE(gst_bin_add(GST_BIN_CAST(pipeline), rtpbin));
+  AdaptivePlayout adaptive_playout(rtpbin, playout_settings);
+
+  DecoderCapabilities decoder_capabilities = DecoderCapabilities::probe();
+  DecoderBackend decoder_backend = chooseDecoderBackend(decoderBackendFromString(decoder_backend_name), decoder_capabilities);
+  std::cout << "Decoder backend: " << to_string(decoder_backend) << std::endl;
+  std::map<int, std::unique_ptr<ReplayReceiver>> receivers;
+  for (const auto& item : streams) {
+    if (item.second.rtp_packets > 0 && (only_stream < 0 || item.first == only_stream)) {
+      receivers[item.first] = std::make_unique<ReplayReceiver>(GST_BIN_CAST(pipeline), rtpbin, item.first,
+                                                               decoder_backend, decoder_capabilities);
+    }
+  }
+  if (receivers.empty()) {
+    THROW_RUNTIME_ERROR("There are no rtp packets to replay in '" << capture_path << "'");
+  }
+
+  GMainLoop* loop = g_main_loop_new(NULL, FALSE);
+  ASSERT_NOT_NULL(loop);
+  GstBus* bus = gst_element_get_bus(pipeline);
+  g_signal_connect(bus, "message::error", G_CALLBACK(cb_error), loop);
+  gst_bus_add_signal_watch(bus);
+  gst_object_unref(bus);
+  ASSERT_TRUE(gst_element_set_state(pipeline, GST_STATE_PLAYING) != GST_STATE_CHANGE_FAILURE);
+
+  g_timeout_add_seconds(1, function_pointer<gboolean(gpointer)>([&](gpointer) -> gboolean {
+    adaptive_playout.update();
+    return G_SOURCE_CONTINUE;
+  }), nullptr);
+
+  // The packets are sent from their own thread, so that the pacing doesn't depend on the main loop.
+  std::atomic<bool> stop = false;
+  int64_t start_cpu_time_us = process_cpu_time_us();
+  auto start_time = std::chrono::steady_clock::now();
+  std::thread sender([&]() {
+    boost::asio::io_context ctx;
+    boost::asio::ip::udp::socket socket(ctx, boost::asio::ip::udp::v4());
+    boost::asio::ip::address loopback = boost::asio::ip::make_address("127.0.0.1");
+    RtpCaptureRecord record;
+    reader.rewind();
+    while (!stop && reader.next(record)) {
+      auto find = receivers.find(record.stream);
+      if (find == receivers.end() || record.kind == RtpCaptureKind::StreamInfo) {
+        continue;
+      }
+      auto due = start_time + std::chrono::microseconds((int64_t)((record.time_us - first_time_us) / speed));
+      std::this_thread::sleep_until(due);
+      int port = record.kind == RtpCaptureKind::Rtp ? find->second->getRtpPort() : find->second->getRtcpPort();
+      boost::system::error_code error;
+      socket.send_to(boost::asio::buffer(record.data, record.size), boost::asio::ip::udp::endpoint(loopback, port), 0, error);
+      if (error) {
+        BOOST_LOG_TRIVIAL(error) << "Failed to send a packet: " << error.message();
+      }
+    }
+    // Give the jitterbuffers time to play out the last packets before we stop.
+    std::this_thread::sleep_for(std::chrono::milliseconds(playout_settings.max_latency_ms + 500));
+    g_idle_add([](gpointer data) -> gboolean {
+      g_main_loop_quit((GMainLoop*)data);
+      return G_SOURCE_REMOVE;
+    }, loop);
+  });
+
+  BOOST_LOG_TRIVIAL(info) << "Replaying " << capture_duration_s << " seconds at " << speed << "x...";
+  g_main_loop_run(loop);
+  stop = true;
+  sender.join();
+  double replay_duration_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+  double cpu_percent = 100.0 * (process_cpu_time_us() - start_cpu_time_us) / (replay_duration_s * 1e6);
+  PlayoutState playout = adaptive_playout.getState();
+  gst_element_set_state(pipeline, GST_STATE_NULL);
+
+  int exit_code = 0;
+  std::cout << std::fixed << std::setprecision(1)
+            << "Replayed " << capture_duration_s << " seconds in " << replay_duration_s << " seconds, cpu: "
+            << cpu_percent << "%" << std::endl;
+  std::cout << "Jitterbuffer: latency " << playout.latency_ms << "ms, jitter " << playout.jitter_ms << "ms, "
+            << playout.late_packets << " late and " << playout.lost_packets << " lost of " << playout.packets
+            << " packets" << std::endl;
+  for (const auto& item : receivers) {
+    // The recording doesn't tell how many frames there were, but each frame ends with a packet with the marker bit.
+    uint64_t recorded_frames = 0;
+    reader.rewind();
+    while (reader.next(record)) {
+      if (record.stream == item.first && record.kind == RtpCaptureKind::Rtp && record.size > 1 &&
+          (record.data[1] & 0x80) != 0) {
+        recorded_frames++;
+      }
+    }
+    uint64_t decoded_frames = item.second->getDecodedFrames();
+    double decoded_percent = recorded_frames > 0 ? 100.0 * decoded_frames / recorded_frames : 0.0;
+    std::cout << "Stream " << item.first << ": decoded " << decoded_frames << " of " << recorded_frames
+              << " frames (" << decoded_percent << "%)" << std::endl;
+    item.second->reportDecodeLatency();
+    if (decoded_percent < expect_min_frames_percent) {
+      std::cout << "FAILED: stream " << item.first << " decoded fewer than " << expect_min_frames_percent
+                << "% of the frames" << std::endl;
+      exit_code = 1;
+    }
+  }
+
+  gst_object_unref(pipeline);
+  g_main_loop_unref(loop);
+  return exit_code;
+}
+
+
+}
+
+
+int main(int argc, char** argv) {
+    return snowrobot::main(argc, argv);
+}
@@ -1,4 +1,8 @@
+#include "../common/decoderbackend.h"
+#include "../common/fec.h"
 #include "../common/linebasedserver.h"
+#include "../common/playoutcontroller.h"
+#include "../common/requestdispatcher.h"
 #include "../common/gst_wrappers.h"
 
 #include <winsock2.h>
@@ -9,6 +13,8 @@
 #include <QTNetwork/QTcpSocket>
 
 #include <array>
+#include <atomic>
+#include <functional>
 #include <list>
 #include <string>
 #include <chrono>
@@ -131,10 +137,16 @@ class CameraView : public QFrame {
       }      
     }
 
+    // The wanted_fec_percentage is how much FEC protection we ask for if the server offers it, or -1 to take as much as
+    // the server offers.
     boost::json::object initialize(const std::string& server_host,
                GstBin* pipeline, GstElement* rtpbin,
+               FecReceiver& fec_receiver,
+               DecoderBackend decoder_backend,
+               const DecoderCapabilities& decoder_capabilities,
                const boost::json::object& camera,
-               int camera_index
+               int camera_index,
+               int wanted_fec_percentage
                )  {
       pipeline_ = pipeline;
       rtpbin_ = rtpbin;
@@ -159,6 +171,15 @@ class CameraView : public QFrame {
       for(const std::string& resolution: resolutions_) {
         resolutions_selector->addItem(QString::fromStdString(resolution));
       }
+      if (camera.contains("resolution")) {
+        this->setResolution(std::string(camera.at("resolution").as_string()));
+      }
+      // The signal is connected after the combobox has been filled, so only the user's choices are sent to the server.
+      QObject::connect(resolutions_selector, &QComboBox::currentTextChanged, this, [this](const QString& text) {
+        if (this->resolution_selected_func_) {
+          this->resolution_selected_func_(text.toStdString());
+        }
+      });
       layout->addWidget(resolutions_selector);
       video_widget = new QWidget();
       video_widget->setSizePolicy(QSizePolicy::Minimum, QSizePolicy::Minimum);
@@ -173,17 +194,21 @@ class CameraView : public QFrame {
 
       this->h264depay_ = gst_element_factory_make("rtph264depay", NULL);
       ASSERT_NOT_NULL(this->h264depay_);
+      // When a packet is lost the decoder can't show a correct picture until it gets a keyframe. Instead of showing a
+      // smeared picture until the next regular keyframe, we drop the broken frames and ask the server for a keyframe
+      // right away (rtpbin sends it as a PLI).
+      g_object_set(this->h264depay_, "wait-for-keyframe", TRUE, "request-keyframe", TRUE, NULL);
       ASSERT_TRUE(gst_bin_add(pipeline, this->h264depay_));
 
-      this->h264dec_ = gst_element_factory_make("avdec_h264", NULL);
-      ASSERT_NOT_NULL(this->h264dec_);
+      // The hardware decoders keep the frames in gpu memory, and the sink takes them from there, so a grid of cameras
+      // doesn't peg the laptop's cpu.
+      this->h264dec_ = createDecoder(decoder_backend, decoder_capabilities);
       ASSERT_TRUE(gst_bin_add(pipeline, this->h264dec_));
 
-      this->videosink_ = gst_element_factory_make("d3dvideosink", NULL);
-      ASSERT_NOT_NULL(this->videosink_);
+      this->videosink_ = createVideoSink(decoder_backend);
       ASSERT_TRUE(gst_bin_add(pipeline, this->videosink_));
 
-      video_rtp_udpsrc_ = gst_element_factory_make("udpsrc", "video_rtp_udpsrc_");
+      video_rtp_udpsrc_ = gst_element_factory_make("udpsrc", NULL);
       ASSERT_NOT_NULL(video_rtp_udpsrc_);
       // temp hack:
       global_video_rtp_udpsrc_hack = video_rtp_udpsrc_;
@@ -200,7 +225,7 @@ class CameraView : public QFrame {
       ASSERT_TRUE(gst_bin_add(pipeline, video_rtp_udpsrc_));
 
 
-      video_rtcp_udpsrc_ = gst_element_factory_make("udpsrc", "video_rtcp_udpsrc_");
+      video_rtcp_udpsrc_ = gst_element_factory_make("udpsrc", NULL);
       ASSERT_NOT_NULL(video_rtcp_udpsrc_);
       g_object_set(video_rtcp_udpsrc_, "port", 0, NULL );
       gst_element_set_state(video_rtcp_udpsrc_, GST_STATE_PAUSED);
@@ -210,7 +235,7 @@ class CameraView : public QFrame {
       ASSERT_TRUE(gst_bin_add(pipeline, video_rtcp_udpsrc_));
 
 
-      video_rtcp_udpsink_ = gst_element_factory_make("udpsink", "video_rtcp_udpsink_");
+      video_rtcp_udpsink_ = gst_element_factory_make("udpsink", NULL);
       g_object_set(video_rtcp_udpsink_, "host", server_host, NULL);
       g_object_set(video_rtcp_udpsink_, "port", video_rtcp_udpsrc_port, NULL);
       g_object_set(video_rtcp_udpsink_, "sync", false, NULL );
@@ -219,6 +244,14 @@ class CameraView : public QFrame {
 
 
     
+      // The FEC decoder is added when rtpbin creates the session, so it must be enabled before the pads are requested.
+      int fec_percentage = 0;
+      if (camera.contains("fec") && wanted_fec_percentage != 0) {
+        int max_fec_percentage = (int)camera.at("fec").as_object().at("max_percentage").as_int64();
+        fec_percentage = wanted_fec_percentage < 0 ? max_fec_percentage : std::min(wanted_fec_percentage, max_fec_percentage);
+        fec_receiver.enableSession(camera_index);
+      }
+
       std::string send_rtcp_src_pad_name = "send_rtcp_src_" + std::to_string(camera_index);
       ASSERT_TRUE(gst_element_link_pads(rtpbin, send_rtcp_src_pad_name.c_str(), video_rtcp_udpsink_, "sink"));
 
@@ -228,19 +261,45 @@ class CameraView : public QFrame {
       std::string recv_rtp_sink_pad_name = "recv_rtp_sink_" + std::to_string(camera_index);
       ASSERT_TRUE(gst_element_link_pads(video_rtp_udpsrc_, "src", rtpbin, recv_rtp_sink_pad_name.c_str()));
 
+      // The server adapts the video bitrate to our receiver reports, so send them every second instead of the
+      // default every five seconds.
+      GObject* session = nullptr;
+      g_signal_emit_by_name(rtpbin, "get-internal-session", (guint)camera_index, &session);
+      ASSERT_NOT_NULL(session);
+      g_object_set(session, "rtcp-min-interval", (guint64)GST_SECOND, NULL);
+      // The server can have several clients, and it tells our receiver reports apart from the others' by the ssrc.
+      guint rtcp_ssrc = 0;
+      g_object_get(session, "internal-ssrc", &rtcp_ssrc, NULL);
+      g_object_unref(session);
+
       //std::string recv_rtp_src_pad_name = "recv_rtp_src_" + std::to_string(camera_index);
       //ASSERT_TRUE(gst_element_link_pads(rtpbin, recv_rtp_src_pad_name.c_str(), this->h264depay_, "sink"));
 
       ASSERT_TRUE(gst_element_link(this->h264depay_, this->h264dec_));
       ASSERT_TRUE(gst_element_link(this->h264dec_, this->videosink_));
 
-      gst_video_overlay_set_window_handle((GstVideoOverlay*)this->videosink_, winId);
+      // The decoder sends new caps downstream when the first frame in the new resolution has been decoded, which is
+      // when a resolution switch is done as far as the user can see.
+      GstPad* h264dec_src_pad = gst_element_get_static_pad(this->h264dec_, "src");
+      ASSERT_NOT_NULL(h264dec_src_pad);
+      gst_pad_add_probe(h264dec_src_pad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, CameraView::decoderCapsProbe, this, NULL);
+      gst_object_unref(h264dec_src_pad);
+
+      if (GST_IS_VIDEO_OVERLAY(this->videosink_)) {
+        gst_video_overlay_set_window_handle((GstVideoOverlay*)this->videosink_, winId);
+      } else {
+        BOOST_LOG_TRIVIAL(warning) << "CameraView::initialize(): the video sink can't draw in our window, so the video is shown in a window of its own";
+      }
 
       boost::json::object response_msg;
       response_msg["name"] = camera_name;
       response_msg["camera_index"] = camera_index;
       response_msg["video_rtp_udpsrc_port"] = video_rtp_udpsrc_assigned_port;
       response_msg["video_rtcp_udpsrc_port"] = video_rtcp_udpsrc_assigned_port;
+      response_msg["rtcp_ssrc"] = rtcp_ssrc;
+      if (fec_percentage > 0) {
+        response_msg["fec_percentage"] = fec_percentage;
+      }
 
       g_signal_connect(rtpbin, "pad-added", G_CALLBACK(CameraView::pad_added_handler), this);
 
@@ -251,14 +310,79 @@ class CameraView : public QFrame {
       return resolutions_;
     }
 
+    // The func is called with the resolution the user picked in the combobox.
+    void setResolutionSelectedFunc(std::function<void(const std::string&)> func) {
+      resolution_selected_func_ = func;
+    }
+
+    // Remembers when we asked the server for another resolution, so we can log how long the switch took.
+    void startResolutionSwitch() {
+      resolution_switch_start_us_ = g_get_monotonic_time();
+    }
+
+    // Shows the resolution the server uses now, without sending it back to the server.
+    void setResolution(const std::string& resolution) {
+      QSignalBlocker blocker(resolutions_selector);
+      QString text = QString::fromStdString(resolution);
+      int index = resolutions_selector->findText(text);
+      if (index < 0) {
+        // The server's caps string can be written a bit differently from the ones in the resolutions list.
+        resolutions_selector->addItem(text);
+        index = resolutions_selector->count() - 1;
+      }
+      resolutions_selector->setCurrentIndex(index);
+    }
+
+    // Stops and removes this view's elements from the running pipeline. This is used when the camera is unplugged
+    // from the server.
+    void removeFromPipeline() {
+      g_signal_handlers_disconnect_by_data(this->rtpbin_, this);
+      std::vector<GstElement*> elements = {video_rtp_udpsrc_, video_rtcp_udpsrc_, h264depay_, h264dec_, videosink_, video_rtcp_udpsink_};
+      for (GstElement* element : elements) {
+        gst_element_set_state(element, GST_STATE_NULL);
+      }
+      for (const std::string& pad_name : {"recv_rtp_sink_" + std::to_string(camera_index_),
+                                          "recv_rtcp_sink_" + std::to_string(camera_index_),
+                                          "send_rtcp_src_" + std::to_string(camera_index_)}) {
+        GstPad* pad = gst_element_get_static_pad(this->rtpbin_, pad_name.c_str());
+        if (pad != nullptr) {
+          gst_element_release_request_pad(this->rtpbin_, pad);
+          gst_object_unref(pad);
+        }
+      }
+      for (GstElement* element : elements) {
+        gst_bin_remove(pipeline_, element);
+      }
+    }
+
     ~CameraView() {
     }
 
   private:
+    static GstPadProbeReturn decoderCapsProbe(GstPad* pad, GstPadProbeInfo* info, gpointer user_data) {
+      GstEvent* event = GST_PAD_PROBE_INFO_EVENT(info);
+      if (GST_EVENT_TYPE(event) != GST_EVENT_CAPS) {
+        return GST_PAD_PROBE_OK;
+      }
+      CameraView* camera_view = (CameraView*)user_data;
+      int64_t start_us = camera_view->resolution_switch_start_us_.exchange(0);
+      if (start_us != 0) {
+        GstCaps* caps = nullptr;
+        gst_event_parse_caps(event, &caps);
+        BOOST_LOG_TRIVIAL(info) << "CameraView: the resolution switch of '" << camera_view->camera_name << "' took "
+                                << (g_get_monotonic_time() - start_us) / 1000 << "ms. The decoder now outputs "
+                                << string_from_gchar(gst_caps_to_string(caps));
+      }
+      return GST_PAD_PROBE_OK;
+    }
+
     std::string camera_name;
     int camera_index_;
     QComboBox* resolutions_selector;
     std::list<std::string> resolutions_;
+    std::function<void(const std::string&)> resolution_selected_func_;
+    // The g_get_monotonic_time() when we asked for another resolution, or 0. The decoder's streaming thread reads it.
+    std::atomic<int64_t> resolution_switch_start_us_ = 0;
     QWidget* video_widget;
     GstBin* pipeline_ = nullptr;
 
@@ -273,6 +397,135 @@ class CameraView : public QFrame {
 };
 
 
+// Plays the audio from one of the server's microphones. The audio is received through the same rtpbin as the video,
+// which uses the server's rtcp sender reports to play the audio and video in sync.
+class AudioPlayer {
+  public:
+    static void pad_added_handler(GstElement *element, GstPad *pad, gpointer data) {
+      std::string pad_name = string_from_gchar(gst_pad_get_name(pad));
+      AudioPlayer* audio_player = (AudioPlayer*)data;
+      std::string prefix = "recv_rtp_src_" + std::to_string(audio_player->session_index_) + "_";
+      if (pad_name.find(prefix) == 0) {
+        GstPad* sink_pad = gst_element_get_static_pad(audio_player->opusdepay_, "sink");
+        ASSERT_NOT_NULL(sink_pad);
+        GstPadLinkReturn link_result = gst_pad_link(pad, sink_pad);
+        gst_object_unref(sink_pad);
+        if (link_result != GST_PAD_LINK_OK) {
+          THROW_RUNTIME_ERROR("Failed to link the new pad!");
+        }
+      }
+    }
+
+    // Returns the part of the welcome-response that tells the server where to send the audio.
+    boost::json::object initialize(const std::string& server_host,
+                                   GstBin* pipeline, GstElement* rtpbin,
+                                   const boost::json::object& microphone,
+                                   int session_index) {
+      pipeline_ = pipeline;
+      rtpbin_ = rtpbin;
+      session_index_ = session_index;
+      microphone_name_ = std::string(microphone.at("name").as_string());
+      int64_t audio_rtcp_udpsrc_port = microphone.at("audio_rtcp_udpsrc_port").as_int64();
+
+      audio_rtp_udpsrc_ = gst_element_factory_make("udpsrc", NULL);
+      ASSERT_NOT_NULL(audio_rtp_udpsrc_);
+      g_object_set(audio_rtp_udpsrc_, "port", 0, NULL);
+      auto audio_rtp_udpsrc_caps = make_GstCaps_ptr(gst_caps_from_string("application/x-rtp,media=(string)audio,clock-rate=(int)48000,encoding-name=(string)OPUS"));
+      g_object_set(audio_rtp_udpsrc_, "caps", audio_rtp_udpsrc_caps.get(), NULL);
+      gst_element_set_state(audio_rtp_udpsrc_, GST_STATE_PAUSED);
+      gint audio_rtp_udpsrc_assigned_port;
+      g_object_get(audio_rtp_udpsrc_, "port", &audio_rtp_udpsrc_assigned_port, NULL);
+      ASSERT_TRUE(gst_bin_add(pipeline, audio_rtp_udpsrc_));
+
+      audio_rtcp_udpsrc_ = gst_element_factory_make("udpsrc", NULL);
+      ASSERT_NOT_NULL(audio_rtcp_udpsrc_);
+      g_object_set(audio_rtcp_udpsrc_, "port", 0, NULL);
+      gst_element_set_state(audio_rtcp_udpsrc_, GST_STATE_PAUSED);
+      gint audio_rtcp_udpsrc_assigned_port;
+      g_object_get(audio_rtcp_udpsrc_, "port", &audio_rtcp_udpsrc_assigned_port, NULL);
+      ASSERT_TRUE(gst_bin_add(pipeline, audio_rtcp_udpsrc_));
+
+      audio_rtcp_udpsink_ = gst_element_factory_make("udpsink", NULL);
+      ASSERT_NOT_NULL(audio_rtcp_udpsink_);
+      g_object_set(audio_rtcp_udpsink_, "host", server_host.c_str(), NULL);
+      g_object_set(audio_rtcp_udpsink_, "port", (gint)audio_rtcp_udpsrc_port, NULL);
+      g_object_set(audio_rtcp_udpsink_, "sync", FALSE, NULL);
+      g_object_set(audio_rtcp_udpsink_, "async", FALSE, NULL);
+      ASSERT_TRUE(gst_bin_add(pipeline, audio_rtcp_udpsink_));
+
+      opusdepay_ = gst_element_factory_make("rtpopusdepay", NULL);
+      ASSERT_NOT_NULL(opusdepay_);
+      opusdec_ = gst_element_factory_make("opusdec", NULL);
+      ASSERT_NOT_NULL(opusdec_);
+      // A lost packet is covered up with the decoder's packet loss concealment instead of a click.
+      g_object_set(opusdec_, "plc", TRUE, NULL);
+      audioconvert_ = gst_element_factory_make("audioconvert", NULL);
+      ASSERT_NOT_NULL(audioconvert_);
+      audioresample_ = gst_element_factory_make("audioresample", NULL);
+      ASSERT_NOT_NULL(audioresample_);
+      audiosink_ = gst_element_factory_make("autoaudiosink", NULL);
+      ASSERT_NOT_NULL(audiosink_);
+      for (GstElement* element : {opusdepay_, opusdec_, audioconvert_, audioresample_, audiosink_}) {
+        ASSERT_TRUE(gst_bin_add(pipeline, element));
+      }
+      ASSERT_TRUE(gst_element_link_many(opusdepay_, opusdec_, audioconvert_, audioresample_, audiosink_, NULL));
+
+      std::string send_rtcp_src_pad_name = "send_rtcp_src_" + std::to_string(session_index);
+      ASSERT_TRUE(gst_element_link_pads(rtpbin, send_rtcp_src_pad_name.c_str(), audio_rtcp_udpsink_, "sink"));
+      std::string recv_rtcp_sink_pad_name = "recv_rtcp_sink_" + std::to_string(session_index);
+      ASSERT_TRUE(gst_element_link_pads(audio_rtcp_udpsrc_, "src", rtpbin, recv_rtcp_sink_pad_name.c_str()));
+      std::string recv_rtp_sink_pad_name = "recv_rtp_sink_" + std::to_string(session_index);
+      ASSERT_TRUE(gst_element_link_pads(audio_rtp_udpsrc_, "src", rtpbin, recv_rtp_sink_pad_name.c_str()));
+
+      g_signal_connect(rtpbin, "pad-added", G_CALLBACK(AudioPlayer::pad_added_handler), this);
+
+      boost::json::object response_msg;
+      response_msg["name"] = microphone_name_;
+      response_msg["audio_rtp_udpsrc_port"] = audio_rtp_udpsrc_assigned_port;
+      response_msg["audio_rtcp_udpsrc_port"] = audio_rtcp_udpsrc_assigned_port;
+      return response_msg;
+    }
+
+    // Stops and removes the player's elements from the running pipeline. This is used when the microphone is
+    // unplugged from the server.
+    void removeFromPipeline() {
+      g_signal_handlers_disconnect_by_data(this->rtpbin_, this);
+      std::vector<GstElement*> elements = {audio_rtp_udpsrc_, audio_rtcp_udpsrc_, opusdepay_, opusdec_, audioconvert_,
+                                           audioresample_, audiosink_, audio_rtcp_udpsink_};
+      for (GstElement* element : elements) {
+        gst_element_set_state(element, GST_STATE_NULL);
+      }
+      for (const std::string& pad_name : {"recv_rtp_sink_" + std::to_string(session_index_),
+                                          "recv_rtcp_sink_" + std::to_string(session_index_),
+                                          "send_rtcp_src_" + std::to_string(session_index_)}) {
+        GstPad* pad = gst_element_get_static_pad(this->rtpbin_, pad_name.c_str());
+        if (pad != nullptr) {
+          gst_element_release_request_pad(this->rtpbin_, pad);
+          gst_object_unref(pad);
+        }
+      }
+      for (GstElement* element : elements) {
+        gst_bin_remove(pipeline_, element);
+      }
+    }
+
+  private:
+    std::string microphone_name_;
+    int session_index_ = -1;
+    GstBin* pipeline_ = nullptr;
+    GstElement* rtpbin_ = nullptr;
+
+    GstElement* audio_rtp_udpsrc_ = nullptr;
+    GstElement* audio_rtcp_udpsrc_ = nullptr;
+    GstElement* audio_rtcp_udpsink_ = nullptr;
+    GstElement* opusdepay_ = nullptr;
+    GstElement* opusdec_ = nullptr;
+    GstElement* audioconvert_ = nullptr;
+    GstElement* audioresample_ = nullptr;
+    GstElement* audiosink_ = nullptr;
+};
+
+
 int main(int argc, char** argv)
 {
   gst_init(NULL, NULL);
@@ -306,16 +559,30 @@ int main(int argc, char** argv)
   BOOST_LOG_TRIVIAL(info) << "Created gstreamer pipeline.";
 
   int debug_port_nr;
+  int fec_percentage;
+  bool no_audio = false;
   std::string server_host;
+  std::string decoder_backend_name;
+  PlayoutSettings playout_settings;
   boost::program_options::options_description desc("Allowed options");
   desc.add_options()
     ("debug-port", boost::program_options::value<int>(&debug_port_nr)->default_value(12346), "debug port")
     ("server-host", boost::program_options::value<std::string>(&server_host)->default_value("localhost"), "server-host")
+    ("fec-percentage", boost::program_options::value<int>(&fec_percentage)->default_value(-1), "the forward error correction to ask the server for, in percent of the video packets (-1 takes what the server offers, 0 disables it)")
+    ("no-audio", boost::program_options::bool_switch(&no_audio), "don't play the audio from the server's microphones")
+    ("min-latency", boost::program_options::value<int>(&playout_settings.min_latency_ms)->default_value(playout_settings.min_latency_ms), "the lowest jitterbuffer latency (ms) the adaptive playout will use")
+    ("start-latency", boost::program_options::value<int>(&playout_settings.start_latency_ms)->default_value(playout_settings.start_latency_ms), "the jitterbuffer latency (ms) to start out with")
+    ("max-latency", boost::program_options::value<int>(&playout_settings.max_latency_ms)->default_value(playout_settings.max_latency_ms), "the highest jitterbuffer latency (ms) the adaptive playout will use")
+    ("decoder", boost::program_options::value<std::string>(&decoder_backend_name)->default_value("auto"), "the h264 decoder to use: auto, software, d3d11, vaapi, nvdec or v4l2")
   ;
   boost::program_options::variables_map vm;
   boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
   boost::program_options::notify(vm);  
 
+  DecoderCapabilities decoder_capabilities = DecoderCapabilities::probe();
+  DecoderBackend decoder_backend = chooseDecoderBackend(decoderBackendFromString(decoder_backend_name), decoder_capabilities);
+  BOOST_LOG_TRIVIAL(info) << "Using the '" << to_string(decoder_backend) << "' h264 decoder";
+
   QApplication app{argc, argv};
 
   QMainWindow main_window;
@@ -343,6 +610,12 @@ int main(int argc, char** argv)
   std::map<std::string, // camera name
            CameraView*  // camera view
            > camera_views;
+  std::map<std::string, // microphone name
+           std::unique_ptr<AudioPlayer>
+           > audio_players;
+  int next_session_index = 0;  // the rtp-session index of the next CameraView or AudioPlayer
+  std::unique_ptr<FecReceiver> fec_receiver;
+  std::unique_ptr<AdaptivePlayout> adaptive_playout;
 
 
 
@@ -419,6 +692,7 @@ int main(int argc, char** argv)
 
       BOOST_LOG_TRIVIAL(info) << "Calling gst_pipeline_new()...";
       pipeline = gst_pipeline_new(NULL);
+      next_session_index = 0;
 
       GstBus* bus = gst_element_get_bus((GstElement*)pipeline);
       g_signal_connect (bus, "message::error", G_CALLBACK (cb_error), pipeline);
@@ -433,9 +707,15 @@ int main(int argc, char** argv)
       ASSERT_NOT_NULL(rtpbin);
       BOOST_LOG_TRIVIAL(info) << "rtpbin:" << rtpbin;
 
-      g_object_set (rtpbin, "latency", 200, "do-retransmission", TRUE,
+      g_object_set (rtpbin, "do-retransmission", TRUE,
           "rtp-profile", GST_RTP_PROFILE_AVPF, NULL);
 
+      // The jitterbuffer latency follows the jitter of the link, see PlayoutController.
+      adaptive_playout = std::make_unique<AdaptivePlayout>(rtpbin, playout_settings);
+
+      // The packets are kept for as long as the jitterbuffer can wait for them.
+      fec_receiver = std::make_unique<FecReceiver>(rtpbin, (GstClockTime)playout_settings.max_latency_ms * GST_MSECOND);
+
       BOOST_LOG_TRIVIAL(info) << "Calling gst_bin_add_many()...";
       gst_bin_add_many(GST_BIN_CAST(pipeline),
         rtpbin,
@@ -459,7 +739,10 @@ int main(int argc, char** argv)
         delete camera_view;
       }
       camera_views.clear();
+      audio_players.clear();
 
+      fec_receiver.reset();
+      adaptive_playout.reset();
       gst_object_unref(pipeline);
       pipeline = nullptr;
       rtpbin = nullptr;
@@ -472,6 +755,110 @@ int main(int argc, char** argv)
       }
      });
 
+  // Asks the server to switch the camera to another resolution. The server answers with a resolution-changed
+  // message. This must be called on the main window's thread, since it uses the server_socket.
+  auto requestResolution = [&](const std::string& camera_name, const std::string& resolution) {
+    auto find = camera_views.find(camera_name);
+    if (find == camera_views.end()) {
+      THROW_RUNTIME_ERROR("Unknown camera name: '" << camera_name << "'");
+    }
+    find->second->startResolutionSwitch();
+    boost::json::object request;
+    request["type"] = "select-resolution";
+    request["camera"] = camera_name;
+    request["resolution"] = resolution;
+    std::string request_str = boost::json::serialize(request) + "\n";
+    BOOST_LOG_TRIVIAL(info) << "Asking the server to switch '" << camera_name << "' to '" << resolution << "'";
+    if (server_socket->write(request_str.data(), request_str.size()) < 0) {
+      THROW_RUNTIME_ERROR("Failed to send the select-resolution request to the server.");
+    }
+  };
+
+  // Creates a CameraView for each of the cameras and an AudioPlayer for each of the microphones that we don't already
+  // have, adds them to the pipeline, and tells the server where to send the video and audio. The is_update is true for
+  // the devices that are plugged in after we connected.
+  auto addDevices = [&](const boost::json::array& cameras, const boost::json::array& microphones, bool is_update) {
+    boost::json::array camera_responses;
+    for (const boost::json::value& item : cameras) {
+      const boost::json::object& camera = item.as_object();
+      std::string camera_name(camera.at("name").as_string());
+      auto find = camera_views.find(camera_name);
+      if (find == camera_views.end()) {
+        CameraView* new_camera_view = new CameraView();
+        boost::json::object camera_response_msg = new_camera_view->initialize(
+          server_host,
+          GST_BIN_CAST(pipeline),
+          rtpbin,
+          *fec_receiver,
+          decoder_backend,
+          decoder_capabilities,
+          camera,
+          next_session_index++,
+          fec_percentage);
+        camera_responses.push_back(std::move(camera_response_msg));
+        new_camera_view->setResolutionSelectedFunc([&, camera_name](const std::string& resolution) {
+          try {
+            requestResolution(camera_name, resolution);
+          }
+          catch (const std::exception& e) {
+            BOOST_LOG_TRIVIAL(error) << e.what();
+            showStatusBarMessage(e.what());
+          }
+        });
+        camera_views_layout->addWidget(new_camera_view);
+        camera_views[camera_name] = new_camera_view;
+
+      }
+    }
+    boost::json::array microphone_responses;
+    for (const boost::json::value& item : microphones) {
+      const boost::json::object& microphone = item.as_object();
+      std::string microphone_name(microphone.at("name").as_string());
+      if (no_audio || audio_players.count(microphone_name) > 0) {
+        continue;
+      }
+      auto audio_player = std::make_unique<AudioPlayer>();
+      microphone_responses.push_back(audio_player->initialize(
+        server_host,
+        GST_BIN_CAST(pipeline),
+        rtpbin,
+        microphone,
+        next_session_index++));
+      audio_players[microphone_name] = std::move(audio_player);
+    }
+    if (camera_views.size() > 0) {
+      std::ostringstream msg;
+      msg << "Got " << camera_views.size() << " cameras from the server.";
+      BOOST_LOG_TRIVIAL(info) << msg.str();
+      showStatusBarMessage(msg.str());
+    }
+
+    BOOST_LOG_TRIVIAL(info) << "Calling gst_debug_bin_to_dot_file()";
+    GST_DEBUG_BIN_TO_DOT_FILE((GstBin*)pipeline, GST_DEBUG_GRAPH_SHOW_MEDIA_TYPE, "client.dot");
+    BOOST_LOG_TRIVIAL(info) << "gst_debug_bin_to_dot_file() finished ok";
+
+    GstStateChangeReturn result = gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    BOOST_LOG_TRIVIAL(info) << "Started the gstreamer pipeline. result:" << result;
+    if (result == GST_STATE_CHANGE_FAILURE) {
+      throw std::runtime_error("Failed to start the gstreamer pipeline!");
+    }
+
+    if (is_update && camera_responses.empty() && microphone_responses.empty()) {
+      // We already had the device.
+      return;
+    }
+    boost::json::object response;
+    response["type"] = "welcome-response";
+    response["cameras"] = std::move(camera_responses);
+    response["microphones"] = std::move(microphone_responses);
+    std::string response_str = boost::json::serialize(response) + "\n";
+    auto bytes_written = server_socket->write(response_str.data(), response_str.size());
+    if (bytes_written < 0) {
+      BOOST_LOG_TRIVIAL(info) << "Failed to reply to the server's welcome message.";
+      server_socket->close();
+    }
+  };
+
   main_window.connect(server_socket, &QTcpSocket::readyRead, &main_window, [&]() {
       while (server_socket->canReadLine()) {
         QByteArray response = server_socket->readLine();
@@ -495,52 +882,80 @@ int main(int argc, char** argv)
             if (response_type == "cameras") {
               const boost::json::array& cameras = response_obj.at("cameras").as_array();
               BOOST_LOG_TRIVIAL(info) << "Got " << cameras.size() << " cameras from the server";
+              // Older servers don't send any microphones.
+              boost::json::array microphones;
+              if (response_obj.contains("microphones")) {
+                microphones = response_obj.at("microphones").as_array();
+              }
+              addDevices(cameras, microphones, false);
+
+            } else if (response_type == "camera-added") {
+              // A camera was plugged in on the server. It is added to our running pipeline like the others.
+              boost::json::array cameras;
+              cameras.push_back(response_obj.at("camera"));
+              addDevices(cameras, boost::json::array(), true);
+
+            } else if (response_type == "camera-removed") {
+              std::string camera_name(response_obj.at("name").as_string());
+              std::lock_guard guard(camera_views_lock);
+              auto find = camera_views.find(camera_name);
+              if (find != camera_views.end()) {
+                CameraView* camera_view = find->second;
+                camera_view->removeFromPipeline();
+                camera_views_layout->removeWidget(camera_view);
+                delete camera_view;
+                camera_views.erase(find);
+              }
+              std::ostringstream msg;
+              msg << "The camera '" << camera_name << "' was removed from the server.";
+              BOOST_LOG_TRIVIAL(info) << msg.str();
+              showStatusBarMessage(msg.str());
+
+            } else if (response_type == "microphone-added") {
+              boost::json::array microphones;
+              microphones.push_back(response_obj.at("microphone"));
+              addDevices(boost::json::array(), microphones, true);
+
+            } else if (response_type == "microphone-removed") {
+              std::string microphone_name(response_obj.at("name").as_string());
+              auto find = audio_players.find(microphone_name);
+              if (find != audio_players.end()) {
+                find->second->removeFromPipeline();
+                audio_players.erase(find);
+              }
+              BOOST_LOG_TRIVIAL(info) << "The microphone '" << microphone_name << "' was removed from the server.";
 
-              int camera_index = 0;
-              boost::json::array camera_responses;
-              for (const boost::json::value& item : cameras) {
-                const boost::json::object& camera = item.as_object();
-                std::string camera_name(camera.at("name").as_string());
+            } else if (response_type == "resolution-changed") {
+              // This is sent to all the clients when the operator has picked another resolution, and just to the
+              // operator if the server couldn't use it.
+              std::string camera_name(response_obj.at("camera").as_string());
+              std::ostringstream msg;
+              if (response_obj.contains("error")) {
+                msg << "The server couldn't change the resolution of '" << camera_name << "': " << response_obj.at("error").as_string();
+                BOOST_LOG_TRIVIAL(error) << msg.str();
+              } else {
+                std::string resolution(response_obj.at("resolution").as_string());
                 auto find = camera_views.find(camera_name);
-                if (find == camera_views.end()) {
-                  CameraView* new_camera_view = new CameraView();
-                  boost::json::object camera_response_msg = new_camera_view->initialize(
-                    server_host,
-                    GST_BIN_CAST(pipeline),
-                    rtpbin,
-                    camera,
-                    camera_index);
-                  camera_responses.push_back(std::move(camera_response_msg));
-                  camera_views_layout->addWidget(new_camera_view);
-                  camera_views[camera_name] = new_camera_view;
-
+                if (find != camera_views.end()) {
+                  find->second->setResolution(resolution);
                 }
-              }
-              if (camera_views.size() > 0) {
-                std::ostringstream msg;
-                msg << "Got " << camera_views.size() << " cameras from the server.";
+                msg << "The camera '" << camera_name << "' now uses " << resolution;
                 BOOST_LOG_TRIVIAL(info) << msg.str();
-                showStatusBarMessage(msg.str());
               }
+              showStatusBarMessage(msg.str());
 
-              BOOST_LOG_TRIVIAL(info) << "Calling gst_debug_bin_to_dot_file()";
-              GST_DEBUG_BIN_TO_DOT_FILE((GstBin*)pipeline, GST_DEBUG_GRAPH_SHOW_MEDIA_TYPE, "client.dot");
-              BOOST_LOG_TRIVIAL(info) << "gst_debug_bin_to_dot_file() finished ok";
-
-              GstStateChangeReturn result = gst_element_set_state(pipeline, GST_STATE_PLAYING);
-              BOOST_LOG_TRIVIAL(info) << "Started the gstreamer pipeline. result:" << result;
-              if (result == GST_STATE_CHANGE_FAILURE) {
-                throw std::runtime_error("Failed to start the gstreamer pipeline!");
-              }
-
-              boost::json::object response;
-              response["type"] = "welcome-response";
-              response["cameras"] = std::move(camera_responses);
-              std::string response_str = boost::json::serialize(response) + "\n";
-              auto bytes_written = server_socket->write(response_str.data(), response_str.size());
-              if (bytes_written < 0) {
-                BOOST_LOG_TRIVIAL(info) << "Failed to reply to the server's welcome message.";
-                server_socket->close();
+            } else if (response_type == "pipeline-state") {
+              // The server attaches us to its pipeline in the background, and sends this when it is done.
+              std::string state(response_obj.at("state").as_string());
+              std::ostringstream msg;
+              if (state == "error") {
+                msg << "The server failed to start the video: " << response_obj.at("error").as_string();
+                BOOST_LOG_TRIVIAL(error) << msg.str();
+                showStatusBarMessage(msg.str(), 0);
+              } else {
+                msg << "The server's pipeline is " << state << ".";
+                BOOST_LOG_TRIVIAL(info) << msg.str();
+                showStatusBarMessage(msg.str());
               }
 
             } else {
@@ -563,10 +978,86 @@ int main(int argc, char** argv)
 
   server_socket_connect_timer->singleShot(100, connectToServer);
 
+  // Adapts the jitterbuffer latency once a second while we are connected.
+  QTimer* playout_timer = new QTimer(&main_window);
+  main_window.connect(playout_timer, &QTimer::timeout, &main_window, [&]() {
+    if (adaptive_playout) {
+      adaptive_playout->update();
+    }
+  });
+  playout_timer->start(1000);
+
 
 
   boost::asio::io_context ctx;
 
+  // The debug port's requests, which the ci-tests use to look at and control the client.
+  auto debug_dispatcher = makeRequestDispatcher<std::string>(
+    onText<"ping">([](boost::asio::ip::tcp::socket& sock) {
+      return std::string("pong");
+    }),
+
+    onText<"is connected to server">([&](boost::asio::ip::tcp::socket& sock) {
+      return std::string(isConnectedToServer() ? "true" : "false");
+    }),
+
+    // The jitterbuffer latency the adaptive playout uses now, and what it is based on.
+    onText<"get playout">([&](boost::asio::ip::tcp::socket& sock) {
+      boost::json::object playout;
+      QMetaObject::invokeMethod(&main_window, [&]() {
+          if (adaptive_playout) {
+            PlayoutState state = adaptive_playout->getState();
+            playout["latency_ms"] = state.latency_ms;
+            playout["jitter_ms"] = state.jitter_ms;
+            playout["packets"] = state.packets;
+            playout["late_packets"] = state.late_packets;
+            playout["lost_packets"] = state.lost_packets;
+          }
+        },
+        getConnectionTypeToUse()
+        );
+      return boost::json::serialize(playout);
+    }),
+
+    onText<"get cameras">([&](boost::asio::ip::tcp::socket& sock) {
+      boost::json::array camera_list;
+      std::lock_guard guard(camera_views_lock);
+      for(const auto& item : camera_views) {
+        boost::json::object camera;
+        camera["name"] = item.first;
+        CameraView* camera_view = item.second; 
+        boost::json::array resolutions;
+        for(const std::string& resolution : camera_view->getResolutions()) {
+          resolutions.emplace_back(resolution);
+        }
+        camera["resolutions"] = std::move(resolutions);
+        camera_list.push_back(std::move(camera));
+      }
+      return boost::json::serialize(camera_list);
+    }),
+
+    onJson<"select_camera">([&](const boost::json::object& request_obj, boost::asio::ip::tcp::socket& sock) {
+      std::string camera_name(request_obj.at("camera").as_string());
+      std::string resolution(request_obj.at("resolution").as_string());
+      // The server_socket belongs to the main window's thread, and the exception can't be thrown through Qt.
+      std::string error;
+      QMetaObject::invokeMethod(&main_window, [&]() {
+          try {
+            std::lock_guard guard(camera_views_lock);
+            requestResolution(camera_name, resolution);
+          }
+          catch (const std::exception& e) {
+            error = e.what();
+          }
+        },
+        getConnectionTypeToUse()
+        );
+      if (!error.empty()) {
+        throw std::runtime_error(error);
+      }
+      return std::string("ok");
+    }));
+
   std::shared_ptr<LineBasedServer> debug_port;
   if (debug_port_nr > 0) {
     BOOST_LOG_TRIVIAL(info) << "client starting debug listen port at " << debug_port_nr;
@@ -589,56 +1080,15 @@ int main(int argc, char** argv)
       showStatusBarMessage(msg.str());
      },
  
-     [&](boost::asio::ip::tcp::socket& sock, const std::string& request) {
+     [&](boost::asio::ip::tcp::socket& sock, std::string_view request) {
       BOOST_LOG_TRIVIAL(info) << "Got a debug port message from '" << sock.remote_endpoint() << "': " << request;
-      std::string response;
-      if (request == "ping") {
-        response = "pong";
-
-      } else if (request == "is connected to server") {
-        if (isConnectedToServer()) {
-          response = "true";
-        } else {
-          response = "false";
-        }
-
-      } else if (request == "get cameras") {
-        boost::json::array camera_list;
-        std::lock_guard guard(camera_views_lock);
-        for(const auto& item : camera_views) {
-          boost::json::object camera;
-          camera["name"] = item.first;
-          CameraView* camera_view = item.second; 
-          boost::json::array resolutions;
-          for(const std::string& resolution : camera_view->getResolutions()) {
-            resolutions.emplace_back(resolution);
-          }
-          camera["resolutions"] = std::move(resolutions);
-          camera_list.push_back(std::move(camera));
-        }
-        response = boost::json::serialize(camera_list);
-
-      } else {
-        try {
-          boost::json::object request_obj = boost::json::parse(request).as_object();
-          std::string request_type(request_obj.at("type").as_string());
-          if (request_type == "select_camera") {
-            std::string camera_name(request_obj.at("camera").as_string());
-            std::string resolution(request_obj.at("resolution").as_string());
-            response = "ok";
-          } else {
-            std::ostringstream msg;
-            msg << "Unknown request type: '" << request_type << "'";
-            throw std::runtime_error(msg.str());
-          }
-
-        } catch(const std::exception& e) {
-          std::ostringstream msg;
-          msg << "ERROR: Got this error: '" << e.what() << "' while trying to handle the request '" << request << "'";
-          response = msg.str();
-        }
+      try {
+        return debug_dispatcher.dispatch(request, sock);
+      } catch(const std::exception& e) {
+        std::ostringstream msg;
+        msg << "ERROR: Got this error: '" << e.what() << "' while trying to handle the request '" << request << "'";
+        return msg.str();
       }
-      return response;
     }
     
     );
@@ -0,0 +1,215 @@
+#include "controlchannel.h"
+
+#include <array>
+
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/log/trivial.hpp>
+
+
+namespace snowrobot {
+
+
+uint64_t unix_time_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+
+// Returns true if sequence number a comes after b. The sequence numbers wrap around, so this uses the same trick as
+// rtp does for its sequence numbers.
+static bool is_newer(uint32_t a, uint32_t b) {
+  return (int32_t)(a - b) > 0;
+}
+
+
+ControlChannelServer::ControlChannelServer(boost::asio::io_context& ctx,
+                                           boost::asio::ip::port_type port_nr,
+                                           std::chrono::milliseconds deadman_timeout,
+                                           DriveCommandFunc drive_command_func)
+  : strand_(boost::asio::make_strand(ctx)),
+    socket_(strand_, boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(), port_nr)),
+    deadman_timer_(strand_),
+    deadman_timeout_(deadman_timeout),
+    drive_command_func_(drive_command_func)
+{
+  this->deadman_timer_.expires_at(std::chrono::steady_clock::time_point::max());
+  auto log_exception = [](std::exception_ptr eptr) {
+    try {
+      if (eptr) {
+        std::rethrow_exception(eptr);
+      }
+    }
+    catch(const std::exception& e) {
+      BOOST_LOG_TRIVIAL(error) << "ControlChannelServer: a coroutine failed: " << e.what();
+    }
+  };
+  boost::asio::co_spawn(this->strand_, this->receive(), log_exception);
+  boost::asio::co_spawn(this->strand_, this->deadman(), log_exception);
+  BOOST_LOG_TRIVIAL(info) << "ControlChannelServer::ControlChannelServer(): listening on udp port " << this->getPort()
+                          << " with a deadman timeout of " << deadman_timeout.count() << "ms";
+}
+
+
+boost::asio::ip::port_type ControlChannelServer::getPort() const {
+  return this->socket_.local_endpoint().port();
+}
+
+
+void ControlChannelServer::setOperator(const boost::asio::ip::udp::endpoint& endpoint) {
+  boost::asio::dispatch(this->strand_, [this, endpoint] {
+    BOOST_LOG_TRIVIAL(info) << "ControlChannelServer::setOperator(): accepting drive commands from " << endpoint;
+    this->operator_endpoint_ = endpoint;
+    this->last_sequence_nr_.reset();
+  });
+}
+
+
+void ControlChannelServer::clearOperator() {
+  boost::asio::dispatch(this->strand_, [this] {
+    BOOST_LOG_TRIVIAL(info) << "ControlChannelServer::clearOperator(): no longer accepting drive commands";
+    this->operator_endpoint_.reset();
+    this->last_sequence_nr_.reset();
+    this->stopMotors("the operator is gone");
+  });
+}
+
+
+ControlChannelOwnership::ControlChannelOwnership(ControlChannelServer& server) : server_(server) {
+}
+
+
+bool ControlChannelOwnership::claim(const std::string& client_id, const boost::asio::ip::udp::endpoint& endpoint) {
+  if (!this->owner_.empty()) {
+    return this->owner_ == client_id;
+  }
+  this->server_.setOperator(endpoint);
+  this->owner_ = client_id;
+  return true;
+}
+
+
+void ControlChannelOwnership::release(const std::string& client_id) {
+  if (this->owner_.empty() || this->owner_ != client_id) {
+    return;
+  }
+  this->server_.clearOperator();
+  this->owner_.clear();
+}
+
+
+void ControlChannelServer::stopMotors(const char* reason) {
+  if (this->stopped_) {
+    return;
+  }
+  BOOST_LOG_TRIVIAL(info) << "ControlChannelServer: stopping the motors, since " << reason;
+  this->stopped_ = true;
+  this->deadman_timer_.expires_at(std::chrono::steady_clock::time_point::max());
+  this->drive_command_func_(DrivePayload{this->last_sequence_nr_.value_or(0), 0, 0, unix_time_us()});
+}
+
+
+boost::asio::awaitable<void> ControlChannelServer::receive() {
+  std::array<uint8_t, Message::header_size + 64> datagram;
+  boost::asio::ip::udp::endpoint sender;
+  Message message;
+  for (;;) {
+    boost::system::error_code ec;
+    size_t size = co_await this->socket_.async_receive_from(
+        boost::asio::buffer(datagram), sender, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    if (ec == boost::asio::error::operation_aborted || !this->socket_.is_open()) {
+      // The socket was closed, so the server is going away.
+      co_return;
+    }
+    if (ec) {
+      // A datagram that was too big for the buffer, or an ICMP port unreachable that Windows reports on the next
+      // receive. Neither should stop the drive commands.
+      BOOST_LOG_TRIVIAL(debug) << "ControlChannelServer::receive(): " << ec.message();
+      this->stats_.rejected++;
+      continue;
+    }
+    if (!this->operator_endpoint_ || sender != *this->operator_endpoint_) {
+      this->stats_.rejected++;
+      continue;
+    }
+    try {
+      if (Message::decode(std::span<const uint8_t>(datagram.data(), size), message) != size ||
+          message.getType() != MessageType::Drive) {
+        this->stats_.rejected++;
+        continue;
+      }
+      DrivePayload command = message.as<DrivePayload>();
+      if (this->last_sequence_nr_ && !is_newer(command.sequence_nr, *this->last_sequence_nr_)) {
+        // A late or duplicated datagram. We have already applied a newer command.
+        this->stats_.stale++;
+        continue;
+      }
+      this->last_sequence_nr_ = command.sequence_nr;
+      this->stats_.applied++;
+      this->stopped_ = false;
+      // Restarting the timer wakes up the deadman() coroutine, which then waits for the new expiry time.
+      this->deadman_timer_.expires_after(this->deadman_timeout_);
+      this->drive_command_func_(command);
+    }
+    catch(const std::exception& e) {
+      BOOST_LOG_TRIVIAL(info) << "ControlChannelServer::receive(): got an invalid datagram from " << sender << ": " << e.what();
+      this->stats_.rejected++;
+    }
+  }
+}
+
+
+boost::asio::awaitable<void> ControlChannelServer::deadman() {
+  for (;;) {
+    boost::system::error_code ec;
+    co_await this->deadman_timer_.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    if (ec == boost::asio::error::operation_aborted) {
+      // The timer was restarted by a fresh command.
+      continue;
+    }
+    if (!this->stopped_) {
+      this->stats_.deadman_stops++;
+      this->stopMotors("no fresh drive command arrived within the deadman timeout");
+    }
+    this->deadman_timer_.expires_at(std::chrono::steady_clock::time_point::max());
+  }
+}
+
+
+ControlChannelClient::ControlChannelClient(boost::asio::io_context& ctx,
+                                           const boost::asio::ip::udp::endpoint& server_endpoint)
+  : socket_(ctx, boost::asio::ip::udp::endpoint(server_endpoint.protocol(), 0)),
+    server_endpoint_(server_endpoint)
+{
+  this->send_buffer_.reserve(Message::header_size + DrivePayload::encoded_size);
+}
+
+
+boost::asio::ip::port_type ControlChannelClient::getLocalPort() const {
+  return this->socket_.local_endpoint().port();
+}
+
+
+DrivePayload ControlChannelClient::makeCommand(int16_t steering, int16_t throttle) {
+  return DrivePayload{this->next_sequence_nr_++, steering, throttle, unix_time_us()};
+}
+
+
+DrivePayload ControlChannelClient::send(int16_t steering, int16_t throttle) {
+  DrivePayload command = this->makeCommand(steering, throttle);
+  this->send_buffer_.clear();
+  Message::encode(command, this->send_buffer_);
+  this->socket_.send_to(boost::asio::buffer(this->send_buffer_), this->server_endpoint_);
+  return command;
+}
+
+
+DrivePayload ControlChannelClient::skip(int16_t steering, int16_t throttle) {
+  return this->makeCommand(steering, throttle);
+}
+
+
+}
@@ -0,0 +1,145 @@
+#ifndef SNOWROBOT_REMOTECONTROL_COMMON_CONTROLCHANNEL_H
+#define SNOWROBOT_REMOTECONTROL_COMMON_CONTROLCHANNEL_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+
+#include "network.h"
+
+
+namespace snowrobot {
+
+
+// Returns the current wallclock time in microseconds since the unix epoch. This is what the drive commands are
+// timestamped with.
+uint64_t unix_time_us();
+
+
+using DriveCommandFunc = std::function<
+  void
+  (
+    const DrivePayload&  // the command to apply to the motors. All zeros means stop.
+  )>;
+
+
+// The server side of the udp control channel. The movement commands are sent as Drive messages (see network.h), one
+// per datagram, instead of via the tcp command port. A lost datagram doesn't hold back the later ones like a lost tcp
+// segment does, and since each command contains the full stick position we don't need the lost ones anyway.
+//
+// Only the latest command matters: a datagram with an older sequence number than the last applied one is discarded.
+// If no fresh command arrives within the deadman timeout, the motors are stopped by applying an all-zero command.
+// Only the operator's datagrams are accepted, see setOperator().
+//
+// Everything runs on a strand of its own, so the io_context can be run by several threads. The drive_command_func is
+// called on that strand.
+class ControlChannelServer {
+  public:
+    // If port_nr is 0 a free port is picked, see getPort().
+    ControlChannelServer(boost::asio::io_context& ctx,
+                         boost::asio::ip::port_type port_nr,
+                         std::chrono::milliseconds deadman_timeout,
+                         DriveCommandFunc drive_command_func);
+
+    boost::asio::ip::port_type getPort() const;
+
+    // Starts accepting commands from the endpoint. This resets the sequence numbering, since the new operator starts
+    // its own sequence. This and clearOperator() can be called from any thread.
+    void setOperator(const boost::asio::ip::udp::endpoint& endpoint);
+
+    // Stops accepting commands and stops the motors right away. This is called when the operator disconnects.
+    void clearOperator();
+
+    struct Stats {
+      uint64_t applied = 0;       // fresh commands that were applied
+      uint64_t stale = 0;         // commands that were older than the last applied one
+      uint64_t rejected = 0;      // datagrams from somebody else than the operator, that weren't Drive messages, or
+                                  // that failed to be received
+      uint64_t deadman_stops = 0; // how many times the deadman stopped the motors
+    };
+    // These must be called on the strand (for example from the drive_command_func), or when the io_context isn't
+    // running.
+    const Stats& getStats() const { return stats_; }
+    // Returns true if the motors are stopped because there is no operator or the deadman has tripped.
+    bool isStopped() const { return stopped_; }
+
+  private:
+    boost::asio::awaitable<void> receive();
+    boost::asio::awaitable<void> deadman();
+    void stopMotors(const char* reason);
+
+    boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+    boost::asio::ip::udp::socket socket_;
+    boost::asio::steady_timer deadman_timer_;
+    std::chrono::milliseconds deadman_timeout_;
+    DriveCommandFunc drive_command_func_;
+
+    std::optional<boost::asio::ip::udp::endpoint> operator_endpoint_;
+    std::optional<uint32_t> last_sequence_nr_;
+    bool stopped_ = true;
+    Stats stats_;
+};
+
+
+// Keeps track of which command-port client is the operator. The first client that asks for the control channel gets
+// it, and keeps it until its connection is lost, whichever way that happens. The clients are known by an id that the
+// caller picks, like the client's remote endpoint as it was when the client connected. This isn't thread safe, it is
+// meant to be used on the app strand.
+class ControlChannelOwnership {
+  public:
+    explicit ControlChannelOwnership(ControlChannelServer& server);
+
+    // Makes the client the operator, with its drive commands coming from the endpoint, unless somebody else already is.
+    // Returns true if the client is the operator now.
+    bool claim(const std::string& client_id, const boost::asio::ip::udp::endpoint& endpoint);
+
+    // Stops accepting the client's drive commands if it is the operator, so that the next client can claim the channel.
+    // This is called when the client's connection is lost.
+    void release(const std::string& client_id);
+
+    // The id of the operator, or an empty string if there is none.
+    const std::string& getOwner() const { return owner_; }
+
+  private:
+    ControlChannelServer& server_;
+    std::string owner_;
+};
+
+
+// The client side of the udp control channel.
+class ControlChannelClient {
+  public:
+    ControlChannelClient(boost::asio::io_context& ctx, const boost::asio::ip::udp::endpoint& server_endpoint);
+
+    // The local port the commands are sent from. The server needs this to know which datagrams are ours, so it is sent
+    // in the welcome-response message.
+    boost::asio::ip::port_type getLocalPort() const;
+
+    // Sends a command with the next sequence number and the current time. Returns the command that was sent.
+    DrivePayload send(int16_t steering, int16_t throttle);
+
+    // Like send(), except that the command isn't actually sent. This is used to simulate packet loss in the tests.
+    DrivePayload skip(int16_t steering, int16_t throttle);
+
+  private:
+    DrivePayload makeCommand(int16_t steering, int16_t throttle);
+
+    boost::asio::ip::udp::socket socket_;
+    boost::asio::ip::udp::endpoint server_endpoint_;
+    uint32_t next_sequence_nr_ = 1;
+    std::vector<uint8_t> send_buffer_;
+};
+
+
+}
+
+#endif
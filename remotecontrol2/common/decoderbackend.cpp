@@ -0,0 +1,153 @@
+#include "decoderbackend.h"
+#include "gst_wrappers.h"
+
+#include <sstream>
+#include <vector>
+
+#include <boost/log/trivial.hpp>
+
+
+namespace snowrobot {
+
+
+std::string to_string(DecoderBackend backend) {
+  switch (backend) {
+    case DecoderBackend::Auto: return "auto";
+    case DecoderBackend::Software: return "software";
+    case DecoderBackend::D3D11: return "d3d11";
+    case DecoderBackend::VaApi: return "vaapi";
+    case DecoderBackend::NvDec: return "nvdec";
+    case DecoderBackend::V4l2M2m: return "v4l2";
+  }
+  return "unknown";
+}
+
+
+DecoderBackend decoderBackendFromString(const std::string& name) {
+  for (DecoderBackend backend : {DecoderBackend::Auto, DecoderBackend::Software, DecoderBackend::D3D11,
+                                 DecoderBackend::VaApi, DecoderBackend::NvDec, DecoderBackend::V4l2M2m}) {
+    if (to_string(backend) == name) {
+      return backend;
+    }
+  }
+  std::ostringstream msg;
+  msg << "Unknown decoder backend '" << name << "'. Valid values are auto, software, d3d11, vaapi, nvdec and v4l2.";
+  throw std::runtime_error(msg.str());
+}
+
+
+static bool element_factory_exists(const char* factory_name) {
+  GstElementFactory* factory = gst_element_factory_find(factory_name);
+  if (factory == nullptr) {
+    return false;
+  }
+  gst_object_unref(factory);
+  return true;
+}
+
+
+DecoderCapabilities DecoderCapabilities::probe() {
+  DecoderCapabilities capabilities;
+  capabilities.has_avdec_h264 = element_factory_exists("avdec_h264");
+  capabilities.has_d3d11h264dec = element_factory_exists("d3d11h264dec");
+  capabilities.has_vah264dec = element_factory_exists("vah264dec");
+  capabilities.has_vaapih264dec = element_factory_exists("vaapih264dec");
+  capabilities.has_nvh264dec = element_factory_exists("nvh264dec");
+  capabilities.has_v4l2slh264dec = element_factory_exists("v4l2slh264dec");
+  capabilities.has_v4l2h264dec = element_factory_exists("v4l2h264dec");
+  return capabilities;
+}
+
+
+DecoderBackend chooseDecoderBackend(DecoderBackend requested, const DecoderCapabilities& capabilities) {
+  auto is_available = [&](DecoderBackend backend) {
+    switch (backend) {
+      case DecoderBackend::Software: return capabilities.has_avdec_h264;
+      case DecoderBackend::D3D11: return capabilities.has_d3d11h264dec;
+      case DecoderBackend::VaApi: return capabilities.has_vah264dec || capabilities.has_vaapih264dec;
+      case DecoderBackend::NvDec: return capabilities.has_nvh264dec;
+      case DecoderBackend::V4l2M2m: return capabilities.has_v4l2slh264dec || capabilities.has_v4l2h264dec;
+      default: return false;
+    }
+  };
+
+  if (requested != DecoderBackend::Auto) {
+    if (is_available(requested)) {
+      return requested;
+    }
+    BOOST_LOG_TRIVIAL(warning) << "chooseDecoderBackend(): the '" << to_string(requested)
+                               << "' decoder backend isn't available, so I'll use the best available one instead.";
+  }
+
+  for (DecoderBackend backend : {DecoderBackend::D3D11, DecoderBackend::VaApi, DecoderBackend::NvDec,
+                                 DecoderBackend::V4l2M2m, DecoderBackend::Software}) {
+    if (is_available(backend)) {
+      return backend;
+    }
+  }
+  throw std::runtime_error("chooseDecoderBackend(): no h264 decoder is available!");
+}
+
+
+GstElement* createDecoder(DecoderBackend backend, const DecoderCapabilities& capabilities) {
+  const char* factory_name = nullptr;
+  switch (backend) {
+    case DecoderBackend::Software:
+      factory_name = "avdec_h264";
+      break;
+    case DecoderBackend::D3D11:
+      factory_name = "d3d11h264dec";
+      break;
+    case DecoderBackend::VaApi:
+      // The va plugin replaces the older gstreamer-vaapi plugin.
+      factory_name = capabilities.has_vah264dec ? "vah264dec" : "vaapih264dec";
+      break;
+    case DecoderBackend::NvDec:
+      factory_name = "nvh264dec";
+      break;
+    case DecoderBackend::V4l2M2m:
+      // The stateless decoders (like the one on the Raspberry Pi 5) have their own element.
+      factory_name = capabilities.has_v4l2slh264dec ? "v4l2slh264dec" : "v4l2h264dec";
+      break;
+    default:
+      THROW_RUNTIME_ERROR("createDecoder() called with the backend " << to_string(backend));
+  }
+  GstElement* decoder = gst_element_factory_make(factory_name, NULL);
+  ASSERT_NOT_NULL(decoder);
+  return decoder;
+}
+
+
+GstElement* createVideoSink(DecoderBackend backend) {
+  // The first sink that exists is used. The d3d11videosink takes both the d3d11 textures and system memory, and
+  // converts the colours in a shader. The glimagesink imports the VA and V4L2 dmabufs and the NVDEC gl textures.
+  std::vector<const char*> candidates;
+  switch (backend) {
+    case DecoderBackend::D3D11:
+      candidates = {"d3d11videosink"};
+      break;
+    case DecoderBackend::VaApi:
+    case DecoderBackend::NvDec:
+    case DecoderBackend::V4l2M2m:
+      candidates = {"glimagesink"};
+      break;
+    default:
+      candidates = {"d3d11videosink", "glimagesink", "d3dvideosink"};
+      break;
+  }
+  for (const char* factory_name : candidates) {
+    if (element_factory_exists(factory_name)) {
+      GstElement* videosink = gst_element_factory_make(factory_name, NULL);
+      ASSERT_NOT_NULL(videosink);
+      return videosink;
+    }
+  }
+  BOOST_LOG_TRIVIAL(warning) << "createVideoSink(): none of the preferred video sinks are available for the '"
+                             << to_string(backend) << "' decoder, so I'll use autovideosink.";
+  GstElement* videosink = gst_element_factory_make("autovideosink", NULL);
+  ASSERT_NOT_NULL(videosink);
+  return videosink;
+}
+
+
+}
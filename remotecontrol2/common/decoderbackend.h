@@ -0,0 +1,72 @@
+#ifndef SNOWROBOT_REMOTECONTROL_COMMON_DECODERBACKEND_H
+#define SNOWROBOT_REMOTECONTROL_COMMON_DECODERBACKEND_H
+
+#include <string>
+
+#include <gst/gst.h>
+
+
+namespace snowrobot {
+
+
+// The different ways the receivers can decode the h264 stream. This is the decoding side of the server's
+// EncoderBackend.
+enum class DecoderBackend {
+  // Use the best decoder that is available.
+  Auto,
+
+  // Software decoding with avdec_h264. This always works, but it uses a lot of cpu with several cameras.
+  Software,
+
+  // Direct3D 11 (d3d11h264dec) on Windows. The decoded frames stay in gpu memory all the way to the d3d11videosink.
+  D3D11,
+
+  // VA-API (vah264dec, or the older vaapih264dec) on Linux with an Intel or AMD gpu.
+  VaApi,
+
+  // NVDEC (nvh264dec) on a NVIDIA gpu.
+  NvDec,
+
+  // A V4L2 memory-to-memory hardware decoder (v4l2slh264dec or v4l2h264dec), like the one on the Raspberry Pi.
+  V4l2M2m,
+};
+
+std::string to_string(DecoderBackend backend);
+
+// Throws a std::runtime_error if the name is unknown.
+DecoderBackend decoderBackendFromString(const std::string& name);
+
+
+// Which decoder elements the gstreamer registry has. The hardware decoder plugins only register their elements if
+// they find a device that can decode h264, so this also tells us if there is any hardware.
+struct DecoderCapabilities {
+  bool has_avdec_h264 = false;
+  bool has_d3d11h264dec = false;
+  bool has_vah264dec = false;
+  bool has_vaapih264dec = false;
+  bool has_nvh264dec = false;
+  bool has_v4l2slh264dec = false;
+  bool has_v4l2h264dec = false;
+
+  static DecoderCapabilities probe();
+};
+
+
+// Returns the backend to use. If the requested backend isn't available we fall back to the best one that is, in the
+// order D3D11, VaApi, NvDec, V4l2M2m, Software. Throws a std::runtime_error if there is no h264 decoder at all.
+DecoderBackend chooseDecoderBackend(DecoderBackend requested, const DecoderCapabilities& capabilities);
+
+
+// Creates the decoder element for the backend.
+GstElement* createDecoder(DecoderBackend backend, const DecoderCapabilities& capabilities);
+
+// Creates the video sink that takes the backend's decoded frames as they are. The hardware decoders hand their frames
+// to the sink in gpu memory (or as dmabufs), and the sinks convert the colours on the gpu, so there is no videoconvert
+// and no copy through the cpu. The software decoder's I420 frames are uploaded once and converted by the sink too.
+// All the sinks implement GstVideoOverlay, except for the autovideosink that is used if none of them are available.
+GstElement* createVideoSink(DecoderBackend backend);
+
+
+}
+
+#endif
@@ -0,0 +1,109 @@
+#include "fec.h"
+#include "gst_wrappers.h"
+
+#include <boost/log/trivial.hpp>
+
+
+namespace snowrobot {
+
+
+GstElement* createFecEncoder(int percentage) {
+  GstElement* encoder = gst_element_factory_make("rtpulpfecenc", NULL);
+  ASSERT_NOT_NULL(encoder);
+  // With multipacket the FEC packets protect all the packets of a frame together, which is what we want for video,
+  // where a frame is usually split over several packets.
+  g_object_set(encoder,
+               "pt", (guint)ulpfec_payload_type,
+               "percentage", (guint)percentage,
+               "multipacket", TRUE,
+               NULL);
+  return encoder;
+}
+
+
+FecReceiver::FecReceiver(GstElement* rtpbin, GstClockTime storage_time)
+  : rtpbin_((GstElement*)gst_object_ref(rtpbin)),
+    storage_time_(storage_time)
+{
+  // The decoder only tries to rebuild a packet when the jitterbuffer tells it that the packet is lost.
+  g_object_set(rtpbin, "do-lost", TRUE, NULL);
+  this->new_storage_handler_ = g_signal_connect(rtpbin, "new-storage", G_CALLBACK(FecReceiver::onNewStorage), this);
+  this->request_fec_decoder_handler_ = g_signal_connect(rtpbin, "request-fec-decoder",
+                                                        G_CALLBACK(FecReceiver::onRequestFecDecoder), this);
+}
+
+
+FecReceiver::~FecReceiver() {
+  g_signal_handler_disconnect(this->rtpbin_, this->new_storage_handler_);
+  g_signal_handler_disconnect(this->rtpbin_, this->request_fec_decoder_handler_);
+  for (GstElement* decoder : this->decoders_) {
+    gst_object_unref(decoder);
+  }
+  gst_object_unref(this->rtpbin_);
+}
+
+
+void FecReceiver::enableSession(guint session) {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  this->sessions_.insert(session);
+}
+
+
+guint FecReceiver::getRecoveredPacketCount() const {
+  return this->sumDecoderProperty("recovered");
+}
+
+
+guint FecReceiver::getUnrecoveredPacketCount() const {
+  return this->sumDecoderProperty("unrecovered");
+}
+
+
+guint FecReceiver::sumDecoderProperty(const char* name) const {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  guint sum = 0;
+  for (GstElement* decoder : this->decoders_) {
+    guint value = 0;
+    g_object_get(decoder, name, &value, NULL);
+    sum += value;
+  }
+  return sum;
+}
+
+
+void FecReceiver::onNewStorage(GstElement* rtpbin, GstElement* storage, guint session, gpointer user_data) {
+  FecReceiver* self = (FecReceiver*)user_data;
+  // The storage keeps nothing by default. The packets must be kept for as long as the jitterbuffer waits for a lost
+  // packet, since that is when the decoder may need them.
+  g_object_set(storage, "size-time", (guint64)self->storage_time_, NULL);
+}
+
+
+GstElement* FecReceiver::onRequestFecDecoder(GstElement* rtpbin, guint session, gpointer user_data) {
+  FecReceiver* self = (FecReceiver*)user_data;
+  {
+    std::lock_guard<std::mutex> guard(self->lock_);
+    if (self->sessions_.count(session) == 0) {
+      return nullptr;
+    }
+  }
+  GObject* storage = nullptr;
+  g_signal_emit_by_name(rtpbin, "get-storage", session, &storage);
+  if (storage == nullptr) {
+    BOOST_LOG_TRIVIAL(error) << "FecReceiver: rtpbin has no storage for session " << session << ", so FEC is disabled";
+    return nullptr;
+  }
+  GstElement* decoder = gst_element_factory_make("rtpulpfecdec", NULL);
+  ASSERT_NOT_NULL(decoder);
+  g_object_set(decoder, "pt", (guint)ulpfec_payload_type, "storage", storage, NULL);
+  g_object_unref(storage);
+  {
+    std::lock_guard<std::mutex> guard(self->lock_);
+    self->decoders_.push_back((GstElement*)gst_object_ref(decoder));
+  }
+  BOOST_LOG_TRIVIAL(info) << "FecReceiver: added a ULPFEC decoder to session " << session;
+  return decoder;
+}
+
+
+}
@@ -0,0 +1,66 @@
+#ifndef SNOWROBOT_REMOTECONTROL_COMMON_FEC_H
+#define SNOWROBOT_REMOTECONTROL_COMMON_FEC_H
+
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include <gst/gst.h>
+
+
+namespace snowrobot {
+
+
+// Forward error correction for the rtp video streams, with ULPFEC (RFC 5109). The server adds FEC packets to the rtp
+// stream it sends to a client, and the client can rebuild a lost packet from them without waiting a round trip for a
+// retransmission. The FEC packets are sent in the same rtp stream as the video, with their own payload type.
+//
+// The server offers FEC for each camera in the cameras message ("fec": {"type": "ulpfec", "pt": 122,
+// "max_percentage": 20}), and each client asks for the protection it wants in its welcome-response ("fec_percentage").
+
+constexpr int ulpfec_payload_type = 122;
+
+
+// Creates an rtpulpfecenc that adds FEC packets for the given percentage of the rtp packets.
+GstElement* createFecEncoder(int percentage);
+
+
+// Makes a receiver's rtpbin rebuild the lost rtp packets from the FEC packets. The rtpbin keeps the received packets
+// for storage_time so that the decoder can use them, and the jitterbuffer tells the decoder which packets it gave up
+// on. The sessions that get FEC are added with enableSession() before the rtpbin's session is created (that is, before
+// its pads are requested).
+class FecReceiver {
+  public:
+    FecReceiver(GstElement* rtpbin, GstClockTime storage_time);
+    ~FecReceiver();
+
+    FecReceiver(const FecReceiver&) = delete;
+    FecReceiver& operator=(const FecReceiver&) = delete;
+
+    void enableSession(guint session);
+
+    // Returns the number of lost packets the decoders have rebuilt, and the number they couldn't rebuild.
+    guint getRecoveredPacketCount() const;
+    guint getUnrecoveredPacketCount() const;
+
+  private:
+    static void onNewStorage(GstElement* rtpbin, GstElement* storage, guint session, gpointer user_data);
+    static GstElement* onRequestFecDecoder(GstElement* rtpbin, guint session, gpointer user_data);
+
+    GstElement* rtpbin_;
+    GstClockTime storage_time_;
+    gulong new_storage_handler_ = 0;
+    gulong request_fec_decoder_handler_ = 0;
+
+    guint sumDecoderProperty(const char* name) const;
+
+    // The signals are emitted on the gstreamer threads.
+    mutable std::mutex lock_;
+    std::set<guint> sessions_;
+    std::vector<GstElement*> decoders_;  // we hold a reference to each
+};
+
+
+}
+
+#endif
@@ -4,6 +4,8 @@
 
 
 #include <memory>
+#include <sstream>
+#include <stdexcept>
 #include <string>
 #include <type_traits>
 #include <utility>
@@ -18,27 +20,27 @@ namespace snowrobot {
 // This file contains some c++ wrappers that make the gstreamer c api slightly less annoying to work with, by
 // automatic freeing of resources with std::unique_ptr.
 
-std::string string_from_gchar(gchar* gchar_ptr) {
+inline std::string string_from_gchar(gchar* gchar_ptr) {
   std::string result(gchar_ptr);
   g_free(gchar_ptr);
   return result;
 }
 
-auto freeGList = [](GList* the_list) {g_list_free(the_list);};
+inline auto freeGList = [](GList* the_list) {g_list_free(the_list);};
 using GList_ptr = std::unique_ptr<GList, decltype(freeGList)>;
-GList_ptr make_GList_ptr(GList* the_list) {
+inline GList_ptr make_GList_ptr(GList* the_list) {
   return GList_ptr(the_list, freeGList);
 }
 
-auto unrefGstCaps = [](GstCaps* the_caps) {gst_caps_unref(the_caps);};
+inline auto unrefGstCaps = [](GstCaps* the_caps) {gst_caps_unref(the_caps);};
 using GstCaps_ptr = std::unique_ptr<GstCaps, decltype(unrefGstCaps)>;
-GstCaps_ptr make_GstCaps_ptr(GstCaps* the_caps) {
+inline GstCaps_ptr make_GstCaps_ptr(GstCaps* the_caps) {
   return GstCaps_ptr(the_caps, unrefGstCaps);
 }
 
-auto unrefGstElement = [](GstElement* obj) {gst_object_unref(obj);};
+inline auto unrefGstElement = [](GstElement* obj) {gst_object_unref(obj);};
 using GstElement_ptr = std::unique_ptr<GstElement, decltype(unrefGstElement)>;
-GstElement_ptr make_GstElement_ptr(GstElement* obj) {
+inline GstElement_ptr make_GstElement_ptr(GstElement* obj) {
   return GstElement_ptr(obj, unrefGstElement);
 }
 
@@ -96,12 +98,12 @@ Fn* function_pointer(Callable&& c)
     return function_pointer_<N>(std::forward<Callable>(c), (Fn*)nullptr);
 }
 
-auto stopAndFreeMonitor = [](GstDeviceMonitor* monitor) {
+inline auto stopAndFreeMonitor = [](GstDeviceMonitor* monitor) {
   gst_device_monitor_stop(monitor);
   gst_object_unref(monitor);
 };
 using GstDeviceMonitor_ptr = std::unique_ptr<GstDeviceMonitor, decltype(stopAndFreeMonitor)>;
-GstDeviceMonitor_ptr make_GstDeviceMonitor_ptr(GstDeviceMonitor* monitor) {
+inline GstDeviceMonitor_ptr make_GstDeviceMonitor_ptr(GstDeviceMonitor* monitor) {
   return GstDeviceMonitor_ptr(monitor, stopAndFreeMonitor);
 }
 
@@ -1,18 +1,88 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <exception>
 #include <iostream>
+#include <boost/asio/steady_timer.hpp>
 #include "linebasedserver.h"
 
 namespace snowrobot {
 
 
+// The line delimiter, which is written after each response with a gather-write instead of being appended to it.
+static const char newline = '\n';
+
+// The receive buffer of a line-based connection starts out with this size, and is doubled when a line doesn't fit, up
+// to max_line_size.
+static constexpr size_t initial_receive_buffer_size = 4096;
+static constexpr size_t max_line_size = 1024 * 1024;
+
+// How many requests each connection can have in progress before the server stops reading from it, and how many bytes
+// of responses can wait to be written.
+static constexpr size_t max_requests_in_flight = 64;
+static constexpr size_t max_pending_write_size = 256 * 1024;
+
+// How many of the write and request buffers each connection keeps for reuse. A connection that has all its requests in
+// flight uses one buffer for each.
+static constexpr size_t max_free_buffers = max_requests_in_flight + 8;
+
+// asio sends at most 16 buffers with each writev(), so a longer gather-write would go out as several small sends, and
+// Nagle's algorithm would hold back each one after the first until the client's delayed ack. Longer gather-writes are
+// copied into one buffer instead.
+static constexpr size_t max_gather_buffers = 16;
+
+
+// Wraps the plain callbacks in coroutines, so that the server only has to deal with one kind of callbacks.
+static AsyncRequestReceivedFunc make_async(RequestReceivedFunc func) {
+  return [func](boost::asio::ip::tcp::socket& sock, std::string_view request) -> boost::asio::awaitable<std::string> {
+    co_return func(sock, request);
+  };
+}
+
+static AsyncMessageReceivedFunc make_async(MessageReceivedFunc func) {
+  if (!func) {
+    return nullptr;
+  }
+  return [func](boost::asio::ip::tcp::socket& sock, const Message& message, std::vector<uint8_t>& response) -> boost::asio::awaitable<void> {
+    func(sock, message, response);
+    co_return;
+  };
+}
+
+
 LineBasedServer::LineBasedServer(boost::asio::io_context& ctx, boost::asio::ip::port_type admin_port_nr,
                 ConnectionMadeFunc connection_made_func,
                 ConnectionLostFunc connection_lost_func,
-                RequestReceivedFunc response_func
-) : connection_made_func_(connection_made_func),
+                RequestReceivedFunc response_func,
+                MessageReceivedFunc message_received_func,
+                boost::asio::any_io_executor app_executor
+) : LineBasedServer(ctx, admin_port_nr, connection_made_func, connection_lost_func,
+                    make_async(response_func), make_async(message_received_func), app_executor)
+{
+}
+
+
+LineBasedServer::LineBasedServer(boost::asio::io_context& ctx, boost::asio::ip::port_type admin_port_nr,
+                ConnectionMadeFunc connection_made_func,
+                ConnectionLostFunc connection_lost_func,
+                AsyncRequestReceivedFunc response_func,
+                AsyncMessageReceivedFunc message_received_func,
+                boost::asio::any_io_executor app_executor
+) : acceptor_(ctx, {boost::asio::ip::tcp::v4(), admin_port_nr}, false),
+    app_executor_(app_executor ? app_executor : boost::asio::any_io_executor(boost::asio::make_strand(ctx))),
+    connection_made_func_(connection_made_func),
     connection_lost_func_(connection_lost_func),
-    response_func_(response_func)
+    response_func_(response_func),
+    message_received_func_(message_received_func)
 {
-  boost::asio::co_spawn(ctx, this->listen(ctx, admin_port_nr), [](std::exception_ptr eptr)
+#ifdef _WIN32
+  typedef boost::asio::detail::socket_option::boolean<BOOST_ASIO_OS_DEF(SOL_SOCKET), SO_EXCLUSIVEADDRUSE> excluse_address;
+  this->acceptor_.set_option(excluse_address(true));
+#else
+  this->acceptor_.set_option(boost::asio::socket_base::reuse_address(false));
+#endif
+
+  boost::asio::co_spawn(ctx, this->listen(ctx), [](std::exception_ptr eptr)
   {
     try
     {
@@ -28,23 +98,215 @@ LineBasedServer::LineBasedServer(boost::asio::io_context& ctx, boost::asio::ip::
 }
 
 
-boost::asio::awaitable<void> LineBasedServer::listen(boost::asio::io_context& ctx, boost::asio::ip::port_type admin_port_nr)
+boost::asio::ip::port_type LineBasedServer::getPort() const {
+  return this->acceptor_.local_endpoint().port();
+}
+
+
+void LineBasedServer::setTimeout(std::chrono::steady_clock::duration timeout) {
+  this->timeout_ = timeout;
+}
+
+
+// The state of one client connection. Everything except the socket is only touched on the connection's strand.
+struct LineBasedServer::Connection {
+  explicit Connection(boost::asio::ip::tcp::socket sock) : sock(std::move(sock)), wakeup(this->sock.get_executor()) {}
+
+  boost::asio::ip::tcp::socket sock;
+  // We don't know which protocol the client uses until it has sent its first byte. The broadcasts that arrive before
+  // that are kept in early_broadcasts, and are framed and sent when we know.
+  bool protocol_known = false;
+  bool binary = false;
+  std::vector<std::string> early_broadcasts;
+  // True while a coroutine is writing to the socket. The writes that arrive in the meantime are queued in pending, and
+  // are sent by the coroutine that is writing. It starts out as true, so that nothing is sent before the welcome
+  // message.
+  bool writing = true;
+  std::deque<std::vector<uint8_t>> pending;
+  size_t pending_size = 0;
+  // The buffers of the writes that have been sent, which are reused for the next ones.
+  std::vector<std::vector<uint8_t>> free_buffers;
+
+  // The requests that are being handled or wait to be, and the requests without an id in the order they arrived.
+  size_t requests_in_flight = 0;
+  std::deque<std::vector<uint8_t>> ordered_requests;
+  bool handling_ordered_requests = false;
+  // The first exception from a request's callback. It closes the connection.
+  std::exception_ptr failure;
+  // Set when the connection is done, so that the requests still in flight don't start any more writes.
+  bool closed = false;
+
+  // The reader waits on this timer when the connection has no room for more requests, and handle_connection() waits
+  // on it for the last requests to finish. It is cancelled by notify() whenever a request finishes or a write is done.
+  boost::asio::steady_timer wakeup;
+  bool notified = false;
+
+  void notify() {
+    this->notified = true;
+    this->wakeup.cancel();
+  }
+
+  // Waits until notify() is called. Other cancellations, like the watchdog's, are thrown as usual.
+  boost::asio::awaitable<void> waitForNotify() {
+    this->notified = false;
+    this->wakeup.expires_at(std::chrono::steady_clock::time_point::max());
+    try {
+      co_await this->wakeup.async_wait(boost::asio::use_awaitable);
+    }
+    catch(const boost::system::system_error&) {
+      if (!this->notified) {
+        throw;
+      }
+    }
+  }
+
+  bool hasRoom() const {
+    return this->requests_in_flight < max_requests_in_flight && this->pending_size <= max_pending_write_size;
+  }
+
+  void fail(std::exception_ptr eptr) {
+    if (!this->failure) {
+      this->failure = eptr;
+    }
+    // Stops the reader. The error is rethrown by handle_requests().
+    boost::system::error_code ec;
+    this->sock.cancel(ec);
+    this->notify();
+  }
+
+  std::vector<uint8_t> takeBuffer() {
+    if (this->free_buffers.empty()) {
+      return {};
+    }
+    std::vector<uint8_t> buffer = std::move(this->free_buffers.back());
+    this->free_buffers.pop_back();
+    buffer.clear();
+    return buffer;
+  }
+
+  void returnBuffer(std::vector<uint8_t>&& buffer) {
+    if (this->free_buffers.size() < max_free_buffers) {
+      this->free_buffers.push_back(std::move(buffer));
+    }
+  }
+};
+
+
+boost::asio::awaitable<void> LineBasedServer::writeText(Connection& connection, std::string_view text) {
+  if (connection.binary) {
+    std::vector<uint8_t> data = connection.takeBuffer();
+    Message::encodeText(text, data);
+    co_await this->write(connection, boost::asio::buffer(data));
+    connection.returnBuffer(std::move(data));
+  } else {
+    std::array<boost::asio::const_buffer, 2> buffers{boost::asio::buffer(text), boost::asio::buffer(&newline, 1)};
+    co_await this->write(connection, buffers);
+  }
+}
+
+
+void LineBasedServer::broadcast(const std::string& text) {
+  std::vector<std::shared_ptr<Connection>> connections;
+  {
+    std::lock_guard<std::mutex> guard(this->connections_lock_);
+    connections.assign(this->connections_.begin(), this->connections_.end());
+  }
+  // All the connections share one copy of the text.
+  auto shared_text = std::make_shared<const std::string>(text);
+  for (std::shared_ptr<Connection>& connection : connections) {
+    boost::asio::co_spawn(
+      connection->sock.get_executor(),
+      [this, connection, shared_text]() -> boost::asio::awaitable<void> {
+        if (!connection->protocol_known) {
+          connection->early_broadcasts.push_back(*shared_text);
+          co_return;
+        }
+        co_await this->writeText(*connection, *shared_text);
+      },
+      [](std::exception_ptr eptr) {
+        try {
+          if (eptr) {
+            std::rethrow_exception(eptr);
+          }
+        }
+        catch(const std::exception& e) {
+          // The connection is going away, and handle_connection() will notice that too.
+          BOOST_LOG_TRIVIAL(info) << "LineBasedServer::broadcast() failed to write to a connection: " << e.what();
+        }
+      });
+  }
+}
+
+
+boost::asio::awaitable<void> LineBasedServer::write(Connection& connection, boost::asio::const_buffer data)
 {
-  
-  boost::asio::ip::tcp::acceptor acceptor(ctx, {boost::asio::ip::tcp::v4(), admin_port_nr}, false);
-#ifdef _WIN32
-  typedef boost::asio::detail::socket_option::boolean<BOOST_ASIO_OS_DEF(SOL_SOCKET), SO_EXCLUSIVEADDRUSE> excluse_address;
-  acceptor.set_option(excluse_address(true));
-#else
-  acceptor.set_option(boost::asio::socket_base::reuse_address(false));
-#endif
+  co_await this->write(connection, std::span<const boost::asio::const_buffer>(&data, 1));
+}
 
+
+boost::asio::awaitable<void> LineBasedServer::write(Connection& connection,
+                                                    std::span<const boost::asio::const_buffer> buffers)
+{
+  if (connection.closed) {
+    throw boost::system::system_error(boost::asio::error::operation_aborted);
+  }
+  if (connection.writing || buffers.size() > max_gather_buffers) {
+    std::vector<uint8_t> data = connection.takeBuffer();
+    for (const boost::asio::const_buffer& buffer : buffers) {
+      const uint8_t* bytes = (const uint8_t*)buffer.data();
+      data.insert(data.end(), bytes, bytes + buffer.size());
+    }
+    connection.pending_size += data.size();
+    connection.pending.push_back(std::move(data));
+    if (connection.writing) {
+      co_return;
+    }
+  } else {
+    connection.writing = true;
+    co_await boost::asio::async_write(connection.sock, buffers, boost::asio::use_awaitable);
+  }
+  connection.writing = true;
+  co_await this->flush(connection);
+}
+
+
+boost::asio::awaitable<void> LineBasedServer::flush(Connection& connection)
+{
+  // The responses that finish while a write is in progress are queued, and are sent together by the next write. The
+  // deque keeps the queued buffers in place while more are added behind them.
+  std::array<boost::asio::const_buffer, max_gather_buffers> buffers;
+  while (!connection.pending.empty()) {
+    size_t count = std::min(connection.pending.size(), buffers.size());
+    for (size_t i = 0; i < count; i++) {
+      buffers[i] = boost::asio::buffer(connection.pending[i]);
+    }
+    co_await boost::asio::async_write(connection.sock,
+                                      std::span<const boost::asio::const_buffer>(buffers.data(), count),
+                                      boost::asio::use_awaitable);
+    for (size_t i = 0; i < count; i++) {
+      connection.pending_size -= connection.pending.front().size();
+      connection.returnBuffer(std::move(connection.pending.front()));
+      connection.pending.pop_front();
+    }
+    connection.notify();
+  }
+  connection.writing = false;
+}
+
+
+boost::asio::awaitable<void> LineBasedServer::listen(boost::asio::io_context& ctx)
+{
   try {
     for (;;)
     {
+      // Each connection gets its own strand, so that the connections can be handled by different threads at the same
+      // time, while the handle_requests() and watchdog() coroutines of a single connection never run concurrently.
+      boost::asio::ip::tcp::socket sock(boost::asio::make_strand(ctx));
+      co_await this->acceptor_.async_accept(sock, boost::asio::use_awaitable);
+      boost::asio::any_io_executor connection_executor = sock.get_executor();
       boost::asio::co_spawn(
-        acceptor.get_executor(),
-        this->handle_connection(co_await acceptor.async_accept(boost::asio::use_awaitable)),
+        connection_executor,
+        this->handle_connection(std::move(sock)),
         boost::asio::detached);
     }
   }
@@ -77,43 +339,31 @@ boost::asio::awaitable<void> LineBasedServer::watchdog(std::chrono::steady_clock
 
 
 
-class ConnectionLostRAII {
-  public:
-    ConnectionLostRAII(ConnectionLostFunc connection_lost_func, boost::asio::ip::tcp::socket& sock):
-      connection_lost_func_(connection_lost_func), socket_(sock) {
-    }
-    ~ConnectionLostRAII() {
-      try {
-        this->connection_lost_func_(this->socket_);
-      }
-      catch(const std::exception& e) {
-        std::cerr << "~ConnectionLostRAII(): got an exception: " << e.what() << std::endl;
-      }
-    }
-  private:
-    ConnectionLostFunc connection_lost_func_;
-    boost::asio::ip::tcp::socket& socket_;
-};
-
-
-boost::asio::awaitable<void> LineBasedServer::handle_connection(boost::asio::ip::tcp::socket sock)
+boost::asio::awaitable<void> LineBasedServer::handle_connection(boost::asio::ip::tcp::socket accepted_sock)
 {
+  auto connection = std::make_shared<Connection>(std::move(accepted_sock));
+  boost::asio::ip::tcp::socket& sock = connection->sock;
   BOOST_LOG_TRIVIAL(info) << "LineBasedServer::handle_connection() got a new connection from " << sock.remote_endpoint();
-  ConnectionLostRAII connection_lost_raii(this->connection_lost_func_, sock);
-
+  // The responses are small and are often sent one at a time, so they shouldn't wait for the previous one to be acked.
+  sock.set_option(boost::asio::ip::tcp::no_delay(true));
+  {
+    std::lock_guard<std::mutex> guard(this->connections_lock_);
+    this->connections_.insert(connection);
+  }
 
   std::chrono::steady_clock::time_point deadline{};
   try {
-    std::string welcome_message = this->connection_made_func_(sock);
+    std::string welcome_message = co_await boost::asio::co_spawn(this->app_executor_,
+      [&]() -> boost::asio::awaitable<std::string> { co_return this->connection_made_func_(sock); },
+      boost::asio::use_awaitable);
     if (!welcome_message.empty()) {
-      welcome_message += "\n";
-      // Write the response back to the socket
-      co_await boost::asio::async_write(sock, boost::asio::buffer(welcome_message), boost::asio::use_awaitable);
+      std::array<boost::asio::const_buffer, 2> buffers{boost::asio::buffer(welcome_message), boost::asio::buffer(&newline, 1)};
+      co_await boost::asio::async_write(sock, buffers, boost::asio::use_awaitable);
     }
 
 
     co_await (
-      this->handle_requests(sock, deadline)
+      this->handle_requests(connection, deadline)
       
       // The "||" operator is overloaded by boost::asio::experimental::awaitable_operators and works like this:
       // When either of the handle_requests() or watchdog() coroutines exit, the io-operations in the other function will fail with
@@ -146,44 +396,131 @@ boost::asio::awaitable<void> LineBasedServer::handle_connection(boost::asio::ip:
   catch(const std::exception& e) {
     BOOST_LOG_TRIVIAL(info) << "LineBasedServer::handle_connection() got an exception: " << e.what();
   }
+
+  {
+    std::lock_guard<std::mutex> guard(this->connections_lock_);
+    this->connections_.erase(connection);
+  }
+  try {
+    // Let the requests that are still in progress finish, so that no callback runs for the connection after the
+    // connection_lost_func. Their writes are aborted first, since a client that has stopped reading (which is what
+    // the watchdog catches) would keep them waiting forever.
+    connection->closed = true;
+    boost::system::error_code ec;
+    sock.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+    sock.cancel(ec);
+    while (connection->requests_in_flight > 0) {
+      co_await connection->waitForNotify();
+    }
+    co_await boost::asio::co_spawn(this->app_executor_,
+      [&]() -> boost::asio::awaitable<void> { this->connection_lost_func_(sock); co_return; },
+      boost::asio::use_awaitable);
+  }
+  catch(const std::exception& e) {
+    BOOST_LOG_TRIVIAL(error) << "LineBasedServer::handle_connection() the connection_lost_func failed: " << e.what();
+  }
 }
 
-boost::asio::awaitable<void> LineBasedServer::handle_requests(boost::asio::ip::tcp::socket& sock,
+boost::asio::awaitable<void> LineBasedServer::handle_requests(std::shared_ptr<Connection> connection_ptr,
                                                               std::chrono::steady_clock::time_point& deadline)
 {
-  boost::asio::streambuf streambuf;
+  Connection& connection = *connection_ptr;
+  boost::asio::ip::tcp::socket& sock = connection.sock;
+  // Peek at the first byte to find out which protocol the client uses.
+  deadline = std::chrono::steady_clock::now() + this->timeout_;
+  uint8_t first_byte = 0;
+  try {
+    co_await sock.async_receive(boost::asio::buffer(&first_byte, 1), boost::asio::socket_base::message_peek,
+                                boost::asio::use_awaitable);
+  }
+  catch(const boost::system::system_error& e) {
+    BOOST_LOG_TRIVIAL(info) << "LineBasedServer::handle_requests() failed to read the first byte: " << e.what();
+    co_return;
+  }
+  connection.protocol_known = true;
+  connection.binary = first_byte == Message::magic && this->message_received_func_;
+  // Now we can send the broadcasts that arrived before we knew the protocol. The connection is still marked as
+  // writing, so they are queued and sent by the flush().
+  for (const std::string& text : connection.early_broadcasts) {
+    co_await this->writeText(connection, text);
+  }
+  connection.early_broadcasts.clear();
+  co_await this->flush(connection);
+
+  if (connection.binary) {
+    co_await this->handle_messages(connection, deadline);
+    co_return;
+  }
+
+  // The receive buffer is allocated once per connection. The lines are parsed in place from it, and it only grows if a
+  // line doesn't fit. The pings that arrived in one read are answered together with a single gather-write, and the
+  // other requests are copied and handled in the background, so we can go on reading.
+  std::vector<char> receive_buffer(initial_receive_buffer_size);
+  size_t received_size = 0;
+  static const std::string_view pong_line = "pong\n";
+  std::vector<boost::asio::const_buffer> pong_buffers;
 
   for (;;)
   {
     try {
       // Extend the watchdog deadline with a few more seconds. 
-      deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
-
-      auto n = co_await boost::asio::async_read_until(sock, streambuf, "\n", boost::asio::use_awaitable);
-      if (n > 0) {
-        std::string request;
-        std::istream is(&streambuf);
-        std::getline(is, request, '\n');
-
-        // we got a request, so call our callback function to get the response.
-        if (request.size() > 0) {
-          // remove windows carriage return
-          if (request[request.size()-1] == '\r') {
-            request.erase(request.size()-1);
-          }
+      deadline = std::chrono::steady_clock::now() + this->timeout_;
+
+      // Don't read any more requests until the ones in flight and the responses that wait to be written are below
+      // their limits. A client that doesn't read its responses is held back here.
+      while (!connection.hasRoom() && !connection.failure) {
+        co_await connection.waitForNotify();
+      }
+      if (connection.failure) {
+        std::rethrow_exception(connection.failure);
+      }
+
+      if (received_size == receive_buffer.size()) {
+        if (receive_buffer.size() >= max_line_size) {
+          throw std::runtime_error("got a line that is longer than " + std::to_string(max_line_size) + " bytes");
         }
-        std::string response = this->response_func_(sock, request);
-        request.clear();
-        if (!response.empty()) {
-          if (response[response.size()-1] != '\n') {
-            response += "\n";
-          }
-          // Write the response back to the socket
-          co_await boost::asio::async_write(sock, boost::asio::buffer(response), boost::asio::use_awaitable);
+        receive_buffer.resize(receive_buffer.size() * 2);
+      }
+      received_size += co_await sock.async_read_some(
+        boost::asio::buffer(receive_buffer.data() + received_size, receive_buffer.size() - received_size),
+        boost::asio::use_awaitable);
+
+      // Handle all the whole lines we have got.
+      size_t offset = 0;
+      size_t pong_count = 0;
+      for (;;) {
+        const char* line_start = receive_buffer.data() + offset;
+        const char* line_end = (const char*)memchr(line_start, '\n', received_size - offset);
+        if (line_end == nullptr) {
+          break;
+        }
+        std::string_view request(line_start, line_end - line_start);
+        offset += request.size() + 1;
+        // remove windows carriage return
+        if (!request.empty() && request.back() == '\r') {
+          request.remove_suffix(1);
+        }
+
+        if (request == "ping") {
+          pong_count++;
+        } else {
+          this->startRequest(connection_ptr, request);
         }
       }
+      // Move the start of the next line to the start of the buffer.
+      std::copy(receive_buffer.begin() + offset, receive_buffer.begin() + received_size, receive_buffer.begin());
+      received_size -= offset;
+
+      if (pong_count > 0) {
+        pong_buffers.assign(pong_count, boost::asio::buffer(pong_line));
+        co_await this->write(connection, pong_buffers);
+      }
     }
     catch(const boost::system::system_error& e) {
+      if (connection.failure) {
+        // A request failed and cancelled the read.
+        std::rethrow_exception(connection.failure);
+      }
       if (e.code().value() == boost::asio::error::operation_aborted) {
       BOOST_LOG_TRIVIAL(info) << "LineBasedServer::handle_requests() got an operation_aborted exception, which means that the connection timed out.";
       } else {
@@ -199,4 +536,180 @@ boost::asio::awaitable<void> LineBasedServer::handle_requests(boost::asio::ip::t
   }
 }
 
+void LineBasedServer::startRequest(const std::shared_ptr<Connection>& connection, std::string_view line)
+{
+  std::vector<uint8_t> data = connection->takeBuffer();
+  data.assign(line.begin(), line.end());
+  connection->requests_in_flight++;
+
+  // Look for an id like "#17 " in front of the request.
+  size_t id_prefix_size = 0;
+  if (line.size() > 2 && line[0] == '#') {
+    size_t digits_end = 1;
+    while (digits_end < line.size() && line[digits_end] >= '0' && line[digits_end] <= '9') {
+      digits_end++;
+    }
+    if (digits_end > 1 && digits_end < line.size() && line[digits_end] == ' ') {
+      id_prefix_size = digits_end + 1;
+    }
+  }
+
+  auto on_error = [connection](std::exception_ptr eptr) {
+    if (eptr) {
+      try {
+        std::rethrow_exception(eptr);
+      }
+      catch(const std::exception& e) {
+        BOOST_LOG_TRIVIAL(info) << "LineBasedServer::startRequest() a request failed, so the connection is closed: " << e.what();
+      }
+      connection->fail(eptr);
+    }
+  };
+  if (id_prefix_size > 0) {
+    boost::asio::co_spawn(connection->sock.get_executor(),
+      this->handleRequest(connection, std::move(data), id_prefix_size),
+      on_error);
+    return;
+  }
+  connection->ordered_requests.push_back(std::move(data));
+  if (!connection->handling_ordered_requests) {
+    connection->handling_ordered_requests = true;
+    boost::asio::co_spawn(connection->sock.get_executor(), this->handleOrderedRequests(connection), on_error);
+  }
+}
+
+
+boost::asio::awaitable<void> LineBasedServer::handleRequest(std::shared_ptr<Connection> connection,
+                                                            std::vector<uint8_t> line, size_t id_prefix_size)
+{
+  std::string_view request((const char*)line.data(), line.size());
+  // "#17 " is written in front of the response, or just "#17" if there is no response.
+  std::string_view id_prefix = request.substr(0, id_prefix_size);
+  request.remove_prefix(id_prefix_size);
+  try {
+    // Run the callback on the app executor, and continue on this connection's strand when it is done.
+    std::string response = co_await boost::asio::co_spawn(this->app_executor_,
+      this->response_func_(connection->sock, request),
+      boost::asio::use_awaitable);
+    if (response.empty()) {
+      id_prefix.remove_suffix(1);
+    } else if (response.back() == '\n') {
+      response.pop_back();
+    }
+    std::array<boost::asio::const_buffer, 3> buffers{
+      boost::asio::buffer(id_prefix), boost::asio::buffer(response), boost::asio::buffer(&newline, 1)};
+    co_await this->write(*connection, buffers);
+  }
+  catch(...) {
+    connection->requests_in_flight--;
+    connection->notify();
+    throw;
+  }
+  connection->returnBuffer(std::move(line));
+  connection->requests_in_flight--;
+  connection->notify();
+}
+
+
+boost::asio::awaitable<void> LineBasedServer::handleOrderedRequests(std::shared_ptr<Connection> connection)
+{
+  while (!connection->ordered_requests.empty() && !connection->failure && !connection->closed) {
+    std::vector<uint8_t> line = std::move(connection->ordered_requests.front());
+    connection->ordered_requests.pop_front();
+    std::string_view request((const char*)line.data(), line.size());
+    try {
+      std::string response = co_await boost::asio::co_spawn(this->app_executor_,
+        this->response_func_(connection->sock, request),
+        boost::asio::use_awaitable);
+      if (!response.empty()) {
+        std::array<boost::asio::const_buffer, 2> buffers{boost::asio::buffer(response), boost::asio::buffer(&newline, 1)};
+        co_await this->write(*connection, std::span<const boost::asio::const_buffer>(buffers.data(),
+                                                                                    response.back() == '\n' ? 1 : 2));
+      }
+    }
+    catch(...) {
+      // The requests that were queued behind this one are dropped along with the connection.
+      connection->requests_in_flight -= 1 + connection->ordered_requests.size();
+      connection->ordered_requests.clear();
+      connection->handling_ordered_requests = false;
+      connection->notify();
+      throw;
+    }
+    connection->returnBuffer(std::move(line));
+    connection->requests_in_flight--;
+    connection->notify();
+  }
+  // Anything that is left was queued after a request failed or the connection was closed.
+  connection->requests_in_flight -= connection->ordered_requests.size();
+  connection->ordered_requests.clear();
+  connection->handling_ordered_requests = false;
+  connection->notify();
+}
+
+
+boost::asio::awaitable<void> LineBasedServer::handle_messages(Connection& connection,
+                                                              std::chrono::steady_clock::time_point& deadline)
+{
+  boost::asio::ip::tcp::socket& sock = connection.sock;
+  // The buffers are allocated once per connection. The receive buffer can always hold at least one whole message, and
+  // the messages are decoded in-place, so no allocations are done per message.
+  std::vector<uint8_t> receive_buffer(Message::header_size + Message::max_payload_size);
+  size_t received_size = 0;
+  std::vector<uint8_t> response;
+  response.reserve(1024);
+  Message message;
+
+  for (;;)
+  {
+    try {
+      // Extend the watchdog deadline with a few more seconds.
+      deadline = std::chrono::steady_clock::now() + this->timeout_;
+
+      received_size += co_await sock.async_read_some(
+        boost::asio::buffer(receive_buffer.data() + received_size, receive_buffer.size() - received_size),
+        boost::asio::use_awaitable);
+
+      // Handle all the whole messages we have got. A client can send several messages without waiting for the
+      // responses, and they are all answered with a single write.
+      size_t offset = 0;
+      response.clear();
+      for (;;) {
+        std::span<const uint8_t> data(receive_buffer.data() + offset, received_size - offset);
+        size_t message_size = Message::decode(data, message);
+        if (message_size == 0) {
+          break;
+        }
+        if (message.getType() == MessageType::Ping) {
+          Message::encode(PongPayload{message.as<PingPayload>().timestamp_us}, response);
+        } else {
+          co_await boost::asio::co_spawn(this->app_executor_,
+            this->message_received_func_(sock, message, response),
+            boost::asio::use_awaitable);
+        }
+        offset += message_size;
+      }
+      // Move the start of the next message to the start of the buffer.
+      std::copy(receive_buffer.begin() + offset, receive_buffer.begin() + received_size, receive_buffer.begin());
+      received_size -= offset;
+
+      if (!response.empty()) {
+        co_await this->write(connection, boost::asio::buffer(response));
+      }
+    }
+    catch(const boost::system::system_error& e) {
+      if (e.code().value() == boost::asio::error::operation_aborted) {
+      BOOST_LOG_TRIVIAL(info) << "LineBasedServer::handle_messages() got an operation_aborted exception, which means that the connection timed out.";
+      } else {
+      std::string info = boost::diagnostic_information(e, true);
+      BOOST_LOG_TRIVIAL(info) << "LineBasedServer::handle_messages() got a boost::system::system_error exception: " << info << ". code:" << e.code();
+      }
+      break;
+    }
+    catch(const std::exception& e) {
+      BOOST_LOG_TRIVIAL(info) << "LineBasedServer::handle_messages() got an '" << typeid(e).name() << "' exception (I'll rethrow it): " << e.what();
+      throw;
+    }
+  }
+}
+
 }
@@ -1,6 +1,16 @@
 #ifndef SNOWROBOT_REMOTECONTROL_COMMON_LINEBASEDSERVER_h
 #define SNOWROBOT_REMOTECONTROL_COMMON_LINEBASEDSERVER_h
 
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include <boost/asio/any_io_executor.hpp>
 #include <boost/asio/buffer.hpp>
 #include <boost/asio/detached.hpp>
 #include <boost/asio/awaitable.hpp>
@@ -11,9 +21,12 @@
 #include <boost/asio/use_awaitable.hpp>
 #include <boost/asio/write.hpp>
 #include <boost/asio/co_spawn.hpp>
+#include <boost/asio/strand.hpp>
 #include <boost/exception/diagnostic_information.hpp> 
 #include <boost/log/trivial.hpp>
 
+#include "network.h"
+
 using namespace boost::asio::experimental::awaitable_operators;
 
 
@@ -35,7 +48,32 @@ using RequestReceivedFunc = std::function<
   std::string  // the callback function should return a response-string (no response will be sent if this is empty)
   (
     boost::asio::ip::tcp::socket&,  // the client socket
-    const std::string&  // the request string
+    std::string_view  // the request line. It refers to the receive buffer, so it is only valid during the call.
+  )>;
+
+using MessageReceivedFunc = std::function<
+  void
+  (
+    boost::asio::ip::tcp::socket&,  // the client socket
+    const Message&,  // the request message. It refers to the receive buffer, so it is only valid during the call.
+    std::vector<uint8_t>&  // the callback function can append response messages to this buffer with Message::encode()
+  )>;
+
+// The coroutine versions of the callbacks above. They are used by the callbacks that must wait for something that
+// takes a while, like a gstreamer state change. The app_executor is free to run the other callbacks while they wait.
+using AsyncRequestReceivedFunc = std::function<
+  boost::asio::awaitable<std::string>
+  (
+    boost::asio::ip::tcp::socket&,
+    std::string_view  // the request line stays valid until the returned coroutine has finished
+  )>;
+
+using AsyncMessageReceivedFunc = std::function<
+  boost::asio::awaitable<void>
+  (
+    boost::asio::ip::tcp::socket&,
+    const Message&,  // the message stays valid until the returned coroutine has finished
+    std::vector<uint8_t>&
   )>;
 
 
@@ -44,6 +82,38 @@ using RequestReceivedFunc = std::function<
 // the constructor is called with the received string (minus the \n character and any trailing '\r' character).
 // This is intended to be used to low-volume command-streams where we want to trace latency for readability and ease of
 // debugging. It is nice to be able to use telnet to manually send messages to such servers.
+//
+// If a message_received_func is given, the clients can also use the binary protocol in network.h. The protocol is
+// chosen by the first byte the client sends: if it is Message::magic the connection uses the binary protocol,
+// otherwise it is line-based. The welcome message from the connection_made_func is always sent as a line of text,
+// since we don't know which protocol the client speaks until it has sent something.
+//
+// The io_context can be run by several threads. Each connection runs on its own strand, so the connections are
+// handled in parallel. The callback functions are all run on the app_executor, which is normally a strand that is
+// shared by all the servers that use the same application state. That way the callbacks don't need any locking. If
+// no app_executor is given, the server makes a strand of its own. The "ping" lines and Ping messages are answered
+// directly on the connection's strand, so the keepalives are answered even when a callback takes a long time.
+//
+// The server can also push messages to the clients with broadcast(). The responses and the pushed messages go through
+// a write queue per connection, so they never interleave on the socket.
+//
+// The lines are parsed in place from a receive buffer that each connection keeps for its lifetime. The writes that have
+// to be queued are copied into buffers from a pool that each connection keeps, so a busy connection reuses the same
+// few buffers instead of allocating new ones.
+//
+// A client can send several lines without waiting for the responses, and the server keeps reading while the requests
+// are handled, so a "ping" is answered right away even if it was sent just after a slow request. A request line can
+// start with an id, like "#17 {\"type\": ...}". Those requests are handled concurrently, and each response is sent
+// as soon as it is ready, with the same id in front of it ("#17 {...}"), so they can arrive in any order. A request
+// with an id always gets a response line, which is just "#17" if the callback returned an empty string. The requests
+// without an id are handled one after another, in the order they arrived, and their responses are sent in that order,
+// like before. Either way the callbacks still run on the app_executor, so they never run at the same time.
+//
+// At most max_requests_in_flight requests per connection are handled or waiting at a time, and the responses that
+// wait to be written are bounded too. When either limit is reached, the server stops reading from the connection
+// until there is room again, so a client that sends requests but doesn't read the responses is held back by tcp's
+// flow control instead of filling up the server's memory. If it stays stuck for longer than the watchdog timeout, the
+// connection is closed.
 class LineBasedServer {
 
   public:
@@ -51,21 +121,73 @@ class LineBasedServer {
                     boost::asio::ip::port_type admin_port_nr,
                     ConnectionMadeFunc connection_made_func,
                     ConnectionLostFunc connection_lost_func,
-                    RequestReceivedFunc response_func
+                    RequestReceivedFunc response_func,
+                    MessageReceivedFunc message_received_func = nullptr,
+                    boost::asio::any_io_executor app_executor = {}
                    );
 
+    // Like the constructor above, except that the request and message callbacks are coroutines.
+    LineBasedServer(boost::asio::io_context& ctx,
+                    boost::asio::ip::port_type admin_port_nr,
+                    ConnectionMadeFunc connection_made_func,
+                    ConnectionLostFunc connection_lost_func,
+                    AsyncRequestReceivedFunc response_func,
+                    AsyncMessageReceivedFunc message_received_func = nullptr,
+                    boost::asio::any_io_executor app_executor = {}
+                   );
+
+    // Returns the port the server listens on. This is useful if the server was created with port number 0.
+    boost::asio::ip::port_type getPort() const;
+
+    // Sends the text to all the connected clients, after the welcome message and any responses that are being
+    // written. The clients that use the binary protocol get it as a Text message, the others as a line. This can be
+    // called from any thread.
+    void broadcast(const std::string& text);
+
+    // Sets how long a connection can go without the server reading anything from it before it is closed. The default
+    // is 60 seconds. Call it before the clients connect.
+    void setTimeout(std::chrono::steady_clock::duration timeout);
+
   private:
-    boost::asio::awaitable<void> listen(boost::asio::io_context& ctx, boost::asio::ip::port_type admin_port_nr);
+    struct Connection;
+
+    // Writes the data, or queues a copy of it if another write is in progress. Must be called on the connection's
+    // strand.
+    boost::asio::awaitable<void> write(Connection& connection, boost::asio::const_buffer data);
+    boost::asio::awaitable<void> write(Connection& connection, std::span<const boost::asio::const_buffer> buffers);
+    // Writes the queued data. The connection must be marked as writing.
+    boost::asio::awaitable<void> flush(Connection& connection);
+    // Writes the text in the framing the connection's protocol uses.
+    boost::asio::awaitable<void> writeText(Connection& connection, std::string_view text);
+
+    // Starts handling a request line in the background. The line is copied, so the caller can reuse its buffer.
+    void startRequest(const std::shared_ptr<Connection>& connection, std::string_view line);
+    // Handles a request that has an id. id_prefix_size is the size of the "#17 " in front of the request.
+    boost::asio::awaitable<void> handleRequest(std::shared_ptr<Connection> connection, std::vector<uint8_t> line,
+                                               size_t id_prefix_size);
+    // Handles the requests without an id, one after another, until there are no more of them.
+    boost::asio::awaitable<void> handleOrderedRequests(std::shared_ptr<Connection> connection);
+
+    boost::asio::awaitable<void> listen(boost::asio::io_context& ctx);
 
     boost::asio::awaitable<void> watchdog(std::chrono::steady_clock::time_point& deadline);
 
     boost::asio::awaitable<void> handle_connection(boost::asio::ip::tcp::socket sock);
-    boost::asio::awaitable<void> handle_requests(boost::asio::ip::tcp::socket& sock,
+    boost::asio::awaitable<void> handle_requests(std::shared_ptr<Connection> connection,
+                                                 std::chrono::steady_clock::time_point& deadline);
+    boost::asio::awaitable<void> handle_messages(Connection& connection,
                                                  std::chrono::steady_clock::time_point& deadline);
 
+    boost::asio::ip::tcp::acceptor acceptor_;
+    boost::asio::any_io_executor app_executor_;
     ConnectionMadeFunc connection_made_func_;
     ConnectionLostFunc connection_lost_func_;
-    RequestReceivedFunc response_func_;
+    AsyncRequestReceivedFunc response_func_;
+    AsyncMessageReceivedFunc message_received_func_;
+    std::chrono::steady_clock::duration timeout_ = std::chrono::seconds(60);
+
+    std::mutex connections_lock_;
+    std::set<std::shared_ptr<Connection>> connections_;
 };
 
 }
@@ -0,0 +1,267 @@
+#include "motorbridge.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/log/trivial.hpp>
+
+
+namespace snowrobot {
+
+
+namespace romeo {
+
+uint8_t encodeSpeed(int16_t per_mille) {
+  int value = 128 + (int)std::lround(std::clamp((int)per_mille, -1000, 1000) * 127 / 1000.0);
+  // A zero would end the message, so full reverse is 1 rather than 0.
+  return (uint8_t)std::clamp(value, 1, 255);
+}
+
+
+int16_t decodeSpeed(uint8_t speed_byte) {
+  return (int16_t)std::lround(((int)speed_byte - 128) * 1000 / 127.0);
+}
+
+
+void encodeMovement(uint8_t sequence_nr, int16_t steering, int16_t throttle, uint8_t* out) {
+  out[0] = 0;
+  out[1] = sequence_nr;
+  out[2] = movement_command;
+  out[3] = encodeSpeed(steering);
+  out[4] = encodeSpeed(throttle);
+  out[5] = 0;
+}
+
+}
+
+
+static int64_t steadyNanoseconds() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+#ifdef _WIN32
+
+
+MotorBridge::MotorBridge(boost::asio::io_context& ctx, const MotorBridgeSettings& settings)
+  : settings_(settings)
+{
+  throw std::runtime_error("MotorBridge: serial devices aren't supported on Windows yet");
+}
+
+
+MotorBridge::~MotorBridge() {
+}
+
+
+void MotorBridge::apply(const MotorOutput& output) {
+}
+
+
+#else
+
+
+static speed_t toTermiosSpeed(int baud_rate) {
+  switch (baud_rate) {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    default:
+      throw std::runtime_error("MotorBridge: unsupported baud rate " + std::to_string(baud_rate));
+  }
+}
+
+
+// Opens the device non-blocking, so a board that stops reading can't block the motor loop, and sets it up as a raw
+// 8N1 line, so no byte is translated or swallowed by the line discipline.
+static int openSerialDevice(const std::string& device, int baud_rate) {
+  speed_t speed = toTermiosSpeed(baud_rate);
+  int fd = ::open(device.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::runtime_error("MotorBridge: failed to open " + device + ": " + strerror(errno));
+  }
+  termios tty{};
+  if (tcgetattr(fd, &tty) != 0) {
+    int error = errno;
+    ::close(fd);
+    throw std::runtime_error("MotorBridge: " + device + " isn't a serial device: " + strerror(error));
+  }
+  cfmakeraw(&tty);
+  tty.c_cflag |= CLOCAL | CREAD;
+  tty.c_cflag &= ~(CSTOPB | CRTSCTS);
+  cfsetispeed(&tty, speed);
+  cfsetospeed(&tty, speed);
+  if (tcsetattr(fd, TCSANOW, &tty) != 0) {
+    int error = errno;
+    ::close(fd);
+    throw std::runtime_error("MotorBridge: failed to configure " + device + ": " + strerror(error));
+  }
+  // Throw away whatever the board sent before we were listening.
+  tcflush(fd, TCIOFLUSH);
+  return fd;
+}
+
+
+MotorBridge::MotorBridge(boost::asio::io_context& ctx, const MotorBridgeSettings& settings)
+  : settings_(settings),
+    write_fd_(openSerialDevice(settings.device, settings.baud_rate)),
+    strand_(boost::asio::make_strand(ctx)),
+    read_descriptor_(strand_)
+{
+  int read_fd = ::dup(this->write_fd_);
+  if (read_fd < 0) {
+    int error = errno;
+    ::close(this->write_fd_);
+    throw std::runtime_error(std::string("MotorBridge: failed to dup the serial device: ") + strerror(error));
+  }
+  this->read_descriptor_.assign(read_fd);
+  auto log_exception = [](std::exception_ptr eptr) {
+    try {
+      if (eptr) {
+        std::rethrow_exception(eptr);
+      }
+    }
+    catch(const std::exception& e) {
+      BOOST_LOG_TRIVIAL(error) << "MotorBridge: stopped reading from the board: " << e.what()
+                               << ". Restart the server to reconnect.";
+    }
+  };
+  boost::asio::co_spawn(this->strand_, this->readResponses(), log_exception);
+  BOOST_LOG_TRIVIAL(info) << "MotorBridge::MotorBridge(): talking to the board on " << settings.device << " at "
+                          << settings.baud_rate << " baud";
+}
+
+
+MotorBridge::~MotorBridge() {
+  ::close(this->write_fd_);
+}
+
+
+void MotorBridge::apply(const MotorOutput& output) {
+  int64_t now_ns = steadyNanoseconds();
+  bool changed = !this->has_written_ || output.steering != this->last_steering_ ||
+                 output.throttle != this->last_throttle_;
+  int64_t keepalive_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(this->settings_.keepalive_interval).count();
+  if (!changed && now_ns - this->last_write_ns_ < keepalive_ns) {
+    this->coalesced_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  // The sequence number is never 0, since that would end the message.
+  uint8_t sequence_nr = this->next_sequence_nr_;
+  this->next_sequence_nr_ = sequence_nr == 255 ? 1 : sequence_nr + 1;
+  std::array<uint8_t, romeo::movement_frame_size> frame;
+  romeo::encodeMovement(sequence_nr, output.steering, output.throttle, frame.data());
+
+  // The time is stored before the write, so the reader finds it even if the ack arrives right away.
+  this->write_times_ns_[sequence_nr].store(now_ns, std::memory_order_relaxed);
+  ssize_t written = ::write(this->write_fd_, frame.data(), frame.size());
+  if (written != (ssize_t)frame.size()) {
+    // Either the port's buffer is full or the device is gone. The next tick tries again with the latest output. A
+    // partial write leaves half a message on the line, which the board nacks before it is back in sync.
+    this->write_times_ns_[sequence_nr].store(0, std::memory_order_relaxed);
+    this->write_failures_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  this->writes_.fetch_add(1, std::memory_order_relaxed);
+  this->has_written_ = true;
+  this->last_steering_ = output.steering;
+  this->last_throttle_ = output.throttle;
+  this->last_write_ns_ = now_ns;
+}
+
+
+boost::asio::awaitable<void> MotorBridge::readResponses() {
+  std::array<uint8_t, 64> buffer;
+  // A response is [0, sequence_nr, response_code, 0]. Like the firmware, we collect the bytes after a zero until the
+  // next zero, and start over on a zero that comes too early.
+  std::array<uint8_t, romeo::response_frame_size> frame;
+  size_t frame_size = 0;
+  for (;;) {
+    size_t size = co_await this->read_descriptor_.async_read_some(boost::asio::buffer(buffer), boost::asio::use_awaitable);
+    for (size_t i = 0; i < size; i++) {
+      uint8_t byte = buffer[i];
+      if (byte == 0) {
+        if (frame_size == romeo::response_frame_size - 1) {
+          this->handleResponse(frame[1], frame[2]);
+          frame_size = 0;
+        }
+        else {
+          if (frame_size > 1) {
+            this->unknown_responses_.fetch_add(1, std::memory_order_relaxed);
+          }
+          frame[0] = 0;
+          frame_size = 1;
+        }
+      }
+      else if (frame_size == 0) {
+        // Out of sync, this isn't the start of a response.
+        continue;
+      }
+      else if (frame_size < romeo::response_frame_size - 1) {
+        frame[frame_size++] = byte;
+      }
+      else {
+        // Too long to be a response.
+        this->unknown_responses_.fetch_add(1, std::memory_order_relaxed);
+        frame_size = 0;
+      }
+    }
+  }
+}
+
+
+void MotorBridge::handleResponse(uint8_t sequence_nr, uint8_t response_code) {
+  int64_t write_time_ns = this->write_times_ns_[sequence_nr].exchange(0, std::memory_order_relaxed);
+  if (write_time_ns == 0) {
+    this->unknown_responses_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  if (response_code == romeo::ack) {
+    this->acks_.fetch_add(1, std::memory_order_relaxed);
+  }
+  else {
+    this->nacks_.fetch_add(1, std::memory_order_relaxed);
+    BOOST_LOG_TRIVIAL(warning) << "MotorBridge: the board rejected message " << (int)sequence_nr << " with code "
+                               << (int)response_code;
+  }
+  int64_t round_trip_us = (steadyNanoseconds() - write_time_ns) / 1000;
+  this->last_round_trip_us_.store(round_trip_us, std::memory_order_relaxed);
+  if (round_trip_us > this->max_round_trip_us_.load(std::memory_order_relaxed)) {
+    this->max_round_trip_us_.store(round_trip_us, std::memory_order_relaxed);
+  }
+}
+
+
+#endif
+
+
+MotorBridge::Stats MotorBridge::getStats() const {
+  Stats stats;
+  stats.writes = this->writes_.load();
+  stats.coalesced = this->coalesced_.load();
+  stats.write_failures = this->write_failures_.load();
+  stats.acks = this->acks_.load();
+  stats.nacks = this->nacks_.load();
+  stats.unknown_responses = this->unknown_responses_.load();
+  stats.last_round_trip_us = this->last_round_trip_us_.load();
+  stats.max_round_trip_us = this->max_round_trip_us_.load();
+  return stats;
+}
+
+
+}
@@ -0,0 +1,135 @@
+#ifndef SNOWROBOT_REMOTECONTROL_COMMON_MOTORBRIDGE_H
+#define SNOWROBOT_REMOTECONTROL_COMMON_MOTORBRIDGE_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/strand.hpp>
+#ifndef _WIN32
+#include <boost/asio/posix/stream_descriptor.hpp>
+#endif
+
+#include "motorloop.h"
+
+
+namespace snowrobot {
+
+
+// The framing of the Romeo BLE Quad firmware in romeo_ble_quad/romeo_ble_quad.ino. Each message is
+//   [0, sequence_nr, command, payload..., 0]
+// and the payload must not contain any zeros, since a zero ends the message. The board answers each message with
+//   [0, sequence_nr, response_code, 0]
+namespace romeo {
+  constexpr uint8_t movement_command = 100;  // payload: steering, throttle
+  constexpr uint8_t ping_command = 101;      // no payload
+  constexpr uint8_t ack = 200;
+  constexpr uint8_t nack = 201;
+  constexpr size_t movement_frame_size = 6;
+  constexpr size_t response_frame_size = 4;
+
+  // The board stops the motors if it hasn't got a movement message for this long.
+  constexpr std::chrono::milliseconds board_deadman_timeout{1000};
+
+  // Maps -1000..1000 per mille to the board's 1..255 byte, where 128 is zero. The firmware turns the byte back into
+  // (byte - 128) / 127.
+  uint8_t encodeSpeed(int16_t per_mille);
+  int16_t decodeSpeed(uint8_t speed_byte);
+
+  // Writes a movement message to out, which must have room for movement_frame_size bytes.
+  void encodeMovement(uint8_t sequence_nr, int16_t steering, int16_t throttle, uint8_t* out);
+}
+
+
+struct MotorBridgeSettings {
+  // The serial device of the board, like /dev/ttyUSB0. A BLE link shows up as a serial device through a BLE-serial
+  // bridge, like ble-serial's pty.
+  std::string device;
+  int baud_rate = 115200;
+  // An unchanged output is sent again this often, so the board's one second deadman doesn't stop the motors while the
+  // operator holds the stick still.
+  std::chrono::milliseconds keepalive_interval{250};
+};
+
+
+// Sends the MotorLoop's outputs to the Romeo BLE Quad board over a serial device, and reads the board's
+// acknowledgements back.
+//
+// apply() is called by the MotorLoop on every tick, on the loop's real-time thread. It writes at most one movement
+// message per tick, and only if the output has changed or the keepalive interval has passed, so a burst of drive
+// commands between two ticks becomes a single write. The write is non-blocking: if the serial port's buffer is full
+// (the board has stopped reading) the message is dropped and the next tick sends the then latest output. Nothing in
+// apply() locks or allocates.
+//
+// The acknowledgements are read by a coroutine on the io_context, on a strand of its own. The board only answers with
+// ack/nack, so the "telemetry" is what the bridge can tell from those: the round trip time of each message, and the
+// messages that were never acknowledged.
+class MotorBridge {
+  public:
+    // Opens and configures the serial device. Throws a std::runtime_error if it can't be opened.
+    MotorBridge(boost::asio::io_context& ctx, const MotorBridgeSettings& settings);
+    ~MotorBridge();
+
+    MotorBridge(const MotorBridge&) = delete;
+    MotorBridge& operator=(const MotorBridge&) = delete;
+
+    // Called by the MotorLoop's output_func on every tick.
+    void apply(const MotorOutput& output);
+
+    struct Stats {
+      uint64_t writes = 0;          // movement messages written
+      uint64_t coalesced = 0;       // ticks that didn't write because the output hadn't changed
+      uint64_t write_failures = 0;  // messages dropped because the serial port was full or gone
+      uint64_t acks = 0;
+      uint64_t nacks = 0;
+      uint64_t unknown_responses = 0;  // responses to a sequence number we have no outstanding message for
+      int64_t last_round_trip_us = -1;
+      int64_t max_round_trip_us = -1;
+    };
+    // This can be called from any thread.
+    Stats getStats() const;
+
+  private:
+#ifndef _WIN32
+    boost::asio::awaitable<void> readResponses();
+    void handleResponse(uint8_t sequence_nr, uint8_t response_code);
+#endif
+
+    MotorBridgeSettings settings_;
+    int write_fd_ = -1;
+
+    // Only used by apply(), on the motor loop's thread.
+    uint8_t next_sequence_nr_ = 1;
+    int16_t last_steering_ = 0;
+    int16_t last_throttle_ = 0;
+    int64_t last_write_ns_ = 0;
+    bool has_written_ = false;
+
+    // When each sequence number was written, on the steady clock in ns, or 0 if it has been answered. Written by
+    // apply() and cleared by the reader.
+    std::array<std::atomic<int64_t>, 256> write_times_ns_{};
+
+    std::atomic<uint64_t> writes_{0};
+    std::atomic<uint64_t> coalesced_{0};
+    std::atomic<uint64_t> write_failures_{0};
+    std::atomic<uint64_t> acks_{0};
+    std::atomic<uint64_t> nacks_{0};
+    std::atomic<uint64_t> unknown_responses_{0};
+    std::atomic<int64_t> last_round_trip_us_{-1};
+    std::atomic<int64_t> max_round_trip_us_{-1};
+
+#ifndef _WIN32
+    boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+    // A dup() of the write_fd_, so asio can own it and read from it while apply() writes to the original.
+    boost::asio::posix::stream_descriptor read_descriptor_;
+#endif
+};
+
+
+}
+
+#endif
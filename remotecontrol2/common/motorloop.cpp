@@ -0,0 +1,157 @@
+#include "motorloop.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <boost/log/trivial.hpp>
+
+
+namespace snowrobot {
+
+
+static int64_t steadyNanoseconds() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+// Moves the output towards the target by at most max_step, except that moving towards zero is never limited, so a
+// stop is always applied right away. A reversal is a stop followed by a speed-up in the other direction, so it jumps
+// to zero and is only limited from there.
+static int16_t limitChange(int16_t output, int16_t target, int max_step) {
+  if (max_step <= 0) {
+    return target;
+  }
+  bool reversing = (output > 0 && target < 0) || (output < 0 && target > 0);
+  if (reversing) {
+    output = 0;
+  }
+  bool slowing_down = (output >= 0 && target >= 0 && target < output) || (output <= 0 && target <= 0 && target > output);
+  if (slowing_down) {
+    return target;
+  }
+  return (int16_t)std::clamp((int)target, output - max_step, output + max_step);
+}
+
+
+static void setRealtimePriority() {
+#ifdef _WIN32
+  if (!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL)) {
+    BOOST_LOG_TRIVIAL(warning) << "MotorLoop: failed to raise the thread priority, error " << GetLastError();
+  }
+#else
+  // Above the default priority of the kernel's threaded interrupt handlers (50), so the loop isn't held up by the
+  // network interrupts.
+  sched_param param{};
+  param.sched_priority = 60;
+  int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+  if (error != 0) {
+    BOOST_LOG_TRIVIAL(warning) << "MotorLoop: failed to use the SCHED_FIFO real-time priority (error " << error
+                               << "), the motor loop runs with a normal priority. Give the server CAP_SYS_NICE or an "
+                               << "rtprio limit to fix this.";
+  }
+#endif
+}
+
+
+MotorLoop::MotorLoop(const MotorLoopSettings& settings, MotorOutputFunc output_func)
+  : settings_(settings),
+    output_func_(std::move(output_func))
+{
+  if (settings.rate_hz <= 0) {
+    throw std::runtime_error("MotorLoop: the rate must be positive");
+  }
+  BOOST_LOG_TRIVIAL(info) << "MotorLoop: running the motors at " << settings.rate_hz << " Hz with a deadman timeout of "
+                          << settings.deadman_timeout.count() << "ms";
+  this->thread_ = std::thread([this] { this->run(); });
+}
+
+
+MotorLoop::~MotorLoop() {
+  this->stopping_ = true;
+  this->thread_.join();
+}
+
+
+void MotorLoop::post(const DrivePayload& command) {
+  this->mailbox_.publish(PostedCommand{command, steadyNanoseconds()});
+}
+
+
+MotorLoop::Stats MotorLoop::getStats() const {
+  Stats stats;
+  stats.ticks = this->ticks_.load();
+  stats.commands = this->commands_.load();
+  stats.deadman_stops = this->deadman_stops_.load();
+  stats.overruns = this->overruns_.load();
+  stats.max_lateness_us = this->max_lateness_us_.load();
+  return stats;
+}
+
+
+void MotorLoop::run() {
+  if (this->settings_.realtime_priority) {
+    setRealtimePriority();
+  }
+  // Everything the loop needs is set up here, so the loop itself doesn't allocate.
+  const int64_t period_ns = 1000000000ll / this->settings_.rate_hz;
+  const int64_t deadman_timeout_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(this->settings_.deadman_timeout).count();
+  const int max_step = this->settings_.max_change_per_s / this->settings_.rate_hz;
+  uint64_t last_version = 0;
+  PostedCommand latest{};
+  MotorOutput output;
+  bool deadman_tripped = true;  // there is no command to apply yet
+
+  // The ticks are scheduled at absolute times, so a late tick doesn't delay the ones after it.
+  int64_t next_tick_ns = steadyNanoseconds();
+  while (!this->stopping_.load(std::memory_order_relaxed)) {
+    std::this_thread::sleep_until(std::chrono::steady_clock::time_point(
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::nanoseconds(next_tick_ns))));
+    int64_t now_ns = steadyNanoseconds();
+    int64_t lateness_us = (now_ns - next_tick_ns) / 1000;
+    if (lateness_us > this->max_lateness_us_.load(std::memory_order_relaxed)) {
+      this->max_lateness_us_.store(lateness_us, std::memory_order_relaxed);
+    }
+
+    uint64_t version = this->mailbox_.read(latest);
+    output.is_new_command = version != last_version;
+    if (output.is_new_command) {
+      this->commands_.fetch_add(1, std::memory_order_relaxed);
+      last_version = version;
+      output.sequence_nr = latest.command.sequence_nr;
+      output.command_timestamp_us = latest.command.timestamp_us;
+      output.command_received_ns = latest.received_ns;
+    }
+
+    bool is_fresh = version != 0 && now_ns - latest.received_ns <= deadman_timeout_ns;
+    if (!is_fresh && !deadman_tripped && (output.steering != 0 || output.throttle != 0)) {
+      this->deadman_stops_.fetch_add(1, std::memory_order_relaxed);
+    }
+    deadman_tripped = !is_fresh;
+    output.deadman = deadman_tripped;
+    int16_t target_steering = is_fresh ? latest.command.steering : 0;
+    int16_t target_throttle = is_fresh ? latest.command.throttle : 0;
+    output.steering = limitChange(output.steering, target_steering, max_step);
+    output.throttle = limitChange(output.throttle, target_throttle, max_step);
+
+    this->output_func_(output);
+    this->ticks_.fetch_add(1, std::memory_order_relaxed);
+
+    next_tick_ns += period_ns;
+    if (next_tick_ns <= now_ns) {
+      // We have missed at least one whole tick. Skip the missed ones instead of running them back to back.
+      int64_t missed = (now_ns - next_tick_ns) / period_ns + 1;
+      this->overruns_.fetch_add(missed, std::memory_order_relaxed);
+      next_tick_ns += missed * period_ns;
+    }
+  }
+}
+
+
+}
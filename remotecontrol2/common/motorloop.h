@@ -0,0 +1,168 @@
+#ifndef SNOWROBOT_REMOTECONTROL_COMMON_MOTORLOOP_H
+#define SNOWROBOT_REMOTECONTROL_COMMON_MOTORLOOP_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include <type_traits>
+
+#include "network.h"
+
+
+namespace snowrobot {
+
+
+// Hands the latest value from one producer thread to one consumer thread without any locks. This is a seqlock: the
+// producer makes the sequence number odd while it writes and even again when it is done, and the consumer retries if
+// the number was odd or changed while it read. A value that is overwritten before the consumer gets to it is simply
+// lost, which is what we want for the drive commands, since only the latest one matters.
+//
+// Neither side ever blocks or allocates. The producer never waits for the consumer, and the consumer only retries while
+// a write is in progress, which takes a few nanoseconds. The value is stored as relaxed atomic words, so a torn read is
+// well-defined, and it is thrown away anyway.
+template<typename T>
+class LatestValueMailbox {
+  static_assert(std::is_trivially_copyable_v<T>, "The mailbox copies the value as raw bytes");
+
+  public:
+    // Must only be called from one thread at a time.
+    void publish(const T& value) {
+      std::array<uint64_t, word_count> words{};
+      memcpy(words.data(), &value, sizeof(T));
+      uint64_t sequence = this->sequence_.load(std::memory_order_relaxed);
+      this->sequence_.store(sequence + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      for (size_t i = 0; i < word_count; i++) {
+        this->words_[i].store(words[i], std::memory_order_relaxed);
+      }
+      this->sequence_.store(sequence + 2, std::memory_order_release);
+    }
+
+    // Copies the latest value to value and returns its version, which goes up by one for each publish(). Returns 0 and
+    // leaves the value alone if nothing has been published yet.
+    uint64_t read(T& value) const {
+      std::array<uint64_t, word_count> words;
+      for (;;) {
+        uint64_t before = this->sequence_.load(std::memory_order_acquire);
+        if (before & 1) {
+          continue;  // the producer is in the middle of a write
+        }
+        for (size_t i = 0; i < word_count; i++) {
+          words[i] = this->words_[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (this->sequence_.load(std::memory_order_relaxed) == before) {
+          if (before != 0) {
+            // T is trivially copyable (see the static_assert), but gcc's -Wclass-memaccess still warns about types
+            // with default member initializers like DrivePayload, so the destination goes through a void pointer.
+            memcpy(static_cast<void*>(&value), words.data(), sizeof(T));
+          }
+          return before / 2;
+        }
+      }
+    }
+
+  private:
+    static constexpr size_t word_count = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    std::atomic<uint64_t> sequence_{0};
+    std::array<std::atomic<uint64_t>, word_count> words_{};
+};
+
+
+struct MotorLoopSettings {
+  // How many times per second the motor outputs are updated.
+  int rate_hz = 100;
+  // The motors are stopped if the latest command is older than this, even if the control channel's own deadman
+  // hasn't stopped them. That one runs on the io threads, which can be held up by the network traffic.
+  std::chrono::milliseconds deadman_timeout{500};
+  // How fast the outputs may speed up or turn, in per mille of full deflection per second, so that a sudden full
+  // stick doesn't jerk the robot or spin the wheels. Slowing down is never limited, and a reversal goes straight to
+  // zero and is only limited from there. 0 disables the limit.
+  int max_change_per_s = 4000;
+  // Run the loop thread with a real-time priority. If the process isn't allowed to, the loop runs with a normal
+  // priority and a warning is logged.
+  bool realtime_priority = true;
+};
+
+
+// What the motors are told to do on one tick of the MotorLoop.
+struct MotorOutput {
+  int16_t steering = 0;         // per mille, after the rate limiting
+  int16_t throttle = 0;         // per mille, after the rate limiting
+  uint32_t sequence_nr = 0;     // the command that is being applied, 0 if there hasn't been one
+  uint64_t command_timestamp_us = 0;  // when the operator sent the command, in microseconds since the unix epoch
+  int64_t command_received_ns = 0;    // when the command was posted to the loop, on the steady clock
+  bool is_new_command = false;  // true on the first tick that applies the command
+  bool deadman = false;         // true if the motors are stopped because the latest command is too old
+};
+
+
+using MotorOutputFunc = std::function<
+  void
+  (
+    const MotorOutput&  // called on the loop thread on every tick, so it must not block
+  )>;
+
+
+// Runs the motors at a fixed rate on a thread of its own, so the motor outputs keep their cadence no matter how busy
+// the io threads are. The drive commands are posted from the control channel's strand into a LatestValueMailbox, and
+// the loop picks up the latest one on each tick. The loop never takes a lock and never allocates, so the only thing that
+// can delay a tick is the scheduler, which is why it asks for a real-time priority.
+//
+// Each tick moves the outputs towards the latest command within the max_change_per_s limit, or straight to zero if the
+// command is older than the deadman timeout, and calls the output_func with the result.
+class MotorLoop {
+  public:
+    MotorLoop(const MotorLoopSettings& settings, MotorOutputFunc output_func);
+
+    // Stops the loop thread. The output_func isn't called after this.
+    ~MotorLoop();
+
+    MotorLoop(const MotorLoop&) = delete;
+    MotorLoop& operator=(const MotorLoop&) = delete;
+
+    // Hands a command to the loop. This must only be called from one thread at a time, which is the control channel's
+    // strand in the server. It never blocks.
+    void post(const DrivePayload& command);
+
+    struct Stats {
+      uint64_t ticks = 0;
+      uint64_t commands = 0;       // the commands the loop has picked up; the ones that were overwritten aren't counted
+      uint64_t deadman_stops = 0;  // how many times the loop's deadman stopped the motors
+      uint64_t overruns = 0;       // the ticks that were skipped because the loop woke up more than a period late
+      int64_t max_lateness_us = 0; // how late the loop has woken up at the most
+    };
+    // This can be called from any thread.
+    Stats getStats() const;
+
+  private:
+    struct PostedCommand {
+      DrivePayload command;
+      int64_t received_ns;
+    };
+
+    void run();
+
+    MotorLoopSettings settings_;
+    MotorOutputFunc output_func_;
+    LatestValueMailbox<PostedCommand> mailbox_;
+    std::atomic<bool> stopping_{false};
+
+    std::atomic<uint64_t> ticks_{0};
+    std::atomic<uint64_t> commands_{0};
+    std::atomic<uint64_t> deadman_stops_{0};
+    std::atomic<uint64_t> overruns_{0};
+    std::atomic<int64_t> max_lateness_us_{0};
+
+    std::thread thread_;
+};
+
+
+}
+
+#endif
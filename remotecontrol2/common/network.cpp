@@ -1,8 +1,83 @@
 #include "network.h"
 
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
 
 namespace snowrobot {
 
 
+size_t Message::decode(std::span<const uint8_t> data, Message& message) {
+  if (data.size() < header_size) {
+    return 0;
+  }
+  if (data[0] != magic) {
+    std::ostringstream msg;
+    msg << "Message::decode(): got the magic byte " << (int)data[0] << " instead of " << (int)magic;
+    throw std::runtime_error(msg.str());
+  }
+  if (data[1] != version) {
+    std::ostringstream msg;
+    msg << "Message::decode(): unsupported protocol version " << (int)data[1];
+    throw std::runtime_error(msg.str());
+  }
+  uint32_t payload_size = read_uint32(&data[4]);
+  if (payload_size > max_payload_size) {
+    std::ostringstream msg;
+    msg << "Message::decode(): the payload size " << payload_size << " is larger than the max " << max_payload_size;
+    throw std::runtime_error(msg.str());
+  }
+  if (data.size() < header_size + payload_size) {
+    return 0;
+  }
+  message.type_ = (MessageType)read_uint16(&data[2]);
+  message.payload_ = data.subspan(header_size, payload_size);
+  return header_size + payload_size;
+}
+
+
+std::string_view Message::asText() const {
+  if (this->type_ != MessageType::Text) {
+    std::ostringstream msg;
+    msg << "Message::asText(): the message has type " << (int)this->type_;
+    throw std::runtime_error(msg.str());
+  }
+  return std::string_view((const char*)this->payload_.data(), this->payload_.size());
 }
 
+
+void Message::encodeText(std::string_view text, std::vector<uint8_t>& out) {
+  uint8_t* header = appendHeader(MessageType::Text, text.size(), out);
+  std::copy(text.begin(), text.end(), header + header_size);
+}
+
+
+void Message::checkPayload(MessageType type, size_t size) const {
+  if (this->type_ != type || this->payload_.size() != size) {
+    std::ostringstream msg;
+    msg << "Message::as(): expected type " << (int)type << " with " << size << " bytes, but the message has type "
+        << (int)this->type_ << " with " << this->payload_.size() << " bytes";
+    throw std::runtime_error(msg.str());
+  }
+}
+
+
+uint8_t* Message::appendHeader(MessageType type, size_t payload_size, std::vector<uint8_t>& out) {
+  if (payload_size > max_payload_size) {
+    std::ostringstream msg;
+    msg << "Message::encode(): the payload size " << payload_size << " is larger than the max " << max_payload_size;
+    throw std::runtime_error(msg.str());
+  }
+  size_t offset = out.size();
+  out.resize(offset + header_size + payload_size);
+  uint8_t* header = out.data() + offset;
+  header[0] = magic;
+  header[1] = version;
+  write_uint16(header + 2, (uint16_t)type);
+  write_uint32(header + 4, (uint32_t)payload_size);
+  return header;
+}
+
+
+}
@@ -1,16 +1,167 @@
 #ifndef SNOWROBOT_REMOTECONTROL_COMMON_NETWORK
 #define SNOWROBOT_REMOTECONTROL_COMMON_NETWORK
 
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <vector>
+
 
 namespace snowrobot {
 
-class Message {
-    public:
-    
+
+// This file implements the binary protocol that is used for high-rate messages like the drive commands. The
+// line-based json protocol is nice for debugging, but it is too slow to parse for messages that are sent many times per
+// second. Both protocols can be used on the same port, see LineBasedServer.
+//
+// Each message is a fixed-size header followed by a typed payload. All the integers are in network byte order.
+//
+//   offset  size  field
+//   0       1     magic (0xB5, which can never be the first byte of a text line)
+//   1       1     protocol version
+//   2       2     message type
+//   4       4     payload size in bytes
+//   8       n     payload
+//
+// The messages are decoded in-place from the receive buffer, so no heap allocations are needed.
+
+
+enum class MessageType : uint16_t {
+  Text = 1,   // the payload is a line of text, normally a json document
+  Ping = 2,   // the payload is a PingPayload, and the receiver answers with a Pong that has the same payload
+  Pong = 3,
+  Drive = 4,  // the payload is a DrivePayload
+};
+
+
+// The byte order helpers that the payloads are encoded with.
+inline void write_uint16(uint8_t* out, uint16_t value) {
+  out[0] = (uint8_t)(value >> 8);
+  out[1] = (uint8_t)value;
+}
+
+inline void write_uint32(uint8_t* out, uint32_t value) {
+  write_uint16(out, (uint16_t)(value >> 16));
+  write_uint16(out + 2, (uint16_t)value);
+}
+
+inline void write_uint64(uint8_t* out, uint64_t value) {
+  write_uint32(out, (uint32_t)(value >> 32));
+  write_uint32(out + 4, (uint32_t)value);
+}
+
+inline uint16_t read_uint16(const uint8_t* in) {
+  return (uint16_t)((in[0] << 8) | in[1]);
+}
+
+inline uint32_t read_uint32(const uint8_t* in) {
+  return ((uint32_t)read_uint16(in) << 16) | read_uint16(in + 2);
+}
+
+inline uint64_t read_uint64(const uint8_t* in) {
+  return ((uint64_t)read_uint32(in) << 32) | read_uint32(in + 4);
+}
+
+
+struct PingPayload {
+  static constexpr MessageType type = MessageType::Ping;
+  static constexpr size_t encoded_size = 8;
+
+  uint64_t timestamp_us = 0;  // any value the sender likes, it is echoed back in the pong
+
+  void encode(uint8_t* out) const {
+    write_uint64(out, timestamp_us);
+  }
+  static PingPayload decode(const uint8_t* in) {
+    return PingPayload{read_uint64(in)};
+  }
+};
+
+
+struct PongPayload {
+  static constexpr MessageType type = MessageType::Pong;
+  static constexpr size_t encoded_size = 8;
+
+  uint64_t timestamp_us = 0;  // the timestamp from the ping
+
+  void encode(uint8_t* out) const {
+    write_uint64(out, timestamp_us);
+  }
+  static PongPayload decode(const uint8_t* in) {
+    return PongPayload{read_uint64(in)};
+  }
+};
+
+
+// A movement command from the operator. The steering and throttle values are in per mille of full deflection.
+struct DrivePayload {
+  static constexpr MessageType type = MessageType::Drive;
+  static constexpr size_t encoded_size = 16;
+
+  uint32_t sequence_nr = 0;
+  int16_t steering = 0;  // -1000 (full left) to 1000 (full right)
+  int16_t throttle = 0;  // -1000 (full reverse) to 1000 (full forward)
+  uint64_t timestamp_us = 0;  // when the command was sent, in microseconds since the unix epoch
+
+  void encode(uint8_t* out) const {
+    write_uint32(out, sequence_nr);
+    write_uint16(out + 4, (uint16_t)steering);
+    write_uint16(out + 6, (uint16_t)throttle);
+    write_uint64(out + 8, timestamp_us);
+  }
+  static DrivePayload decode(const uint8_t* in) {
+    return DrivePayload{read_uint32(in), (int16_t)read_uint16(in + 4), (int16_t)read_uint16(in + 6), read_uint64(in + 8)};
+  }
 };
 
 
+// A single binary message. A decoded Message refers to the buffer it was decoded from, so the buffer must outlive it.
+class Message {
+  public:
+    static constexpr uint8_t magic = 0xB5;
+    static constexpr uint8_t version = 1;
+    static constexpr size_t header_size = 8;
+    static constexpr size_t max_payload_size = 64 * 1024;
+
+    Message() = default;
+
+    MessageType getType() const { return type_; }
+    std::span<const uint8_t> getPayload() const { return payload_; }
+
+    // Decodes the message at the start of the data. Returns the number of bytes the message used, or 0 if the data
+    // doesn't contain the whole message yet. Throws a std::runtime_error if the data isn't a valid message.
+    static size_t decode(std::span<const uint8_t> data, Message& message);
+
+    // Returns the typed payload. Throws a std::runtime_error if the message has another type or size.
+    template<typename Payload>
+    Payload as() const {
+      checkPayload(Payload::type, Payload::encoded_size);
+      return Payload::decode(payload_.data());
+    }
+
+    // Returns the payload of a Text message.
+    std::string_view asText() const;
+
+    // Appends the encoded message to the out buffer. The buffer can be reused between messages to avoid allocations.
+    template<typename Payload>
+    static void encode(const Payload& payload, std::vector<uint8_t>& out) {
+      uint8_t* header = appendHeader(Payload::type, Payload::encoded_size, out);
+      payload.encode(header + header_size);
+    }
+    static void encodeText(std::string_view text, std::vector<uint8_t>& out);
+
+  private:
+    void checkPayload(MessageType type, size_t size) const;
+    // Makes room for the header and payload at the end of the out buffer and writes the header. Returns a pointer to
+    // the header.
+    static uint8_t* appendHeader(MessageType type, size_t payload_size, std::vector<uint8_t>& out);
+
+    MessageType type_ = MessageType::Text;
+    std::span<const uint8_t> payload_;
+};
+
 
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,152 @@
+#include "playoutcontroller.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+#include <boost/log/trivial.hpp>
+
+
+namespace snowrobot {
+
+
+PlayoutController::PlayoutController(const PlayoutSettings& settings) :
+  settings_(settings),
+  latency_ms_(std::clamp(settings.start_latency_ms, settings.min_latency_ms, settings.max_latency_ms))
+{
+}
+
+
+int PlayoutController::update(const PlayoutSample& sample) {
+  // The packets arrive within about 4 times the jitter estimate, and the margin covers the scheduling and decoding
+  // of the frame that the latency is counted from.
+  constexpr double jitter_multiplier = 4.0;
+  constexpr double margin_ms = 10.0;
+  constexpr double max_late_fraction = 0.01;
+  constexpr double late_increase_factor = 1.5;
+  constexpr double decrease_rate = 0.1;
+
+  double wanted_ms = jitter_multiplier * sample.jitter_ms + margin_ms;
+  double late_fraction = sample.packets > 0 ? (double)sample.late_packets / sample.packets : 0.0;
+  if (late_fraction > max_late_fraction) {
+    latency_ms_ = std::max(latency_ms_ * late_increase_factor, wanted_ms);
+  } else if (wanted_ms > latency_ms_) {
+    latency_ms_ = wanted_ms;
+  } else if (sample.lost_packets == 0) {
+    latency_ms_ -= (latency_ms_ - wanted_ms) * decrease_rate;
+  }
+  latency_ms_ = std::clamp(latency_ms_, (double)settings_.min_latency_ms, (double)settings_.max_latency_ms);
+  return getLatency();
+}
+
+
+AdaptivePlayout::AdaptivePlayout(GstElement* rtpbin, const PlayoutSettings& settings)
+  : rtpbin_((GstElement*)gst_object_ref(rtpbin)),
+    controller_(settings),
+    applied_latency_ms_(controller_.getLatency())
+{
+  g_object_set(rtpbin, "latency", (guint)this->applied_latency_ms_, NULL);
+  this->state_.latency_ms = this->applied_latency_ms_;
+  this->new_jitterbuffer_handler_ = g_signal_connect(rtpbin, "new-jitterbuffer",
+                                                     G_CALLBACK(AdaptivePlayout::onNewJitterbuffer), this);
+  this->pad_removed_handler_ = g_signal_connect(rtpbin, "pad-removed", G_CALLBACK(AdaptivePlayout::onPadRemoved), this);
+}
+
+
+AdaptivePlayout::~AdaptivePlayout() {
+  g_signal_handler_disconnect(this->rtpbin_, this->new_jitterbuffer_handler_);
+  g_signal_handler_disconnect(this->rtpbin_, this->pad_removed_handler_);
+  for (auto& item : this->jitterbuffers_) {
+    gst_object_unref(item.first);
+  }
+  gst_object_unref(this->rtpbin_);
+}
+
+
+void AdaptivePlayout::onNewJitterbuffer(GstElement* rtpbin, GstElement* jitterbuffer, guint session, guint ssrc, gpointer user_data) {
+  AdaptivePlayout* self = (AdaptivePlayout*)user_data;
+  std::lock_guard<std::mutex> guard(self->lock_);
+  self->jitterbuffers_[(GstElement*)gst_object_ref(jitterbuffer)] = Jitterbuffer{session, ssrc};
+}
+
+
+void AdaptivePlayout::onPadRemoved(GstElement* rtpbin, GstPad* pad, gpointer user_data) {
+  AdaptivePlayout* self = (AdaptivePlayout*)user_data;
+  // Each stream's jitterbuffer sits in front of its "recv_rtp_src_<session>_<ssrc>_<pt>" pad, and the rtpbin removes
+  // the pad when it removes the stream, like when the sender's ssrc times out or the session is released.
+  gchar* name = gst_pad_get_name(pad);
+  guint session = 0, ssrc = 0, pt = 0;
+  bool is_stream_pad = sscanf(name, "recv_rtp_src_%u_%u_%u", &session, &ssrc, &pt) == 3;
+  g_free(name);
+  if (!is_stream_pad) {
+    return;
+  }
+  std::lock_guard<std::mutex> guard(self->lock_);
+  for (auto it = self->jitterbuffers_.begin(); it != self->jitterbuffers_.end();) {
+    if (it->second.session == session && it->second.ssrc == ssrc) {
+      gst_object_unref(it->first);
+      it = self->jitterbuffers_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+
+int AdaptivePlayout::update() {
+  // The largest jitter of all the streams decides, since they share the rtpbin's latency.
+  PlayoutSample sample;
+  {
+    std::lock_guard<std::mutex> guard(this->lock_);
+    for (auto& [jitterbuffer, info] : this->jitterbuffers_) {
+      JitterbufferTotals& totals = info.totals;
+      GstStructure* stats = nullptr;
+      g_object_get(jitterbuffer, "stats", &stats, NULL);
+      if (stats == nullptr) {
+        continue;
+      }
+      guint64 pushed = 0, late = 0, lost = 0, avg_jitter_ns = 0;
+      gst_structure_get_uint64(stats, "num-pushed", &pushed);
+      gst_structure_get_uint64(stats, "num-late", &late);
+      gst_structure_get_uint64(stats, "num-lost", &lost);
+      gst_structure_get_uint64(stats, "avg-jitter", &avg_jitter_ns);
+      gst_structure_free(stats);
+
+      uint64_t new_pushed = pushed - std::min(pushed, totals.pushed);
+      uint64_t new_late = late - std::min(late, totals.late);
+      uint64_t new_lost = lost - std::min(lost, totals.lost);
+      sample.packets += new_pushed + new_late + new_lost;
+      sample.late_packets += new_late;
+      sample.lost_packets += new_lost;
+      sample.jitter_ms = std::max(sample.jitter_ms, avg_jitter_ns / 1e6);
+      totals = JitterbufferTotals{pushed, late, lost};
+    }
+  }
+
+  int latency_ms = this->controller_.update(sample);
+  constexpr int min_change_ms = 5;
+  if (std::abs(latency_ms - this->applied_latency_ms_) >= min_change_ms) {
+    BOOST_LOG_TRIVIAL(info) << "AdaptivePlayout::update(): changing the jitterbuffer latency from " << this->applied_latency_ms_
+                            << "ms to " << latency_ms << "ms. jitter:" << sample.jitter_ms << "ms late:" << sample.late_packets
+                            << " lost:" << sample.lost_packets << " of " << sample.packets << " packets";
+    g_object_set(this->rtpbin_, "latency", (guint)latency_ms, NULL);
+    this->applied_latency_ms_ = latency_ms;
+  }
+
+  std::lock_guard<std::mutex> guard(this->lock_);
+  this->state_.latency_ms = this->applied_latency_ms_;
+  this->state_.jitter_ms = sample.jitter_ms;
+  this->state_.packets += sample.packets;
+  this->state_.late_packets += sample.late_packets;
+  this->state_.lost_packets += sample.lost_packets;
+  return this->applied_latency_ms_;
+}
+
+
+PlayoutState AdaptivePlayout::getState() const {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  return this->state_;
+}
+
+
+}
@@ -0,0 +1,117 @@
+#ifndef SNOWROBOT_REMOTECONTROL_COMMON_PLAYOUTCONTROLLER_H
+#define SNOWROBOT_REMOTECONTROL_COMMON_PLAYOUTCONTROLLER_H
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+
+#include <gst/gst.h>
+
+
+namespace snowrobot {
+
+
+// The bounds for the receiver's jitterbuffer latency, which the operator sets on the command line.
+struct PlayoutSettings {
+  int min_latency_ms = 20;
+  int start_latency_ms = 200;
+  int max_latency_ms = 500;
+};
+
+
+// What the jitterbuffers saw since the previous PlayoutController::update().
+struct PlayoutSample {
+  double jitter_ms = 0.0;      // the interarrival jitter estimate
+  uint64_t packets = 0;        // all the packets, including the late and lost ones
+  uint64_t late_packets = 0;   // the packets that arrived after their playout time and were dropped
+  uint64_t lost_packets = 0;   // the packets that never arrived
+};
+
+
+// Picks the jitterbuffer latency. A fixed 200 ms is mostly wasted delay on a wired LAN, where the jitter is a ms or two,
+// and it is sometimes too little on LTE. This keeps the latency at a few times the measured jitter, within the
+// operator's bounds:
+//  * If more than 1% of the packets arrived too late, the latency is increased by half right away.
+//  * If the jitter grows, the latency follows it right away.
+//  * If the jitter shrinks, the latency comes down by a tenth of the difference each second, so a single quiet second
+//    on a bursty link doesn't bring it down too far. It isn't lowered while packets are being lost, since the
+//    retransmissions need the time.
+class PlayoutController {
+  public:
+    explicit PlayoutController(const PlayoutSettings& settings = {});
+
+    // Updates the latency from the jitterbuffer stats of the last interval (about a second). Returns the new latency
+    // in ms.
+    int update(const PlayoutSample& sample);
+
+    int getLatency() const {
+      return (int)latency_ms_;
+    }
+
+  private:
+    PlayoutSettings settings_;
+    double latency_ms_;
+};
+
+
+// The state that is shown on the debug ports.
+struct PlayoutState {
+  int latency_ms = 0;
+  double jitter_ms = 0.0;
+  uint64_t packets = 0;
+  uint64_t late_packets = 0;
+  uint64_t lost_packets = 0;
+};
+
+
+// Runs a PlayoutController on a receiver's rtpbin. It reads the stats of all the rtpbin's jitterbuffers, and sets the
+// rtpbin's latency, which the rtpbin passes on to the jitterbuffers. update() is called about once a second. A
+// jitterbuffer is forgotten when the rtpbin removes its stream's pad, so a stream that has gone away doesn't hold on to
+// the jitterbuffer or keep counting in the jitter.
+class AdaptivePlayout {
+  public:
+    AdaptivePlayout(GstElement* rtpbin, const PlayoutSettings& settings);
+    ~AdaptivePlayout();
+
+    AdaptivePlayout(const AdaptivePlayout&) = delete;
+    AdaptivePlayout& operator=(const AdaptivePlayout&) = delete;
+
+    // Returns the new latency in ms.
+    int update();
+
+    PlayoutState getState() const;
+
+  private:
+    // The jitterbuffers' stats are counters since they were created.
+    struct JitterbufferTotals {
+      uint64_t pushed = 0;
+      uint64_t late = 0;
+      uint64_t lost = 0;
+    };
+    struct Jitterbuffer {
+      guint session = 0;
+      guint ssrc = 0;
+      JitterbufferTotals totals;
+    };
+
+    static void onNewJitterbuffer(GstElement* rtpbin, GstElement* jitterbuffer, guint session, guint ssrc, gpointer user_data);
+    static void onPadRemoved(GstElement* rtpbin, GstPad* pad, gpointer user_data);
+
+    GstElement* rtpbin_;
+    gulong new_jitterbuffer_handler_ = 0;
+    gulong pad_removed_handler_ = 0;
+    PlayoutController controller_;
+    // The latency the rtpbin has now. It is only changed when the controller moves it by a few ms, since each change
+    // makes the pipeline recalculate its latency.
+    int applied_latency_ms_;
+
+    // The signal is emitted on the gstreamer threads.
+    mutable std::mutex lock_;
+    std::map<GstElement*, Jitterbuffer> jitterbuffers_;  // we hold a reference to each
+    PlayoutState state_;
+};
+
+
+}
+
+#endif
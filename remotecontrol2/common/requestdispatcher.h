@@ -0,0 +1,259 @@
+#ifndef SNOWROBOT_REMOTECONTROL_COMMON_REQUESTDISPATCHER_H
+#define SNOWROBOT_REMOTECONTROL_COMMON_REQUESTDISPATCHER_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/json/monotonic_resource.hpp>
+#include <boost/json/parser.hpp>
+#include <boost/json/value.hpp>
+
+
+namespace snowrobot {
+
+
+// A request name that can be used as a template argument, like onText<"ping">(...).
+template<size_t N>
+struct RequestName {
+  constexpr RequestName(const char (&name)[N]) {
+    std::copy_n(name, N, this->chars);
+  }
+
+  constexpr std::string_view view() const {
+    return std::string_view(this->chars, N - 1);
+  }
+
+  char chars[N];
+};
+
+
+// A handler for a plain text request, like "ping". It is called with the dispatch() arguments.
+template<RequestName Name, typename Func>
+struct TextRequestHandler {
+  static constexpr std::string_view name = Name.view();
+  static constexpr bool is_json = false;
+  Func func;
+};
+
+// A handler for a json request, which is an object with a "type" member, like {"type": "select-resolution", ...}. It
+// is called with the parsed object and then the dispatch() arguments. The object lives in the dispatcher's arena, so
+// the handler must copy anything it wants to keep after it has returned (or after its coroutine has finished).
+template<RequestName Name, typename Func>
+struct JsonRequestHandler {
+  static constexpr std::string_view name = Name.view();
+  static constexpr bool is_json = true;
+  Func func;
+};
+
+template<RequestName Name, typename Func>
+TextRequestHandler<Name, Func> onText(Func func) {
+  return {std::move(func)};
+}
+
+template<RequestName Name, typename Func>
+JsonRequestHandler<Name, Func> onJson(Func func) {
+  return {std::move(func)};
+}
+
+
+// The memory a json request is parsed into. The first few KB come from a buffer inside the arena, and everything is
+// thrown away at once when the next request is parsed, so the small requests are parsed without touching the heap.
+class RequestArena {
+  public:
+    RequestArena()
+      : resource_(buffer_.data(), buffer_.size()),
+        parser_(boost::json::storage_ptr(), boost::json::parse_options(), parser_stack_.data(), parser_stack_.size())
+    {
+    }
+
+    RequestArena(const RequestArena&) = delete;
+    RequestArena& operator=(const RequestArena&) = delete;
+
+    // Parses the text, which must be a json object. Throws if it isn't. The object is valid until the next parse().
+    const boost::json::object& parse(std::string_view text) {
+      this->value_.reset();
+      this->resource_.release();
+      this->parser_.reset(boost::json::storage_ptr(&this->resource_));
+      this->parser_.write(text.data(), text.size());
+      // The value is move-constructed, which keeps it in the arena. Assigning it would copy it to the heap.
+      this->value_.emplace(this->parser_.release());
+      if (!this->value_->is_object()) {
+        throw std::runtime_error("The request isn't a json object");
+      }
+      return this->value_->get_object();
+    }
+
+  private:
+    std::array<unsigned char, 4096> buffer_;
+    boost::json::monotonic_resource resource_;
+    std::array<unsigned char, 1024> parser_stack_;
+    boost::json::parser parser_;
+    std::optional<boost::json::value> value_;
+};
+
+
+template<typename T>
+struct is_awaitable : std::false_type {};
+
+template<typename T, typename Executor>
+struct is_awaitable<boost::asio::awaitable<T, Executor>> : std::true_type {};
+
+
+template<typename... Handlers>
+constexpr bool hasUniqueRequestNames() {
+  std::array<std::pair<bool, std::string_view>, sizeof...(Handlers)> names{
+    std::pair<bool, std::string_view>(Handlers::is_json, Handlers::name)...};
+  for (size_t i = 0; i < names.size(); i++) {
+    for (size_t j = i + 1; j < names.size(); j++) {
+      if (names[i] == names[j]) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+
+// Calls the handler that matches a request, from a table of handlers that is put together at compile time:
+//
+//   auto dispatcher = makeRequestDispatcher<std::string>(
+//     onText<"ping">([](boost::asio::ip::tcp::socket& sock) { return std::string("pong"); }),
+//     onJson<"select-camera">([&](const boost::json::object& request, boost::asio::ip::tcp::socket& sock) { ... }));
+//   std::string response = dispatcher.dispatch(request, sock);
+//
+// A request that is the name of a text handler is handled without being parsed. Anything else is parsed as a json
+// object into a reused RequestArena, and dispatched on its "type". The handlers are kept in a tuple and the names are
+// compared as string_views, so the dispatching itself never allocates, and a small json request can be handled
+// without any allocations at all if the handler doesn't make any. Two handlers of the same kind with the same name
+// don't compile.
+//
+// If the handlers return a boost::asio::awaitable, use asyncDispatch(), which keeps the request's arena until the
+// handler's coroutine has finished. Each request that is in progress has an arena of its own, and they are reused by
+// the later requests.
+//
+// dispatch() throws a std::runtime_error if no handler matches, and lets the handler's exceptions through. The
+// dispatcher isn't thread safe, it must only be used from one thread or strand at a time.
+template<typename Result, typename... Handlers>
+class RequestDispatcher {
+  static_assert(hasUniqueRequestNames<Handlers...>(), "Two request handlers have the same name");
+
+  public:
+    explicit RequestDispatcher(Handlers... handlers) : handlers_(std::move(handlers)...) {
+    }
+
+    template<typename... Args>
+    Result dispatch(std::string_view request, Args&... args) requires (!is_awaitable<Result>::value) {
+      ArenaLease lease(*this);
+      return std::move(*this->call(request, lease.get(), args...));
+    }
+
+    // The request and the args must stay valid until the returned coroutine has finished.
+    template<typename... Args>
+    Result asyncDispatch(std::string_view request, Args&... args) requires (is_awaitable<Result>::value) {
+      ArenaLease lease(*this);
+      co_return co_await std::move(*this->call(request, lease.get(), args...));
+    }
+
+  private:
+    class ArenaLease {
+      public:
+        explicit ArenaLease(RequestDispatcher& dispatcher) : dispatcher_(dispatcher) {
+          if (dispatcher.free_arenas_.empty()) {
+            this->arena_ = std::make_unique<RequestArena>();
+          } else {
+            this->arena_ = std::move(dispatcher.free_arenas_.back());
+            dispatcher.free_arenas_.pop_back();
+          }
+        }
+
+        ~ArenaLease() {
+          this->dispatcher_.free_arenas_.push_back(std::move(this->arena_));
+        }
+
+        RequestArena& get() {
+          return *this->arena_;
+        }
+
+      private:
+        RequestDispatcher& dispatcher_;
+        std::unique_ptr<RequestArena> arena_;
+    };
+
+    template<typename... Args>
+    std::optional<Result> call(std::string_view request, RequestArena& arena, Args&... args) {
+      std::optional<Result> result;
+      bool handled = std::apply([&](auto&... handler) {
+        return (this->tryText(handler, request, result, args...) || ...);
+      }, this->handlers_);
+      if (handled) {
+        return result;
+      }
+      if (request.empty() || request.front() != '{') {
+        throw std::runtime_error("Unknown request: '" + std::string(request) + "'");
+      }
+      const boost::json::object& request_obj = arena.parse(request);
+      const boost::json::value* type = request_obj.if_contains("type");
+      if (type == nullptr || !type->is_string()) {
+        throw std::runtime_error("The request has no type");
+      }
+      std::string_view request_type = type->get_string();
+      handled = std::apply([&](auto&... handler) {
+        return (this->tryJson(handler, request_type, request_obj, result, args...) || ...);
+      }, this->handlers_);
+      if (!handled) {
+        throw std::runtime_error("Unknown request type: '" + std::string(request_type) + "'");
+      }
+      return result;
+    }
+
+    template<typename Handler, typename... Args>
+    static bool tryText(Handler& handler, std::string_view request, std::optional<Result>& result, Args&... args) {
+      if constexpr (Handler::is_json) {
+        return false;
+      } else {
+        if (request != Handler::name) {
+          return false;
+        }
+        result.emplace(handler.func(args...));
+        return true;
+      }
+    }
+
+    template<typename Handler, typename... Args>
+    static bool tryJson(Handler& handler, std::string_view request_type, const boost::json::object& request_obj,
+                        std::optional<Result>& result, Args&... args) {
+      if constexpr (!Handler::is_json) {
+        return false;
+      } else {
+        if (request_type != Handler::name) {
+          return false;
+        }
+        result.emplace(handler.func(request_obj, args...));
+        return true;
+      }
+    }
+
+    std::tuple<Handlers...> handlers_;
+    std::vector<std::unique_ptr<RequestArena>> free_arenas_;
+};
+
+
+template<typename Result, typename... Handlers>
+RequestDispatcher<Result, Handlers...> makeRequestDispatcher(Handlers... handlers) {
+  return RequestDispatcher<Result, Handlers...>(std::move(handlers)...);
+}
+
+
+}
+
+#endif
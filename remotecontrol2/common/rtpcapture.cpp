@@ -0,0 +1,187 @@
+#include "rtpcapture.h"
+#include "gst_wrappers.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <filesystem>
+
+#include <boost/log/trivial.hpp>
+
+
+namespace snowrobot {
+
+
+static_assert(std::endian::native == std::endian::little, "The capture files are written in little-endian byte order");
+
+
+static constexpr size_t paddedSize(size_t size) {
+  return (size + 7) & ~(size_t)7;
+}
+
+
+RtpCaptureWriter::RtpCaptureWriter(const std::string& path) : path_(path) {
+  int64_t now_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  this->opened_ = std::chrono::steady_clock::now();
+  this->last_flush_ = this->opened_;
+
+  FILE* existing = fopen(path.c_str(), "rb");
+  long existing_size = 0;
+  if (existing != nullptr) {
+    fseek(existing, 0, SEEK_END);
+    existing_size = ftell(existing);
+    fclose(existing);
+  }
+  if (existing_size > 0) {
+    uint64_t valid_size = 0;
+    bool truncated = false;
+    {
+      // This throws if the file isn't a capture file. The reader's mapping must be gone before the file is resized.
+      RtpCaptureReader reader(path);
+      RtpCaptureRecord record;
+      while (reader.next(record)) {
+      }
+      truncated = reader.isTruncated();
+      valid_size = reader.getOffset();
+      this->opened_time_us_ = (uint64_t)std::max<int64_t>(0, now_us - reader.getStartTime());
+    }
+    if (truncated) {
+      // Appending after a partial record would make the reader stop there, so the new records would be lost. A crash
+      // almost always leaves one, since fwrite() flushes at its buffer boundaries rather than at the record boundaries.
+      BOOST_LOG_TRIVIAL(warning) << "RtpCaptureWriter: the capture file '" << path << "' ends with a partial record, "
+                                 << "cutting off the last " << existing_size - valid_size << " bytes";
+      std::error_code error;
+      std::filesystem::resize_file(path, valid_size, error);
+      if (error) {
+        THROW_RUNTIME_ERROR("Failed to cut the partial record off the capture file '" << path << "': " << error.message());
+      }
+    }
+    this->file_ = fopen(path.c_str(), "ab");
+    if (this->file_ == nullptr) {
+      THROW_RUNTIME_ERROR("Failed to open the capture file '" << path << "'");
+    }
+    BOOST_LOG_TRIVIAL(info) << "RtpCaptureWriter: appending to the capture file '" << path << "'";
+    return;
+  }
+
+  this->file_ = fopen(path.c_str(), "wb");
+  if (this->file_ == nullptr) {
+    THROW_RUNTIME_ERROR("Failed to create the capture file '" << path << "'");
+  }
+  RtpCaptureFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, rtp_capture_magic, sizeof(header.magic));
+  header.version = rtp_capture_version;
+  header.start_time_us = now_us;
+  ASSERT_TRUE(fwrite(&header, sizeof(header), 1, this->file_) == 1);
+  fflush(this->file_);
+  BOOST_LOG_TRIVIAL(info) << "RtpCaptureWriter: created the capture file '" << path << "'";
+}
+
+
+RtpCaptureWriter::~RtpCaptureWriter() {
+  if (this->file_ != nullptr) {
+    fclose(this->file_);
+  }
+}
+
+
+void RtpCaptureWriter::write(uint16_t stream, RtpCaptureKind kind, const void* data, size_t size) {
+  static const uint8_t padding[8] = {};
+  // The time is read under the lock, so that the records from the different streams are in time order.
+  std::lock_guard<std::mutex> guard(this->lock_);
+  auto now = std::chrono::steady_clock::now();
+  RtpCaptureRecordHeader header;
+  header.time_us = this->opened_time_us_ +
+      std::chrono::duration_cast<std::chrono::microseconds>(now - this->opened_).count();
+  header.size = (uint32_t)size;
+  header.stream = stream;
+  header.kind = kind;
+  header.reserved = 0;
+  // fwrite() buffers the records, so this is a couple of memcpys for most packets.
+  if (fwrite(&header, sizeof(header), 1, this->file_) != 1 ||
+      (size > 0 && fwrite(data, size, 1, this->file_) != 1) ||
+      (paddedSize(size) > size && fwrite(padding, paddedSize(size) - size, 1, this->file_) != 1)) {
+    // A full disk shouldn't take the video down with it, so we just log it.
+    BOOST_LOG_TRIVIAL(error) << "RtpCaptureWriter::write(): failed to write to '" << this->path_ << "'";
+    return;
+  }
+  this->record_count_++;
+  this->byte_count_ += sizeof(header) + paddedSize(size);
+  if (now - this->last_flush_ >= std::chrono::seconds(1)) {
+    fflush(this->file_);
+    this->last_flush_ = now;
+  }
+}
+
+
+void RtpCaptureWriter::flush() {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  fflush(this->file_);
+  this->last_flush_ = std::chrono::steady_clock::now();
+}
+
+
+uint64_t RtpCaptureWriter::getRecordCount() const {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  return this->record_count_;
+}
+
+
+uint64_t RtpCaptureWriter::getByteCount() const {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  return this->byte_count_;
+}
+
+
+RtpCaptureReader::RtpCaptureReader(const std::string& path)
+  : file_(path.c_str(), boost::interprocess::read_only),
+    region_(file_, boost::interprocess::read_only)
+{
+  this->begin_ = (const uint8_t*)this->region_.get_address();
+  this->end_ = this->begin_ + this->region_.get_size();
+  if (this->region_.get_size() < sizeof(RtpCaptureFileHeader)) {
+    THROW_RUNTIME_ERROR("The file '" << path << "' is too short to be a capture file");
+  }
+  const RtpCaptureFileHeader* header = (const RtpCaptureFileHeader*)this->begin_;
+  if (memcmp(header->magic, rtp_capture_magic, sizeof(header->magic)) != 0) {
+    THROW_RUNTIME_ERROR("The file '" << path << "' isn't a capture file");
+  }
+  if (header->version != rtp_capture_version) {
+    THROW_RUNTIME_ERROR("The capture file '" << path << "' has the unknown version " << header->version);
+  }
+  this->start_time_us_ = header->start_time_us;
+  this->rewind();
+}
+
+
+bool RtpCaptureReader::next(RtpCaptureRecord& record) {
+  if (this->end_ - this->position_ < (ptrdiff_t)sizeof(RtpCaptureRecordHeader)) {
+    this->truncated_ = this->position_ != this->end_;
+    return false;
+  }
+  const RtpCaptureRecordHeader* header = (const RtpCaptureRecordHeader*)this->position_;
+  const uint8_t* data = this->position_ + sizeof(RtpCaptureRecordHeader);
+  // The writer always writes the padding, so a record without it was cut short too.
+  if ((size_t)(this->end_ - data) < paddedSize(header->size)) {
+    this->truncated_ = true;
+    return false;
+  }
+  record.time_us = header->time_us;
+  record.stream = header->stream;
+  record.kind = header->kind;
+  record.data = data;
+  record.size = header->size;
+  this->position_ = data + paddedSize(header->size);
+  return true;
+}
+
+
+void RtpCaptureReader::rewind() {
+  this->position_ = this->begin_ + sizeof(RtpCaptureFileHeader);
+  this->truncated_ = false;
+}
+
+
+}
@@ -0,0 +1,140 @@
+#ifndef SNOWROBOT_REMOTECONTROL_COMMON_RTPCAPTURE_H
+#define SNOWROBOT_REMOTECONTROL_COMMON_RTPCAPTURE_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+
+namespace snowrobot {
+
+
+// A capture file holds the rtp and rtcp packets of a session, with the time each packet was seen, so that a field
+// session can be replayed into a receiver later (see benchmarks/rtpreplay.cpp).
+//
+// The file is a RtpCaptureFileHeader followed by records. Each record is a RtpCaptureRecordHeader followed by the
+// packet, padded to a multiple of 8 bytes so that the next header is aligned. The records are only ever appended, so
+// a file from a server that crashed or lost its power is valid up to the last whole record. The numbers are stored in
+// the host's byte order, which is little-endian on all the machines we use. The reader maps the file into memory and
+// hands out pointers into it, so replaying a large capture doesn't copy the packets.
+
+constexpr char rtp_capture_magic[8] = {'S', 'N', 'O', 'W', 'R', 'T', 'P', '1'};
+constexpr uint32_t rtp_capture_version = 1;
+
+enum class RtpCaptureKind : uint8_t {
+  Rtp = 0,
+  Rtcp = 1,
+  // A json document that describes the stream, like the camera's description in the cameras message. It is written
+  // when the recording of the stream starts.
+  StreamInfo = 2,
+};
+
+struct RtpCaptureFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  // The time the file was created, in microseconds since the unix epoch. The record times count from this.
+  int64_t start_time_us;
+};
+static_assert(sizeof(RtpCaptureFileHeader) == 24);
+
+struct RtpCaptureRecordHeader {
+  uint64_t time_us;  // the time the packet was seen, in microseconds since the file's start_time_us
+  uint32_t size;     // the size of the packet, without the padding
+  uint16_t stream;   // the rtp session index of the camera
+  RtpCaptureKind kind;
+  uint8_t reserved;
+};
+static_assert(sizeof(RtpCaptureRecordHeader) == 16);
+
+
+// Appends records to a capture file. If the file already exists (the server was restarted with the same --record
+// path) the new records are added after the old ones, with times that count from the file's original start time. A
+// partial record at the end, which is what a crash or a power loss usually leaves behind, is cut off first.
+// The methods can be called from several gstreamer threads at once.
+class RtpCaptureWriter {
+  public:
+    explicit RtpCaptureWriter(const std::string& path);
+    ~RtpCaptureWriter();
+
+    RtpCaptureWriter(const RtpCaptureWriter&) = delete;
+    RtpCaptureWriter& operator=(const RtpCaptureWriter&) = delete;
+
+    // Appends a packet with the current time.
+    void write(uint16_t stream, RtpCaptureKind kind, const void* data, size_t size);
+
+    // Writes everything that is buffered to the file. write() does this about once a second by itself, so a crash loses
+    // at most the last second of the recording.
+    void flush();
+
+    const std::string& getPath() const { return path_; }
+    uint64_t getRecordCount() const;
+    uint64_t getByteCount() const;
+
+  private:
+    std::string path_;
+    mutable std::mutex lock_;
+    FILE* file_ = nullptr;
+    // The record times are the time since the file's start time. The wall clock is only read when the file is opened,
+    // since it can jump when the robot gets its time from the network.
+    uint64_t opened_time_us_ = 0;
+    std::chrono::steady_clock::time_point opened_;
+    std::chrono::steady_clock::time_point last_flush_;
+    uint64_t record_count_ = 0;
+    uint64_t byte_count_ = 0;
+};
+
+
+// One record of a capture file. The data points into the reader's mapping of the file.
+struct RtpCaptureRecord {
+  uint64_t time_us = 0;
+  uint16_t stream = 0;
+  RtpCaptureKind kind = RtpCaptureKind::Rtp;
+  const uint8_t* data = nullptr;
+  uint32_t size = 0;
+};
+
+
+// Reads a capture file from start to end. Throws a std::runtime_error if the file isn't a capture file.
+class RtpCaptureReader {
+  public:
+    explicit RtpCaptureReader(const std::string& path);
+
+    RtpCaptureReader(const RtpCaptureReader&) = delete;
+    RtpCaptureReader& operator=(const RtpCaptureReader&) = delete;
+
+    // Reads the next record. Returns false at the end of the file, and if the last record was cut short.
+    bool next(RtpCaptureRecord& record);
+
+    // Starts over from the first record.
+    void rewind();
+
+    // Returns true if next() has reached a record that was cut short, which happens when the writer didn't get to
+    // finish the file.
+    bool isTruncated() const { return truncated_; }
+
+    int64_t getStartTime() const { return start_time_us_; }
+
+    // The offset in the file right after the last record next() has returned, or after the file header if it hasn't
+    // returned any.
+    uint64_t getOffset() const { return position_ - begin_; }
+
+  private:
+    boost::interprocess::file_mapping file_;
+    boost::interprocess::mapped_region region_;
+    const uint8_t* begin_ = nullptr;
+    const uint8_t* end_ = nullptr;
+    const uint8_t* position_ = nullptr;
+    int64_t start_time_us_ = 0;
+    bool truncated_ = false;
+};
+
+
+}
+
+#endif
@@ -0,0 +1,582 @@
+#include "../common/decoderbackend.h"
+#include "../common/fec.h"
+#include "../common/gst_wrappers.h"
+#include "../common/playoutcontroller.h"
+#include "../benchmarks/latencyhistogram.h"
+#include "../benchmarks/processcputime.h"
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <gst/gst.h>
+#include <gst/rtp/rtp.h>
+
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/connect.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/streambuf.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/json/array.hpp>
+#include <boost/json/object.hpp>
+#include <boost/json/parse.hpp>
+#include <boost/json/serialize.hpp>
+#include <boost/log/trivial.hpp>
+#include <boost/program_options.hpp>
+
+
+// A receiver without a GUI that runs on Linux. It talks to the server just like the Qt client does (the cameras,
+// camera-added/-removed and welcome-response messages), receives and decodes the video from all the cameras, and
+// throws the decoded frames away. Every --report-interval seconds it prints the frame rate, jitter, packet loss and
+// decode latency of each stream, and the cpu usage per stream, and a summary when it exits. Use --decoder to compare
+// the hardware decoders with avdec_h264.
+//
+// This lets the whole server->client path run on a Linux ci box (start the server with --test-camera), and several
+// of them can be started to load-test the server.
+
+
+namespace snowrobot {
+
+
+// The numbers that are printed for each stream.
+struct StreamStats {
+  double frames_per_second = 0.0;
+  double jitter_ms = 0.0;
+  int64_t packets_lost = 0;
+  uint64_t packets_received = 0;
+};
+
+
+// Receives and decodes the video from one camera. This is the same chain as in the client's CameraView, except that
+// the decoded frames go to a fakesink.
+class StreamReceiver {
+  public:
+    // The wanted_fec_percentage is how much FEC protection we ask for if the server offers it, or -1 to take as much as
+    // the server offers.
+    boost::json::object initialize(const std::string& server_host,
+                                   GstBin* pipeline,
+                                   GstElement* rtpbin,
+                                   FecReceiver& fec_receiver,
+                                   DecoderBackend decoder_backend,
+                                   const DecoderCapabilities& decoder_capabilities,
+                                   const boost::json::object& camera,
+                                   int session_index,
+                                   int wanted_fec_percentage) {
+      pipeline_ = pipeline;
+      rtpbin_ = rtpbin;
+      session_index_ = session_index;
+      camera_name_ = std::string(camera.at("name").as_string());
+
+      video_rtp_udpsrc_ = gst_element_factory_make("udpsrc", NULL);
+      ASSERT_NOT_NULL(video_rtp_udpsrc_);
+      g_object_set(video_rtp_udpsrc_, "port", 0, NULL);
+      auto video_rtp_udpsrc_caps = make_GstCaps_ptr(gst_caps_from_string(
+        "application/x-rtp,media=(string)video,clock-rate=(int)90000,encoding-name=(string)H264"));
+      g_object_set(video_rtp_udpsrc_, "caps", video_rtp_udpsrc_caps.get(), NULL);
+      gst_element_set_state(video_rtp_udpsrc_, GST_STATE_PAUSED);
+      gint video_rtp_udpsrc_port;
+      g_object_get(video_rtp_udpsrc_, "port", &video_rtp_udpsrc_port, NULL);
+
+      video_rtcp_udpsrc_ = gst_element_factory_make("udpsrc", NULL);
+      ASSERT_NOT_NULL(video_rtcp_udpsrc_);
+      g_object_set(video_rtcp_udpsrc_, "port", 0, NULL);
+      gst_element_set_state(video_rtcp_udpsrc_, GST_STATE_PAUSED);
+      gint video_rtcp_udpsrc_port;
+      g_object_get(video_rtcp_udpsrc_, "port", &video_rtcp_udpsrc_port, NULL);
+
+      video_rtcp_udpsink_ = gst_element_factory_make("udpsink", NULL);
+      ASSERT_NOT_NULL(video_rtcp_udpsink_);
+      g_object_set(video_rtcp_udpsink_, "host", server_host.c_str(), NULL);
+      g_object_set(video_rtcp_udpsink_, "port", (gint)camera.at("video_rtcp_udpsrc_port").as_int64(), NULL);
+      g_object_set(video_rtcp_udpsink_, "sync", FALSE, NULL);
+      g_object_set(video_rtcp_udpsink_, "async", FALSE, NULL);
+
+      h264depay_ = gst_element_factory_make("rtph264depay", NULL);
+      ASSERT_NOT_NULL(h264depay_);
+      g_object_set(h264depay_, "wait-for-keyframe", TRUE, "request-keyframe", TRUE, NULL);
+      h264dec_ = createDecoder(decoder_backend, decoder_capabilities);
+      videosink_ = gst_element_factory_make("fakesink", NULL);
+      ASSERT_NOT_NULL(videosink_);
+      // Nobody looks at the frames, so there is no point in waiting until they are due.
+      g_object_set(videosink_, "sync", FALSE, NULL);
+
+      for (GstElement* element : {video_rtp_udpsrc_, video_rtcp_udpsrc_, video_rtcp_udpsink_, h264depay_, h264dec_, videosink_}) {
+        ASSERT_TRUE(gst_bin_add(pipeline, element));
+      }
+      ASSERT_TRUE(gst_element_link_many(h264depay_, h264dec_, videosink_, NULL));
+
+      // The FEC decoder is added when rtpbin creates the session, so it must be enabled before the pads are requested.
+      int fec_percentage = 0;
+      if (camera.contains("fec") && wanted_fec_percentage != 0) {
+        int max_fec_percentage = (int)camera.at("fec").as_object().at("max_percentage").as_int64();
+        fec_percentage = wanted_fec_percentage < 0 ? max_fec_percentage : std::min(wanted_fec_percentage, max_fec_percentage);
+        fec_receiver.enableSession(session_index);
+      }
+
+      std::string send_rtcp_src_pad_name = "send_rtcp_src_" + std::to_string(session_index);
+      ASSERT_TRUE(gst_element_link_pads(rtpbin, send_rtcp_src_pad_name.c_str(), video_rtcp_udpsink_, "sink"));
+      std::string recv_rtcp_sink_pad_name = "recv_rtcp_sink_" + std::to_string(session_index);
+      ASSERT_TRUE(gst_element_link_pads(video_rtcp_udpsrc_, "src", rtpbin, recv_rtcp_sink_pad_name.c_str()));
+      std::string recv_rtp_sink_pad_name = "recv_rtp_sink_" + std::to_string(session_index);
+      ASSERT_TRUE(gst_element_link_pads(video_rtp_udpsrc_, "src", rtpbin, recv_rtp_sink_pad_name.c_str()));
+
+      // Send the receiver reports every second, like the client does, so the server's bitrate controller gets the same
+      // feedback from us as from a real client.
+      GObject* session = nullptr;
+      g_signal_emit_by_name(rtpbin, "get-internal-session", (guint)session_index, &session);
+      ASSERT_NOT_NULL(session);
+      g_object_set(session, "rtcp-min-interval", (guint64)GST_SECOND, NULL);
+      guint rtcp_ssrc = 0;
+      g_object_get(session, "internal-ssrc", &rtcp_ssrc, NULL);
+      g_object_unref(session);
+
+      GstPad* depay_src_pad = gst_element_get_static_pad(h264depay_, "src");
+      ASSERT_NOT_NULL(depay_src_pad);
+      gst_pad_add_probe(depay_src_pad, GST_PAD_PROBE_TYPE_BUFFER, StreamReceiver::onDepayloaded, this, NULL);
+      gst_object_unref(depay_src_pad);
+      GstPad* decoder_src_pad = gst_element_get_static_pad(h264dec_, "src");
+      ASSERT_NOT_NULL(decoder_src_pad);
+      gst_pad_add_probe(decoder_src_pad, GST_PAD_PROBE_TYPE_BUFFER, StreamReceiver::onDecoded, this, NULL);
+      gst_object_unref(decoder_src_pad);
+
+      g_signal_connect(rtpbin, "pad-added", G_CALLBACK(StreamReceiver::onPadAdded), this);
+      last_report_time_ = g_get_monotonic_time();
+
+      boost::json::object response_msg;
+      response_msg["name"] = camera_name_;
+      response_msg["camera_index"] = session_index;
+      response_msg["video_rtp_udpsrc_port"] = video_rtp_udpsrc_port;
+      response_msg["video_rtcp_udpsrc_port"] = video_rtcp_udpsrc_port;
+      response_msg["rtcp_ssrc"] = rtcp_ssrc;
+      if (fec_percentage > 0) {
+        response_msg["fec_percentage"] = fec_percentage;
+      }
+      return response_msg;
+    }
+
+    // Stops and removes the elements from the running pipeline. This is used when the camera is unplugged from the
+    // server.
+    void removeFromPipeline() {
+      g_signal_handlers_disconnect_by_data(this->rtpbin_, this);
+      std::vector<GstElement*> elements = {video_rtp_udpsrc_, video_rtcp_udpsrc_, h264depay_, h264dec_, videosink_, video_rtcp_udpsink_};
+      for (GstElement* element : elements) {
+        gst_element_set_state(element, GST_STATE_NULL);
+      }
+      for (const std::string& pad_name : {"recv_rtp_sink_" + std::to_string(session_index_),
+                                          "recv_rtcp_sink_" + std::to_string(session_index_),
+                                          "send_rtcp_src_" + std::to_string(session_index_)}) {
+        GstPad* pad = gst_element_get_static_pad(this->rtpbin_, pad_name.c_str());
+        if (pad != nullptr) {
+          gst_element_release_request_pad(this->rtpbin_, pad);
+          gst_object_unref(pad);
+        }
+      }
+      for (GstElement* element : elements) {
+        gst_bin_remove(pipeline_, element);
+      }
+    }
+
+    const std::string& getName() const {
+      return camera_name_;
+    }
+
+    // Returns the stats since the last call, and moves the decode latencies since the last call to the histogram.
+    StreamStats takeStats(LatencyHistogram& decode_latency) {
+      StreamStats stats;
+      gint64 now = g_get_monotonic_time();
+      uint64_t decoded_frames = decoded_frames_.exchange(0);
+      total_decoded_frames_ += decoded_frames;
+      if (now > last_report_time_) {
+        stats.frames_per_second = decoded_frames * (double)G_USEC_PER_SEC / (now - last_report_time_);
+      }
+      last_report_time_ = now;
+      {
+        std::lock_guard<std::mutex> guard(lock_);
+        for (int64_t latency_us : decode_latencies_) {
+          decode_latency.add(latency_us);
+          total_decode_latency_.add(latency_us);
+        }
+        decode_latencies_.clear();
+      }
+
+      // The jitter and loss are the rtpbin's numbers for the server's ssrc, the same ones it puts in our receiver
+      // reports.
+      GObject* session = nullptr;
+      g_signal_emit_by_name(this->rtpbin_, "get-internal-session", (guint)this->session_index_, &session);
+      if (session == nullptr) {
+        return stats;
+      }
+      G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+      GValueArray* sources = nullptr;
+      g_object_get(session, "sources", &sources, NULL);
+      for (guint i = 0; sources != nullptr && i < sources->n_values; i++) {
+        GObject* source = (GObject*)g_value_get_object(g_value_array_get_nth(sources, i));
+        GstStructure* source_stats = nullptr;
+        g_object_get(source, "stats", &source_stats, NULL);
+        gboolean internal = FALSE;
+        gst_structure_get_boolean(source_stats, "internal", &internal);
+        if (!internal) {
+          guint jitter = 0;
+          gint packets_lost = 0;
+          guint64 packets_received = 0;
+          gst_structure_get_uint(source_stats, "jitter", &jitter);
+          gst_structure_get_int(source_stats, "packets-lost", &packets_lost);
+          gst_structure_get_uint64(source_stats, "packets-received", &packets_received);
+          stats.jitter_ms = std::max(stats.jitter_ms, jitter / 90.0);  // the video clock-rate is 90kHz
+          stats.packets_lost += std::max(packets_lost, 0);
+          stats.packets_received += packets_received;
+        }
+        gst_structure_free(source_stats);
+      }
+      if (sources != nullptr) {
+        g_value_array_free(sources);
+      }
+      G_GNUC_END_IGNORE_DEPRECATIONS
+      g_object_unref(session);
+      return stats;
+    }
+
+    uint64_t getTotalDecodedFrames() const {
+      return total_decoded_frames_;
+    }
+
+    const LatencyHistogram& getTotalDecodeLatency() const {
+      return total_decode_latency_;
+    }
+
+  private:
+    static void onPadAdded(GstElement* rtpbin, GstPad* pad, gpointer data) {
+      StreamReceiver* self = (StreamReceiver*)data;
+      std::string pad_name = string_from_gchar(gst_pad_get_name(pad));
+      std::string prefix = "recv_rtp_src_" + std::to_string(self->session_index_) + "_";
+      if (pad_name.find(prefix) == 0) {
+        GstPad* sink_pad = gst_element_get_static_pad(self->h264depay_, "sink");
+        ASSERT_NOT_NULL(sink_pad);
+        if (gst_pad_link(pad, sink_pad) != GST_PAD_LINK_OK) {
+          BOOST_LOG_TRIVIAL(error) << "StreamReceiver::onPadAdded(): failed to link the pad '" << pad_name << "'";
+        }
+        gst_object_unref(sink_pad);
+      }
+    }
+
+    static GstPadProbeReturn onDepayloaded(GstPad* pad, GstPadProbeInfo* info, gpointer user_data) {
+      StreamReceiver* self = (StreamReceiver*)user_data;
+      GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+      std::lock_guard<std::mutex> guard(self->lock_);
+      self->depayloaded_times_[GST_BUFFER_PTS(buffer)] = g_get_monotonic_time();
+      return GST_PAD_PROBE_OK;
+    }
+
+    // The decode latency is the time from the depayloader hands a complete frame to the decoder until the decoder
+    // outputs it. The decoder keeps the pts.
+    static GstPadProbeReturn onDecoded(GstPad* pad, GstPadProbeInfo* info, gpointer user_data) {
+      StreamReceiver* self = (StreamReceiver*)user_data;
+      GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+      self->decoded_frames_++;
+      std::lock_guard<std::mutex> guard(self->lock_);
+      auto find = self->depayloaded_times_.find(GST_BUFFER_PTS(buffer));
+      if (find != self->depayloaded_times_.end()) {
+        self->decode_latencies_.push_back(g_get_monotonic_time() - find->second);
+        // The older frames were dropped by the decoder.
+        self->depayloaded_times_.erase(self->depayloaded_times_.begin(), std::next(find));
+      }
+      return GST_PAD_PROBE_OK;
+    }
+
+    std::string camera_name_;
+    int session_index_ = -1;
+    GstBin* pipeline_ = nullptr;
+    GstElement* rtpbin_ = nullptr;
+
+    GstElement* video_rtp_udpsrc_ = nullptr;
+    GstElement* video_rtcp_udpsrc_ = nullptr;
+    GstElement* video_rtcp_udpsink_ = nullptr;
+    GstElement* h264depay_ = nullptr;
+    GstElement* h264dec_ = nullptr;
+    GstElement* videosink_ = nullptr;
+
+    // These are updated by the streaming threads.
+    std::atomic<uint64_t> decoded_frames_ = 0;
+    std::mutex lock_;
+    std::map<GstClockTime, gint64> depayloaded_times_;
+    std::vector<int64_t> decode_latencies_;
+
+    // These are only used by the reporting.
+    gint64 last_report_time_ = 0;
+    uint64_t total_decoded_frames_ = 0;
+    LatencyHistogram total_decode_latency_{"decode (total)"};
+};
+
+
+static void
+cb_error(GstBus* bus, GstMessage* message, gpointer data)
+{
+  GError* error = NULL;
+  gst_message_parse_error(message, &error, NULL);
+  BOOST_LOG_TRIVIAL(error) << "cb_error:" << GST_OBJECT_NAME(message->src) << ": " << error->message;
+  g_error_free(error);
+}
+
+
+// Reads one line from the socket, without the '\n'.
+static boost::asio::awaitable<std::string> read_line(boost::asio::ip::tcp::socket& sock, boost::asio::streambuf& streambuf) {
+  co_await boost::asio::async_read_until(sock, streambuf, "\n", boost::asio::use_awaitable);
+  std::string line;
+  std::istream is(&streambuf);
+  std::getline(is, line, '\n');
+  co_return line;
+}
+
+
+int main(int argc, char** argv)
+{
+  gst_init(&argc, &argv);
+
+  std::string server_host;
+  int command_port_nr;
+  int duration_s;
+  int report_interval_s;
+  PlayoutSettings playout_settings;
+  int fec_percentage;
+  double expect_min_fps;
+  std::string decoder_backend_name;
+  boost::program_options::options_description desc("Allowed options");
+  desc.add_options()
+      ("server-host", boost::program_options::value<std::string>(&server_host)->default_value("localhost"), "the host the server runs on")
+      ("command-port", boost::program_options::value<int>(&command_port_nr)->default_value(20000), "the server's command port")
+      ("duration", boost::program_options::value<int>(&duration_s)->default_value(0), "how many seconds to run (0 runs until killed)")
+      ("report-interval", boost::program_options::value<int>(&report_interval_s)->default_value(1), "how many seconds between the reports")
+      ("min-latency", boost::program_options::value<int>(&playout_settings.min_latency_ms)->default_value(playout_settings.min_latency_ms), "the lowest jitterbuffer latency (ms) the adaptive playout will use")
+      ("start-latency", boost::program_options::value<int>(&playout_settings.start_latency_ms)->default_value(playout_settings.start_latency_ms), "the jitterbuffer latency (ms) to start out with")
+      ("max-latency", boost::program_options::value<int>(&playout_settings.max_latency_ms)->default_value(playout_settings.max_latency_ms), "the highest jitterbuffer latency (ms) the adaptive playout will use (set it to --min-latency for a fixed latency)")
+      ("fec-percentage", boost::program_options::value<int>(&fec_percentage)->default_value(-1), "the forward error correction to ask the server for, in percent of the video packets (-1 takes what the server offers, 0 disables it)")
+      ("decoder", boost::program_options::value<std::string>(&decoder_backend_name)->default_value("auto"), "the h264 decoder to use: auto, software, d3d11, vaapi, nvdec or v4l2")
+      ("expect-min-fps", boost::program_options::value<double>(&expect_min_fps)->default_value(0.0), "fail if a stream's average frame rate is lower than this")
+  ;
+  boost::program_options::variables_map vm;
+  boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+  boost::program_options::notify(vm);
+
+  DecoderCapabilities decoder_capabilities = DecoderCapabilities::probe();
+  DecoderBackend decoder_backend = chooseDecoderBackend(decoderBackendFromString(decoder_backend_name), decoder_capabilities);
+  std::cout << "Decoder backend: " << to_string(decoder_backend) << std::endl;
+
+  // The bus watch runs on the glib main loop.
+  GMainLoop* loop = g_main_loop_new(NULL, FALSE);
+  ASSERT_NOT_NULL(loop);
+  auto loop_runner_thread_future = std::async(std::launch::async, [loop] { g_main_loop_run(loop); });
+
+  GstElement* pipeline = gst_pipeline_new("headlessclient");
+  ASSERT_NOT_NULL(pipeline);
+  GstBus* bus = gst_element_get_bus(pipeline);
+  g_signal_connect(bus, "message::error", G_CALLBACK(cb_error), NULL);
+  gst_bus_add_signal_watch(bus);
+  gst_object_unref(bus);
+
+  GstElement* rtpbin = gst_element_factory_make("rtpbin", NULL);
+  ASSERT_NOT_NULL(rtpbin);
+  g_object_set(rtpbin, "do-retransmission", TRUE, "rtp-profile", GST_RTP_PROFILE_AVPF, NULL);
+  ASSERT_TRUE(gst_bin_add(GST_BIN_CAST(pipeline), rtpbin));
+  AdaptivePlayout adaptive_playout(rtpbin, playout_settings);
+  FecReceiver fec_receiver(rtpbin, (GstClockTime)playout_settings.max_latency_ms * GST_MSECOND);
+
+  // Only touched by the io_context's thread.
+  std::map<std::string, std::unique_ptr<StreamReceiver>> streams;
+  std::vector<std::unique_ptr<StreamReceiver>> removed_streams;  // kept for the summary
+  int next_session_index = 0;
+
+  boost::asio::io_context ctx;
+  boost::asio::ip::tcp::socket sock(ctx);
+  auto send_line = [&](const std::string& line) {
+    std::string data = line + "\n";
+    boost::asio::write(sock, boost::asio::buffer(data));
+  };
+
+  // Adds the cameras that we don't already have to the pipeline, and tells the server where to send the video.
+  auto add_streams = [&](const boost::json::array& cameras) {
+    boost::json::array camera_responses;
+    for (const boost::json::value& item : cameras) {
+      const boost::json::object& camera = item.as_object();
+      std::string camera_name(camera.at("name").as_string());
+      if (streams.count(camera_name) > 0) {
+        continue;
+      }
+      auto stream = std::make_unique<StreamReceiver>();
+      camera_responses.push_back(stream->initialize(server_host, GST_BIN_CAST(pipeline), rtpbin, fec_receiver,
+                                                    decoder_backend, decoder_capabilities, camera,
+                                                    next_session_index++, fec_percentage));
+      streams[camera_name] = std::move(stream);
+    }
+    if (gst_element_set_state(pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+      THROW_RUNTIME_ERROR("Failed to start the gstreamer pipeline!");
+    }
+    boost::json::object response;
+    response["type"] = "welcome-response";
+    response["cameras"] = std::move(camera_responses);
+    send_line(boost::json::serialize(response));
+  };
+
+  auto last_ping_send_time = std::chrono::steady_clock::now();
+  std::chrono::milliseconds last_ping_time{0};
+
+  auto handle_message = [&](const std::string& line) {
+    if (line == "pong") {
+      last_ping_time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - last_ping_send_time);
+      return;
+    }
+    BOOST_LOG_TRIVIAL(info) << "Got a message from the server: " << line;
+    boost::json::value value = boost::json::parse(line);
+    const boost::json::object& message = value.as_object();
+    std::string type(message.at("type").as_string());
+    if (type == "cameras") {
+      add_streams(message.at("cameras").as_array());
+    } else if (type == "camera-added") {
+      boost::json::array cameras;
+      cameras.push_back(message.at("camera"));
+      add_streams(cameras);
+    } else if (type == "camera-removed") {
+      auto find = streams.find(std::string(message.at("name").as_string()));
+      if (find != streams.end()) {
+        find->second->removeFromPipeline();
+        removed_streams.push_back(std::move(find->second));
+        streams.erase(find);
+      }
+    } else if (type == "pipeline-state") {
+      if (message.at("state").as_string() == "error") {
+        BOOST_LOG_TRIVIAL(error) << "The server failed to start the video: " << message.at("error").as_string();
+      }
+    }
+    // The other messages (the microphones, resolution changes, ...) don't matter to us.
+  };
+
+  // Nearly all the cpu this process uses goes to receiving and decoding the video, so the cpu usage divided by the
+  // number of streams is what each stream costs to decode.
+  gint64 last_cpu_report_time = g_get_monotonic_time();
+  int64_t last_cpu_time_us = process_cpu_time_us();
+  auto report = [&]() {
+    gint64 now = g_get_monotonic_time();
+    int64_t cpu_time_us = process_cpu_time_us();
+    double cpu_percent = now > last_cpu_report_time ? 100.0 * (cpu_time_us - last_cpu_time_us) / (now - last_cpu_report_time) : 0.0;
+    last_cpu_report_time = now;
+    last_cpu_time_us = cpu_time_us;
+    int playout_latency_ms = adaptive_playout.update();
+    if (!streams.empty()) {
+      std::cout << std::fixed << std::setprecision(1) << "cpu " << cpu_percent << "% ("
+                << cpu_percent / streams.size() << "% per stream), playout delay " << playout_latency_ms << " ms"
+                << std::endl;
+    }
+    for (auto& [name, stream] : streams) {
+      LatencyHistogram decode_latency("decode");
+      StreamStats stats = stream->takeStats(decode_latency);
+      uint64_t packets_expected = stats.packets_received + stats.packets_lost;
+      std::cout << std::fixed << std::setprecision(1)
+                << name << ": " << stats.frames_per_second << " fps"
+                << ", jitter " << stats.jitter_ms << " ms"
+                << ", lost " << stats.packets_lost << " packets ("
+                << (packets_expected > 0 ? 100.0 * stats.packets_lost / packets_expected : 0.0) << "%)"
+                << ", decode p50 " << decode_latency.percentile(0.50) / 1000.0 << " ms"
+                << " p99 " << decode_latency.percentile(0.99) / 1000.0 << " ms"
+                << ", ping " << last_ping_time.count() << " ms"
+                << std::endl;
+    }
+  };
+
+  gint64 start_time = g_get_monotonic_time();
+  int64_t start_cpu_time_us = process_cpu_time_us();
+  boost::asio::co_spawn(ctx, [&]() -> boost::asio::awaitable<void> {
+    boost::asio::ip::tcp::resolver resolver(ctx);
+    auto endpoints = co_await resolver.async_resolve(server_host, std::to_string(command_port_nr), boost::asio::use_awaitable);
+    co_await boost::asio::async_connect(sock, endpoints, boost::asio::use_awaitable);
+    BOOST_LOG_TRIVIAL(info) << "Connected to the server at " << sock.remote_endpoint();
+    boost::asio::streambuf streambuf;
+    while (true) {
+      handle_message(co_await read_line(sock, streambuf));
+    }
+  }, [&](std::exception_ptr e) {
+    if (e) {
+      try {
+        std::rethrow_exception(e);
+      }
+      catch (const std::exception& e) {
+        BOOST_LOG_TRIVIAL(error) << "Lost the connection to the server: " << e.what();
+      }
+    }
+    ctx.stop();
+  });
+
+  // The server drops the connections that are silent for a minute, so we ping it now and then like the client does.
+  boost::asio::co_spawn(ctx, [&]() -> boost::asio::awaitable<void> {
+    boost::asio::steady_timer timer(ctx);
+    while (true) {
+      timer.expires_after(std::chrono::seconds(report_interval_s));
+      co_await timer.async_wait(boost::asio::use_awaitable);
+      report();
+      if (sock.is_open() && std::chrono::steady_clock::now() - last_ping_send_time > std::chrono::seconds(10)) {
+        last_ping_send_time = std::chrono::steady_clock::now();
+        send_line("ping");
+      }
+    }
+  }, boost::asio::detached);
+
+  boost::asio::steady_timer duration_timer(ctx);
+  if (duration_s > 0) {
+    duration_timer.expires_after(std::chrono::seconds(duration_s));
+    duration_timer.async_wait([&](const boost::system::error_code&) { ctx.stop(); });
+  }
+  ctx.run();
+  double run_time_s = (g_get_monotonic_time() - start_time) / (double)G_USEC_PER_SEC;
+  double total_cpu_percent = 100.0 * (process_cpu_time_us() - start_cpu_time_us) / (run_time_s * G_USEC_PER_SEC);
+
+  gst_element_set_state(pipeline, GST_STATE_NULL);
+
+  // The summary of the whole run.
+  int exit_code = 0;
+  std::cout << "Summary after " << std::fixed << std::setprecision(1) << run_time_s << " s with the '"
+            << to_string(decoder_backend) << "' decoder: cpu " << total_cpu_percent << "%";
+  if (!streams.empty()) {
+    std::cout << " (" << total_cpu_percent / streams.size() << "% per stream)";
+  }
+  std::cout << std::endl;
+  for (auto& [name, stream] : streams) {
+    LatencyHistogram decode_latency("decode");
+    stream->takeStats(decode_latency);
+    double average_fps = stream->getTotalDecodedFrames() / run_time_s;
+    std::cout << name << ": " << stream->getTotalDecodedFrames() << " frames decoded, " << average_fps << " fps average" << std::endl;
+    stream->getTotalDecodeLatency().report();
+    if (average_fps < expect_min_fps) {
+      std::cout << "FAILED: '" << name << "' only got " << average_fps << " fps, expected at least " << expect_min_fps << std::endl;
+      exit_code = 1;
+    }
+  }
+  if (streams.empty() && expect_min_fps > 0) {
+    std::cout << "FAILED: the server didn't send any video" << std::endl;
+    exit_code = 1;
+  }
+
+  g_main_loop_quit(loop);
+  loop_runner_thread_future.get();
+  gst_object_unref(pipeline);
+  g_main_loop_unref(loop);
+  return exit_code;
+}
+
+
+}
+
+
+int main(int argc, char** argv) {
+    return snowrobot::main(argc, argv);
+}
@@ -0,0 +1,45 @@
+"""
+This script is used by CTest to run the headlessclient against a real server. It starts the server with a
+videotestsrc camera, waits until the server's command port accepts connections (the headlessclient doesn't retry the
+connection), runs the headlessclient with the rest of the arguments, and exits with the headlessclient's exit code.
+The server is killed afterwards, whichever way the headlessclient exits.
+"""
+import argparse
+import socket
+import subprocess
+import sys
+import time
+
+
+def wait_for_port(host, port, process, timeout):
+    starttime = time.monotonic()
+    while True:
+        if process.poll() is not None:
+            raise AssertionError(f"The server exited with the code {process.returncode} before it was ready!")
+        try:
+            socket.create_connection((host, port), timeout=1).close()
+            return
+        except OSError:
+            if time.monotonic() - starttime > timeout:
+                raise AssertionError(f"Timed out while waiting for the server's command port {port}")
+            time.sleep(0.1)
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--server", required=True, help="the path to the server executable")
+    parser.add_argument("--headlessclient", required=True, help="the path to the headlessclient executable")
+    parser.add_argument("--command-port", type=int, default=20000, help="the command port the server listens on")
+    args, headlessclient_args = parser.parse_known_args()
+
+    server_process = subprocess.Popen(
+        [args.server, "--test-camera", "--command-port", str(args.command_port)])
+    try:
+        wait_for_port("localhost", args.command_port, server_process, timeout=60)
+        client_process = subprocess.run(
+            [args.headlessclient, "--server-host", "localhost", "--command-port", str(args.command_port)]
+            + headlessclient_args)
+        sys.exit(client_process.returncode)
+    finally:
+        server_process.kill()
+        server_process.wait()
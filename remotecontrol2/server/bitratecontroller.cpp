@@ -0,0 +1,76 @@
+#include "bitratecontroller.h"
+
+#include <algorithm>
+
+
+namespace snowrobot {
+
+
+BitrateController::BitrateController(const BitrateSettings& settings) :
+  settings_(settings),
+  bitrate_kbps_(settings.start_bitrate_kbps)
+{
+}
+
+
+int BitrateController::onReceiverReport(const ReceiverReport& report) {
+  // The thresholds and factors are the ones suggested in the gcc draft for the loss-based controller.
+  constexpr double high_loss = 0.10;
+  constexpr double low_loss = 0.02;
+  constexpr double increase_factor = 1.08;
+
+  // The delay-based backoff. The jitter on a healthy wifi or LTE link is usually a few ms, and the round trip time
+  // only grows way beyond the smallest one we have seen when packets are piling up in a queue somewhere.
+  constexpr double high_jitter_ms = 30.0;
+  constexpr double queuing_delay_ms = 150.0;
+  constexpr double delay_backoff_factor = 0.85;
+
+  bool is_queuing = false;
+  if (report.round_trip_time_ms >= 0.0) {
+    if (min_round_trip_time_ms_ < 0.0 || report.round_trip_time_ms < min_round_trip_time_ms_) {
+      min_round_trip_time_ms_ = report.round_trip_time_ms;
+    }
+    is_queuing = report.round_trip_time_ms > min_round_trip_time_ms_ + queuing_delay_ms;
+  }
+  if (report.jitter_ms > high_jitter_ms) {
+    is_queuing = true;
+  }
+
+  if (report.fraction_lost > high_loss) {
+    bitrate_kbps_ *= (1.0 - 0.5 * report.fraction_lost);
+  } else if (is_queuing) {
+    bitrate_kbps_ *= delay_backoff_factor;
+  } else if (report.fraction_lost < low_loss) {
+    bitrate_kbps_ *= increase_factor;
+  }
+  // Between low_loss and high_loss we keep the current bitrate.
+
+  bitrate_kbps_ = std::clamp(bitrate_kbps_, (double)settings_.min_bitrate_kbps, (double)settings_.max_bitrate_kbps);
+  return getBitrate();
+}
+
+
+int BitrateController::getMaxFramerate() const {
+  if (bitrate_kbps_ < settings_.low_bitrate_kbps) {
+    return settings_.low_bitrate_max_framerate;
+  }
+  return 0;
+}
+
+
+double BitrateController::computeRoundTripTimeMs(uint32_t last_sr, uint32_t delay_since_last_sr, uint64_t now_ntp) {
+  if (last_sr == 0) {
+    return -1.0;
+  }
+  // The "middle 32 bits" of the ntp timestamp, which is the format used in the report blocks. The unit is 1/65536 s.
+  uint32_t now_compact = (uint32_t)((now_ntp >> 16) & 0xffffffff);
+  uint32_t round_trip_time = now_compact - last_sr - delay_since_last_sr;
+  if (round_trip_time > 0x80000000) {
+    // The clock went backwards or the report is garbage.
+    return -1.0;
+  }
+  return round_trip_time * 1000.0 / 65536.0;
+}
+
+
+}
@@ -0,0 +1,64 @@
+#ifndef SNOWROBOT_REMOTECONTROL_SERVER_BITRATECONTROLLER_H
+#define SNOWROBOT_REMOTECONTROL_SERVER_BITRATECONTROLLER_H
+
+#include <cstdint>
+
+
+namespace snowrobot {
+
+
+// The values from a single report block in a rtcp receiver report (or sender report) that describes how the
+// receiver sees our stream.
+struct ReceiverReport {
+  double fraction_lost = 0.0;       // 0.0 - 1.0, the fraction of the packets that were lost since the previous report
+  double jitter_ms = 0.0;           // the receiver's interarrival jitter estimate
+  double round_trip_time_ms = -1.0; // negative if the receiver hasn't received a sender report from us yet
+};
+
+
+struct BitrateSettings {
+  int min_bitrate_kbps = 100;
+  int start_bitrate_kbps = 300;
+  int max_bitrate_kbps = 2000;
+
+  // The video framerate is capped at low_bitrate_max_framerate when the bitrate drops below low_bitrate_kbps, so
+  // that each frame gets a reasonable amount of bits.
+  int low_bitrate_kbps = 200;
+  int low_bitrate_max_framerate = 15;
+};
+
+
+// This class implements a simple congestion controller for the video encoder, based on the rtcp receiver reports
+// that the client sends back to us. It uses the loss-based part of the google congestion control algorithm (see
+// https://datatracker.ietf.org/doc/html/draft-ietf-rmcat-gcc-02), plus a crude delay-based backoff that kicks in when
+// the round trip time or the jitter grows. That is what happens on a LTE uplink when the modem starts to queue up our
+// packets.
+class BitrateController {
+  public:
+    explicit BitrateController(const BitrateSettings& settings = {});
+
+    // Updates the target bitrate based on a new receiver report. Returns the new target bitrate in kbit/s.
+    int onReceiverReport(const ReceiverReport& report);
+
+    int getBitrate() const {
+      return (int)bitrate_kbps_;
+    }
+
+    // Returns the max framerate the video should be sent at, or 0 if there is no limit.
+    int getMaxFramerate() const;
+
+    // Calculates the round trip time from the "last SR" and "delay since last SR" fields of a report block, see
+    // https://datatracker.ietf.org/doc/html/rfc3550#section-6.4.1. now_ntp is the current time as a 64 bit NTP
+    // timestamp. Returns a negative value if the receiver hasn't received any sender reports yet.
+    static double computeRoundTripTimeMs(uint32_t last_sr, uint32_t delay_since_last_sr, uint64_t now_ntp);
+
+  private:
+    BitrateSettings settings_;
+    double bitrate_kbps_;
+    double min_round_trip_time_ms_ = -1.0;
+};
+
+
+}
+
+#endif
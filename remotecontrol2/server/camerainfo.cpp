@@ -0,0 +1,795 @@
+#include "camerainfo.h"
+#include "teebranch.h"
+#include "../common/fec.h"
+#include "../common/gst_wrappers.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <gst/rtp/rtp.h>
+#include <gst/video/video.h>
+
+#include <boost/json/array.hpp>
+#include <boost/json/serialize.hpp>
+#include <boost/log/trivial.hpp>
+
+
+namespace snowrobot {
+
+
+CameraInfo::CameraInfo() {
+  BOOST_LOG_TRIVIAL(info) << "CameraInfo::CameraInfo() running";
+}
+
+
+boost::json::object CameraInfo::initialize(GstBin* pipeline,
+                                           GstElement* rtpbin,
+                                           GstDevice* camera_device,
+                                           int camera_index,
+                                           const CameraSettings& settings) {
+
+  this->pipeline_ = pipeline;
+  this->rtpbin_ = rtpbin;
+  this->camera_index_ = camera_index;
+
+  EncoderCapabilities capabilities = EncoderCapabilities::probe(camera_device);
+  this->encoder_backend_ = chooseEncoderBackend(settings.encoder_backend, capabilities);
+  BOOST_LOG_TRIVIAL(info) << "CameraInfo::initialize(): using the '" << to_string(this->encoder_backend_) << "' encoder backend";
+
+  // Only a v4l2src can hand dmabufs to the hardware encoder. The videotestsrc produces normal system memory buffers.
+#ifdef __linux__
+  bool use_dmabuf = this->encoder_backend_ == EncoderBackend::V4l2M2m && camera_device != nullptr;
+#else
+  bool use_dmabuf = false;
+#endif
+
+  GstElement* video_source = nullptr;
+  if (camera_device == nullptr) {
+    BOOST_LOG_TRIVIAL(info) << "CameraInfo::initialize(): creating videotestsrc";
+    video_source = gst_element_factory_make("videotestsrc", NULL);
+    ASSERT_NOT_NULL(video_source);
+    g_object_set(video_source, "is-live", TRUE, NULL);
+  } else {
+    BOOST_LOG_TRIVIAL(info) << "CameraInfo::initialize(): creating ksvideosrc";
+    video_source = gst_element_factory_make(
+#ifdef __linux__
+      "v4l2src",
+#else
+      "ksvideosrc",
+      //"videotestsrc"
+#endif
+      NULL);
+    ASSERT_NOT_NULL(video_source);
+    if (use_dmabuf) {
+      gst_util_set_object_arg(G_OBJECT(video_source), "io-mode", "dmabuf");
+    }
+  }
+
+  this->bitrate_settings_ = settings.bitrate;
+  this->fec_max_percentage_ = settings.fec_max_percentage;
+  this->bitrate_controller_ = std::make_unique<BitrateController>(settings.bitrate);
+
+  BOOST_LOG_TRIVIAL(info) << "CameraInfo::initialize(): creating rtph264pay";
+  GstElement* rtph264pay = gst_element_factory_make("rtph264pay", NULL);
+  ASSERT_NOT_NULL(rtph264pay);
+  // Send SPS/PPS with every keyframe, so that a client that attaches to the running pipeline can start decoding at
+  // the first keyframe it gets.
+  g_object_set(rtph264pay, "config-interval", -1, NULL);
+
+  BOOST_LOG_TRIVIAL(info) << "CameraInfo::initialize(): creating udpsrc";
+  GstElement* video_rtcp_udpsrc = gst_element_factory_make("udpsrc", NULL);
+  g_object_set(video_rtcp_udpsrc, "port", 0, NULL);
+  gst_element_set_state(video_rtcp_udpsrc, GST_STATE_PAUSED);
+  gint  video_rtcp_udpsrc_assigned_port;
+  g_object_get(video_rtcp_udpsrc, "port", &video_rtcp_udpsrc_assigned_port, NULL);
+  BOOST_LOG_TRIVIAL(info) << "CameraInfo::initialize(): video_rtcp_udpsrc_assigned_port " << video_rtcp_udpsrc_assigned_port;
+
+
+  GstElement* queue = gst_element_factory_make("queue", NULL);
+  ASSERT_NOT_NULL(queue);
+
+  // The elements from the video source to the payloader, in the order they should be linked.
+  std::vector<GstElement*> video_chain = {video_source, queue};
+
+  auto make_capsfilter = [](const char* caps_str) {
+    GstElement* capsfilter = gst_element_factory_make("capsfilter", NULL);
+    ASSERT_NOT_NULL(capsfilter);
+    auto caps = make_GstCaps_ptr(gst_caps_from_string(caps_str));
+    g_object_set(capsfilter, "caps", caps.get(), NULL);
+    return capsfilter;
+  };
+
+// This is the resolution we start out with. The client can pick another one with selectResolution().
+#ifdef _WIN32
+  const char* raw_video_caps = "video/x-raw, format=YUY2, width=640, height=360, framerate=30/1, pixel-aspect-ratio=1/1";
+#else
+  const char* raw_video_caps = "video/x-raw, format=(string)YUY2, width=(int)640, height=(int)480";
+#endif
+  //g_object_set (video_source, "caps", gst_caps_from_string("video/x-raw,width=640,height=360,framerate=15/1"), NULL);
+  //g_object_set (videoconvert, "caps", gst_caps_from_string("video/x-raw,width=640,height=360,framerate=15/1"), NULL);
+
+  GstElement* videorate = nullptr;
+  if (this->encoder_backend_ == EncoderBackend::CameraH264) {
+    // The camera does the encoding, so we just need to make sure the h264 stream is in a form rtph264pay accepts.
+    this->video_capsfilter_ = make_capsfilter("video/x-h264, stream-format=(string)byte-stream");
+    video_chain.push_back(this->video_capsfilter_);
+    GstElement* h264parse = gst_element_factory_make("h264parse", NULL);
+    ASSERT_NOT_NULL(h264parse);
+    video_chain.push_back(h264parse);
+    this->encoder_ = h264parse;
+
+  } else {
+    videorate = gst_element_factory_make("videorate", NULL);
+    ASSERT_NOT_NULL(videorate);
+    video_chain.push_back(videorate);
+    this->video_capsfilter_ = make_capsfilter(raw_video_caps);
+    video_chain.push_back(this->video_capsfilter_);
+
+    BOOST_LOG_TRIVIAL(info) << "CameraInfo::initialize(): creating the encoder";
+    GstElement* encoder = createEncoder(this->encoder_backend_, this->bitrate_controller_->getBitrate(), settings.keyframes);
+    if (this->encoder_backend_ == EncoderBackend::V4l2M2m) {
+      // The hardware encoder takes YUY2 directly, so there is no need for a videoconvert.
+      if (use_dmabuf) {
+        gst_util_set_object_arg(G_OBJECT(encoder), "output-io-mode", "dmabuf-import");
+      }
+      video_chain.push_back(encoder);
+      // The Raspberry Pi encoder refuses to negotiate unless the level is set.
+      video_chain.push_back(make_capsfilter("video/x-h264, level=(string)4, profile=(string)constrained-baseline"));
+      GstElement* h264parse = gst_element_factory_make("h264parse", NULL);
+      ASSERT_NOT_NULL(h264parse);
+      video_chain.push_back(h264parse);
+
+    } else {
+      GstElement* videoconvert = gst_element_factory_make("videoconvert", NULL);
+      ASSERT_NOT_NULL(videoconvert);
+      video_chain.push_back(videoconvert);
+#ifndef _WIN32
+      // hack to avoid this issue:
+      //   https://gstreamer-devel.narkive.com/zUkuYpXL/x264-error-baseline-profile-doesn-t-support-4-2-2
+      video_chain.push_back(make_capsfilter("video/x-raw,format=I420"));
+#endif
+      video_chain.push_back(encoder);
+    }
+    this->encoder_ = encoder;
+  }
+  if (settings.recorder) {
+    // The recording gets the encoded video from a tee in front of the payloader, so it is only encoded once.
+    this->h264_tee_ = gst_element_factory_make("tee", NULL);
+    ASSERT_NOT_NULL(this->h264_tee_);
+    video_chain.push_back(this->h264_tee_);
+  }
+  video_chain.push_back(rtph264pay);
+
+  for (GstElement* element : video_chain) {
+    ASSERT_TRUE(gst_bin_add(pipeline, element));
+  }
+  ASSERT_TRUE(gst_bin_add(pipeline, video_rtcp_udpsrc));
+
+  this->elements_ = video_chain;
+  this->elements_.push_back(video_rtcp_udpsrc);
+
+  for (size_t i = 1; i < video_chain.size(); i++) {
+    ASSERT_TRUE(gst_element_link(video_chain[i-1], video_chain[i]));
+  }
+
+  std::string recv_rtcp_sink_pad_name = "recv_rtcp_sink_" + std::to_string(this->camera_index_);
+  ASSERT_TRUE(gst_element_link_pads(video_rtcp_udpsrc, "src", rtpbin, recv_rtcp_sink_pad_name.c_str()));
+
+  std::string send_rtp_sink_pad_name = "send_rtp_sink_" + std::to_string(this->camera_index_);
+  ASSERT_TRUE(gst_element_link_pads(rtph264pay, "src", rtpbin, send_rtp_sink_pad_name.c_str()));
+
+  // The payloader gets the h264 as a byte-stream whichever encoder backend is used, so the QP is read there.
+  this->qp_meter_ = std::make_shared<H264QpMeter>();
+  GstPad* payloader_sink_pad = gst_element_get_static_pad(rtph264pay, "sink");
+  ASSERT_NOT_NULL(payloader_sink_pad);
+  H264QpMeter::attach(this->qp_meter_, payloader_sink_pad);
+  gst_object_unref(payloader_sink_pad);
+
+  // The rtp and rtcp packets go to a tee each, so that the clients can be attached and detached while the pipeline
+  // is playing. This means that the camera and encoder keeps running between client connections.
+  this->rtp_tee_ = addTeeWithFakesink(pipeline, this->elements_);
+  std::string send_rtp_src_pad_name = "send_rtp_src_" + std::to_string(this->camera_index_);
+  ASSERT_TRUE(gst_element_link_pads(rtpbin, send_rtp_src_pad_name.c_str(), this->rtp_tee_, "sink"));
+
+  this->rtcp_tee_ = addTeeWithFakesink(pipeline, this->elements_);
+  std::string send_rtcp_src_pad_name = "send_rtcp_src_" + std::to_string(this->camera_index_);
+  ASSERT_TRUE(gst_element_link_pads(rtpbin, send_rtcp_src_pad_name.c_str(), this->rtcp_tee_, "sink"));
+
+  if (settings.capture) {
+    // The recording gets the packets exactly as the clients do, before any client's FEC is added.
+    this->capture_ = settings.capture;
+    addCaptureBranch(pipeline, this->rtp_tee_, this->capture_, (uint16_t)this->camera_index_, RtpCaptureKind::Rtp, this->elements_);
+    addCaptureBranch(pipeline, this->rtcp_tee_, this->capture_, (uint16_t)this->camera_index_, RtpCaptureKind::Rtcp, this->elements_);
+  }
+  if (settings.recorder) {
+    this->recorder_ = settings.recorder;
+    this->recording_name_ = camera_device == nullptr ? "videotestsrc" : string_from_gchar(gst_device_get_display_name(camera_device));
+    this->recording_sink_ = this->recorder_->addCamera(pipeline, this->h264_tee_, this->recording_name_, this->elements_);
+  }
+
+  this->video_source_ = video_source;
+  this->payloader_ = rtph264pay;
+  this->videorate_ = videorate;
+  this->applyBitrate();
+
+  // The rtp-session was created by rtpbin when we requested the pads above.
+  GObject* session = nullptr;
+  g_signal_emit_by_name(rtpbin, "get-internal-session", (guint)this->camera_index_, &session);
+  ASSERT_NOT_NULL(session);
+  g_signal_connect(session, "on-receiving-rtcp", G_CALLBACK(CameraInfo::onReceivingRtcp), this);
+  g_signal_connect(session, "on-feedback-rtcp", G_CALLBACK(CameraInfo::onFeedbackRtcp), this);
+  g_object_unref(session);
+
+  boost::json::object camera;
+  if (this->fec_max_percentage_ > 0) {
+    boost::json::object fec;
+    fec["type"] = "ulpfec";
+    fec["pt"] = ulpfec_payload_type;
+    fec["max_percentage"] = this->fec_max_percentage_;
+    camera["fec"] = std::move(fec);
+  }
+  if (camera_device == nullptr) {
+    camera["name"] = "videotestsrc";
+    camera["video_rtcp_udpsrc_port"] = video_rtcp_udpsrc_assigned_port;
+    boost::json::array resolutions;
+    resolutions.emplace_back("video/x-raw, format=(string)YUY2, width=(int)640, height=(int)480, framerate=(fraction)30/1");
+    camera["resolutions"] = std::move(resolutions);
+    camera["resolution"] = this->getResolution();
+    this->description_ = camera;
+    this->recordDescription();
+    return camera;
+  }
+
+  std::string display_name = string_from_gchar(gst_device_get_display_name(camera_device));
+  camera["name"] = display_name;
+  camera["video_rtcp_udpsrc_port"] = video_rtcp_udpsrc_assigned_port;
+
+  auto device_gst_caps = make_GstCaps_ptr(gst_device_get_caps(camera_device));
+  this->device_caps_ = make_GstCaps_ptr(gst_caps_ref(device_gst_caps.get()));
+  std::string device_gst_caps_str = string_from_gchar(gst_caps_to_string(device_gst_caps.get()));
+  boost::json::array resolutions;
+  auto for_each_caps2 = [] (GstCapsFeatures * features,
+                    GstStructure * structure,
+                    gpointer user_data) -> gboolean {
+    std::string structure_str = string_from_gchar(gst_structure_to_string(structure));
+    boost::json::array* resolutions = (boost::json::array*)user_data;
+    resolutions->emplace_back(structure_str);
+    return TRUE;
+  };
+  gst_caps_foreach(device_gst_caps.get(), for_each_caps2, &resolutions);
+  camera["resolutions"] = std::move(resolutions);
+  camera["resolution"] = this->getResolution();
+  this->description_ = camera;
+  this->recordDescription();
+  return std::move(camera);
+}
+
+
+void CameraInfo::syncStateWithPipeline() {
+  for (GstElement* element : this->elements_) {
+    ASSERT_TRUE(gst_element_sync_state_with_parent(element));
+  }
+}
+
+
+void CameraInfo::removeFromPipeline() {
+  BOOST_LOG_TRIVIAL(info) << "CameraInfo::removeFromPipeline(): removing camera " << this->camera_index_;
+  // Stop the video chain first, from the source and downstream, so that nothing is pushed into the tees while the
+  // clients are detached.
+  for (GstElement* element : this->elements_) {
+    if (element == this->rtp_tee_) {
+      break;
+    }
+    gst_element_set_state(element, GST_STATE_NULL);
+  }
+
+  std::vector<std::string> client_ids;
+  {
+    std::lock_guard<std::mutex> guard(this->lock_);
+    for (const auto& item : this->clients_) {
+      client_ids.push_back(item.first);
+    }
+  }
+  for (const std::string& client_id : client_ids) {
+    this->removeClient(client_id);
+  }
+
+  GObject* session = nullptr;
+  g_signal_emit_by_name(this->rtpbin_, "get-internal-session", (guint)this->camera_index_, &session);
+  if (session != nullptr) {
+    g_signal_handlers_disconnect_by_data(session, this);
+    g_object_unref(session);
+  }
+
+  // Releasing the sink pads makes rtpbin remove the matching src pads, and the rtp-session when it has no pads left.
+  for (const std::string& pad_name : {"send_rtp_sink_" + std::to_string(this->camera_index_),
+                                      "recv_rtcp_sink_" + std::to_string(this->camera_index_)}) {
+    GstPad* pad = gst_element_get_static_pad(this->rtpbin_, pad_name.c_str());
+    if (pad != nullptr) {
+      gst_element_release_request_pad(this->rtpbin_, pad);
+      gst_object_unref(pad);
+    }
+  }
+
+  for (GstElement* element : this->elements_) {
+    gst_element_set_state(element, GST_STATE_NULL);
+    gst_bin_remove(this->pipeline_, element);
+  }
+  this->elements_.clear();
+  if (this->recorder_) {
+    this->recorder_->removeCamera(this->recording_name_);
+  }
+}
+
+
+void CameraInfo::addClient(const std::string& client_id,
+                           const std::string& client_address,
+                           const boost::json::object& client_info) {
+  if (this->clients_.count(client_id) > 0) {
+    THROW_RUNTIME_ERROR("The client '" << client_id << "' is already attached to camera " << this->camera_index_);
+  }
+  gint video_client_rtcp_udpsrc_port = client_info.at("video_rtcp_udpsrc_port").as_int64();
+  gint video_client_rtp_udpsrc_port = client_info.at("video_rtp_udpsrc_port").as_int64();
+
+  ClientBranch branch;
+  branch.rtp_queue = gst_element_factory_make("queue", NULL);
+  ASSERT_NOT_NULL(branch.rtp_queue);
+  branch.rtp_udpsink = gst_element_factory_make("udpsink", NULL);
+  ASSERT_NOT_NULL(branch.rtp_udpsink);
+  branch.rtcp_udpsink = gst_element_factory_make("udpsink", NULL);
+  ASSERT_NOT_NULL(branch.rtcp_udpsink);
+
+  g_object_set(branch.rtcp_udpsink, "port", video_client_rtcp_udpsrc_port, NULL);
+  g_object_set(branch.rtcp_udpsink, "host", client_address.c_str(), NULL);
+  g_object_set(branch.rtcp_udpsink, "sync", FALSE, NULL);
+  g_object_set(branch.rtcp_udpsink, "async", FALSE, NULL);
+
+  g_object_set(branch.rtp_udpsink, "port", video_client_rtp_udpsrc_port, NULL);
+  g_object_set(branch.rtp_udpsink, "host", client_address.c_str(), NULL);
+  gint64 ts_offset = 0;
+  g_object_set(branch.rtp_udpsink, "ts-offset", ts_offset, NULL);
+  // The pipeline is already playing, so the new sink must not wait for a preroll.
+  g_object_set(branch.rtp_udpsink, "async", FALSE, NULL);
+  // A client that can't keep up must not stall the other clients, so its queue drops the oldest packets when it is
+  // full instead of blocking the tee. 200ms is enough to ride out a short hiccup without adding much latency.
+  g_object_set(branch.rtp_queue, "max-size-buffers", 0, NULL);
+  g_object_set(branch.rtp_queue, "max-size-bytes", 0, NULL);
+  g_object_set(branch.rtp_queue, "max-size-time", (guint64)200 * GST_MSECOND, NULL);
+  gst_util_set_object_arg(G_OBJECT(branch.rtp_queue), "leaky", "downstream");
+
+  if (client_info.contains("rtcp_ssrc")) {
+    branch.has_rtcp_ssrc = true;
+    branch.rtcp_ssrc = (uint32_t)client_info.at("rtcp_ssrc").as_int64();
+  }
+  if (client_info.contains("fec_percentage")) {
+    branch.fec_percentage = std::clamp((int)client_info.at("fec_percentage").as_int64(), 0, this->fec_max_percentage_);
+  }
+
+  ASSERT_TRUE(gst_bin_add(this->pipeline_, branch.rtp_queue));
+  ASSERT_TRUE(gst_bin_add(this->pipeline_, branch.rtp_udpsink));
+  ASSERT_TRUE(gst_bin_add(this->pipeline_, branch.rtcp_udpsink));
+  if (branch.fec_percentage > 0) {
+    // The FEC packets are made after the queue, so that they protect the packets the client actually gets. Each
+    // client gets its own FEC encoder, since the clients can ask for different amounts of protection.
+    branch.fec_encoder = createFecEncoder(branch.fec_percentage);
+    ASSERT_TRUE(gst_bin_add(this->pipeline_, branch.fec_encoder));
+    ASSERT_TRUE(gst_element_link_many(branch.rtp_queue, branch.fec_encoder, branch.rtp_udpsink, NULL));
+    ASSERT_TRUE(gst_element_sync_state_with_parent(branch.rtp_udpsink));
+    ASSERT_TRUE(gst_element_sync_state_with_parent(branch.fec_encoder));
+  } else {
+    ASSERT_TRUE(gst_element_link(branch.rtp_queue, branch.rtp_udpsink));
+    ASSERT_TRUE(gst_element_sync_state_with_parent(branch.rtp_udpsink));
+  }
+  ASSERT_TRUE(gst_element_sync_state_with_parent(branch.rtp_queue));
+  ASSERT_TRUE(gst_element_sync_state_with_parent(branch.rtcp_udpsink));
+
+  branch.rtp_tee_pad = gst_element_get_request_pad(this->rtp_tee_, "src_%u");
+  ASSERT_NOT_NULL(branch.rtp_tee_pad);
+  GstPad* rtp_queue_sink_pad = gst_element_get_static_pad(branch.rtp_queue, "sink");
+  ASSERT_TRUE(gst_pad_link(branch.rtp_tee_pad, rtp_queue_sink_pad) == GST_PAD_LINK_OK);
+  gst_object_unref(rtp_queue_sink_pad);
+
+  branch.rtcp_tee_pad = gst_element_get_request_pad(this->rtcp_tee_, "src_%u");
+  ASSERT_NOT_NULL(branch.rtcp_tee_pad);
+  GstPad* rtcp_udpsink_sink_pad = gst_element_get_static_pad(branch.rtcp_udpsink, "sink");
+  ASSERT_TRUE(gst_pad_link(branch.rtcp_tee_pad, rtcp_udpsink_sink_pad) == GST_PAD_LINK_OK);
+  gst_object_unref(rtcp_udpsink_sink_pad);
+
+  bool is_operator = false;
+  {
+    std::lock_guard<std::mutex> guard(this->lock_);
+    branch.attach_number = this->next_attach_number_++;
+    this->clients_[client_id] = branch;
+    if (this->operator_client_id_.empty()) {
+      this->operator_client_id_ = client_id;
+      is_operator = true;
+    }
+    if (branch.has_rtcp_ssrc) {
+      auto viewer_find = this->viewers_.find(branch.rtcp_ssrc);
+      if (viewer_find != this->viewers_.end()) {
+        viewer_find->second.stats.client_id = client_id;
+        viewer_find->second.stats.fec_percentage = branch.fec_percentage;
+      }
+    }
+  }
+  BOOST_LOG_TRIVIAL(info) << "CameraInfo::addClient(): attached the client '" << client_id << "' (" << client_address
+                          << ") to camera " << this->camera_index_ << (is_operator ? " as the operator" : "")
+                          << " with " << branch.fec_percentage << "% FEC";
+  if (is_operator) {
+    this->applyBitrate();
+  }
+
+  // The client can't decode anything until it gets a keyframe, so don't make it wait for the next periodic one.
+  this->forceKeyframe();
+}
+
+
+void CameraInfo::removeClient(const std::string& client_id) {
+  ClientBranch branch;
+  bool was_operator = false;
+  {
+    std::lock_guard<std::mutex> guard(this->lock_);
+    auto find = this->clients_.find(client_id);
+    if (find == this->clients_.end()) {
+      return;
+    }
+    branch = find->second;
+    this->clients_.erase(find);
+    if (branch.has_rtcp_ssrc) {
+      this->viewers_.erase(branch.rtcp_ssrc);
+    }
+    if (this->operator_client_id_ == client_id) {
+      // The client that has been attached the longest takes over as the operator.
+      was_operator = true;
+      this->operator_client_id_.clear();
+      int oldest_attach_number = 0;
+      for (const auto& item : this->clients_) {
+        if (this->operator_client_id_.empty() || item.second.attach_number < oldest_attach_number) {
+          this->operator_client_id_ = item.first;
+          oldest_attach_number = item.second.attach_number;
+        }
+      }
+    }
+  }
+  std::vector<GstElement*> rtp_elements = {branch.rtp_udpsink};
+  if (branch.fec_encoder != nullptr) {
+    rtp_elements.push_back(branch.fec_encoder);
+  }
+  rtp_elements.push_back(branch.rtp_queue);
+  detachBranch(this->pipeline_, this->rtp_tee_, branch.rtp_tee_pad, rtp_elements);
+  detachBranch(this->pipeline_, this->rtcp_tee_, branch.rtcp_tee_pad, {branch.rtcp_udpsink});
+  BOOST_LOG_TRIVIAL(info) << "CameraInfo::removeClient(): detached the client '" << client_id << "' from camera " << this->camera_index_;
+  if (was_operator) {
+    this->applyBitrate();
+  }
+}
+
+
+void CameraInfo::recordDescription() {
+  if (!this->capture_) {
+    return;
+  }
+  boost::json::object stream_info;
+  stream_info["camera"] = this->getDescription();
+  stream_info["rtp_caps"] = "application/x-rtp,media=(string)video,clock-rate=(int)90000,encoding-name=(string)H264";
+  std::string json = boost::json::serialize(stream_info);
+  this->capture_->write((uint16_t)this->camera_index_, RtpCaptureKind::StreamInfo, json.data(), json.size());
+}
+
+
+boost::json::object CameraInfo::getDescription() const {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  return this->description_;
+}
+
+
+std::string CameraInfo::getResolution() const {
+  GstCaps* caps = nullptr;
+  g_object_get(this->video_capsfilter_, "caps", &caps, NULL);
+  ASSERT_NOT_NULL(caps);
+  auto caps_ptr = make_GstCaps_ptr(caps);
+  return string_from_gchar(gst_caps_to_string(caps));
+}
+
+
+std::string CameraInfo::selectResolution(const std::string& resolution) {
+  auto caps = make_GstCaps_ptr(gst_caps_from_string(resolution.c_str()));
+  if (!caps || gst_caps_get_size(caps.get()) != 1) {
+    THROW_RUNTIME_ERROR("'" << resolution << "' isn't a valid resolution");
+  }
+  // The capsfilter sits just after the camera if it does the encoding, and in front of the encoder otherwise.
+  const char* expected_media_type = this->encoder_backend_ == EncoderBackend::CameraH264 ? "video/x-h264" : "video/x-raw";
+  if (!gst_structure_has_name(gst_caps_get_structure(caps.get(), 0), expected_media_type)) {
+    THROW_RUNTIME_ERROR("The '" << to_string(this->encoder_backend_) << "' encoder backend needs a " << expected_media_type
+                        << " resolution, not '" << resolution << "'");
+  }
+  if (this->device_caps_ && !gst_caps_can_intersect(this->device_caps_.get(), caps.get())) {
+    THROW_RUNTIME_ERROR("Camera " << this->camera_index_ << " doesn't support the resolution '" << resolution << "'");
+  }
+  if (this->encoder_backend_ == EncoderBackend::CameraH264) {
+    gst_caps_set_simple(caps.get(), "stream-format", G_TYPE_STRING, "byte-stream", NULL);
+  }
+
+  // Changing the capsfilter's caps makes it ask the upstream elements to renegotiate, so the camera switches to the
+  // new format while the pipeline keeps playing. The encoder is reconfigured for the new size when the new caps reach
+  // it, and the clients can't decode the new size until they get a keyframe.
+  if (this->recording_sink_ != nullptr) {
+    // The new size goes in a new file.
+    VideoRecorder::splitSegment(this->recording_sink_);
+  }
+  g_object_set(this->video_capsfilter_, "caps", caps.get(), NULL);
+  this->forceKeyframe();
+
+  std::string new_resolution = this->getResolution();
+  {
+    std::lock_guard<std::mutex> guard(this->lock_);
+    this->description_["resolution"] = new_resolution;
+  }
+  this->recordDescription();
+  BOOST_LOG_TRIVIAL(info) << "CameraInfo::selectResolution(): camera " << this->camera_index_ << " now uses " << new_resolution;
+  return new_resolution;
+}
+
+
+std::string CameraInfo::getOperator() const {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  return this->operator_client_id_;
+}
+
+
+void CameraInfo::forceKeyframe() {
+  // The payloader passes the upstream force-key-unit event on to the encoder.
+  GstEvent* event = gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0);
+  GstPad* payloader_src_pad = gst_element_get_static_pad(this->payloader_, "src");
+  ASSERT_NOT_NULL(payloader_src_pad);
+  gst_pad_send_event(payloader_src_pad, event);
+  gst_object_unref(payloader_src_pad);
+}
+
+
+int CameraInfo::getRequestedKeyframeCount() const {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  return this->requested_keyframe_count_;
+}
+
+
+int CameraInfo::getBitrate() const {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  return this->selectBitrateController().getBitrate();
+}
+
+
+std::vector<ViewerStats> CameraInfo::getViewerStats() const {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  std::vector<ViewerStats> result;
+  for (const auto& item : this->viewers_) {
+    result.push_back(item.second.stats);
+  }
+  return result;
+}
+
+
+boost::json::object CameraInfo::getStats() const {
+  boost::json::object stats;
+  {
+    std::lock_guard<std::mutex> guard(this->lock_);
+    stats["name"] = this->description_.at("name");
+    stats["clients"] = this->clients_.size();
+  }
+  stats["session"] = this->camera_index_;
+
+  boost::json::object encoder = this->qp_meter_->collect();
+  encoder["backend"] = to_string(this->encoder_backend_);
+  encoder["bitrate_kbps"] = this->getBitrate();
+  stats["encoder"] = std::move(encoder);
+
+  // The packets we have sent are counted by the rtp-session's internal source, which is our own ssrc.
+  GObject* session = nullptr;
+  g_signal_emit_by_name(this->rtpbin_, "get-internal-session", (guint)this->camera_index_, &session);
+  if (session != nullptr) {
+    GObject* internal_source = nullptr;
+    g_object_get(session, "internal-source", &internal_source, NULL);
+    if (internal_source != nullptr) {
+      GstStructure* source_stats = nullptr;
+      g_object_get(internal_source, "stats", &source_stats, NULL);
+      guint64 packets_sent = 0;
+      guint64 octets_sent = 0;
+      gst_structure_get_uint64(source_stats, "packets-sent", &packets_sent);
+      gst_structure_get_uint64(source_stats, "octets-sent", &octets_sent);
+      stats["packets_sent"] = packets_sent;
+      stats["bytes_sent"] = octets_sent;
+      gst_structure_free(source_stats);
+      g_object_unref(internal_source);
+    }
+    g_object_unref(session);
+  }
+
+  boost::json::array viewers;
+  for (const ViewerStats& viewer : this->getViewerStats()) {
+    boost::json::object viewer_obj;
+    viewer_obj["client_id"] = viewer.client_id;
+    viewer_obj["rtcp_ssrc"] = viewer.rtcp_ssrc;
+    viewer_obj["round_trip_time_ms"] = viewer.last_report.round_trip_time_ms;
+    viewer_obj["fraction_lost"] = viewer.last_report.fraction_lost;
+    viewer_obj["jitter_ms"] = viewer.last_report.jitter_ms;
+    viewer_obj["report_count"] = viewer.report_count;
+    viewer_obj["bitrate_kbps"] = viewer.bitrate_kbps;
+    viewer_obj["keyframe_requests"] = viewer.keyframe_requests;
+    viewer_obj["fec_percentage"] = viewer.fec_percentage;
+    viewers.push_back(std::move(viewer_obj));
+  }
+  stats["viewers"] = std::move(viewers);
+  return stats;
+}
+
+
+const BitrateController& CameraInfo::selectBitrateController() const {
+  // Use the operator's link if we know which receiver reports are the operator's.
+  auto operator_find = this->clients_.find(this->operator_client_id_);
+  if (operator_find != this->clients_.end() && operator_find->second.has_rtcp_ssrc) {
+    auto viewer_find = this->viewers_.find(operator_find->second.rtcp_ssrc);
+    if (viewer_find != this->viewers_.end()) {
+      return viewer_find->second.bitrate_controller;
+    }
+  }
+  // Otherwise use the slowest link, so that we don't overload any of the clients.
+  const BitrateController* result = nullptr;
+  for (const auto& item : this->viewers_) {
+    if (result == nullptr || item.second.bitrate_controller.getBitrate() < result->getBitrate()) {
+      result = &item.second.bitrate_controller;
+    }
+  }
+  return result != nullptr ? *result : *this->bitrate_controller_;
+}
+
+
+// Returns the current wallclock time as a 64 bit NTP timestamp, which is what rtpbin uses in the sender reports.
+static guint64 now_as_ntp_timestamp() {
+  constexpr guint64 seconds_from_1900_to_1970 = 2208988800ULL;
+  gint64 now_us = g_get_real_time();
+  guint64 seconds = (guint64)(now_us / G_USEC_PER_SEC) + seconds_from_1900_to_1970;
+  guint64 fraction = ((guint64)(now_us % G_USEC_PER_SEC) << 32) / G_USEC_PER_SEC;
+  return (seconds << 32) | fraction;
+}
+
+
+void CameraInfo::onReceivingRtcp(GObject* session, GstBuffer* buffer, gpointer user_data) {
+  // Viewers that haven't sent a receiver report for this long have probably gone away without telling us their ssrc.
+  constexpr gint64 viewer_timeout_us = 10 * G_USEC_PER_SEC;
+
+  CameraInfo* camera_info = (CameraInfo*)user_data;
+  guint our_ssrc = 0;
+  g_object_get(session, "internal-ssrc", &our_ssrc, NULL);
+
+  GstRTCPBuffer rtcp = GST_RTCP_BUFFER_INIT;
+  if (!gst_rtcp_buffer_map(buffer, GST_MAP_READ, &rtcp)) {
+    return;
+  }
+  gint64 now = g_get_monotonic_time();
+  bool got_report = false;
+  std::unique_lock<std::mutex> guard(camera_info->lock_);
+  GstRTCPPacket packet;
+  for (gboolean more = gst_rtcp_buffer_get_first_packet(&rtcp, &packet); more; more = gst_rtcp_packet_move_to_next(&packet)) {
+    GstRTCPType packet_type = gst_rtcp_packet_get_type(&packet);
+    guint32 sender_ssrc;
+    if (packet_type == GST_RTCP_TYPE_RR) {
+      sender_ssrc = gst_rtcp_packet_rr_get_ssrc(&packet);
+    } else if (packet_type == GST_RTCP_TYPE_SR) {
+      gst_rtcp_packet_sr_get_sender_info(&packet, &sender_ssrc, NULL, NULL, NULL, NULL);
+    } else {
+      continue;
+    }
+    guint report_block_count = gst_rtcp_packet_get_rb_count(&packet);
+    for (guint i = 0; i < report_block_count; i++) {
+      guint32 ssrc, exthighestseq, jitter, lsr, dlsr;
+      guint8 fractionlost;
+      gint32 packetslost;
+      gst_rtcp_packet_get_rb(&packet, i, &ssrc, &fractionlost, &packetslost, &exthighestseq, &jitter, &lsr, &dlsr);
+      if (ssrc != our_ssrc) {
+        // This block is about some other stream.
+        continue;
+      }
+
+      ReceiverReport report;
+      report.fraction_lost = fractionlost / 256.0;
+      report.jitter_ms = jitter / 90.0;  // the jitter is in rtp timestamp units, and the video clock-rate is 90kHz
+      report.round_trip_time_ms = BitrateController::computeRoundTripTimeMs(lsr, dlsr, now_as_ntp_timestamp());
+
+      auto viewer_find = camera_info->viewers_.find(sender_ssrc);
+      if (viewer_find == camera_info->viewers_.end()) {
+        viewer_find = camera_info->viewers_.emplace(sender_ssrc, Viewer(camera_info->bitrate_settings_)).first;
+        Viewer& viewer = viewer_find->second;
+        viewer.stats.rtcp_ssrc = sender_ssrc;
+        for (const auto& item : camera_info->clients_) {
+          if (item.second.has_rtcp_ssrc && item.second.rtcp_ssrc == sender_ssrc) {
+            viewer.stats.client_id = item.first;
+            viewer.stats.fec_percentage = item.second.fec_percentage;
+          }
+        }
+        BOOST_LOG_TRIVIAL(info) << "CameraInfo::onReceivingRtcp(): got the first receiver report from ssrc " << sender_ssrc
+                                << " (client '" << viewer.stats.client_id << "') for camera " << camera_info->camera_index_;
+      }
+      Viewer& viewer = viewer_find->second;
+      int old_bitrate = viewer.bitrate_controller.getBitrate();
+      int new_bitrate = viewer.bitrate_controller.onReceiverReport(report);
+      viewer.stats.last_report = report;
+      viewer.stats.report_count++;
+      viewer.stats.bitrate_kbps = new_bitrate;
+      viewer.last_report_time = now;
+      BOOST_LOG_TRIVIAL(debug) << "CameraInfo::onReceivingRtcp(): ssrc:" << sender_ssrc
+                               << " fraction_lost:" << report.fraction_lost
+                               << " jitter_ms:" << report.jitter_ms << " rtt_ms:" << report.round_trip_time_ms
+                               << " bitrate:" << old_bitrate << "->" << new_bitrate;
+      got_report = true;
+    }
+  }
+  gst_rtcp_buffer_unmap(&rtcp);
+
+  for (auto it = camera_info->viewers_.begin(); it != camera_info->viewers_.end(); ) {
+    if (now - it->second.last_report_time > viewer_timeout_us) {
+      BOOST_LOG_TRIVIAL(info) << "CameraInfo::onReceivingRtcp(): forgetting the silent ssrc " << it->first;
+      it = camera_info->viewers_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  guard.unlock();
+
+  if (got_report) {
+    camera_info->applyBitrate();
+  }
+}
+
+
+void CameraInfo::onFeedbackRtcp(GObject* session, guint type, guint fbtype, guint sender_ssrc, guint media_ssrc,
+                                GstBuffer* fci, gpointer user_data) {
+  // All the clients that lost the same packets ask for a keyframe at about the same time, and a client keeps asking
+  // until the keyframe arrives. One keyframe per round trip is enough for all of them.
+  constexpr gint64 min_keyframe_interval_us = 200 * 1000;
+
+  bool is_pli = type == GST_RTCP_TYPE_PSFB && fbtype == GST_RTCP_PSFB_TYPE_PLI;
+  bool is_fir = type == GST_RTCP_TYPE_PSFB && fbtype == GST_RTCP_PSFB_TYPE_FIR;
+  if (!is_pli && !is_fir) {
+    return;
+  }
+  CameraInfo* camera_info = (CameraInfo*)user_data;
+  gint64 now = g_get_monotonic_time();
+  {
+    std::lock_guard<std::mutex> guard(camera_info->lock_);
+    auto viewer_find = camera_info->viewers_.find(sender_ssrc);
+    if (viewer_find != camera_info->viewers_.end()) {
+      viewer_find->second.stats.keyframe_requests++;
+    }
+    if (now - camera_info->last_requested_keyframe_time_ < min_keyframe_interval_us) {
+      return;
+    }
+    camera_info->last_requested_keyframe_time_ = now;
+    camera_info->requested_keyframe_count_++;
+  }
+  BOOST_LOG_TRIVIAL(info) << "CameraInfo::onFeedbackRtcp(): got a " << (is_pli ? "PLI" : "FIR") << " from ssrc "
+                          << sender_ssrc << " for camera " << camera_info->camera_index_ << ", forcing a keyframe";
+  camera_info->forceKeyframe();
+}
+
+
+void CameraInfo::applyBitrate() {
+  if (this->encoder_backend_ == EncoderBackend::CameraH264) {
+    // We have no control over the bitrate of a camera that does its own encoding.
+    return;
+  }
+  std::lock_guard<std::mutex> guard(this->lock_);
+  const BitrateController& bitrate_controller = this->selectBitrateController();
+  int new_bitrate = bitrate_controller.getBitrate();
+  if (new_bitrate != this->applied_bitrate_kbps_) {
+    BOOST_LOG_TRIVIAL(info) << "CameraInfo::applyBitrate(): changing the bitrate of camera " << this->camera_index_
+                            << " from " << this->applied_bitrate_kbps_ << " to " << new_bitrate << " kbit/s";
+    setEncoderBitrate(this->encoder_backend_, this->encoder_, new_bitrate);
+    this->applied_bitrate_kbps_ = new_bitrate;
+  }
+
+  gint max_framerate = bitrate_controller.getMaxFramerate();
+  g_object_set(this->videorate_, "max-rate", max_framerate > 0 ? max_framerate : G_MAXINT, NULL);
+}
+
+
+}
@@ -0,0 +1,216 @@
+#ifndef SNOWROBOT_REMOTECONTROL_SERVER_CAMERAINFO_H
+#define SNOWROBOT_REMOTECONTROL_SERVER_CAMERAINFO_H
+
+#include "../common/gst_wrappers.h"
+#include "../common/rtpcapture.h"
+#include "bitratecontroller.h"
+#include "encoderbackend.h"
+#include "pipelinestats.h"
+#include "videorecorder.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/json/object.hpp>
+
+#include <gst/gst.h>
+
+
+namespace snowrobot {
+
+
+// The settings for a camera that the user can change on the command line.
+struct CameraSettings {
+  BitrateSettings bitrate;
+  EncoderBackend encoder_backend = EncoderBackend::Auto;
+  KeyframeSettings keyframes;
+  // The most FEC protection a client can ask for, in percent of the video packets. 0 disables FEC. See common/fec.h.
+  int fec_max_percentage = 0;
+  // If set, the camera's rtp and rtcp packets are appended to this capture file, see common/rtpcapture.h.
+  std::shared_ptr<RtpCaptureWriter> capture;
+  // If set, the camera's video is recorded to disk next to the live stream, see videorecorder.h.
+  std::shared_ptr<VideoRecorder> recorder;
+};
+
+
+// The rtcp feedback we have got from one of the clients that watches a camera.
+struct ViewerStats {
+  std::string client_id;   // empty if the client didn't tell us which ssrc it sends its rtcp packets with
+  uint32_t rtcp_ssrc = 0;
+  ReceiverReport last_report;
+  int report_count = 0;
+  int bitrate_kbps = 0;    // the bitrate this client's link can handle, according to its own bitrate controller
+  int keyframe_requests = 0;  // the number of PLI and FIR packets this client has sent
+  int fec_percentage = 0;     // the FEC protection we add to this client's stream
+};
+
+
+// This class contains the gstreamer elements that captures, encodes and sends the video from one camera. The elements
+// are added to a pipeline that is owned by the caller, and the rtp-stream is sent via the rtp-session with the same
+// index as the camera in the caller's rtpbin.
+// The pipeline is meant to be kept running all the time. The clients are attached to and detached from the running
+// pipeline with addClient() and removeClient(), so a reconnecting client doesn't have to wait for the camera and the
+// encoder to start up again.
+// Each camera is encoded once, no matter how many clients that are attached. Each client gets its own leaky send queue,
+// so a slow client loses packets instead of stalling the others. The rtcp feedback from each client is tracked
+// separately. The first attached client is the operator, and the encoder bitrate follows the operator's link.
+class CameraInfo {
+  public:
+    CameraInfo();
+
+    // This method is called just after a new CameraInfo instance is created.
+    // It returns the message that should be sent to the client to inform it of this camera and
+    // which network ports the client need to connect to.
+    // If camera_device is nullptr a live videotestsrc is used instead of a real camera. This is used by the
+    // benchmarks and tests, since they must be able to run on machines that doesn't have any cameras.
+    boost::json::object initialize(GstBin* pipeline,
+                                   GstElement* rtpbin,
+                                   GstDevice* camera_device,
+                                   int camera_index,
+                                   const CameraSettings& settings = {});
+
+    // Returns the same message as initialize() did, with the current "resolution".
+    boost::json::object getDescription() const;
+
+    // Brings the camera's elements to the pipeline's state. This is used when the camera is added to a pipeline that
+    // is already playing.
+    void syncStateWithPipeline();
+
+    // Detaches all the clients, and stops and removes the camera's elements from the pipeline. This is used when the
+    // camera is unplugged. The CameraInfo can't be used after this.
+    void removeFromPipeline();
+
+    // This method is called when the client has sent a info-message about the desired resolution, udp ports, etc.
+    // It starts sending the video to the client. The client_address is the ip-address the rtp and rtcp packets
+    // should be sent to, and the client_id is used to identify the client in removeClient(). The client_info may
+    // contain the "rtcp_ssrc" the client sends its receiver reports with, so that we can tell its reports apart from
+    // the other clients' reports, and the "fec_percentage" it wants if the camera's description offered FEC.
+    void addClient(const std::string& client_id, const std::string& client_address, const boost::json::object& client_info);
+
+    // Stops sending the video to the client. It is ok to call this for a client that isn't attached.
+    void removeClient(const std::string& client_id);
+
+    // Asks the encoder to make the next frame a keyframe.
+    void forceKeyframe();
+
+    // Returns the number of keyframes that have been forced because a client asked for one with a PLI or FIR.
+    int getRequestedKeyframeCount() const;
+
+    // Returns the caps the camera's video is currently restricted to.
+    std::string getResolution() const;
+
+    // Switches the camera to the resolution (and framerate, if the caps have one) without stopping the pipeline. The
+    // resolution is a caps string like the ones in the description's "resolutions" list. Throws a std::runtime_error if
+    // the camera or the encoder backend can't use it. Returns the new resolution.
+    std::string selectResolution(const std::string& resolution);
+
+    // Returns the client_id of the operator, or an empty string if no client is attached.
+    std::string getOperator() const;
+
+    // These are used by the benchmarks to attach pad-probes to the various stages of the pipeline.
+    // The encoder is the element that outputs the h264 stream, which is a h264parse if the camera does the encoding.
+    GstElement* getVideoSource() const { return video_source_; }
+    GstElement* getEncoder() const { return encoder_; }
+    EncoderBackend getEncoderBackend() const { return encoder_backend_; }
+    GstElement* getPayloader() const { return payloader_; }
+
+    // Returns the bitrate the encoder is currently told to use.
+    int getBitrate() const;
+
+    // Returns the clients' rtcp feedback, ordered by the rtcp ssrc.
+    std::vector<ViewerStats> getViewerStats() const;
+
+    // Returns the camera's numbers for the debug port's "stats" request: the encoder's bitrate and the QP of the frames
+    // since the previous call, the packets sent by the rtp-session, and the clients' rtcp feedback.
+    boost::json::object getStats() const;
+
+  private:
+    // Called by the rtp-session each time a rtcp packet is received from the client. The receiver reports in the
+    // packet are fed to the bitrate controller, which retunes the encoder.
+    static void onReceivingRtcp(GObject* session, GstBuffer* buffer, gpointer user_data);
+    // Called by the rtp-session for each rtcp feedback message. A client that has lost packets and can't decode the
+    // video until it gets a keyframe sends a PLI (or a FIR), and we force one.
+    static void onFeedbackRtcp(GObject* session, guint type, guint fbtype, guint sender_ssrc, guint media_ssrc,
+                               GstBuffer* fci, gpointer user_data);
+    void applyBitrate();
+    // Writes the description to the capture file, so that a replay knows what the stream contains.
+    void recordDescription();
+    // Returns the bitrate controller that decides the encoder bitrate. The lock_ must be held.
+    const BitrateController& selectBitrateController() const;
+
+    // The elements that sends the rtp and rtcp packets to one client.
+    struct ClientBranch {
+      GstPad* rtp_tee_pad = nullptr;
+      GstElement* rtp_queue = nullptr;
+      GstElement* fec_encoder = nullptr;  // nullptr if the client doesn't use FEC
+      GstElement* rtp_udpsink = nullptr;
+      GstPad* rtcp_tee_pad = nullptr;
+      GstElement* rtcp_udpsink = nullptr;
+      bool has_rtcp_ssrc = false;
+      uint32_t rtcp_ssrc = 0;
+      int fec_percentage = 0;
+      int attach_number = 0;  // used to pick the oldest client as the new operator when the operator leaves
+    };
+
+    // The state we keep for each rtcp ssrc we get receiver reports from.
+    struct Viewer {
+      explicit Viewer(const BitrateSettings& settings) : bitrate_controller(settings) {}
+      BitrateController bitrate_controller;
+      ViewerStats stats;
+      gint64 last_report_time = 0;  // g_get_monotonic_time()
+    };
+
+    GstBin* pipeline_ = nullptr;
+    GstElement* rtpbin_ = nullptr;
+    int camera_index_ = -1;
+
+    GstElement* video_source_ = nullptr;
+    GstElement* encoder_ = nullptr;
+    GstElement* payloader_ = nullptr;
+    GstElement* videorate_ = nullptr;
+    // The capsfilter that decides the camera's resolution and framerate, see selectResolution().
+    GstElement* video_capsfilter_ = nullptr;
+    // The caps the camera supports. This is nullptr for the videotestsrc.
+    GstCaps_ptr device_caps_{nullptr, unrefGstCaps};
+    GstElement* rtp_tee_ = nullptr;
+    GstElement* rtcp_tee_ = nullptr;
+    std::shared_ptr<H264QpMeter> qp_meter_;
+    std::shared_ptr<RtpCaptureWriter> capture_;  // nullptr if the camera isn't recorded
+    // The tee in front of the payloader and the recording branch's splitmuxsink. These are nullptr if the video isn't
+    // recorded to disk.
+    GstElement* h264_tee_ = nullptr;
+    GstElement* recording_sink_ = nullptr;
+    std::shared_ptr<VideoRecorder> recorder_;
+    std::string recording_name_;
+    // All the elements initialize() added to the pipeline, from the video source and downstream.
+    std::vector<GstElement*> elements_;
+
+    // The clients_ and viewers_ are used both by the thread that attaches the clients and by the gstreamer thread that
+    // receives the rtcp packets, so they are protected by the lock_. The description_ is protected too, since the
+    // resolution in it can change while the command port reads it.
+    mutable std::mutex lock_;
+    boost::json::object description_;
+    std::map<std::string, ClientBranch> clients_;
+    std::string operator_client_id_;
+    int next_attach_number_ = 0;
+    std::map<uint32_t, Viewer> viewers_;
+    // When we last forced a keyframe because of a PLI or FIR, see onFeedbackRtcp().
+    gint64 last_requested_keyframe_time_ = 0;
+    int requested_keyframe_count_ = 0;
+
+    EncoderBackend encoder_backend_ = EncoderBackend::X264;
+    BitrateSettings bitrate_settings_;
+    int fec_max_percentage_ = 0;
+    // Used until we get the first receiver report.
+    std::unique_ptr<BitrateController> bitrate_controller_;
+    int applied_bitrate_kbps_ = -1;
+};
+
+
+}
+
+#endif
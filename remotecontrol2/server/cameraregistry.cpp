@@ -0,0 +1,265 @@
+#include "cameraregistry.h"
+
+#include <boost/log/trivial.hpp>
+
+
+namespace snowrobot {
+
+
+// The jobs that are queued on the pipeline worker hold a reference to the device until they have run.
+static std::shared_ptr<GstDevice> device_ref(GstDevice* device) {
+  return std::shared_ptr<GstDevice>(device, [](GstDevice* device) { gst_object_unref(device); });
+}
+
+
+static bool is_camera(GstDevice* device) {
+  std::string device_class = string_from_gchar(gst_device_get_device_class(device));
+  return device_class == "Video/Source" || device_class == "Source/Video";
+}
+
+
+static bool is_microphone(GstDevice* device) {
+  std::string device_class = string_from_gchar(gst_device_get_device_class(device));
+  return device_class == "Audio/Source" || device_class == "Source/Audio";
+}
+
+
+CameraRegistry::CameraRegistry(GstBin* pipeline,
+                               GstElement* rtpbin,
+                               PipelineWorker& pipeline_worker,
+                               const CameraSettings& settings,
+                               const AudioSettings& audio_settings,
+                               CameraAddedFunc camera_added_func,
+                               CameraRemovedFunc camera_removed_func,
+                               MicrophoneAddedFunc microphone_added_func,
+                               MicrophoneRemovedFunc microphone_removed_func)
+  : pipeline_(pipeline),
+    rtpbin_(rtpbin),
+    pipeline_worker_(pipeline_worker),
+    settings_(settings),
+    audio_settings_(audio_settings),
+    camera_added_func_(camera_added_func),
+    camera_removed_func_(camera_removed_func),
+    microphone_added_func_(microphone_added_func),
+    microphone_removed_func_(microphone_removed_func),
+    monitor_(make_GstDeviceMonitor_ptr(gst_device_monitor_new()))
+{
+  // Some platforms use "Video/Source" and some use "Source/Video".
+  gst_device_monitor_add_filter(this->monitor_.get(), "Video/Source", NULL);
+  gst_device_monitor_add_filter(this->monitor_.get(), "Source/Video", NULL);
+  gst_device_monitor_add_filter(this->monitor_.get(), "Audio/Source", NULL);
+  gst_device_monitor_add_filter(this->monitor_.get(), "Source/Audio", NULL);
+}
+
+
+CameraRegistry::~CameraRegistry() {
+  if (this->bus_watch_id_ != 0) {
+    g_source_remove(this->bus_watch_id_);
+  }
+}
+
+
+void CameraRegistry::start() {
+  GstBus* bus = gst_device_monitor_get_bus(this->monitor_.get());
+  this->bus_watch_id_ = gst_bus_add_watch(bus, CameraRegistry::onBusMessage, this);
+  gst_object_unref(bus);
+
+  if (!gst_device_monitor_start(this->monitor_.get())) {
+    THROW_RUNTIME_ERROR("The GstDeviceMonitor couldn't be started!");
+  }
+
+  // The monitor only posts messages for the devices that come and go after it was started, so the ones that are
+  // already plugged in are added here. If a provider posts device-added messages for them too, addDevice() ignores
+  // the duplicates.
+  GList_ptr devices = make_GList_ptr(gst_device_monitor_get_devices(this->monitor_.get()));
+  for (GList* devIter = g_list_first(devices.get()); devIter != nullptr; devIter=g_list_next(devIter)) {
+    GstDevice* device = (GstDevice*) devIter->data;
+    if (device == nullptr) {
+      continue;
+    }
+    // The list holds a reference to each device, which the job takes over.
+    this->pipeline_worker_.post([this, device = device_ref(device)] {
+      this->addDevice(device.get());
+    });
+  }
+  BOOST_LOG_TRIVIAL(info) << "CameraRegistry::start(): the device monitor is running";
+}
+
+
+gboolean CameraRegistry::onBusMessage(GstBus* bus, GstMessage* message, gpointer user_data) {
+  CameraRegistry* registry = (CameraRegistry*)user_data;
+  GstDevice* device = nullptr;
+  try {
+    switch (GST_MESSAGE_TYPE(message)) {
+      case GST_MESSAGE_DEVICE_ADDED:
+        gst_message_parse_device_added(message, &device);
+        registry->pipeline_worker_.post([registry, device = device_ref(device)] {
+          registry->addDevice(device.get());
+        });
+        break;
+      case GST_MESSAGE_DEVICE_REMOVED:
+        gst_message_parse_device_removed(message, &device);
+        registry->pipeline_worker_.post([registry, device = device_ref(device)] {
+          registry->removeDevice(device.get());
+        });
+        break;
+      default:
+        break;
+    }
+  }
+  catch(const std::exception& e) {
+    // The exception can't be thrown through glib. This happens if a device comes or goes while the server shuts down.
+    BOOST_LOG_TRIVIAL(info) << "CameraRegistry::onBusMessage() failed: " << e.what();
+  }
+  return G_SOURCE_CONTINUE;
+}
+
+
+void CameraRegistry::addDevice(GstDevice* device) {
+  if (is_camera(device)) {
+    this->addCamera(device);
+  }
+  else if (is_microphone(device)) {
+    this->addMicrophone(device);
+  }
+}
+
+
+// The device is nullptr for the test camera.
+void CameraRegistry::addCamera(GstDevice* device) {
+  std::string display_name = device == nullptr ? "videotestsrc" : string_from_gchar(gst_device_get_display_name(device));
+  if (this->find(display_name)) {
+    BOOST_LOG_TRIVIAL(info) << "CameraRegistry::addCamera(): we already have a camera called '" << display_name << "'";
+    return;
+  }
+
+  BOOST_LOG_TRIVIAL(info) << "CameraRegistry::addCamera(): adding the camera '" << display_name << "'";
+  auto camera_info = std::make_shared<CameraInfo>();
+  camera_info->initialize(this->pipeline_, this->rtpbin_, device, this->next_session_index_++, this->settings_);
+  camera_info->syncStateWithPipeline();
+  {
+    std::lock_guard<std::mutex> guard(this->lock_);
+    this->cameras_[display_name] = camera_info;
+  }
+  this->camera_added_func_(camera_info->getDescription());
+}
+
+
+void CameraRegistry::addTestCamera() {
+  this->pipeline_worker_.post([this] {
+    this->addCamera(nullptr);
+  });
+}
+
+
+void CameraRegistry::addMicrophone(GstDevice* device) {
+  std::string display_name = string_from_gchar(gst_device_get_display_name(device));
+  if (this->findMicrophone(display_name)) {
+    BOOST_LOG_TRIVIAL(info) << "CameraRegistry::addMicrophone(): we already have a microphone called '" << display_name << "'";
+    return;
+  }
+
+  BOOST_LOG_TRIVIAL(info) << "CameraRegistry::addMicrophone(): adding the microphone '" << display_name << "'";
+  auto microphone_info = std::make_shared<MicrophoneInfo>();
+  microphone_info->initialize(this->pipeline_, this->rtpbin_, device, this->next_session_index_++, this->audio_settings_);
+  microphone_info->syncStateWithPipeline();
+  {
+    std::lock_guard<std::mutex> guard(this->lock_);
+    this->microphones_[display_name] = microphone_info;
+  }
+  this->microphone_added_func_(microphone_info->getDescription());
+}
+
+
+void CameraRegistry::removeDevice(GstDevice* device) {
+  std::string display_name = string_from_gchar(gst_device_get_display_name(device));
+  std::shared_ptr<CameraInfo> camera_info;
+  std::shared_ptr<MicrophoneInfo> microphone_info;
+  {
+    std::lock_guard<std::mutex> guard(this->lock_);
+    if (is_camera(device)) {
+      auto find = this->cameras_.find(display_name);
+      if (find != this->cameras_.end()) {
+        camera_info = find->second;
+        this->cameras_.erase(find);
+      }
+    }
+    else if (is_microphone(device)) {
+      auto find = this->microphones_.find(display_name);
+      if (find != this->microphones_.end()) {
+        microphone_info = find->second;
+        this->microphones_.erase(find);
+      }
+    }
+  }
+  if (camera_info) {
+    BOOST_LOG_TRIVIAL(info) << "CameraRegistry::removeDevice(): removing the camera '" << display_name << "'";
+    camera_info->removeFromPipeline();
+    this->camera_removed_func_(display_name);
+  }
+  if (microphone_info) {
+    BOOST_LOG_TRIVIAL(info) << "CameraRegistry::removeDevice(): removing the microphone '" << display_name << "'";
+    microphone_info->removeFromPipeline();
+    this->microphone_removed_func_(display_name);
+  }
+}
+
+
+std::shared_ptr<CameraInfo> CameraRegistry::find(const std::string& name) const {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  auto find = this->cameras_.find(name);
+  if (find == this->cameras_.end()) {
+    return nullptr;
+  }
+  return find->second;
+}
+
+
+std::vector<std::shared_ptr<CameraInfo>> CameraRegistry::getCameras() const {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  std::vector<std::shared_ptr<CameraInfo>> result;
+  for (const auto& item : this->cameras_) {
+    result.push_back(item.second);
+  }
+  return result;
+}
+
+
+std::shared_ptr<MicrophoneInfo> CameraRegistry::findMicrophone(const std::string& name) const {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  auto find = this->microphones_.find(name);
+  if (find == this->microphones_.end()) {
+    return nullptr;
+  }
+  return find->second;
+}
+
+
+std::vector<std::shared_ptr<MicrophoneInfo>> CameraRegistry::getMicrophones() const {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  std::vector<std::shared_ptr<MicrophoneInfo>> result;
+  for (const auto& item : this->microphones_) {
+    result.push_back(item.second);
+  }
+  return result;
+}
+
+
+void CameraRegistry::clear() {
+  std::map<std::string, std::shared_ptr<CameraInfo>> cameras;
+  std::map<std::string, std::shared_ptr<MicrophoneInfo>> microphones;
+  {
+    std::lock_guard<std::mutex> guard(this->lock_);
+    cameras.swap(this->cameras_);
+    microphones.swap(this->microphones_);
+  }
+  for (auto& item : cameras) {
+    item.second->removeFromPipeline();
+  }
+  for (auto& item : microphones) {
+    item.second->removeFromPipeline();
+  }
+}
+
+
+}
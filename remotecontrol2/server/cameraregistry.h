@@ -0,0 +1,125 @@
+#ifndef SNOWROBOT_REMOTECONTROL_SERVER_CAMERAREGISTRY_H
+#define SNOWROBOT_REMOTECONTROL_SERVER_CAMERAREGISTRY_H
+
+#include "../common/gst_wrappers.h"
+#include "camerainfo.h"
+#include "microphoneinfo.h"
+#include "pipelineworker.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/json/object.hpp>
+
+#include <gst/gst.h>
+
+
+namespace snowrobot {
+
+
+using CameraAddedFunc = std::function<
+  void
+  (
+    const boost::json::object&  // the camera's description, see CameraInfo::getDescription()
+  )>;
+
+using CameraRemovedFunc = std::function<
+  void
+  (
+    const std::string&  // the camera's name
+  )>;
+
+using MicrophoneAddedFunc = std::function<
+  void
+  (
+    const boost::json::object&  // the microphone's description, see MicrophoneInfo::getDescription()
+  )>;
+
+using MicrophoneRemovedFunc = std::function<
+  void
+  (
+    const std::string&  // the microphone's name
+  )>;
+
+
+// Keeps track of the cameras and microphones that are plugged in. A GstDeviceMonitor runs for as long as the server
+// runs, and the devices are added to and removed from the running pipeline as they come and go, so the server doesn't
+// have to find all the cameras before it starts, and it notices a usb webcam that is plugged in later.
+//
+// The device monitor's messages arrive on the glib main loop, and the devices are added and removed on the pipeline
+// worker. The lists of devices can be read from any thread. Each device gets its own rtp-session in the rtpbin.
+class CameraRegistry {
+  public:
+    // The funcs are called on the pipeline worker thread.
+    CameraRegistry(GstBin* pipeline,
+                   GstElement* rtpbin,
+                   PipelineWorker& pipeline_worker,
+                   const CameraSettings& settings,
+                   const AudioSettings& audio_settings,
+                   CameraAddedFunc camera_added_func,
+                   CameraRemovedFunc camera_removed_func,
+                   MicrophoneAddedFunc microphone_added_func,
+                   MicrophoneRemovedFunc microphone_removed_func);
+
+    ~CameraRegistry();
+
+    // Starts the device monitor. The cameras that are already plugged in are added in the background, just like the
+    // ones that are plugged in later.
+    void start();
+
+    // Adds a camera with a videotestsrc, so the server can be tested on a machine without cameras (like the ci box).
+    void addTestCamera();
+
+    // Returns the camera with the name, or nullptr if there isn't one.
+    std::shared_ptr<CameraInfo> find(const std::string& name) const;
+
+    // Returns all the cameras, ordered by name.
+    std::vector<std::shared_ptr<CameraInfo>> getCameras() const;
+
+    // Returns the microphone with the name, or nullptr if there isn't one.
+    std::shared_ptr<MicrophoneInfo> findMicrophone(const std::string& name) const;
+
+    // Returns all the microphones, ordered by name.
+    std::vector<std::shared_ptr<MicrophoneInfo>> getMicrophones() const;
+
+    // Removes all the cameras and microphones from the pipeline. This must be called on the pipeline worker, or after it has been
+    // stopped.
+    void clear();
+
+  private:
+    static gboolean onBusMessage(GstBus* bus, GstMessage* message, gpointer user_data);
+    // These run on the pipeline worker.
+    void addDevice(GstDevice* device);
+    void removeDevice(GstDevice* device);
+    void addCamera(GstDevice* device);
+    void addMicrophone(GstDevice* device);
+
+    GstBin* pipeline_;
+    GstElement* rtpbin_;
+    PipelineWorker& pipeline_worker_;
+    CameraSettings settings_;
+    AudioSettings audio_settings_;
+    CameraAddedFunc camera_added_func_;
+    CameraRemovedFunc camera_removed_func_;
+    MicrophoneAddedFunc microphone_added_func_;
+    MicrophoneRemovedFunc microphone_removed_func_;
+
+    GstDeviceMonitor_ptr monitor_;
+    guint bus_watch_id_ = 0;
+
+    mutable std::mutex lock_;
+    std::map<std::string, std::shared_ptr<CameraInfo>> cameras_;
+    std::map<std::string, std::shared_ptr<MicrophoneInfo>> microphones_;
+    // The rtp-session indexes aren't reused, since rtpbin may still be tearing down the session of a device that was
+    // just unplugged. Only used on the pipeline worker.
+    int next_session_index_ = 0;
+};
+
+
+}
+
+#endif
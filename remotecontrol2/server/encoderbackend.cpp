@@ -0,0 +1,164 @@
+#include "encoderbackend.h"
+#include "../common/gst_wrappers.h"
+
+#include <boost/log/trivial.hpp>
+
+
+namespace snowrobot {
+
+
+std::string to_string(EncoderBackend backend) {
+  switch (backend) {
+    case EncoderBackend::Auto: return "auto";
+    case EncoderBackend::X264: return "x264";
+    case EncoderBackend::V4l2M2m: return "v4l2";
+    case EncoderBackend::CameraH264: return "camera";
+  }
+  return "unknown";
+}
+
+
+EncoderBackend encoderBackendFromString(const std::string& name) {
+  for (EncoderBackend backend : {EncoderBackend::Auto, EncoderBackend::X264, EncoderBackend::V4l2M2m, EncoderBackend::CameraH264}) {
+    if (to_string(backend) == name) {
+      return backend;
+    }
+  }
+  std::ostringstream msg;
+  msg << "Unknown encoder backend '" << name << "'. Valid values are auto, x264, v4l2 and camera.";
+  throw std::runtime_error(msg.str());
+}
+
+
+static bool element_factory_exists(const char* factory_name) {
+  GstElementFactory* factory = gst_element_factory_find(factory_name);
+  if (factory == nullptr) {
+    return false;
+  }
+  gst_object_unref(factory);
+  return true;
+}
+
+
+EncoderCapabilities EncoderCapabilities::probe(GstDevice* camera_device) {
+  EncoderCapabilities capabilities;
+  capabilities.has_x264enc = element_factory_exists("x264enc");
+  // The v4l2 plugin only registers the v4l2h264enc element if it finds a m2m encoder device.
+  capabilities.has_v4l2h264enc = element_factory_exists("v4l2h264enc");
+
+  if (camera_device != nullptr) {
+    auto device_caps = make_GstCaps_ptr(gst_device_get_caps(camera_device));
+    for (guint i = 0; device_caps && i < gst_caps_get_size(device_caps.get()); i++) {
+      GstStructure* structure = gst_caps_get_structure(device_caps.get(), i);
+      if (gst_structure_has_name(structure, "video/x-h264")) {
+        capabilities.camera_has_h264 = true;
+      }
+    }
+  }
+  return capabilities;
+}
+
+
+EncoderBackend chooseEncoderBackend(EncoderBackend requested, const EncoderCapabilities& capabilities) {
+  auto is_available = [&](EncoderBackend backend) {
+    switch (backend) {
+      case EncoderBackend::X264: return capabilities.has_x264enc;
+      case EncoderBackend::V4l2M2m: return capabilities.has_v4l2h264enc;
+      case EncoderBackend::CameraH264: return capabilities.camera_has_h264;
+      default: return false;
+    }
+  };
+
+  if (requested != EncoderBackend::Auto) {
+    if (is_available(requested)) {
+      return requested;
+    }
+    BOOST_LOG_TRIVIAL(warning) << "chooseEncoderBackend(): the '" << to_string(requested)
+                               << "' encoder backend isn't available, so I'll use the best available one instead.";
+  }
+
+  // The hardware encoder is preferred over the camera's own h264, since we can't control the bitrate of the camera.
+  for (EncoderBackend backend : {EncoderBackend::V4l2M2m, EncoderBackend::CameraH264, EncoderBackend::X264}) {
+    if (is_available(backend)) {
+      return backend;
+    }
+  }
+  throw std::runtime_error("chooseEncoderBackend(): no h264 encoder is available!");
+}
+
+
+// The V4L2 encoder settings are passed via the extra-controls structure. This sets one of the controls and keeps the
+// others.
+static void set_v4l2_control(GstElement* encoder, const char* name, int value) {
+  GstStructure* controls = nullptr;
+  g_object_get(encoder, "extra-controls", &controls, NULL);
+  if (controls == nullptr) {
+    controls = gst_structure_new_empty("controls");
+  }
+  gst_structure_set(controls, name, G_TYPE_INT, value, NULL);
+  g_object_set(encoder, "extra-controls", controls, NULL);
+  gst_structure_free(controls);
+}
+
+
+GstElement* createEncoder(EncoderBackend backend, int bitrate_kbps, const KeyframeSettings& keyframe_settings) {
+  int keyframe_interval = keyframe_settings.keyframe_interval;
+  if (keyframe_settings.intra_refresh && keyframe_interval == 0) {
+    keyframe_interval = default_intra_refresh_interval;
+  }
+
+  GstElement* encoder = nullptr;
+  switch (backend) {
+    case EncoderBackend::X264:
+      encoder = gst_element_factory_make("x264enc", NULL);
+      ASSERT_NOT_NULL(encoder);
+      g_object_set(encoder, "tune", 4 /*GstX264EncTune  zerolatency (0x00000004) – Zero latency*/   , NULL);
+      g_object_set(encoder, "byte-stream", TRUE, NULL);
+      g_object_set(encoder, "bitrate", (guint)bitrate_kbps, NULL);
+      if (keyframe_interval > 0) {
+        // With intra-refresh x264 uses this as the length of each refresh wave.
+        g_object_set(encoder, "key-int-max", (guint)keyframe_interval, NULL);
+      }
+      g_object_set(encoder, "intra-refresh", (gboolean)keyframe_settings.intra_refresh, NULL);
+      break;
+
+    case EncoderBackend::V4l2M2m:
+      encoder = gst_element_factory_make("v4l2h264enc", NULL);
+      ASSERT_NOT_NULL(encoder);
+      set_v4l2_control(encoder, "video_bitrate", bitrate_kbps * 1000);
+      // Send SPS/PPS with every keyframe, which x264enc also does when byte-stream is enabled.
+      set_v4l2_control(encoder, "repeat_sequence_header", 1);
+      if (keyframe_settings.intra_refresh) {
+        // The driver ignores the controls it doesn't know, so this falls back to whole keyframes on encoders that
+        // can't do intra-refresh.
+        set_v4l2_control(encoder, "intra_refresh_period", keyframe_interval);
+      } else if (keyframe_interval > 0) {
+        set_v4l2_control(encoder, "h264_i_frame_period", keyframe_interval);
+      }
+      break;
+
+    case EncoderBackend::CameraH264:
+      break;
+
+    default:
+      THROW_RUNTIME_ERROR("createEncoder() called with the backend " << to_string(backend));
+  }
+  return encoder;
+}
+
+
+void setEncoderBitrate(EncoderBackend backend, GstElement* encoder, int bitrate_kbps) {
+  switch (backend) {
+    case EncoderBackend::X264:
+      g_object_set(encoder, "bitrate", (guint)bitrate_kbps, NULL);
+      break;
+    case EncoderBackend::V4l2M2m:
+      set_v4l2_control(encoder, "video_bitrate", bitrate_kbps * 1000);
+      break;
+    default:
+      break;
+  }
+}
+
+
+}
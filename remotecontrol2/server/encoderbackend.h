@@ -0,0 +1,77 @@
+#ifndef SNOWROBOT_REMOTECONTROL_SERVER_ENCODERBACKEND_H
+#define SNOWROBOT_REMOTECONTROL_SERVER_ENCODERBACKEND_H
+
+#include <string>
+
+#include <gst/gst.h>
+
+
+namespace snowrobot {
+
+
+// The different ways CameraInfo can produce the h264 stream.
+enum class EncoderBackend {
+  // Use the best backend that is available.
+  Auto,
+
+  // Software encoding with x264enc. This always works, but it uses a lot of cpu on a Raspberry Pi.
+  X264,
+
+  // A V4L2 memory-to-memory hardware encoder (v4l2h264enc), like the one on the Raspberry Pi. The camera frames are
+  // passed to the encoder as dmabufs, so they are never copied in userspace.
+  V4l2M2m,
+
+  // The camera itself delivers h264, so we only need to parse and packetize it. The bitrate can't be changed.
+  CameraH264,
+};
+
+std::string to_string(EncoderBackend backend);
+
+// Throws a std::runtime_error if the name is unknown.
+EncoderBackend encoderBackendFromString(const std::string& name);
+
+
+// What the machine and the camera can do, as found by probe(). The backendselection benchmark makes up its own.
+struct EncoderCapabilities {
+  bool has_x264enc = false;
+  bool has_v4l2h264enc = false;
+  bool camera_has_h264 = false;
+
+  // Looks up the encoder elements in the gstreamer registry and the h264 caps of the camera. The camera_device can
+  // be nullptr, which means that a videotestsrc is used.
+  static EncoderCapabilities probe(GstDevice* camera_device);
+};
+
+
+// Returns the backend to use. If the requested backend isn't available we fall back to the best one that is, in the
+// order V4l2M2m, CameraH264, X264. Throws a std::runtime_error if there is no usable backend at all.
+EncoderBackend chooseEncoderBackend(EncoderBackend requested, const EncoderCapabilities& capabilities);
+
+
+// How often the encoder refreshes the whole picture. A receiver that has lost packets can't decode the video again
+// until the picture has been refreshed, unless it asks for a keyframe (see CameraInfo).
+struct KeyframeSettings {
+  // The number of frames between the keyframes, or between the start of the intra-refresh waves. 0 means the
+  // encoder's default, which is several seconds for x264enc.
+  int keyframe_interval = 0;
+
+  // Refresh the picture with a column of intra-coded blocks that sweeps across the frames instead of with whole
+  // keyframes. A keyframe is several times larger than the other frames, and on a thin uplink the burst of rtp packets
+  // it makes can cause packet loss and jitter on its own. Only x264enc and some V4L2 encoders support this.
+  bool intra_refresh = false;
+};
+
+// The keyframe_interval used for the intra refresh if KeyframeSettings::keyframe_interval is 0.
+constexpr int default_intra_refresh_interval = 30;
+
+
+// Creates the encoder element for the backend (nullptr for CameraH264, which has no encoder).
+GstElement* createEncoder(EncoderBackend backend, int bitrate_kbps, const KeyframeSettings& keyframe_settings = {});
+
+// Changes the bitrate of an encoder that was created by createEncoder(). This can be done while the pipeline is playing.
+void setEncoderBitrate(EncoderBackend backend, GstElement* encoder, int bitrate_kbps);
+
+
+}
+
+#endif
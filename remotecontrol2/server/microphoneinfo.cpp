@@ -0,0 +1,256 @@
+#include "microphoneinfo.h"
+#include "teebranch.h"
+#include "../common/gst_wrappers.h"
+
+#include <boost/log/trivial.hpp>
+
+
+namespace snowrobot {
+
+
+// The opus rtp clock rate is always 48 kHz, no matter what the sample rate of the audio is.
+constexpr int opus_clock_rate = 48000;
+
+
+MicrophoneInfo::MicrophoneInfo() {
+  BOOST_LOG_TRIVIAL(info) << "MicrophoneInfo::MicrophoneInfo() running";
+}
+
+
+boost::json::object MicrophoneInfo::initialize(GstBin* pipeline,
+                                               GstElement* rtpbin,
+                                               GstDevice* microphone_device,
+                                               int session_index,
+                                               const AudioSettings& settings) {
+  this->pipeline_ = pipeline;
+  this->rtpbin_ = rtpbin;
+  this->session_index_ = session_index;
+
+  GstElement* audio_source = nullptr;
+  if (microphone_device == nullptr) {
+    BOOST_LOG_TRIVIAL(info) << "MicrophoneInfo::initialize(): creating audiotestsrc";
+    audio_source = gst_element_factory_make("audiotestsrc", NULL);
+    ASSERT_NOT_NULL(audio_source);
+    g_object_set(audio_source, "is-live", TRUE, NULL);
+    // One buffer per opus frame, like a real microphone with the latency-time below.
+    g_object_set(audio_source, "samplesperbuffer", opus_clock_rate * settings.frame_ms / 1000, NULL);
+  } else {
+    // The device knows which source element it needs (pulsesrc, alsasrc, wasapisrc, ...).
+    audio_source = gst_device_create_element(microphone_device, NULL);
+    ASSERT_NOT_NULL(audio_source);
+    // The audio sources capture 10 ms at a time by default, and buffer 200 ms. We want the samples as soon as there
+    // is enough for an opus frame.
+    if (g_object_class_find_property(G_OBJECT_GET_CLASS(audio_source), "latency-time") != nullptr) {
+      g_object_set(audio_source, "latency-time", (gint64)settings.frame_ms * 1000, NULL);
+    }
+  }
+
+  GstElement* queue = gst_element_factory_make("queue", NULL);
+  ASSERT_NOT_NULL(queue);
+  GstElement* audioconvert = gst_element_factory_make("audioconvert", NULL);
+  ASSERT_NOT_NULL(audioconvert);
+  GstElement* audioresample = gst_element_factory_make("audioresample", NULL);
+  ASSERT_NOT_NULL(audioresample);
+  GstElement* capsfilter = gst_element_factory_make("capsfilter", NULL);
+  ASSERT_NOT_NULL(capsfilter);
+  // The robot has a single microphone, so there is no point in sending stereo.
+  auto caps = make_GstCaps_ptr(gst_caps_new_simple("audio/x-raw",
+                                                   "rate", G_TYPE_INT, opus_clock_rate,
+                                                   "channels", G_TYPE_INT, 1,
+                                                   NULL));
+  g_object_set(capsfilter, "caps", caps.get(), NULL);
+
+  BOOST_LOG_TRIVIAL(info) << "MicrophoneInfo::initialize(): creating opusenc";
+  GstElement* encoder = gst_element_factory_make("opusenc", NULL);
+  ASSERT_NOT_NULL(encoder);
+  g_object_set(encoder, "bitrate", settings.bitrate_kbps * 1000, NULL);
+  gst_util_set_object_arg(G_OBJECT(encoder), "frame-size", std::to_string(settings.frame_ms).c_str());
+  // This turns off the parts of opus that add lookahead, which saves a few ms.
+  gst_util_set_object_arg(G_OBJECT(encoder), "audio-type", "restricted-lowdelay");
+
+  GstElement* payloader = gst_element_factory_make("rtpopuspay", NULL);
+  ASSERT_NOT_NULL(payloader);
+  g_object_set(payloader, "pt", 97, NULL);
+
+  GstElement* audio_rtcp_udpsrc = gst_element_factory_make("udpsrc", NULL);
+  ASSERT_NOT_NULL(audio_rtcp_udpsrc);
+  g_object_set(audio_rtcp_udpsrc, "port", 0, NULL);
+  gst_element_set_state(audio_rtcp_udpsrc, GST_STATE_PAUSED);
+  gint audio_rtcp_udpsrc_assigned_port;
+  g_object_get(audio_rtcp_udpsrc, "port", &audio_rtcp_udpsrc_assigned_port, NULL);
+
+  std::vector<GstElement*> audio_chain = {audio_source, queue, audioconvert, audioresample, capsfilter, encoder, payloader};
+  for (GstElement* element : audio_chain) {
+    ASSERT_TRUE(gst_bin_add(pipeline, element));
+  }
+  ASSERT_TRUE(gst_bin_add(pipeline, audio_rtcp_udpsrc));
+  this->elements_ = audio_chain;
+  this->elements_.push_back(audio_rtcp_udpsrc);
+
+  for (size_t i = 1; i < audio_chain.size(); i++) {
+    ASSERT_TRUE(gst_element_link(audio_chain[i-1], audio_chain[i]));
+  }
+
+  std::string recv_rtcp_sink_pad_name = "recv_rtcp_sink_" + std::to_string(this->session_index_);
+  ASSERT_TRUE(gst_element_link_pads(audio_rtcp_udpsrc, "src", rtpbin, recv_rtcp_sink_pad_name.c_str()));
+
+  std::string send_rtp_sink_pad_name = "send_rtp_sink_" + std::to_string(this->session_index_);
+  ASSERT_TRUE(gst_element_link_pads(payloader, "src", rtpbin, send_rtp_sink_pad_name.c_str()));
+
+  this->rtp_tee_ = addTeeWithFakesink(pipeline, this->elements_);
+  std::string send_rtp_src_pad_name = "send_rtp_src_" + std::to_string(this->session_index_);
+  ASSERT_TRUE(gst_element_link_pads(rtpbin, send_rtp_src_pad_name.c_str(), this->rtp_tee_, "sink"));
+
+  this->rtcp_tee_ = addTeeWithFakesink(pipeline, this->elements_);
+  std::string send_rtcp_src_pad_name = "send_rtcp_src_" + std::to_string(this->session_index_);
+  ASSERT_TRUE(gst_element_link_pads(rtpbin, send_rtcp_src_pad_name.c_str(), this->rtcp_tee_, "sink"));
+
+  this->audio_source_ = audio_source;
+  this->encoder_ = encoder;
+  this->payloader_ = payloader;
+
+  boost::json::object microphone;
+  if (microphone_device == nullptr) {
+    microphone["name"] = "audiotestsrc";
+  } else {
+    microphone["name"] = string_from_gchar(gst_device_get_display_name(microphone_device));
+  }
+  microphone["audio_rtcp_udpsrc_port"] = audio_rtcp_udpsrc_assigned_port;
+  microphone["encoding_name"] = "OPUS";
+  microphone["clock_rate"] = opus_clock_rate;
+  microphone["bitrate_kbps"] = settings.bitrate_kbps;
+  microphone["frame_ms"] = settings.frame_ms;
+  std::lock_guard<std::mutex> guard(this->lock_);
+  this->description_ = microphone;
+  return microphone;
+}
+
+
+boost::json::object MicrophoneInfo::getDescription() const {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  return this->description_;
+}
+
+
+void MicrophoneInfo::syncStateWithPipeline() {
+  for (GstElement* element : this->elements_) {
+    ASSERT_TRUE(gst_element_sync_state_with_parent(element));
+  }
+}
+
+
+void MicrophoneInfo::removeFromPipeline() {
+  BOOST_LOG_TRIVIAL(info) << "MicrophoneInfo::removeFromPipeline(): removing the microphone in session " << this->session_index_;
+  for (GstElement* element : this->elements_) {
+    if (element == this->rtp_tee_) {
+      break;
+    }
+    gst_element_set_state(element, GST_STATE_NULL);
+  }
+
+  std::vector<std::string> client_ids;
+  {
+    std::lock_guard<std::mutex> guard(this->lock_);
+    for (const auto& item : this->clients_) {
+      client_ids.push_back(item.first);
+    }
+  }
+  for (const std::string& client_id : client_ids) {
+    this->removeClient(client_id);
+  }
+
+  for (const std::string& pad_name : {"send_rtp_sink_" + std::to_string(this->session_index_),
+                                      "recv_rtcp_sink_" + std::to_string(this->session_index_)}) {
+    GstPad* pad = gst_element_get_static_pad(this->rtpbin_, pad_name.c_str());
+    if (pad != nullptr) {
+      gst_element_release_request_pad(this->rtpbin_, pad);
+      gst_object_unref(pad);
+    }
+  }
+
+  for (GstElement* element : this->elements_) {
+    gst_element_set_state(element, GST_STATE_NULL);
+    gst_bin_remove(this->pipeline_, element);
+  }
+  this->elements_.clear();
+}
+
+
+void MicrophoneInfo::addClient(const std::string& client_id,
+                               const std::string& client_address,
+                               const boost::json::object& client_info) {
+  if (this->clients_.count(client_id) > 0) {
+    THROW_RUNTIME_ERROR("The client '" << client_id << "' is already attached to the microphone in session " << this->session_index_);
+  }
+  gint audio_client_rtp_udpsrc_port = client_info.at("audio_rtp_udpsrc_port").as_int64();
+  gint audio_client_rtcp_udpsrc_port = client_info.at("audio_rtcp_udpsrc_port").as_int64();
+
+  ClientBranch branch;
+  branch.rtp_queue = gst_element_factory_make("queue", NULL);
+  ASSERT_NOT_NULL(branch.rtp_queue);
+  branch.rtp_udpsink = gst_element_factory_make("udpsink", NULL);
+  ASSERT_NOT_NULL(branch.rtp_udpsink);
+  branch.rtcp_udpsink = gst_element_factory_make("udpsink", NULL);
+  ASSERT_NOT_NULL(branch.rtcp_udpsink);
+
+  g_object_set(branch.rtp_udpsink, "port", audio_client_rtp_udpsrc_port, NULL);
+  g_object_set(branch.rtp_udpsink, "host", client_address.c_str(), NULL);
+  g_object_set(branch.rtp_udpsink, "async", FALSE, NULL);
+  g_object_set(branch.rtcp_udpsink, "port", audio_client_rtcp_udpsrc_port, NULL);
+  g_object_set(branch.rtcp_udpsink, "host", client_address.c_str(), NULL);
+  g_object_set(branch.rtcp_udpsink, "sync", FALSE, NULL);
+  g_object_set(branch.rtcp_udpsink, "async", FALSE, NULL);
+  // Late audio is useless, so a client that can't keep up loses the oldest packets, like with the video.
+  g_object_set(branch.rtp_queue, "max-size-buffers", 0, NULL);
+  g_object_set(branch.rtp_queue, "max-size-bytes", 0, NULL);
+  g_object_set(branch.rtp_queue, "max-size-time", (guint64)200 * GST_MSECOND, NULL);
+  gst_util_set_object_arg(G_OBJECT(branch.rtp_queue), "leaky", "downstream");
+
+  ASSERT_TRUE(gst_bin_add(this->pipeline_, branch.rtp_queue));
+  ASSERT_TRUE(gst_bin_add(this->pipeline_, branch.rtp_udpsink));
+  ASSERT_TRUE(gst_bin_add(this->pipeline_, branch.rtcp_udpsink));
+  ASSERT_TRUE(gst_element_link(branch.rtp_queue, branch.rtp_udpsink));
+  ASSERT_TRUE(gst_element_sync_state_with_parent(branch.rtp_udpsink));
+  ASSERT_TRUE(gst_element_sync_state_with_parent(branch.rtp_queue));
+  ASSERT_TRUE(gst_element_sync_state_with_parent(branch.rtcp_udpsink));
+
+  branch.rtp_tee_pad = gst_element_get_request_pad(this->rtp_tee_, "src_%u");
+  ASSERT_NOT_NULL(branch.rtp_tee_pad);
+  GstPad* rtp_queue_sink_pad = gst_element_get_static_pad(branch.rtp_queue, "sink");
+  ASSERT_TRUE(gst_pad_link(branch.rtp_tee_pad, rtp_queue_sink_pad) == GST_PAD_LINK_OK);
+  gst_object_unref(rtp_queue_sink_pad);
+
+  branch.rtcp_tee_pad = gst_element_get_request_pad(this->rtcp_tee_, "src_%u");
+  ASSERT_NOT_NULL(branch.rtcp_tee_pad);
+  GstPad* rtcp_udpsink_sink_pad = gst_element_get_static_pad(branch.rtcp_udpsink, "sink");
+  ASSERT_TRUE(gst_pad_link(branch.rtcp_tee_pad, rtcp_udpsink_sink_pad) == GST_PAD_LINK_OK);
+  gst_object_unref(rtcp_udpsink_sink_pad);
+
+  {
+    std::lock_guard<std::mutex> guard(this->lock_);
+    this->clients_[client_id] = branch;
+  }
+  BOOST_LOG_TRIVIAL(info) << "MicrophoneInfo::addClient(): attached the client '" << client_id << "' (" << client_address
+                          << ") to the microphone in session " << this->session_index_;
+}
+
+
+void MicrophoneInfo::removeClient(const std::string& client_id) {
+  ClientBranch branch;
+  {
+    std::lock_guard<std::mutex> guard(this->lock_);
+    auto find = this->clients_.find(client_id);
+    if (find == this->clients_.end()) {
+      return;
+    }
+    branch = find->second;
+    this->clients_.erase(find);
+  }
+  detachBranch(this->pipeline_, this->rtp_tee_, branch.rtp_tee_pad, {branch.rtp_udpsink, branch.rtp_queue});
+  detachBranch(this->pipeline_, this->rtcp_tee_, branch.rtcp_tee_pad, {branch.rtcp_udpsink});
+  BOOST_LOG_TRIVIAL(info) << "MicrophoneInfo::removeClient(): detached the client '" << client_id
+                          << "' from the microphone in session " << this->session_index_;
+}
+
+
+}
@@ -0,0 +1,97 @@
+#ifndef SNOWROBOT_REMOTECONTROL_SERVER_MICROPHONEINFO_H
+#define SNOWROBOT_REMOTECONTROL_SERVER_MICROPHONEINFO_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/json/object.hpp>
+
+#include <gst/gst.h>
+
+
+namespace snowrobot {
+
+
+// The settings for the microphones that the user can change on the command line.
+struct AudioSettings {
+  // Opus gives good speech at 16-32 kbit/s, compared to the 64 kbit/s of the PCMA the old gstreamer scripts used.
+  int bitrate_kbps = 24;
+  // The length of each opus frame (and rtp packet). Shorter frames mean lower latency, but more packets and more
+  // rtp/udp/ip header overhead. Valid values are 5, 10, 20, 40 and 60.
+  int frame_ms = 10;
+};
+
+
+// This class contains the gstreamer elements that captures, encodes and sends the audio from one microphone. It works
+// like CameraInfo: the elements are added to a pipeline and a rtpbin that is owned by the caller, the audio is sent via
+// the rtp-session with the given index, and the clients are attached to and detached from the running pipeline.
+//
+// The audio and video sessions share the server's rtpbin, so their rtcp sender reports use the same clock and cname.
+// This lets the client's rtpbin play the audio in sync with the video.
+class MicrophoneInfo {
+  public:
+    MicrophoneInfo();
+
+    // Creates the elements and returns the message that tells the client about the microphone. If microphone_device
+    // is nullptr a live audiotestsrc is used, which is what the benchmarks do.
+    boost::json::object initialize(GstBin* pipeline,
+                                   GstElement* rtpbin,
+                                   GstDevice* microphone_device,
+                                   int session_index,
+                                   const AudioSettings& settings = {});
+
+    // Returns the same message as initialize() did.
+    boost::json::object getDescription() const;
+
+    // Brings the microphone's elements to the pipeline's state.
+    void syncStateWithPipeline();
+
+    // Detaches all the clients, and stops and removes the microphone's elements from the pipeline. The MicrophoneInfo
+    // can't be used after this.
+    void removeFromPipeline();
+
+    // Starts sending the audio to the client. The client_info contains the "audio_rtp_udpsrc_port" and
+    // "audio_rtcp_udpsrc_port" the client listens on.
+    void addClient(const std::string& client_id, const std::string& client_address, const boost::json::object& client_info);
+
+    // Stops sending the audio to the client. It is ok to call this for a client that isn't attached.
+    void removeClient(const std::string& client_id);
+
+    // These are used by the benchmarks to attach pad-probes to the various stages of the pipeline.
+    GstElement* getAudioSource() const { return audio_source_; }
+    GstElement* getEncoder() const { return encoder_; }
+    GstElement* getPayloader() const { return payloader_; }
+
+  private:
+    // The elements that sends the rtp and rtcp packets to one client.
+    struct ClientBranch {
+      GstPad* rtp_tee_pad = nullptr;
+      GstElement* rtp_queue = nullptr;
+      GstElement* rtp_udpsink = nullptr;
+      GstPad* rtcp_tee_pad = nullptr;
+      GstElement* rtcp_udpsink = nullptr;
+    };
+
+    GstBin* pipeline_ = nullptr;
+    GstElement* rtpbin_ = nullptr;
+    int session_index_ = -1;
+
+    GstElement* audio_source_ = nullptr;
+    GstElement* encoder_ = nullptr;
+    GstElement* payloader_ = nullptr;
+    GstElement* rtp_tee_ = nullptr;
+    GstElement* rtcp_tee_ = nullptr;
+    // All the elements initialize() added to the pipeline, from the audio source and downstream.
+    std::vector<GstElement*> elements_;
+
+    mutable std::mutex lock_;
+    boost::json::object description_;
+    std::map<std::string, ClientBranch> clients_;
+};
+
+
+}
+
+#endif
@@ -0,0 +1,447 @@
+#include "pipelinestats.h"
+#include "../common/gst_wrappers.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <fstream>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+// The codecparsers library is marked as unstable api, although the h264 parser has been stable for many years.
+#define GST_USE_UNSTABLE_API
+#include <gst/codecparsers/gsth264parser.h>
+
+#include <boost/log/trivial.hpp>
+
+
+namespace snowrobot {
+
+
+struct PipelineStats::ElementCounters {
+  std::string path;     // the element's path in the pipeline, like "rtpbin0/rtpsession0"
+  std::string factory;
+  GWeakRef element;     // used to read the queue levels
+  bool is_queue = false;
+  bool measure_processing_time = false;
+
+  // These are updated by the streaming threads without any locking.
+  std::atomic<uint64_t> buffers_in{0};
+  std::atomic<uint64_t> buffers_out{0};
+  std::atomic<uint64_t> bytes_out{0};
+
+  // The arrival times of the last buffers at the sink pad, by their timestamp. A queue can hold more than this many
+  // buffers, but then the buffers just aren't sampled.
+  std::mutex lock;
+  std::array<std::pair<GstClockTime, int64_t>, 64> arrivals;
+  size_t next_arrival = 0;
+  uint64_t processing_time_sum_ns = 0;
+  uint64_t processing_time_count = 0;
+  uint64_t processing_time_max_ns = 0;
+
+  // The totals at the previous collect(), protected by the PipelineStats' collect_lock_.
+  uint64_t previous_buffers_in = 0;
+  uint64_t previous_buffers_out = 0;
+  uint64_t previous_bytes_out = 0;
+
+  ElementCounters() {
+    g_weak_ref_init(&this->element, nullptr);
+    this->arrivals.fill({GST_CLOCK_TIME_NONE, 0});
+  }
+
+  ~ElementCounters() {
+    g_weak_ref_clear(&this->element);
+  }
+
+  void addArrival(GstClockTime pts, int64_t now_ns) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->arrivals[this->next_arrival] = {pts, now_ns};
+    this->next_arrival = (this->next_arrival + 1) % this->arrivals.size();
+  }
+
+  void addDeparture(GstClockTime pts, int64_t now_ns) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    for (auto& arrival : this->arrivals) {
+      if (arrival.first == pts) {
+        // A payloader sends many packets with the frame's timestamp, but only the first one counts.
+        uint64_t processing_time_ns = (uint64_t)std::max<int64_t>(0, now_ns - arrival.second);
+        this->processing_time_sum_ns += processing_time_ns;
+        this->processing_time_count++;
+        this->processing_time_max_ns = std::max(this->processing_time_max_ns, processing_time_ns);
+        arrival.first = GST_CLOCK_TIME_NONE;
+        break;
+      }
+    }
+  }
+};
+
+
+static int64_t steadyNanoseconds() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+static GstPadProbeReturn onBuffer(GstPad* pad, GstPadProbeInfo* info, gpointer user_data) {
+  PipelineStats::ElementCounters& counters = **(std::shared_ptr<PipelineStats::ElementCounters>*)user_data;
+  GstBuffer* buffer = nullptr;
+  uint64_t buffer_count = 1;
+  uint64_t byte_count = 0;
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+    GstBufferList* list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+    buffer_count = gst_buffer_list_length(list);
+    byte_count = gst_buffer_list_calculate_size(list);
+    buffer = buffer_count > 0 ? gst_buffer_list_get(list, 0) : nullptr;
+  } else {
+    buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    byte_count = gst_buffer_get_size(buffer);
+  }
+
+  bool is_sink = GST_PAD_DIRECTION(pad) == GST_PAD_SINK;
+  if (is_sink) {
+    counters.buffers_in += buffer_count;
+  } else {
+    counters.buffers_out += buffer_count;
+    counters.bytes_out += byte_count;
+  }
+  if (counters.measure_processing_time && buffer != nullptr && GST_BUFFER_PTS_IS_VALID(buffer)) {
+    if (is_sink) {
+      counters.addArrival(GST_BUFFER_PTS(buffer), steadyNanoseconds());
+    } else {
+      counters.addDeparture(GST_BUFFER_PTS(buffer), steadyNanoseconds());
+    }
+  }
+  return GST_PAD_PROBE_OK;
+}
+
+
+static void addPadProbe(GstPad* pad, const std::shared_ptr<PipelineStats::ElementCounters>& counters) {
+  gst_pad_add_probe(pad, (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST), onBuffer,
+                    new std::shared_ptr<PipelineStats::ElementCounters>(counters),
+                    [](gpointer data) { delete (std::shared_ptr<PipelineStats::ElementCounters>*)data; });
+}
+
+
+static void onPadAdded(GstElement* element, GstPad* pad, gpointer user_data) {
+  addPadProbe(pad, *(std::shared_ptr<PipelineStats::ElementCounters>*)user_data);
+}
+
+
+// The element's path without the pipeline's name, like "rtpbin0/rtpsession0".
+static std::string elementPath(GstElement* element, GstElement* pipeline) {
+  std::string path = GST_OBJECT_NAME(element);
+  for (GstObject* parent = GST_OBJECT_PARENT(element);
+       parent != nullptr && parent != GST_OBJECT_CAST(pipeline);
+       parent = GST_OBJECT_PARENT(parent)) {
+    path = std::string(GST_OBJECT_NAME(parent)) + "/" + path;
+  }
+  return path;
+}
+
+
+// An element with exactly one always sink pad and one always src pad passes each buffer through, so the buffers that
+// leave it can be matched with the ones that went in. A tee or a muxer can't be measured this way.
+static bool hasOneSinkAndOneSrc(GstElement* element) {
+  int sink_templates = 0;
+  int src_templates = 0;
+  for (const GList* item = gst_element_class_get_pad_template_list(GST_ELEMENT_GET_CLASS(element)); item != nullptr; item = item->next) {
+    GstPadTemplate* pad_template = (GstPadTemplate*)item->data;
+    if (GST_PAD_TEMPLATE_PRESENCE(pad_template) != GST_PAD_ALWAYS) {
+      return false;
+    }
+    if (GST_PAD_TEMPLATE_DIRECTION(pad_template) == GST_PAD_SINK) {
+      sink_templates++;
+    } else {
+      src_templates++;
+    }
+  }
+  return sink_templates == 1 && src_templates == 1;
+}
+
+
+// The cpu time the process has used in seconds, and its resident memory in KiB.
+static void readProcessUsage(double& cpu_s, uint64_t& rss_kb) {
+  cpu_s = 0.0;
+  rss_kb = 0;
+#ifdef _WIN32
+  FILETIME creation_time, exit_time, kernel_time, user_time;
+  if (GetProcessTimes(GetCurrentProcess(), &creation_time, &exit_time, &kernel_time, &user_time)) {
+    auto to_seconds = [](const FILETIME& time) {
+      return (((uint64_t)time.dwHighDateTime << 32) | time.dwLowDateTime) / 1e7;  // in units of 100 ns
+    };
+    cpu_s = to_seconds(kernel_time) + to_seconds(user_time);
+  }
+  PROCESS_MEMORY_COUNTERS memory_counters;
+  if (K32GetProcessMemoryInfo(GetCurrentProcess(), &memory_counters, sizeof(memory_counters))) {
+    rss_kb = memory_counters.WorkingSetSize / 1024;
+  }
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    cpu_s = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+  }
+  // The second number is the resident set size in pages. ru_maxrss is only the peak.
+  std::ifstream statm("/proc/self/statm");
+  uint64_t size_pages = 0;
+  uint64_t resident_pages = 0;
+  if (statm >> size_pages >> resident_pages) {
+    rss_kb = resident_pages * (uint64_t)sysconf(_SC_PAGESIZE) / 1024;
+  }
+#endif
+}
+
+
+PipelineStats::PipelineStats(GstElement* pipeline) : pipeline_(pipeline) {
+  ASSERT_TRUE(GST_IS_BIN(pipeline));
+  gst_object_ref(this->pipeline_);
+  this->previous_collect_ = std::chrono::steady_clock::now();
+  uint64_t rss_kb = 0;
+  readProcessUsage(this->previous_cpu_s_, rss_kb);
+
+  this->element_added_handler_ = g_signal_connect(pipeline, "deep-element-added", G_CALLBACK(PipelineStats::onDeepElementAdded), this);
+  this->element_removed_handler_ = g_signal_connect(pipeline, "deep-element-removed", G_CALLBACK(PipelineStats::onDeepElementRemoved), this);
+
+  // The elements that are already in the pipeline. If the pipeline changes while we iterate, we start over, and the
+  // elements we have already seen are skipped by addElement().
+  GstIterator* iterator = gst_bin_iterate_recurse(GST_BIN_CAST(pipeline));
+  GValue item = G_VALUE_INIT;
+  bool done = false;
+  while (!done) {
+    switch (gst_iterator_next(iterator, &item)) {
+      case GST_ITERATOR_OK:
+        this->addElement(GST_ELEMENT_CAST(g_value_get_object(&item)));
+        g_value_reset(&item);
+        break;
+      case GST_ITERATOR_RESYNC:
+        gst_iterator_resync(iterator);
+        break;
+      default:
+        done = true;
+        break;
+    }
+  }
+  g_value_unset(&item);
+  gst_iterator_free(iterator);
+}
+
+
+PipelineStats::~PipelineStats() {
+  // The probes and pad-added handlers hold on to their counters themselves, so they can stay on the elements.
+  g_signal_handler_disconnect(this->pipeline_, this->element_added_handler_);
+  g_signal_handler_disconnect(this->pipeline_, this->element_removed_handler_);
+  gst_object_unref(this->pipeline_);
+}
+
+
+void PipelineStats::onDeepElementAdded(GstBin* bin, GstBin* sub_bin, GstElement* element, gpointer user_data) {
+  ((PipelineStats*)user_data)->addElement(element);
+}
+
+
+void PipelineStats::onDeepElementRemoved(GstBin* bin, GstBin* sub_bin, GstElement* element, gpointer user_data) {
+  PipelineStats* self = (PipelineStats*)user_data;
+  std::lock_guard<std::mutex> guard(self->lock_);
+  self->elements_.erase(element);
+}
+
+
+void PipelineStats::addElement(GstElement* element) {
+  // The bins' buffers are counted by the elements inside them.
+  if (GST_IS_BIN(element)) {
+    return;
+  }
+  auto counters = std::make_shared<ElementCounters>();
+  counters->path = elementPath(element, this->pipeline_);
+  GstElementFactory* factory = gst_element_get_factory(element);
+  counters->factory = factory != nullptr ? GST_OBJECT_NAME(factory) : "";
+  g_weak_ref_set(&counters->element, element);
+  counters->is_queue = counters->factory == "queue";
+  counters->measure_processing_time = hasOneSinkAndOneSrc(element);
+
+  {
+    std::lock_guard<std::mutex> guard(this->lock_);
+    if (this->elements_.count(element) > 0) {
+      // The constructor's iteration can see the elements that deep-element-added has already told us about.
+      return;
+    }
+    this->elements_[element] = counters;
+  }
+
+  // The request pads of a tee or rtpbin, and the sometimes pads of a demuxer, are added later.
+  g_signal_connect_data(element, "pad-added", G_CALLBACK(onPadAdded),
+                        new std::shared_ptr<ElementCounters>(counters),
+                        [](gpointer data, GClosure*) { delete (std::shared_ptr<ElementCounters>*)data; },
+                        (GConnectFlags)0);
+  GstIterator* iterator = gst_element_iterate_pads(element);
+  GValue item = G_VALUE_INIT;
+  while (gst_iterator_next(iterator, &item) == GST_ITERATOR_OK) {
+    addPadProbe(GST_PAD_CAST(g_value_get_object(&item)), counters);
+    g_value_reset(&item);
+  }
+  g_value_unset(&item);
+  gst_iterator_free(iterator);
+}
+
+
+boost::json::object PipelineStats::collect() {
+  std::lock_guard<std::mutex> collect_guard(this->collect_lock_);
+  auto now = std::chrono::steady_clock::now();
+  double interval_s = std::max(1e-3, std::chrono::duration<double>(now - this->previous_collect_).count());
+  this->previous_collect_ = now;
+
+  std::vector<std::shared_ptr<ElementCounters>> all_counters;
+  {
+    std::lock_guard<std::mutex> guard(this->lock_);
+    for (const auto& item : this->elements_) {
+      all_counters.push_back(item.second);
+    }
+  }
+
+  boost::json::object elements;
+  for (const std::shared_ptr<ElementCounters>& counters : all_counters) {
+    boost::json::object element;
+    element["factory"] = counters->factory;
+
+    uint64_t buffers_in = counters->buffers_in.load();
+    uint64_t buffers_out = counters->buffers_out.load();
+    uint64_t bytes_out = counters->bytes_out.load();
+    element["buffers_in_per_s"] = (buffers_in - counters->previous_buffers_in) / interval_s;
+    element["buffers_out_per_s"] = (buffers_out - counters->previous_buffers_out) / interval_s;
+    element["kbps_out"] = (bytes_out - counters->previous_bytes_out) * 8 / 1000.0 / interval_s;
+    counters->previous_buffers_in = buffers_in;
+    counters->previous_buffers_out = buffers_out;
+    counters->previous_bytes_out = bytes_out;
+
+    if (counters->measure_processing_time) {
+      std::lock_guard<std::mutex> guard(counters->lock);
+      if (counters->processing_time_count > 0) {
+        element["processing_time_avg_us"] = counters->processing_time_sum_ns / 1000.0 / counters->processing_time_count;
+        element["processing_time_max_us"] = counters->processing_time_max_ns / 1000.0;
+      }
+      counters->processing_time_sum_ns = 0;
+      counters->processing_time_count = 0;
+      counters->processing_time_max_ns = 0;
+    }
+
+    if (counters->is_queue) {
+      GstElement* queue = (GstElement*)g_weak_ref_get(&counters->element);
+      if (queue != nullptr) {
+        guint level_buffers = 0;
+        guint level_bytes = 0;
+        guint64 level_time = 0;
+        guint64 max_time = 0;
+        g_object_get(queue, "current-level-buffers", &level_buffers, "current-level-bytes", &level_bytes,
+                     "current-level-time", &level_time, "max-size-time", &max_time, NULL);
+        boost::json::object level;
+        level["buffers"] = level_buffers;
+        level["bytes"] = level_bytes;
+        level["time_ms"] = level_time / (double)GST_MSECOND;
+        level["max_time_ms"] = max_time / (double)GST_MSECOND;
+        element["queue"] = std::move(level);
+        gst_object_unref(queue);
+      }
+    }
+    elements[counters->path] = std::move(element);
+  }
+
+  double cpu_s = 0.0;
+  uint64_t rss_kb = 0;
+  readProcessUsage(cpu_s, rss_kb);
+  boost::json::object process;
+  // This is the sum over all the cores, so it can be more than 100.
+  process["cpu_percent"] = (cpu_s - this->previous_cpu_s_) * 100.0 / interval_s;
+  process["cpu_s"] = cpu_s;
+  process["rss_kb"] = rss_kb;
+  this->previous_cpu_s_ = cpu_s;
+
+  boost::json::object result;
+  result["interval_s"] = interval_s;
+  result["process"] = std::move(process);
+  result["elements"] = std::move(elements);
+  return result;
+}
+
+
+H264QpMeter::H264QpMeter() : parser_(gst_h264_nal_parser_new()) {
+}
+
+
+H264QpMeter::~H264QpMeter() {
+  gst_h264_nal_parser_free(this->parser_);
+}
+
+
+void H264QpMeter::attach(const std::shared_ptr<H264QpMeter>& meter, GstPad* pad) {
+  gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER,
+    [](GstPad*, GstPadProbeInfo* info, gpointer user_data) {
+      (*(std::shared_ptr<H264QpMeter>*)user_data)->parseFrame(GST_PAD_PROBE_INFO_BUFFER(info));
+      return GST_PAD_PROBE_OK;
+    },
+    new std::shared_ptr<H264QpMeter>(meter),
+    [](gpointer data) { delete (std::shared_ptr<H264QpMeter>*)data; });
+}
+
+
+void H264QpMeter::parseFrame(GstBuffer* buffer) {
+  GstMapInfo map;
+  if (!gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+    return;
+  }
+  int qp = -1;
+  GstH264NalUnit nalu;
+  guint offset = 0;
+  // The SPS and PPS come in front of the keyframes' slices, so stopping at the first slice is enough.
+  while (qp < 0) {
+    GstH264ParserResult result = gst_h264_parser_identify_nalu(this->parser_, map.data, offset, map.size, &nalu);
+    // The last nal unit of the buffer has no start code after it.
+    if (result != GST_H264_PARSER_OK && result != GST_H264_PARSER_NO_NAL_END) {
+      break;
+    }
+    if (nalu.type == GST_H264_NAL_SPS || nalu.type == GST_H264_NAL_PPS) {
+      gst_h264_parser_parse_nal(this->parser_, &nalu);
+    } else if (nalu.type == GST_H264_NAL_SLICE || nalu.type == GST_H264_NAL_SLICE_IDR) {
+      GstH264SliceHdr slice;
+      if (gst_h264_parser_parse_slice_hdr(this->parser_, &nalu, &slice, TRUE, TRUE) == GST_H264_PARSER_OK) {
+        qp = 26 + slice.pps->pic_init_qp_minus26 + slice.slice_qp_delta;
+      }
+      break;
+    }
+    if (result == GST_H264_PARSER_NO_NAL_END) {
+      break;
+    }
+    offset = nalu.offset + nalu.size;
+  }
+  gst_buffer_unmap(buffer, &map);
+
+  if (qp >= 0) {
+    std::lock_guard<std::mutex> guard(this->lock_);
+    this->qp_min_ = this->frames_ == 0 ? qp : std::min(this->qp_min_, qp);
+    this->qp_max_ = this->frames_ == 0 ? qp : std::max(this->qp_max_, qp);
+    this->qp_sum_ += qp;
+    this->frames_++;
+  }
+}
+
+
+boost::json::object H264QpMeter::collect() {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  boost::json::object result;
+  if (this->frames_ > 0) {
+    result["qp_avg"] = this->qp_sum_ / (double)this->frames_;
+    result["qp_min"] = this->qp_min_;
+    result["qp_max"] = this->qp_max_;
+    result["frames"] = this->frames_;
+  }
+  this->frames_ = 0;
+  this->qp_sum_ = 0;
+  return result;
+}
+
+
+}
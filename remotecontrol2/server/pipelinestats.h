@@ -0,0 +1,98 @@
+#ifndef SNOWROBOT_REMOTECONTROL_SERVER_PIPELINESTATS_H
+#define SNOWROBOT_REMOTECONTROL_SERVER_PIPELINESTATS_H
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include <boost/json/object.hpp>
+
+#include <gst/gst.h>
+
+// From gst/codecparsers/gsth264parser.h, which is only included by pipelinestats.cpp.
+typedef struct _GstH264NalParser GstH264NalParser;
+
+
+namespace snowrobot {
+
+
+// Collects the numbers that the debug port's "stats" request returns: how many buffers each element of the pipeline
+// takes in and puts out, how long each element holds on to a buffer, the fill level of each queue, and the process'
+// cpu and memory use.
+//
+// The buffers are counted by pad probes on every pad of every element, which are added as the elements and pads are
+// added to the pipeline, so the cameras and clients that come and go are covered too. A probe costs an atomic add for
+// most buffers. The elements with one sink pad and one src pad also get their processing time measured: the time from
+// a buffer arrives at the sink pad until the buffer with the same timestamp leaves the src pad. For a queue this is the
+// time the buffer waited in the queue, and for an encoder it includes the encoder's own latency.
+//
+// The rates and processing times are averages since the previous collect(), so a scraper that asks once a second gets
+// the numbers for the last second.
+class PipelineStats {
+  public:
+    explicit PipelineStats(GstElement* pipeline);
+    ~PipelineStats();
+
+    PipelineStats(const PipelineStats&) = delete;
+    PipelineStats& operator=(const PipelineStats&) = delete;
+
+    // Returns {"interval_s": ..., "process": {...}, "elements": {"<element path>": {...}, ...}}.
+    boost::json::object collect();
+
+    struct ElementCounters;
+
+  private:
+    static void onDeepElementAdded(GstBin* bin, GstBin* sub_bin, GstElement* element, gpointer user_data);
+    static void onDeepElementRemoved(GstBin* bin, GstBin* sub_bin, GstElement* element, gpointer user_data);
+    void addElement(GstElement* element);
+
+    GstElement* pipeline_;
+    gulong element_added_handler_ = 0;
+    gulong element_removed_handler_ = 0;
+
+    std::mutex lock_;
+    std::map<GstElement*, std::shared_ptr<ElementCounters>> elements_;
+
+    // Only used by collect(), which may be called from any thread.
+    std::mutex collect_lock_;
+    std::chrono::steady_clock::time_point previous_collect_;
+    double previous_cpu_s_ = 0.0;
+};
+
+
+// Reads the quantizer of each frame from the slice headers of a h264 byte-stream. None of the encoders tell us which QP
+// they picked, but it is the best measure of the picture quality the bitrate buys, so we parse the first slice header
+// of each frame with gstreamer's h264 parser. The SPS and PPS are picked up from the stream as they pass.
+class H264QpMeter {
+  public:
+    H264QpMeter();
+    ~H264QpMeter();
+
+    H264QpMeter(const H264QpMeter&) = delete;
+    H264QpMeter& operator=(const H264QpMeter&) = delete;
+
+    // Adds a buffer probe to the pad, which must carry a h264 byte-stream with one frame per buffer. The probe keeps
+    // the meter alive.
+    static void attach(const std::shared_ptr<H264QpMeter>& meter, GstPad* pad);
+
+    // Returns {"qp_avg": ..., "qp_min": ..., "qp_max": ..., "frames": ...} for the frames since the previous call, or an
+    // empty object if no frame has been parsed.
+    boost::json::object collect();
+
+  private:
+    void parseFrame(GstBuffer* buffer);
+
+    std::mutex lock_;
+    GstH264NalParser* parser_;  // only used by the streaming thread
+    int frames_ = 0;
+    int qp_sum_ = 0;
+    int qp_min_ = 0;
+    int qp_max_ = 0;
+};
+
+
+}
+
+#endif
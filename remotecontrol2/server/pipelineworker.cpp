@@ -0,0 +1,78 @@
+#include "pipelineworker.h"
+
+#include <stdexcept>
+
+#include <boost/log/trivial.hpp>
+
+
+namespace snowrobot {
+
+
+PipelineWorker::PipelineWorker()
+  : thread_([this] { this->run(); })
+{
+}
+
+
+PipelineWorker::~PipelineWorker() {
+  this->stop();
+}
+
+
+void PipelineWorker::post(std::function<void()> job) {
+  this->enqueue([job = std::move(job)] {
+    try {
+      job();
+    }
+    catch(const std::exception& e) {
+      BOOST_LOG_TRIVIAL(error) << "PipelineWorker: a job failed: " << e.what();
+    }
+  });
+}
+
+
+void PipelineWorker::enqueue(std::function<void()> job) {
+  {
+    std::lock_guard<std::mutex> guard(this->lock_);
+    if (this->stopping_) {
+      throw std::runtime_error("PipelineWorker::enqueue(): the worker has been stopped");
+    }
+    this->jobs_.push_back(std::move(job));
+  }
+  this->jobs_changed_.notify_one();
+}
+
+
+void PipelineWorker::stop() {
+  {
+    std::lock_guard<std::mutex> guard(this->lock_);
+    this->stopping_ = true;
+  }
+  this->jobs_changed_.notify_one();
+  if (this->thread_.joinable()) {
+    this->thread_.join();
+  }
+}
+
+
+void PipelineWorker::run() {
+  BOOST_LOG_TRIVIAL(info) << "PipelineWorker::run() starting.";
+  for (;;) {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> guard(this->lock_);
+      this->jobs_changed_.wait(guard, [this] { return this->stopping_ || !this->jobs_.empty(); });
+      if (this->jobs_.empty()) {
+        // We are stopping, and all the queued jobs have run.
+        break;
+      }
+      job = std::move(this->jobs_.front());
+      this->jobs_.pop_front();
+    }
+    job();
+  }
+  BOOST_LOG_TRIVIAL(info) << "PipelineWorker::run() finished ok.";
+}
+
+
+}
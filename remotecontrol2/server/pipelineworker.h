@@ -0,0 +1,85 @@
+#ifndef SNOWROBOT_REMOTECONTROL_SERVER_PIPELINEWORKER_H
+#define SNOWROBOT_REMOTECONTROL_SERVER_PIPELINEWORKER_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/post.hpp>
+
+
+namespace snowrobot {
+
+
+// The gstreamer calls that change the pipeline (state changes, attaching and detaching the clients, dumping the
+// pipeline graph, ...) can block for a long time, for example while a camera device is opened. They must not run on
+// the io threads, since every connection on the io_context would stall while they run, pings and watchdogs included.
+// Instead they are handed to the PipelineWorker, which runs them one at a time on a thread of its own. Since the jobs
+// run in the order they were queued, they don't need any locking between them either.
+class PipelineWorker {
+  public:
+    PipelineWorker();
+
+    // Runs the jobs that are still queued before returning.
+    ~PipelineWorker();
+
+    // Queues a job, and returns without waiting for it. An exception from the job is logged.
+    void post(std::function<void()> job);
+
+    // Queues a job, and completes with the job's exception (or a null exception_ptr if it went ok) when the job has
+    // run. The completion handler is called on its associated executor, so a coroutine can just do
+    //   co_await worker.asyncRun([&]{ ... }, boost::asio::use_awaitable);
+    // which rethrows the job's exception in the coroutine. The coroutine's strand is free to run other things while
+    // the job runs.
+    template<typename CompletionToken>
+    auto asyncRun(std::function<void()> job, CompletionToken&& token) {
+      return boost::asio::async_initiate<CompletionToken, void(std::exception_ptr)>(
+        [this](auto handler, std::function<void()> job) {
+          // The job queue holds std::functions, which must be copyable, so the move-only handler is kept in a
+          // shared_ptr. The work guard keeps the handler's io_context from running out of work while the job runs.
+          auto work = boost::asio::make_work_guard(boost::asio::get_associated_executor(handler));
+          auto completion = std::make_shared<std::pair<decltype(handler), decltype(work)>>(std::move(handler), std::move(work));
+          this->enqueue([completion, job = std::move(job)] {
+            std::exception_ptr eptr;
+            try {
+              job();
+            }
+            catch(...) {
+              eptr = std::current_exception();
+            }
+            auto executor = completion->second.get_executor();
+            boost::asio::post(executor, [completion, eptr]() mutable {
+              std::move(completion->first)(eptr);
+            });
+            completion->second.reset();
+          });
+        },
+        token, std::move(job));
+    }
+
+    // Runs the jobs that are already queued, and stops the thread. No jobs can be queued after this.
+    void stop();
+
+  private:
+    void enqueue(std::function<void()> job);
+    void run();
+
+    std::mutex lock_;
+    std::condition_variable jobs_changed_;
+    std::deque<std::function<void()>> jobs_;
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+
+}
+
+#endif
@@ -1,15 +1,30 @@
+#include "../common/controlchannel.h"
 #include "../common/linebasedserver.h"
+#include "../common/motorbridge.h"
+#include "../common/motorloop.h"
+#include "../common/network.h"
+#include "../common/requestdispatcher.h"
 #include "../common/gst_wrappers.h"
+#include "camerainfo.h"
+#include "cameraregistry.h"
+#include "microphoneinfo.h"
+#include "pipelinestats.h"
+#include "pipelineworker.h"
+#include "videorecorder.h"
 
 #include <future>
 
 #include <chrono>
 #include <iostream>
 #include <typeinfo>
+#include <unordered_map>
+#include <vector>
 
 #ifdef _WIN32
 #include <winsock2.h>
 #endif
+#include <gst/rtp/rtp.h>
+
 #include <boost/program_options.hpp>
 #include <boost/json/array.hpp>
 #include <boost/json/object.hpp>
@@ -21,171 +36,6 @@
 namespace snowrobot {
 
 
-  
-
-class CameraInfo {
-  public:
-    CameraInfo() {
-      BOOST_LOG_TRIVIAL(info) << "CameraInfo::CameraInfo() running";
-
-    }
-
-    // This method is called just after a new CameraInfo instance is created.
-    // It returns the message that should be sent to the client to inform it of this camera and
-    // which network ports the client need to connect to.
-    boost::json::object initialize(GstBin* pipeline,
-                                   GstElement* rtpbin,
-                                   GstDevice * camera_device,
-                                   int camera_index) {
-
-      this->pipeline_ = pipeline;
-      this->rtpbin_ = rtpbin;
-      this->camera_index_ = camera_index;
-      BOOST_LOG_TRIVIAL(info) << "CameraInfo::initialize(): creating ksvideosrc";
-      GstElement* video_source = gst_element_factory_make(
-#ifdef __linux__ 
-        "v4l2src",
-#else
-        "ksvideosrc",
-        //"videotestsrc"
-#endif
-        NULL);
-      ASSERT_NOT_NULL(video_source);
-
-      BOOST_LOG_TRIVIAL(info) << "CameraInfo::initialize(): creating x264enc";
-      GstElement* x264enc = gst_element_factory_make("x264enc", NULL);
-      ASSERT_NOT_NULL(x264enc);
-      g_object_set(x264enc, "tune", 4 /*GstX264EncTune  zerolatency (0x00000004) – Zero latency*/   , NULL);
-      g_object_set(x264enc, "byte-stream", TRUE, NULL);
-      g_object_set(x264enc, "bitrate", 300, NULL);
-
-      BOOST_LOG_TRIVIAL(info) << "CameraInfo::initialize(): creating rtph264pay";
-      GstElement* rtph264pay = gst_element_factory_make("rtph264pay", NULL);
-      ASSERT_NOT_NULL(rtph264pay);
-
-      BOOST_LOG_TRIVIAL(info) << "CameraInfo::initialize(): creating udpsrc";
-      GstElement* video_rtcp_udpsrc = gst_element_factory_make("udpsrc", "video_rtcp_udpsrc");
-      g_object_set(video_rtcp_udpsrc, "port", 0, NULL);
-      gst_element_set_state(video_rtcp_udpsrc, GST_STATE_PAUSED);
-      gint  video_rtcp_udpsrc_assigned_port;
-      g_object_get(video_rtcp_udpsrc, "port", &video_rtcp_udpsrc_assigned_port, NULL);
-      BOOST_LOG_TRIVIAL(info) << "CameraInfo::initialize(): video_rtcp_udpsrc_assigned_port " << video_rtcp_udpsrc_assigned_port;
-
-
-      GstElement* queue = gst_element_factory_make("queue", NULL);
-      ASSERT_NOT_NULL(queue);
-
-      GstElement* videorate = gst_element_factory_make("videorate", NULL);
-      ASSERT_NOT_NULL(videorate);
-
-      GstElement* videoconvert = gst_element_factory_make("videoconvert", NULL);
-      ASSERT_NOT_NULL(videoconvert);
-
-// TODO: get the resolution from the client!
-#ifdef _WIN32
-      GstCaps* video_caps = gst_caps_from_string("video/x-raw, format=YUY2, width=640, height=360, framerate=30/1, pixel-aspect-ratio=1/1");
-#else
-      GstCaps* video_caps = gst_caps_from_string("video/x-raw, format=(string)YUY2, width=(int)640, height=(int)480");
-
-#endif
-      //g_object_set (video_source, "caps", gst_caps_from_string("video/x-raw,width=640,height=360,framerate=15/1"), NULL);
-      //g_object_set (videoconvert, "caps", gst_caps_from_string("video/x-raw,width=640,height=360,framerate=15/1"), NULL);
-
-
-      ASSERT_TRUE(gst_bin_add(pipeline, video_source));
-      ASSERT_TRUE(gst_bin_add(pipeline, queue));
-      ASSERT_TRUE(gst_bin_add(pipeline, videorate));
-      ASSERT_TRUE(gst_bin_add(pipeline, videoconvert));
-      ASSERT_TRUE(gst_bin_add(pipeline, x264enc));
-      ASSERT_TRUE(gst_bin_add(pipeline, rtph264pay));
-      ASSERT_TRUE(gst_bin_add(pipeline, video_rtcp_udpsrc));
-      
-      //ASSERT_TRUE(gst_element_set_state(pipeline, GST_STATE_READY));
-
-
-      ASSERT_TRUE(gst_element_link(video_source, queue));
-      ASSERT_TRUE(gst_element_link(queue, videorate));
-      ASSERT_TRUE(gst_element_link_filtered(videorate, videoconvert, video_caps));
-      
-      
-#ifdef _WIN32
-      ASSERT_TRUE(gst_element_link(videoconvert, x264enc));
-#else
-      // hack to avoid this issue:
-      //   https://gstreamer-devel.narkive.com/zUkuYpXL/x264-error-baseline-profile-doesn-t-support-4-2-2
-//      GstCaps* video_caps2 = gst_caps_from_string("video/x-raw,format=i420");
-        //GstCaps* video_caps2 = gst_caps_from_string("video/x-raw,format=yuv420p");
-
-
-      GstCaps* video_caps2 = gst_caps_from_string("video/x-raw,format=I420");
-      ASSERT_TRUE(gst_element_link_filtered(videoconvert, x264enc, video_caps2));
-
-#endif
-
-      ASSERT_TRUE(gst_element_link(x264enc, rtph264pay));
-
-      std::string recv_rtcp_sink_pad_name = "recv_rtcp_sink_" + std::to_string(this->camera_index_);
-      ASSERT_TRUE(gst_element_link_pads(video_rtcp_udpsrc, "src", rtpbin, recv_rtcp_sink_pad_name.c_str()));
-
-      std::string send_rtp_sink_pad_name = "send_rtp_sink_" + std::to_string(this->camera_index_);
-      ASSERT_TRUE(gst_element_link_pads(rtph264pay, "src", rtpbin, send_rtp_sink_pad_name.c_str()));
-
-      boost::json::object camera;
-      std::string display_name = string_from_gchar(gst_device_get_display_name(camera_device));
-      camera["name"] = display_name;
-      camera["video_rtcp_udpsrc_port"] = video_rtcp_udpsrc_assigned_port;
-
-      auto device_gst_caps = make_GstCaps_ptr(gst_device_get_caps(camera_device));
-      std::string device_gst_caps_str = string_from_gchar(gst_caps_to_string(device_gst_caps.get()));
-      boost::json::array resolutions;
-      auto for_each_caps2 = [] (GstCapsFeatures * features,
-                        GstStructure * structure,
-                        gpointer user_data) -> gboolean {
-        std::string structure_str = string_from_gchar(gst_structure_to_string(structure));
-        boost::json::array* resolutions = (boost::json::array*)user_data;
-        resolutions->emplace_back(structure_str);
-        return TRUE;
-      };
-      gst_caps_foreach(device_gst_caps.get(), for_each_caps2, &resolutions);
-      camera["resolutions"] = std::move(resolutions);
-      return std::move(camera);
-    }
-
-    // This method is called when the client has sent a info-message about the desired resolution, udp ports, etc.
-    void setClientInfo(boost::asio::ip::tcp::socket& client_socket, const boost::json::object& client_info) {
-      gint video_client_rtcp_udpsrc_port = client_info.at("video_rtcp_udpsrc_port").as_int64();
-      gint video_client_rtp_udpsrc_port = client_info.at("video_rtp_udpsrc_port").as_int64();
-
-      GstElement* video_rtcp_udpsink = gst_element_factory_make("udpsink", "video_rtcp_udpsink");
-      GstElement* video_rtp_udpsink = gst_element_factory_make("udpsink", "video_rtp_udpsink");
-
-      std::string client_address = client_socket.remote_endpoint().address().to_string();
-      g_object_set(video_rtcp_udpsink, "port", video_client_rtcp_udpsrc_port, NULL);
-      g_object_set(video_rtcp_udpsink, "host", client_address.c_str(), NULL);
-      g_object_set(video_rtcp_udpsink, "sync", FALSE, NULL);
-      g_object_set(video_rtcp_udpsink, "async", FALSE, NULL);
-
-      g_object_set(video_rtp_udpsink, "port", video_client_rtp_udpsrc_port, NULL);
-      g_object_set(video_rtp_udpsink, "host", client_address.c_str(), NULL);
-      gint64 ts_offset = 0;
-      g_object_set(video_rtp_udpsink, "ts-offset", ts_offset, NULL);
-      
-      ASSERT_TRUE(gst_bin_add(this->pipeline_, video_rtcp_udpsink));
-      ASSERT_TRUE(gst_bin_add(this->pipeline_, video_rtp_udpsink));
-
-      std::string send_rtcp_src_pad_name = "send_rtcp_src_" + std::to_string(this->camera_index_);
-      ASSERT_TRUE(gst_element_link_pads(this->rtpbin_, send_rtcp_src_pad_name.c_str(), video_rtcp_udpsink, "sink"));
-
-      std::string send_rtp_src_pad_name = "send_rtp_src_" + std::to_string(this->camera_index_);
-      ASSERT_TRUE(gst_element_link_pads(this->rtpbin_, send_rtp_src_pad_name.c_str(), video_rtp_udpsink, "sink"));
-
-    }
-  private:
-    GstBin* pipeline_;
-    GstElement* rtpbin_;
-    int camera_index_;
-};
-
 
 
 static void
@@ -234,6 +84,7 @@ cb_error (GstBus * bus, GstMessage * message, gpointer data)
 
 int main(int argc, char** argv)
 {
+  auto startup_time = std::chrono::steady_clock::now();
   gst_init(NULL, NULL);
   const gchar *nano_str;
   guint major, minor, micro, nano;
@@ -247,71 +98,64 @@ int main(int argc, char** argv)
 
   BOOST_LOG_TRIVIAL(info) << "This program is linked against GStreamer " << major << "." << minor << "." << micro << " " << nano_str;
   
-  GList_ptr devices;
-
-  // At least on Windows11, the gst_device_monitor_get_devices() function sometimes doesn't find the integrated camera on my laptop.
-  // It usually works to call the function multiple times until the camera is found. I have no clue what causes this behaviour, but
-  // the retries seems to work ok for now. 
-  size_t camera_count = 0;
-  size_t attempt_nr = 0;
-  constexpr size_t max_attempts = 10;
-  while(true) {
-    attempt_nr += 1;
-    BOOST_LOG_TRIVIAL(info) << "Getting the video and audio devices (attempt " << attempt_nr << "/" << max_attempts << "). This can take a minute or two...";
-    auto monitor = make_GstDeviceMonitor_ptr(gst_device_monitor_new());
-    if(!gst_device_monitor_start(monitor.get())) {
-      BOOST_LOG_TRIVIAL(error) << "GstDeviceMonitor couldn't started!";
-      exit(-1);
-    }
-
-    devices = make_GList_ptr(gst_device_monitor_get_devices(monitor.get()));
-
-    for (GList* devIter = g_list_first(devices.get()); devIter != nullptr; devIter=g_list_next(devIter)) {
-      GstDevice * device = (GstDevice*) devIter->data;
-      if (device == nullptr) {
-        continue;
-      }
-
-      std::string device_class = string_from_gchar(gst_device_get_device_class(device));
-      std::string display_name = string_from_gchar(gst_device_get_display_name(device));
-
-      if (device_class != "Audio/Source" && device_class != "Video/Source" && device_class != "Source/Video") {
-        //continue;
-      }
-      if (device_class == "Video/Source" || device_class == "Source/Video") {
-        camera_count += 1;
-      }
-      BOOST_LOG_TRIVIAL(info) << "device_class: " << device_class << ": " << display_name;
-    }
-  
-    if (camera_count > 0) {
-      // We found at least one camera. Good.
-      break;
-    } else {
-      if (attempt_nr >= max_attempts) {
-        std::ostringstream msg;
-        msg << "Failed to find any cameras after " << attempt_nr << " attempts! Giving up!";
-        BOOST_LOG_TRIVIAL(error) << msg.str();
-        throw std::runtime_error(msg.str());
-      } else {
-        BOOST_LOG_TRIVIAL(warning) << "Failed to find any cameras after " << attempt_nr << "/" << max_attempts << " attempts. I'll try again in a few seconds.";
-        std::this_thread::sleep_for(std::chrono::milliseconds(2000));
-      }
-    }
-  }
-
   int debug_port_nr;
   int command_port_nr;
+  int control_port_nr;
+  int deadman_timeout_ms;
+  MotorLoopSettings motor_settings;
+  MotorBridgeSettings motor_bridge_settings;
+  int io_thread_count;
+  bool test_camera = false;
+  CameraSettings camera_settings;
+  AudioSettings audio_settings;
+  std::string encoder_backend_name;
+  std::string record_path;
+  RecordingSettings recording_settings;
+  int record_max_mb;
   boost::program_options::options_description desc("Allowed options");
   desc.add_options()
       ("debug-port", boost::program_options::value<int>(&debug_port_nr)->default_value(0), "debug port")
       ("command-port", boost::program_options::value<int>(&command_port_nr)->default_value(20000), "command port")
+      ("control-port", boost::program_options::value<int>(&control_port_nr)->default_value(0), "the udp port for the drive commands (0 picks a free port)")
+      ("io-threads", boost::program_options::value<int>(&io_thread_count)->default_value(4), "how many threads that handle the network connections")
+      ("deadman-timeout", boost::program_options::value<int>(&deadman_timeout_ms)->default_value(500), "stop the motors if no fresh drive command has arrived for this many ms")
+      ("motor-rate", boost::program_options::value<int>(&motor_settings.rate_hz)->default_value(motor_settings.rate_hz), "how many times per second the motor outputs are updated")
+      ("motor-max-change", boost::program_options::value<int>(&motor_settings.max_change_per_s)->default_value(motor_settings.max_change_per_s), "how fast the motors may speed up or turn, in per mille of full deflection per second (0 disables the limit)")
+      ("motor-device", boost::program_options::value<std::string>(&motor_bridge_settings.device), "the serial device of the Romeo BLE Quad motor board, like /dev/ttyUSB0 or a BLE-serial bridge's pty (the motors aren't driven without it)")
+      ("motor-baud", boost::program_options::value<int>(&motor_bridge_settings.baud_rate)->default_value(motor_bridge_settings.baud_rate), "the baud rate of the motor board's serial device")
+      ("min-bitrate", boost::program_options::value<int>(&camera_settings.bitrate.min_bitrate_kbps)->default_value(camera_settings.bitrate.min_bitrate_kbps), "the lowest video bitrate (kbit/s) the bitrate controller will use")
+      ("start-bitrate", boost::program_options::value<int>(&camera_settings.bitrate.start_bitrate_kbps)->default_value(camera_settings.bitrate.start_bitrate_kbps), "the video bitrate (kbit/s) to start out with")
+      ("max-bitrate", boost::program_options::value<int>(&camera_settings.bitrate.max_bitrate_kbps)->default_value(camera_settings.bitrate.max_bitrate_kbps), "the highest video bitrate (kbit/s) the bitrate controller will use")
+      ("encoder", boost::program_options::value<std::string>(&encoder_backend_name)->default_value("auto"), "the h264 encoder to use: auto, x264, v4l2 or camera")
+      ("keyframe-interval", boost::program_options::value<int>(&camera_settings.keyframes.keyframe_interval)->default_value(0), "the number of frames between the keyframes (0 uses the encoder's default)")
+      ("fec-percentage", boost::program_options::value<int>(&camera_settings.fec_max_percentage)->default_value(0), "the most forward error correction a client can ask for, in percent of the video packets (0 disables it)")
+      ("intra-refresh", boost::program_options::bool_switch(&camera_settings.keyframes.intra_refresh), "refresh the picture gradually instead of with whole keyframes, which avoids the bursts of packets on a thin uplink")
+      ("record", boost::program_options::value<std::string>(&record_path), "append the rtp and rtcp packets of all the cameras to this capture file, which rtpreplay can play back")
+      ("record-dir", boost::program_options::value<std::string>(&recording_settings.directory), "record the cameras to files in this directory, next to the live stream")
+      ("record-format", boost::program_options::value<std::string>(&recording_settings.format)->default_value(recording_settings.format), "the format of the recorded files: mkv or mp4")
+      ("record-segment", boost::program_options::value<int>(&recording_settings.segment_s)->default_value(recording_settings.segment_s), "the length of each recorded file in seconds")
+      ("record-max-mb", boost::program_options::value<int>(&record_max_mb)->default_value((int)(recording_settings.max_bytes / (1024 * 1024))), "delete the oldest recorded files when the recordings take more than this many MiB")
+      ("test-camera", boost::program_options::bool_switch(&test_camera), "add a camera with a videotestsrc, for testing the server on a machine without cameras")
+      ("audio-bitrate", boost::program_options::value<int>(&audio_settings.bitrate_kbps)->default_value(audio_settings.bitrate_kbps), "the opus bitrate (kbit/s) of the microphones")
+      ("audio-frame-ms", boost::program_options::value<int>(&audio_settings.frame_ms)->default_value(audio_settings.frame_ms), "the length of each opus frame in ms (5, 10, 20, 40 or 60); shorter frames mean lower latency but more packets")
   ;
   boost::program_options::variables_map vm;
   boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
   boost::program_options::notify(vm);    
+  camera_settings.encoder_backend = encoderBackendFromString(encoder_backend_name);
+  motor_settings.deadman_timeout = std::chrono::milliseconds(deadman_timeout_ms);
+  if (!record_path.empty()) {
+    camera_settings.capture = std::make_shared<RtpCaptureWriter>(record_path);
+  }
+  if (!recording_settings.directory.empty()) {
+    recording_settings.max_bytes = (uint64_t)record_max_mb * 1024 * 1024;
+    camera_settings.recorder = std::make_shared<VideoRecorder>(recording_settings);
+  }
 
   boost::asio::io_context ctx;
+  // The io_context is run by several threads, but all the callbacks from the debug and command ports run on this
+  // strand. They share the camera registry, the pipeline, etc, so this way they don't need any locking.
+  boost::asio::any_io_executor app_strand = boost::asio::make_strand(ctx);
 
 
   GstElement* pipeline = NULL;
@@ -328,6 +172,14 @@ int main(int argc, char** argv)
   auto loop_runner_future = std::async(std::launch::async, loop_runner_func);
 
   // The debug port used for ci-tests and for manual debugging.
+  std::function<std::string()> get_stats;  // set when the pipeline and the camera registry have been created
+  auto debug_dispatcher = makeRequestDispatcher<std::string>(
+    onText<"stats">([&get_stats](boost::asio::ip::tcp::socket& sock) {
+      return get_stats();
+    }),
+    onText<"ping">([](boost::asio::ip::tcp::socket& sock) {
+      return std::string("pong");
+    }));
   std::unique_ptr<LineBasedServer> debug_port;
   if (debug_port_nr > 0) {
     debug_port = std::make_unique<LineBasedServer>(
@@ -343,162 +195,430 @@ int main(int argc, char** argv)
       BOOST_LOG_TRIVIAL(info) << "Lost the debug-port connection from '" << sock.remote_endpoint() << "'";
     },
 
-    [](boost::asio::ip::tcp::socket& sock, const std::string& request) {
-      BOOST_LOG_TRIVIAL(info) << "Got a debug-port message from '" << sock.remote_endpoint() << "': " << request;
-      std::string response;
-      if (request == "ping") {
-        response = "pong";
-      } else {
-        response = "ERROR: unknown request '" + request + "'";
+    [&debug_dispatcher](boost::asio::ip::tcp::socket& sock, std::string_view request) {
+      // The stats are scraped every second, so they aren't logged.
+      if (request != "stats") {
+        BOOST_LOG_TRIVIAL(info) << "Got a debug-port message from '" << sock.remote_endpoint() << "': " << request;
       }
-      return response;
-    });
+      try {
+        return debug_dispatcher.dispatch(request, sock);
+      }
+      catch(const std::exception& e) {
+        return "ERROR: " + std::string(e.what());
+      }
+    },
+
+    nullptr,
+    app_strand);
   }
 
 
   GstBusFunc bus_callback = nullptr;
 
-  std::map<std::string, CameraInfo> camera_infos;
+  // The pipeline is created once at startup and is kept running until the server exits. The clients are attached to
+  // and detached from the running pipeline, so a client that reconnects after a network glitch doesn't have to wait
+  // for the cameras and encoders to start up again.
+  BOOST_LOG_TRIVIAL(info) << "Calling gst_pipeline_new()";
+  pipeline = gst_pipeline_new(NULL);
+  // The stats are collected from the start, so the probes are on every element the pipeline ever gets.
+  PipelineStats pipeline_stats(pipeline);
+
+  // add a gstreamer message handler      
+  /*bus_callback = function_pointer<gboolean(GstBus*, GstMessage*, gpointer)>([] (GstBus*, GstMessage* msg, gpointer) -> gboolean {
+    BOOST_LOG_TRIVIAL(info) << "bus_callback() running. msg:" << gst_message_type_get_name(msg->type) << " type:" << msg->type;
+    return TRUE;
+  });
+  GstBus* bus = gst_pipeline_get_bus((GstPipeline*)pipeline);
+  guint bus_watch_id = gst_bus_add_watch (bus, bus_callback, loop);
+  gst_object_unref (bus);*/
+
+  GstBus* bus = gst_element_get_bus((GstElement*)pipeline);
+  g_signal_connect (bus, "message::error", G_CALLBACK (cb_error), pipeline);
+  g_signal_connect (bus, "message::warning", G_CALLBACK (cb_warning), pipeline);
+  g_signal_connect (bus, "message::state-changed", G_CALLBACK (cb_state), pipeline);
+  g_signal_connect (bus, "message::eos", G_CALLBACK (cb_eos), NULL);
+  gst_bus_add_signal_watch (bus);
+
+  gst_object_unref (bus);
+
+  GstElement* rtpbin = gst_element_factory_make("rtpbin", NULL);
+  // The clients use the AVPF profile, so they can ask for a keyframe with a PLI as soon as they lose a packet instead
+  // of waiting for the next regular rtcp interval.
+  g_object_set(rtpbin, "rtp-profile", GST_RTP_PROFILE_AVPF, NULL);
+  gst_bin_add_many(GST_BIN_CAST(pipeline), rtpbin, NULL);
+
+  // All the calls that change the pipeline run on the pipeline worker, so that the io threads never have to wait for
+  // a camera to open or for a state change to finish.
+  PipelineWorker pipeline_worker;
+
+  // The pipeline starts out with just the rtpbin, and the cameras are added to the playing pipeline as the camera
+  // registry finds them. The clients' attach jobs are queued behind this one.
+  std::string pipeline_start_error;  // only touched by the pipeline worker
+  pipeline_worker.post([&] {
+    GstStateChangeReturn start_result = gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    BOOST_LOG_TRIVIAL(info) << "Started the gstreamer pipeline. result:" << start_result;
+    if (start_result == GST_STATE_CHANGE_FAILURE) {
+      pipeline_start_error = "Failed to start the gstreamer pipeline!";
+      BOOST_LOG_TRIVIAL(error) << pipeline_start_error;
+    }
+  });
+
+  // The cameras and microphones are found by a device monitor that keeps running in the background, so the server
+  // doesn't have to wait for them before it starts listening, and a usb webcam can be plugged in and out while the
+  // server runs. The connected clients are told about the changes with camera-added, camera-removed, microphone-added
+  // and microphone-removed messages.
+  std::function<void(const std::string&)> broadcast_to_clients;  // set when the command port has been created
+  CameraRegistry camera_registry(
+    GST_BIN_CAST(pipeline),
+    rtpbin,
+    pipeline_worker,
+    camera_settings,
+    audio_settings,
+    [&](const boost::json::object& camera) {
+      boost::json::object msg;
+      msg["type"] = "camera-added";
+      msg["camera"] = camera;
+      broadcast_to_clients(boost::json::serialize(msg));
+    },
+    [&](const std::string& camera_name) {
+      boost::json::object msg;
+      msg["type"] = "camera-removed";
+      msg["name"] = camera_name;
+      broadcast_to_clients(boost::json::serialize(msg));
+    },
+    [&](const boost::json::object& microphone) {
+      boost::json::object msg;
+      msg["type"] = "microphone-added";
+      msg["microphone"] = microphone;
+      broadcast_to_clients(boost::json::serialize(msg));
+    },
+    [&](const std::string& microphone_name) {
+      boost::json::object msg;
+      msg["type"] = "microphone-removed";
+      msg["name"] = microphone_name;
+      broadcast_to_clients(boost::json::serialize(msg));
+    });
 
-  // The command port is where the client application connects to the server.
-  bool has_active_client = false;
-  boost::asio::ip::tcp::endpoint active_client;
-  LineBasedServer command_port(
+  // The command port's clients are known by their remote endpoint, which is looked up once when the client connects.
+  // remote_endpoint() throws once the peer has reset the connection, and the client must still be found when the
+  // connection is lost. Only touched on the app strand.
+  std::unordered_map<const boost::asio::ip::tcp::socket*, boost::asio::ip::tcp::endpoint> client_endpoints;
+  auto client_endpoint_of = [&client_endpoints](boost::asio::ip::tcp::socket& sock) {
+    auto find = client_endpoints.find(&sock);
+    if (find != client_endpoints.end()) {
+      return find->second;
+    }
+    // Every command port connection is added when it is made, so this is only a fallback that doesn't throw.
+    boost::system::error_code ec;
+    return sock.remote_endpoint(ec);
+  };
+  auto client_id_of = [&client_endpoint_of](boost::asio::ip::tcp::socket& sock) {
+    std::ostringstream client_id;
+    client_id << client_endpoint_of(sock);
+    return client_id.str();
+  };
+
+  // The motors are updated at a fixed rate by a thread of their own, which picks up the latest drive command on each
+  // tick and hands it to the motor board. Without a --motor-device the outputs only show up in the debug port's stats.
+  std::unique_ptr<MotorBridge> motor_bridge;
+  if (!motor_bridge_settings.device.empty()) {
+    motor_bridge = std::make_unique<MotorBridge>(ctx, motor_bridge_settings);
+  }
+  MotorLoop motor_loop(motor_settings, [&motor_bridge](const MotorOutput& output) {
+    if (motor_bridge) {
+      motor_bridge->apply(output);
+    }
+  });
+
+  // The drive commands from the operator arrive on the udp control channel. The client finds the port in the cameras
+  // message, and tells us which port it sends from in the welcome-response message. The control channel's strand is
+  // the only thread that posts to the motor loop.
+  ControlChannelServer control_channel(
     ctx,
-    command_port_nr,
-     
-    [&](boost::asio::ip::tcp::socket& sock) -> std::string {
-      BOOST_LOG_TRIVIAL(info) << "Got a new connection from '" << sock.remote_endpoint() << "'";
-      if (has_active_client) {
-        return "There is already an active client";
+    control_port_nr,
+    std::chrono::milliseconds(deadman_timeout_ms),
+    [&motor_loop](const DrivePayload& command) {
+      BOOST_LOG_TRIVIAL(debug) << "Motor command: seq:" << command.sequence_nr << " steering:" << command.steering
+                               << " throttle:" << command.throttle
+                               << " age:" << ((int64_t)unix_time_us() - (int64_t)command.timestamp_us) << "us";
+      motor_loop.post(command);
+    });
+  ControlChannelOwnership control_channel_owner(control_channel);  // which client controls the motors
+
+  // Handles the json requests from the clients. The same requests can be sent both as text lines and as Text
+  // messages in the binary protocol. This runs on the app strand, and hands the pipeline changes to the pipeline
+  // worker. The request objects live in the dispatcher's arena until the handler's coroutine has finished.
+  auto command_dispatcher = makeRequestDispatcher<boost::asio::awaitable<std::string>>(
+    onText<"ping">([](boost::asio::ip::tcp::socket& sock) -> boost::asio::awaitable<std::string> {
+      co_return "pong";
+    }),
+
+    onJson<"welcome-response">([&](const boost::json::object& request_obj, boost::asio::ip::tcp::socket& sock) -> boost::asio::awaitable<std::string> {
+      std::string client_id = client_id_of(sock);
+      std::string client_address = client_endpoint_of(sock).address().to_string();
+      std::vector<std::pair<std::shared_ptr<CameraInfo>, const boost::json::object*>> attachments;
+      for (const boost::json::value& value : request_obj.at("cameras").as_array()) {
+        const boost::json::object& camera_response = value.as_object();
+        std::string camera_name(camera_response.at("name").as_string());
+        std::shared_ptr<CameraInfo> camera_info = camera_registry.find(camera_name);
+        if (!camera_info) {
+          std::ostringstream msg;
+          msg << "Unknown camera name: '" << camera_name << "'";
+          throw std::runtime_error(msg.str());
+        }
+        attachments.emplace_back(camera_info, &camera_response);
       }
-      has_active_client = true;
-      active_client = sock.remote_endpoint();
-
-      BOOST_LOG_TRIVIAL(info) << "Calling gst_pipeline_new()";
-      pipeline = gst_pipeline_new(NULL);
 
-      // add a gstreamer message handler      
-      /*bus_callback = function_pointer<gboolean(GstBus*, GstMessage*, gpointer)>([] (GstBus*, GstMessage* msg, gpointer) -> gboolean {
-        BOOST_LOG_TRIVIAL(info) << "bus_callback() running. msg:" << gst_message_type_get_name(msg->type) << " type:" << msg->type;
-        return TRUE;
-      });
-      GstBus* bus = gst_pipeline_get_bus((GstPipeline*)pipeline);
-      guint bus_watch_id = gst_bus_add_watch (bus, bus_callback, loop);
-      gst_object_unref (bus);*/
-
-      GstBus* bus = gst_element_get_bus((GstElement*)pipeline);
-      g_signal_connect (bus, "message::error", G_CALLBACK (cb_error), pipeline);
-      g_signal_connect (bus, "message::warning", G_CALLBACK (cb_warning), pipeline);
-      g_signal_connect (bus, "message::state-changed", G_CALLBACK (cb_state), pipeline);
-      g_signal_connect (bus, "message::eos", G_CALLBACK (cb_eos), NULL);
-      gst_bus_add_signal_watch (bus);
-
-      gst_object_unref (bus);
-
-      GstElement* rtpbin = gst_element_factory_make("rtpbin", NULL);
-      gst_bin_add_many(GST_BIN_CAST(pipeline), rtpbin, NULL);
-      
-      boost::json::array cameras;
-      int camere_index = -1;
-      for (GList* devIter = g_list_first(devices.get()); devIter != nullptr; devIter=g_list_next(devIter)) {
-        GstDevice * device = (GstDevice*) devIter->data;
-        if (device == nullptr) {
-          continue;
+      // The "microphones" are optional, since a client without audio output doesn't ask for any.
+      std::vector<std::pair<std::shared_ptr<MicrophoneInfo>, const boost::json::object*>> audio_attachments;
+      if (request_obj.contains("microphones")) {
+        for (const boost::json::value& value : request_obj.at("microphones").as_array()) {
+          const boost::json::object& microphone_response = value.as_object();
+          std::string microphone_name(microphone_response.at("name").as_string());
+          std::shared_ptr<MicrophoneInfo> microphone_info = camera_registry.findMicrophone(microphone_name);
+          if (!microphone_info) {
+            std::ostringstream msg;
+            msg << "Unknown microphone name: '" << microphone_name << "'";
+            throw std::runtime_error(msg.str());
+          }
+          audio_attachments.emplace_back(microphone_info, &microphone_response);
         }
+      }
+
+      if (request_obj.contains("control_udp_port")) {
+        boost::asio::ip::udp::endpoint control_endpoint(client_endpoint_of(sock).address(),
+                                                        (boost::asio::ip::port_type)request_obj.at("control_udp_port").as_int64());
+        control_channel_owner.claim(client_id, control_endpoint);
+      }
+
+      // Attach the client on the pipeline worker, and tell the client how it went when it is done. The client can
+      // start the drive commands right away, it doesn't have to wait for the video.
+      boost::json::object state_msg;
+      state_msg["type"] = "pipeline-state";
+      try {
+        GstState state = GST_STATE_VOID_PENDING;
+        co_await pipeline_worker.asyncRun([&] {
+          if (!pipeline_start_error.empty()) {
+            throw std::runtime_error(pipeline_start_error);
+          }
+          for (auto& [camera_info, camera_response] : attachments) {
+            camera_info->addClient(client_id, client_address, *camera_response);
+          }
+          for (auto& [microphone_info, microphone_response] : audio_attachments) {
+            microphone_info->addClient(client_id, client_address, *microphone_response);
+          }
 
-        std::string device_class = string_from_gchar(gst_device_get_device_class(device));
-        if (device_class != "Video/Source" && device_class != "Source/Video") {
-          continue;
+          BOOST_LOG_TRIVIAL(info) << "Calling gst_debug_bin_to_dot_file()";
+          GST_DEBUG_BIN_TO_DOT_FILE((GstBin*)pipeline, GST_DEBUG_GRAPH_SHOW_MEDIA_TYPE, "server.dot");
+          BOOST_LOG_TRIVIAL(info) << "gst_debug_bin_to_dot_file() finished ok";
+
+          gst_element_get_state(pipeline, &state, nullptr, 0);
+        }, boost::asio::use_awaitable);
+        state_msg["state"] = gst_element_state_get_name(state);
+        state_msg["cameras"] = attachments.size();
+        state_msg["microphones"] = audio_attachments.size();
+      }
+      catch(const std::exception& e) {
+        BOOST_LOG_TRIVIAL(error) << "Failed to attach '" << client_id << "' to the pipeline: " << e.what();
+        state_msg["state"] = "error";
+        state_msg["error"] = e.what();
+      }
+      co_return boost::json::serialize(state_msg);
+    }),
+
+    // Switches a camera to another resolution and/or framerate without stopping the pipeline. All the clients watch
+    // the same encoded stream, so only the operator gets to pick, and everybody is told about the change.
+    onJson<"select-resolution">([&](const boost::json::object& request_obj, boost::asio::ip::tcp::socket& sock) -> boost::asio::awaitable<std::string> {
+      std::string camera_name(request_obj.at("camera").as_string());
+      std::string resolution(request_obj.at("resolution").as_string());
+      std::shared_ptr<CameraInfo> camera_info = camera_registry.find(camera_name);
+      boost::json::object result_msg;
+      result_msg["type"] = "resolution-changed";
+      result_msg["camera"] = camera_name;
+      try {
+        if (!camera_info) {
+          THROW_RUNTIME_ERROR("Unknown camera name: '" << camera_name << "'");
         }
-        camere_index++;
-        std::string display_name = string_from_gchar(gst_device_get_display_name(device));
-        auto find = camera_infos.find(display_name);
-        if (find != camera_infos.end()) {
-          BOOST_LOG_TRIVIAL(error) << "Got a duplicate camera name '" << display_name << "'!";
-          exit(-1);
+        if (camera_info->getOperator() != client_id_of(sock)) {
+          THROW_RUNTIME_ERROR("Only the operator can change the resolution of '" << camera_name << "'");
         }
-        CameraInfo& camera_info = camera_infos[display_name];  // This will insert a new CameraInfo entry int the map
+        std::string new_resolution;
+        co_await pipeline_worker.asyncRun([&] {
+          new_resolution = camera_info->selectResolution(resolution);
+        }, boost::asio::use_awaitable);
+        result_msg["resolution"] = new_resolution;
+        broadcast_to_clients(boost::json::serialize(result_msg));
+      }
+      catch(const std::exception& e) {
+        BOOST_LOG_TRIVIAL(error) << "Failed to change the resolution of '" << camera_name << "' to '" << resolution << "': " << e.what();
+        result_msg["error"] = e.what();
+        co_return boost::json::serialize(result_msg);
+      }
+      co_return std::string();
+    }),
+
+    // Lists the recorded files that cover a time range, so the operator can fetch them from the robot. The times are
+    // unix times in ms, and the camera is optional.
+    onJson<"get-recording">([&](const boost::json::object& request_obj, boost::asio::ip::tcp::socket& sock) -> boost::asio::awaitable<std::string> {
+      boost::json::object result_msg;
+      result_msg["type"] = "recording";
+      if (!camera_settings.recorder) {
+        result_msg["error"] = "The server doesn't record the cameras, start it with --record-dir";
+      } else {
+        std::string camera_name = request_obj.contains("camera") ? std::string(request_obj.at("camera").as_string()) : "";
+        int64_t from_ms = request_obj.contains("from") ? request_obj.at("from").to_number<int64_t>() : 0;
+        int64_t to_ms = request_obj.contains("to") ? request_obj.at("to").to_number<int64_t>() : INT64_MAX / 1000;
+        boost::json::array segments;
+        for (const RecordingSegment& segment : camera_settings.recorder->getSegments(camera_name, from_ms * 1000, to_ms * 1000)) {
+          boost::json::object segment_obj;
+          segment_obj["camera"] = segment.camera;
+          segment_obj["path"] = segment.path;
+          segment_obj["start"] = segment.start_time_us / 1000;
+          segment_obj["end"] = segment.end_time_us / 1000;
+          segment_obj["bytes"] = segment.bytes;
+          segments.push_back(std::move(segment_obj));
+        }
+        result_msg["segments"] = std::move(segments);
+      }
+      co_return boost::json::serialize(result_msg);
+    }));
+
+  auto handle_command = [&](boost::asio::ip::tcp::socket& sock, std::string_view request) -> boost::asio::awaitable<std::string> {
+    if (request != "ping") {
+      BOOST_LOG_TRIVIAL(info) << "Got a message from '" << client_id_of(sock) << "': " << request;
+    }
+    co_return co_await command_dispatcher.asyncDispatch(request, sock);
+  };
+
+  // The command port is where the client applications connect to the server. Any number of clients can watch the
+  // cameras at the same time. The first one to connect is the operator, see CameraInfo.
+  LineBasedServer command_port(
+    ctx,
+    command_port_nr,
+     
+    [&](boost::asio::ip::tcp::socket& sock) -> std::string {
+      client_endpoints[&sock] = sock.remote_endpoint();
+      BOOST_LOG_TRIVIAL(info) << "Got a new connection from '" << client_id_of(sock) << "'";
 
-        boost::json::object camera = std::move(camera_info.initialize(GST_BIN_CAST(pipeline), rtpbin, device, camere_index));
+      boost::json::array cameras;
+      for (const std::shared_ptr<CameraInfo>& camera_info : camera_registry.getCameras()) {
+        cameras.push_back(camera_info->getDescription());
+      }
 
-        cameras.push_back(std::move(camera));
+      boost::json::array microphones;
+      for (const std::shared_ptr<MicrophoneInfo>& microphone_info : camera_registry.getMicrophones()) {
+        microphones.push_back(microphone_info->getDescription());
       }
 
       boost::json::object cameras_msg;
       cameras_msg["type"] = "cameras";
       cameras_msg["cameras"] = std::move(cameras);
+      cameras_msg["microphones"] = std::move(microphones);
+      cameras_msg["control_udp_port"] = control_channel.getPort();
       std::string cameras_msg_str = boost::json::serialize(cameras_msg);
-      BOOST_LOG_TRIVIAL(info) << "Sending this camera list to '" << sock.remote_endpoint() << "': " << cameras_msg_str;
+      BOOST_LOG_TRIVIAL(info) << "Sending this camera list to '" << client_id_of(sock) << "': " << cameras_msg_str;
       return cameras_msg_str;
     },
 
     [&](boost::asio::ip::tcp::socket& sock) {
-      BOOST_LOG_TRIVIAL(info) << "Lost the connection from '" << sock.remote_endpoint() << "'";
-      if (sock.remote_endpoint() == active_client) {
-        camera_infos.clear();
-        gst_element_set_state(pipeline, GST_STATE_NULL);
-        gst_object_unref(pipeline);
-        pipeline = nullptr;
-        has_active_client = false;
-      }
+      std::string client_id = client_id_of(sock);
+      client_endpoints.erase(&sock);
+      BOOST_LOG_TRIVIAL(info) << "Lost the connection from '" << client_id << "'";
+      // The motors are stopped first, so that nothing below can keep a gone operator in control.
+      control_channel_owner.release(client_id);
+      // The worker runs the jobs in order, so this can't overtake the client's own attach job.
+      pipeline_worker.post([&camera_registry, client_id] {
+        for (const std::shared_ptr<CameraInfo>& camera_info : camera_registry.getCameras()) {
+          camera_info->removeClient(client_id);
+        }
+        for (const std::shared_ptr<MicrophoneInfo>& microphone_info : camera_registry.getMicrophones()) {
+          microphone_info->removeClient(client_id);
+        }
+      });
     },
 
-    [&](boost::asio::ip::tcp::socket& sock, const std::string& request) {
-      std::string response;
-      if (request == "ping") {
-        response = "pong";
-
-      } else {
-        BOOST_LOG_TRIVIAL(info) << "Got a message from '" << sock.remote_endpoint() << "': " << request;
-
-        boost::json::object request_obj = boost::json::parse(request).as_object();
-        std::string request_type(request_obj.at("type").as_string());
-        if (request_type == "welcome-response") {
-          boost::json::array camera_responses = request_obj.at("cameras").as_array();
-          for (boost::json::value& value : camera_responses) {
-            boost::json::object& camera_response = value.as_object();
-            std::string camera_name(camera_response.at("name").as_string());
-            auto camera_info_find = camera_infos.find(camera_name);
-            if (camera_info_find == camera_infos.end()) {
-              std::ostringstream msg;
-              msg << "Unknown camera name: '" << camera_name << "'";
-              throw std::runtime_error(msg.str());
-            }
-            CameraInfo& camera_info = camera_info_find->second;
-            camera_info.setClientInfo(sock, camera_response); 
-          }
-
-          BOOST_LOG_TRIVIAL(info) << "Calling gst_debug_bin_to_dot_file()";
-          GST_DEBUG_BIN_TO_DOT_FILE((GstBin*)pipeline, GST_DEBUG_GRAPH_SHOW_MEDIA_TYPE, "server.dot");
-          BOOST_LOG_TRIVIAL(info) << "gst_debug_bin_to_dot_file() finished ok";
-
-          GstStateChangeReturn result = gst_element_set_state(pipeline, GST_STATE_PLAYING);
-          BOOST_LOG_TRIVIAL(info) << "Started the gstreamer pipeline. result:" << result;
-          if (result == GST_STATE_CHANGE_FAILURE) {
-            throw std::runtime_error("Failed to start the gstreamer pipeline!");
+    handle_command,
+
+    // The binary protocol is used for the high-rate messages, see network.h. Text messages are handled just like the
+    // lines from the line-based protocol.
+    [&](boost::asio::ip::tcp::socket& sock, const Message& message, std::vector<uint8_t>& response) -> boost::asio::awaitable<void> {
+      switch (message.getType()) {
+        case MessageType::Drive: {
+          DrivePayload drive = message.as<DrivePayload>();
+          BOOST_LOG_TRIVIAL(debug) << "Got a drive command from '" << client_id_of(sock) << "': seq:" << drive.sequence_nr
+                                   << " steering:" << drive.steering << " throttle:" << drive.throttle;
+          break;
+        }
+        case MessageType::Text: {
+          std::string text_response = co_await handle_command(sock, message.asText());
+          if (!text_response.empty()) {
+            Message::encodeText(text_response, response);
           }
-
-
-          // we don't want to send a response to this message, so we return an empty string.
-          response = "";
-        } else {
-          BOOST_LOG_TRIVIAL(info) << "Got an unknown request type: '" << request_type << "' from '" << sock.remote_endpoint();
-          std::ostringstream msg;
-          msg << "Unknown request type: '" << request_type << "'";
-          throw std::runtime_error(msg.str());
+          break;
         }
-
+        default:
+          THROW_RUNTIME_ERROR("Unknown message type " << (int)message.getType() << " from '" << client_id_of(sock) << "'");
       }
-      return response;
-    }
+    },
+
+    app_strand
   );
+  broadcast_to_clients = [&](const std::string& text) { command_port.broadcast(text); };
+  get_stats = [&] {
+    boost::json::object stats = pipeline_stats.collect();
+    stats["time"] = g_get_real_time() / 1000;  // unix time in ms
+    boost::json::array cameras;
+    for (const std::shared_ptr<CameraInfo>& camera_info : camera_registry.getCameras()) {
+      cameras.push_back(camera_info->getStats());
+    }
+    stats["cameras"] = std::move(cameras);
+    MotorLoop::Stats motor_stats = motor_loop.getStats();
+    boost::json::object motors;
+    motors["ticks"] = motor_stats.ticks;
+    motors["commands"] = motor_stats.commands;
+    motors["deadman_stops"] = motor_stats.deadman_stops;
+    motors["overruns"] = motor_stats.overruns;
+    motors["max_lateness_us"] = motor_stats.max_lateness_us;
+    if (motor_bridge) {
+      MotorBridge::Stats bridge_stats = motor_bridge->getStats();
+      boost::json::object board;
+      board["writes"] = bridge_stats.writes;
+      board["coalesced"] = bridge_stats.coalesced;
+      board["write_failures"] = bridge_stats.write_failures;
+      board["acks"] = bridge_stats.acks;
+      board["nacks"] = bridge_stats.nacks;
+      board["unknown_responses"] = bridge_stats.unknown_responses;
+      board["last_round_trip_us"] = bridge_stats.last_round_trip_us;
+      board["max_round_trip_us"] = bridge_stats.max_round_trip_us;
+      motors["board"] = std::move(board);
+    }
+    stats["motors"] = std::move(motors);
+    return boost::json::serialize(stats);
+  };
+  camera_registry.start();
+  if (test_camera) {
+    camera_registry.addTestCamera();
+  }
+  BOOST_LOG_TRIVIAL(info) << "The command port is listening on port " << command_port.getPort() << ", "
+                          << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startup_time).count()
+                          << "ms after startup.";
+
+  BOOST_LOG_TRIVIAL(info) << "server starting up with " << io_thread_count << " io threads.";
+  std::vector<std::future<void>> io_thread_futures;
+  for (int i = 0; i < io_thread_count; i++) {
+    io_thread_futures.push_back(std::async(std::launch::async, [&ctx]{ctx.run();}));
+  }
 
-  BOOST_LOG_TRIVIAL(info) << "server starting up.";
-  auto asio_main_future = std::async(std::launch::async, [&ctx]{ctx.run();});
+  BOOST_LOG_TRIVIAL(info) << "Waiting for the io threads to finish";
+  for (std::future<void>& io_thread_future : io_thread_futures) {
+    io_thread_future.get();
+  }
 
-  BOOST_LOG_TRIVIAL(info) << "Calling asio_main_future.get();";
-  asio_main_future.get();
+  // Let the worker finish the detach jobs of the last clients before the pipeline is torn down.
+  pipeline_worker.stop();
+  camera_registry.clear();
+  gst_element_set_state(pipeline, GST_STATE_NULL);
+  gst_object_unref(pipeline);
 
   g_main_loop_quit(loop);
   loop_runner_future.get();
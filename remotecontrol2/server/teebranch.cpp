@@ -0,0 +1,108 @@
+#include "teebranch.h"
+#include "../common/gst_wrappers.h"
+
+
+namespace snowrobot {
+
+
+// Adds a tee to the pipeline with a fakesink on one of its src pads. The fakesink keeps the data flowing when there
+// are no clients attached to the tee. Both elements are appended to the elements list.
+GstElement* addTeeWithFakesink(GstBin* pipeline, std::vector<GstElement*>& elements) {
+  GstElement* tee = gst_element_factory_make("tee", NULL);
+  ASSERT_NOT_NULL(tee);
+  GstElement* fakesink = gst_element_factory_make("fakesink", NULL);
+  ASSERT_NOT_NULL(fakesink);
+  g_object_set(fakesink, "sync", FALSE, NULL);
+  g_object_set(fakesink, "async", FALSE, NULL);
+  ASSERT_TRUE(gst_bin_add(pipeline, tee));
+  ASSERT_TRUE(gst_bin_add(pipeline, fakesink));
+  ASSERT_TRUE(gst_element_link(tee, fakesink));
+  elements.push_back(tee);
+  elements.push_back(fakesink);
+  return tee;
+}
+
+
+struct CaptureTarget {
+  std::shared_ptr<RtpCaptureWriter> writer;
+  uint16_t stream;
+  RtpCaptureKind kind;
+};
+
+// Attaches a branch to the tee that appends each packet to the capture file, as the given stream and kind. The branch
+// has its own leaky queue, so a slow disk drops packets from the recording instead of stalling the tee. The elements
+// are appended to the elements list.
+void addCaptureBranch(GstBin* pipeline, GstElement* tee, std::shared_ptr<RtpCaptureWriter> writer, uint16_t stream,
+                      RtpCaptureKind kind, std::vector<GstElement*>& elements) {
+  GstElement* queue = gst_element_factory_make("queue", NULL);
+  ASSERT_NOT_NULL(queue);
+  g_object_set(queue, "max-size-buffers", 0, NULL);
+  g_object_set(queue, "max-size-bytes", 0, NULL);
+  g_object_set(queue, "max-size-time", (guint64)1 * GST_SECOND, NULL);
+  gst_util_set_object_arg(G_OBJECT(queue), "leaky", "downstream");
+  GstElement* fakesink = gst_element_factory_make("fakesink", NULL);
+  ASSERT_NOT_NULL(fakesink);
+  g_object_set(fakesink, "sync", FALSE, NULL);
+  g_object_set(fakesink, "async", FALSE, NULL);
+  g_object_set(fakesink, "signal-handoffs", TRUE, NULL);
+  // The packets are timestamped when the fakesink gets them, which is just after the queue. The queue is empty unless
+  // the disk is slow, so this is within a fraction of a ms of when the packets were sent.
+  g_signal_connect_data(fakesink, "handoff",
+    G_CALLBACK(+[](GstElement* fakesink, GstBuffer* buffer, GstPad* pad, gpointer user_data) {
+      CaptureTarget* target = (CaptureTarget*)user_data;
+      GstMapInfo map;
+      if (gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+        target->writer->write(target->stream, target->kind, map.data, map.size);
+        gst_buffer_unmap(buffer, &map);
+      }
+    }),
+    new CaptureTarget{std::move(writer), stream, kind},
+    [](gpointer user_data, GClosure*) {
+      delete (CaptureTarget*)user_data;
+    },
+    (GConnectFlags)0);
+  ASSERT_TRUE(gst_bin_add(pipeline, queue));
+  ASSERT_TRUE(gst_bin_add(pipeline, fakesink));
+  ASSERT_TRUE(gst_element_link_many(tee, queue, fakesink, NULL));
+  elements.push_back(queue);
+  elements.push_back(fakesink);
+}
+
+
+struct DetachRequest {
+  GstBin* pipeline;
+  GstElement* tee;
+  GstPad* tee_pad;
+  std::vector<GstElement*> elements;  // ordered from downstream to upstream
+};
+
+// Unlinks the elements that are attached to the tee_pad and removes them from the pipeline. This is done from an
+// idle probe, since the tee may be pushing a buffer on the pad at this very moment. The sinks must be stopped before
+// the queues, since a queue thread can be blocked in a sink's clock wait.
+void detachBranch(GstBin* pipeline, GstElement* tee, GstPad* tee_pad, std::vector<GstElement*> elements) {
+  DetachRequest* request = new DetachRequest{pipeline, tee, tee_pad, std::move(elements)};
+  gst_pad_add_probe(tee_pad, GST_PAD_PROBE_TYPE_IDLE,
+    [](GstPad* pad, GstPadProbeInfo* info, gpointer user_data) -> GstPadProbeReturn {
+      DetachRequest* request = (DetachRequest*)user_data;
+      GstPad* peer = gst_pad_get_peer(pad);
+      if (peer != nullptr) {
+        gst_pad_unlink(pad, peer);
+        gst_object_unref(peer);
+      }
+      gst_element_release_request_pad(request->tee, pad);
+      for (GstElement* element : request->elements) {
+        gst_element_set_state(element, GST_STATE_NULL);
+        gst_bin_remove(request->pipeline, element);
+      }
+      return GST_PAD_PROBE_REMOVE;
+    },
+    request,
+    [](gpointer user_data) {
+      DetachRequest* request = (DetachRequest*)user_data;
+      gst_object_unref(request->tee_pad);
+      delete request;
+    });
+}
+
+
+}
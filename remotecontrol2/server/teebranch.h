@@ -0,0 +1,36 @@
+#ifndef SNOWROBOT_REMOTECONTROL_SERVER_TEEBRANCH_H
+#define SNOWROBOT_REMOTECONTROL_SERVER_TEEBRANCH_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <gst/gst.h>
+
+#include "../common/rtpcapture.h"
+
+
+namespace snowrobot {
+
+
+// The cameras and microphones send their rtp and rtcp packets to a tee each, and the clients' udpsinks are attached
+// to and detached from the tees while the pipeline is playing. These are the helpers for that.
+
+// Adds a tee to the pipeline with a fakesink on one of its src pads. The fakesink keeps the data flowing when there
+// are no clients attached to the tee. Both elements are appended to the elements list.
+GstElement* addTeeWithFakesink(GstBin* pipeline, std::vector<GstElement*>& elements);
+
+// Attaches a branch to the tee that appends each packet to the capture file, as the given stream and kind. The branch
+// has its own leaky queue, so a slow disk drops packets from the recording instead of stalling the tee. The elements
+// are appended to the elements list.
+void addCaptureBranch(GstBin* pipeline, GstElement* tee, std::shared_ptr<RtpCaptureWriter> writer, uint16_t stream,
+                      RtpCaptureKind kind, std::vector<GstElement*>& elements);
+
+// Unlinks the elements that are attached to the tee_pad and removes them from the pipeline. The elements must be
+// ordered from downstream to upstream. This takes over the reference to the tee_pad.
+void detachBranch(GstBin* pipeline, GstElement* tee, GstPad* tee_pad, std::vector<GstElement*> elements);
+
+
+}
+
+#endif
@@ -0,0 +1,357 @@
+#include "videorecorder.h"
+#include "../common/gst_wrappers.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <filesystem>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <boost/log/trivial.hpp>
+
+
+namespace snowrobot {
+
+
+// The camera names are display names like "HD Pro Webcam C920", so only the safe characters are used in the file names.
+static std::string sanitize(const std::string& camera_name) {
+  std::string result;
+  for (char c : camera_name) {
+    result += std::isalnum((unsigned char)c) || c == '-' ? c : '-';
+  }
+  return result;
+}
+
+
+// The files are named "<camera>_<unix time in ms>.<format>".
+static bool parseSegmentName(const std::filesystem::path& path, std::string& camera, int64_t& start_time_us) {
+  std::string stem = path.stem().string();
+  size_t separator = stem.rfind('_');
+  if (separator == std::string::npos || separator == 0) {
+    return false;
+  }
+  try {
+    start_time_us = std::stoll(stem.substr(separator + 1)) * 1000;
+  }
+  catch(const std::exception&) {
+    return false;
+  }
+  camera = stem.substr(0, separator);
+  return true;
+}
+
+
+static int64_t lastWriteTime(const std::filesystem::path& path) {
+  std::error_code error;
+  auto file_time = std::filesystem::last_write_time(path, error);
+  if (error) {
+    return 0;
+  }
+  auto system_time = std::chrono::file_clock::to_sys(file_time);
+  return std::chrono::duration_cast<std::chrono::microseconds>(system_time.time_since_epoch()).count();
+}
+
+
+// Flushes the file's data to the disk. Any file descriptor of the file will do, so we don't need splitmuxsink's.
+static void syncFile(const std::string& path) {
+#ifdef _WIN32
+  int fd = _open(path.c_str(), _O_RDONLY);
+  if (fd >= 0) {
+    _commit(fd);
+    _close(fd);
+  }
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    fdatasync(fd);
+    close(fd);
+  }
+#endif
+}
+
+
+VideoRecorder::VideoRecorder(const RecordingSettings& settings) : settings_(settings) {
+  if (settings.format != "mkv" && settings.format != "mp4") {
+    THROW_RUNTIME_ERROR("Unknown recording format '" << settings.format << "', use mkv or mp4");
+  }
+  std::filesystem::create_directories(settings.directory);
+  this->scanDirectory();
+  this->sync_thread_ = std::thread([this] { this->runSyncThread(); });
+}
+
+
+VideoRecorder::~VideoRecorder() {
+  {
+    std::lock_guard<std::mutex> guard(this->lock_);
+    this->stopping_ = true;
+  }
+  this->stop_changed_.notify_all();
+  this->sync_thread_.join();
+}
+
+
+void VideoRecorder::scanDirectory() {
+  uint64_t total_bytes = 0;
+  for (const auto& entry : std::filesystem::directory_iterator(this->settings_.directory)) {
+    std::string extension = entry.path().extension().string();
+    if (!entry.is_regular_file() || (extension != ".mkv" && extension != ".mp4")) {
+      continue;
+    }
+    RecordingSegment segment;
+    if (!parseSegmentName(entry.path(), segment.camera, segment.start_time_us)) {
+      continue;
+    }
+    segment.path = entry.path().string();
+    segment.end_time_us = lastWriteTime(entry.path());
+    segment.bytes = entry.file_size();
+    total_bytes += segment.bytes;
+    this->segments_[segment.path] = segment;
+  }
+  BOOST_LOG_TRIVIAL(info) << "VideoRecorder: found " << this->segments_.size() << " recorded files (" << total_bytes / (1024 * 1024)
+                          << " MiB) in '" << this->settings_.directory << "'";
+}
+
+
+GstElement* VideoRecorder::addCamera(GstBin* pipeline, GstElement* h264_tee, const std::string& camera_name,
+                                     std::vector<GstElement*>& elements) {
+  GstElement* queue = gst_element_factory_make("queue", NULL);
+  ASSERT_NOT_NULL(queue);
+  // A couple of seconds is enough to ride out a slow write, and the tee never waits for the recording.
+  g_object_set(queue, "max-size-buffers", 0, NULL);
+  g_object_set(queue, "max-size-bytes", 0, NULL);
+  g_object_set(queue, "max-size-time", (guint64)2 * GST_SECOND, NULL);
+  gst_util_set_object_arg(G_OBJECT(queue), "leaky", "downstream");
+
+  // The payloader takes the h264 as a byte-stream, while the muxers want it in avc form with the SPS/PPS in the caps.
+  GstElement* h264parse = gst_element_factory_make("h264parse", NULL);
+  ASSERT_NOT_NULL(h264parse);
+
+  GstElement* splitmuxsink = gst_element_factory_make("splitmuxsink", NULL);
+  ASSERT_NOT_NULL(splitmuxsink);
+  g_object_set(splitmuxsink, "max-size-time", (guint64)this->settings_.segment_s * GST_SECOND, NULL);
+  // Finishing a file (writing the mp4 index, closing it) is done on a thread of its own instead of the streaming
+  // thread. With this, splitmuxsink makes a new muxer for each file from the muxer-factory.
+  g_object_set(splitmuxsink, "async-finalize", TRUE, NULL);
+  g_object_set(splitmuxsink, "muxer-factory", this->settings_.format == "mp4" ? "mp4mux" : "matroskamux", NULL);
+  GstStructure* muxer_properties;
+  if (this->settings_.format == "mkv") {
+    // Write the file as a stream, so it doesn't need any seeking back to the start when it is closed.
+    muxer_properties = gst_structure_new("properties", "streamable", G_TYPE_BOOLEAN, TRUE, NULL);
+  } else {
+    // A plain mp4 file has its index at the end, so it can't be played at all if the robot loses its power before
+    // it is closed. A fragmented one has an index for each fragment, so only the last fragment is lost. The duration
+    // is in ms.
+    muxer_properties = gst_structure_new("properties", "fragment-duration", G_TYPE_UINT, (guint)1000, NULL);
+  }
+  g_object_set(splitmuxsink, "muxer-properties", muxer_properties, NULL);
+  gst_structure_free(muxer_properties);
+  // The location callback needs the camera's name.
+  g_object_set_data_full(G_OBJECT(splitmuxsink), "snowrobot-camera", g_strdup(sanitize(camera_name).c_str()), g_free);
+  g_signal_connect(splitmuxsink, "format-location-full", G_CALLBACK(VideoRecorder::onFormatLocation), this);
+
+  ASSERT_TRUE(gst_bin_add(pipeline, queue));
+  ASSERT_TRUE(gst_bin_add(pipeline, h264parse));
+  ASSERT_TRUE(gst_bin_add(pipeline, splitmuxsink));
+  ASSERT_TRUE(gst_element_link_many(h264_tee, queue, h264parse, splitmuxsink, NULL));
+  elements.push_back(queue);
+  elements.push_back(h264parse);
+  elements.push_back(splitmuxsink);
+  BOOST_LOG_TRIVIAL(info) << "VideoRecorder::addCamera(): recording '" << camera_name << "' to '" << this->settings_.directory << "'";
+  return splitmuxsink;
+}
+
+
+void VideoRecorder::removeCamera(const std::string& camera_name) {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  auto find = this->open_paths_.find(sanitize(camera_name));
+  if (find != this->open_paths_.end()) {
+    this->unsynced_paths_.push_back(find->second);
+    this->open_paths_.erase(find);
+  }
+}
+
+
+void VideoRecorder::splitSegment(GstElement* splitmuxsink) {
+  g_signal_emit_by_name(splitmuxsink, "split-after");
+}
+
+
+// Returns the unix time of the sample's buffer. splitmuxsink asks for the file name once the first frame has gone
+// through its queues, which can be a while after the frame was captured, so the wall clock at that point would name
+// the file too late. Instead the buffer's running time is compared to the pipeline's current running time. Falls back
+// to the current time if the buffer has no timestamp or the element has no clock yet.
+static int64_t sampleUnixTime(GstElement* element, GstSample* sample) {
+  int64_t now_us = g_get_real_time();
+  GstBuffer* buffer = sample != nullptr ? gst_sample_get_buffer(sample) : nullptr;
+  const GstSegment* segment = sample != nullptr ? gst_sample_get_segment(sample) : nullptr;
+  if (buffer == nullptr || segment == nullptr || !GST_BUFFER_PTS_IS_VALID(buffer)) {
+    return now_us;
+  }
+  GstClockTime running_time = gst_segment_to_running_time(segment, GST_FORMAT_TIME, GST_BUFFER_PTS(buffer));
+  GstClock* clock = gst_element_get_clock(element);
+  if (clock == nullptr || !GST_CLOCK_TIME_IS_VALID(running_time)) {
+    if (clock != nullptr) {
+      gst_object_unref(clock);
+    }
+    return now_us;
+  }
+  GstClockTime now_running_time = gst_clock_get_time(clock) - gst_element_get_base_time(element);
+  gst_object_unref(clock);
+  return now_us - ((int64_t)now_running_time - (int64_t)running_time) / 1000;
+}
+
+
+gchar* VideoRecorder::onFormatLocation(GstElement* splitmuxsink, guint fragment_id, GstSample* first_sample, gpointer user_data) {
+  VideoRecorder* self = (VideoRecorder*)user_data;
+  std::string camera = (const char*)g_object_get_data(G_OBJECT(splitmuxsink), "snowrobot-camera");
+  int64_t start_time_us = sampleUnixTime(splitmuxsink, first_sample);
+  std::filesystem::path path = std::filesystem::path(self->settings_.directory) /
+      (camera + "_" + std::to_string(start_time_us / 1000) + "." + self->settings_.format);
+
+  RecordingSegment segment;
+  segment.camera = camera;
+  segment.path = path.string();
+  segment.start_time_us = start_time_us;
+  segment.end_time_us = start_time_us;
+  {
+    std::lock_guard<std::mutex> guard(self->lock_);
+    auto open_find = self->open_paths_.find(camera);
+    if (open_find != self->open_paths_.end()) {
+      // The previous file is finished now, but it still needs a last sync.
+      self->unsynced_paths_.push_back(open_find->second);
+    }
+    self->open_paths_[camera] = segment.path;
+    self->segments_[segment.path] = segment;
+  }
+  BOOST_LOG_TRIVIAL(info) << "VideoRecorder: starting the file '" << segment.path << "'";
+  return g_strdup(segment.path.c_str());
+}
+
+
+void VideoRecorder::runSyncThread() {
+  std::unique_lock<std::mutex> lock(this->lock_);
+  while (!this->stopping_) {
+    this->stop_changed_.wait_for(lock, std::chrono::seconds(this->settings_.sync_interval_s), [this] { return this->stopping_; });
+    lock.unlock();
+    try {
+      this->sync();
+    }
+    catch(const std::exception& e) {
+      BOOST_LOG_TRIVIAL(error) << "VideoRecorder: the sync failed: " << e.what();
+    }
+    lock.lock();
+  }
+}
+
+
+void VideoRecorder::sync() {
+  std::vector<std::string> paths;
+  {
+    std::lock_guard<std::mutex> guard(this->lock_);
+    paths.swap(this->unsynced_paths_);
+    for (const auto& item : this->open_paths_) {
+      paths.push_back(item.second);
+    }
+  }
+  // The fsync can take seconds on an sd-card, so it's done without holding the lock.
+  for (const std::string& path : paths) {
+    syncFile(path);
+  }
+
+  std::vector<std::string> deleted_paths;
+  {
+    std::lock_guard<std::mutex> guard(this->lock_);
+    uint64_t total_bytes = 0;
+    for (auto& item : this->segments_) {
+      std::error_code error;
+      uint64_t bytes = std::filesystem::file_size(item.first, error);
+      if (!error) {
+        item.second.bytes = bytes;
+      }
+      total_bytes += item.second.bytes;
+    }
+    for (const std::string& path : paths) {
+      auto find = this->segments_.find(path);
+      if (find != this->segments_.end()) {
+        find->second.end_time_us = lastWriteTime(path);
+      }
+    }
+
+    // The oldest files go first, whichever camera they belong to, but never a file that is being written to, or one
+    // that has been closed since the fsync above. splitmuxsink may still be finishing that one on its own thread, and
+    // it hasn't been flushed yet.
+    auto is_pending = [&](const std::string& path) {
+      bool is_open = std::any_of(this->open_paths_.begin(), this->open_paths_.end(),
+                                 [&](const auto& item) { return item.second == path; });
+      return is_open ||
+             std::find(this->unsynced_paths_.begin(), this->unsynced_paths_.end(), path) != this->unsynced_paths_.end();
+    };
+    std::vector<const RecordingSegment*> by_age;
+    for (const auto& item : this->segments_) {
+      by_age.push_back(&item.second);
+    }
+    std::sort(by_age.begin(), by_age.end(), [](const RecordingSegment* a, const RecordingSegment* b) {
+      return a->start_time_us < b->start_time_us;
+    });
+    for (const RecordingSegment* segment : by_age) {
+      if (total_bytes <= this->settings_.max_bytes) {
+        break;
+      }
+      if (!is_pending(segment->path)) {
+        total_bytes -= segment->bytes;
+        deleted_paths.push_back(segment->path);
+      }
+    }
+    for (const std::string& path : deleted_paths) {
+      this->segments_.erase(path);
+    }
+  }
+  for (const std::string& path : deleted_paths) {
+    std::error_code error;
+    std::filesystem::remove(path, error);
+    BOOST_LOG_TRIVIAL(info) << "VideoRecorder: deleted the old file '" << path << "'" << (error ? " (failed: " + error.message() + ")" : "");
+  }
+}
+
+
+std::vector<RecordingSegment> VideoRecorder::getSegments(const std::string& camera_name, int64_t from_us, int64_t to_us) const {
+  std::string camera = sanitize(camera_name);
+  std::vector<RecordingSegment> result;
+  std::lock_guard<std::mutex> guard(this->lock_);
+  for (const auto& item : this->segments_) {
+    const RecordingSegment& segment = item.second;
+    bool is_open = false;
+    for (const auto& open : this->open_paths_) {
+      is_open |= open.second == segment.path;
+    }
+    // The file that is being written to goes on until now.
+    int64_t end_time_us = is_open ? g_get_real_time() : segment.end_time_us;
+    if ((camera_name.empty() || segment.camera == camera) && segment.start_time_us <= to_us && end_time_us >= from_us) {
+      result.push_back(segment);
+      result.back().end_time_us = end_time_us;
+    }
+  }
+  std::sort(result.begin(), result.end(), [](const RecordingSegment& a, const RecordingSegment& b) {
+    return a.start_time_us < b.start_time_us;
+  });
+  return result;
+}
+
+
+uint64_t VideoRecorder::getTotalBytes() const {
+  std::lock_guard<std::mutex> guard(this->lock_);
+  uint64_t total_bytes = 0;
+  for (const auto& item : this->segments_) {
+    total_bytes += item.second.bytes;
+  }
+  return total_bytes;
+}
+
+
+}
@@ -0,0 +1,109 @@
+#ifndef SNOWROBOT_REMOTECONTROL_SERVER_VIDEORECORDER_H
+#define SNOWROBOT_REMOTECONTROL_SERVER_VIDEORECORDER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gst/gst.h>
+
+
+namespace snowrobot {
+
+
+// The settings for the on-robot recording that the user can change on the command line.
+struct RecordingSettings {
+  // The recordings are written here. An empty directory disables the recording.
+  std::string directory;
+  // "mkv" or "mp4". If the robot loses its power, a matroska file is readable up to the last written frame, and an mp4
+  // file, which is written as a fragmented mp4, up to the last full fragment of one second.
+  std::string format = "mkv";
+  // Each camera's recording is split into files of about this length. A file can only start at a keyframe, so the files
+  // are longer if the keyframes are further apart.
+  int segment_s = 60;
+  // The oldest files are deleted when all the recordings together take more than this.
+  uint64_t max_bytes = 4ull * 1024 * 1024 * 1024;
+  // How often the written data is flushed to the disk.
+  int sync_interval_s = 5;
+};
+
+
+// One of the recorded files.
+struct RecordingSegment {
+  std::string camera;
+  std::string path;
+  int64_t start_time_us = 0;  // unix time
+  int64_t end_time_us = 0;    // unix time, the time of the last write
+  uint64_t bytes = 0;
+};
+
+
+// Records the cameras to disk, next to the live stream. The recording branch gets the same encoded h264 buffers as the
+// camera's rtph264pay, from a tee in front of the payloader, so the video is only encoded once. The branch has its own
+// leaky queue, so a slow disk drops frames from the recording instead of holding back the live video. The dropped frames
+// make the recording stutter until the next keyframe.
+//
+// splitmuxsink splits the recording into files of --record-segment seconds, named after the camera and the unix time
+// (in ms) of their first frame. A thread of the recorder's own flushes the files to disk every sync_interval_s and
+// deletes the oldest files when the recordings take more than max_bytes, so neither the fsync() nor the deletes ever
+// run on a streaming thread. The files that are already in the directory when the server starts are counted too.
+class VideoRecorder {
+  public:
+    explicit VideoRecorder(const RecordingSettings& settings);
+
+    // Stops the sync thread after a final sync.
+    ~VideoRecorder();
+
+    VideoRecorder(const VideoRecorder&) = delete;
+    VideoRecorder& operator=(const VideoRecorder&) = delete;
+
+    // Adds a recording branch for the camera to the tee that the camera's encoded h264 goes through. The elements are
+    // appended to the elements list, and they are stopped and removed along with the camera's other elements. Returns
+    // the splitmuxsink, which splitSegment() needs.
+    GstElement* addCamera(GstBin* pipeline, GstElement* h264_tee, const std::string& camera_name,
+                          std::vector<GstElement*>& elements);
+
+    // Tells the recorder that the camera's recording branch has been stopped, so its last file is finished.
+    void removeCamera(const std::string& camera_name);
+
+    // Closes the camera's current file and starts a new one at the next keyframe. This is done before the camera changes
+    // its resolution, since the muxers can't change the video size in the middle of a file.
+    static void splitSegment(GstElement* splitmuxsink);
+
+    // Returns the camera's files that overlap the time range (unix time in us), ordered by their start time. An empty
+    // camera name returns the files of all the cameras.
+    std::vector<RecordingSegment> getSegments(const std::string& camera_name, int64_t from_us, int64_t to_us) const;
+
+    uint64_t getTotalBytes() const;
+
+  private:
+    // Called by splitmuxsink on its streaming thread when it starts a new file. Returns the file's path.
+    static gchar* onFormatLocation(GstElement* splitmuxsink, guint fragment_id, GstSample* first_sample, gpointer user_data);
+    void scanDirectory();
+    void runSyncThread();
+    // Flushes the files that have been written to since the last sync, and deletes the oldest files if the recordings
+    // take too much space. This runs on the sync thread.
+    void sync();
+
+    RecordingSettings settings_;
+
+    mutable std::mutex lock_;
+    std::condition_variable stop_changed_;
+    bool stopping_ = false;
+    // Ordered by the path, which sorts the files of each camera by their start time.
+    std::map<std::string, RecordingSegment> segments_;
+    // The files splitmuxsink is writing to, one per camera.
+    std::map<std::string, std::string> open_paths_;
+    // The files that have been closed since the last sync, and haven't been flushed yet.
+    std::vector<std::string> unsynced_paths_;
+    std::thread sync_thread_;
+};
+
+
+}
+
+#endif
@@ -73,6 +73,18 @@ class SmokeTest(IntegrationTestBase):
         reply = self.client_connection.send_message(select_camera_msg)
         self.assertEqual(reply, "ok")
 
+        ###############################################################################
+        # Check that the server's debug port reports the pipeline stats.
+        ###############################################################################
+        reply = self.server_connection.send_message("stats")
+        try:
+            stats = json.loads(reply)
+        except Exception as error:
+            raise AssertionError(f"Failed to parse the reply to the 'stats' request! {reply=}  {error=}")
+        self.assertGreater(stats["process"]["rss_kb"], 0)
+        self.assertGreater(len(stats["elements"]), 0)
+        self.assertIn(selected_camera["name"], [camera["name"] for camera in stats["cameras"]])
+
 
 if __name__ == "__main__":
     unittest.main()